@@ -0,0 +1,175 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# Measures "opkg update" and "opkg install" wall time against a generated
+# feed served by tests/feedserver.py on localhost, under a set of network
+# profiles. Results are written as JSON in the same shape as opkg-bench.
+
+import argparse
+import gzip
+import json
+import os
+import shutil
+import sys
+
+HERE = os.path.dirname(os.path.realpath(__file__))
+
+# latency (ms), bandwidth (KiB/s, 0 for unlimited), drop rate
+PROFILES = {
+    'lan': (0, 0, 0.0),
+    'wan': (50, 1024, 0.0),
+    'slow': (200, 128, 0.0),
+    'flaky': (20, 0, 0.05),
+}
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(
+        description='Time opkg update and install against a local feed server.')
+    parser.add_argument('--opkg', required=True, help='opkg binary to test')
+    parser.add_argument('-o', '--output', help='write JSON results here')
+    parser.add_argument('-r', '--reps', type=int, default=3)
+    parser.add_argument('--packages', type=int, default=10000,
+                        help='number of packages in the feed')
+    parser.add_argument('--targets', type=int, default=5,
+                        help='packages to install (plus their dependencies)')
+    parser.add_argument('--payload', type=int, default=256,
+                        help='payload of each downloaded package, in KiB')
+    parser.add_argument('--profile', action='append', choices=PROFILES,
+                        help='network profile, may be repeated '
+                             '(default: lan and wan)')
+    parser.add_argument('--latency', type=float,
+                        help='custom profile: latency in ms')
+    parser.add_argument('--bandwidth', type=int, default=0,
+                        help='custom profile: bandwidth in KiB/s')
+    parser.add_argument('--drop-rate', type=float, default=0.0,
+                        help='custom profile: connection drop probability')
+    return parser.parse_args()
+
+
+args = parse_args()
+
+# The test helpers read their configuration from the environment.
+os.environ['OPKG_PATH'] = os.path.realpath(args.opkg)
+for var, default in (('VARDIR', '/var'), ('SYSCONFDIR', '/etc'),
+                     ('DATADIR', '/share')):
+    os.environ.setdefault(var, default)
+sys.path.insert(0, os.path.join(HERE, '..', 'tests'))
+
+import bigfeed  # noqa: E402
+import cfg  # noqa: E402
+from feedserver import FeedServer  # noqa: E402
+
+
+def write_conf(url):
+    conf = '{}{}/opkg/opkg.conf'.format(cfg.offline_root,
+                                        os.environ['SYSCONFDIR'])
+    os.makedirs(os.path.dirname(conf), exist_ok=True)
+    with open(conf, 'w') as f:
+        f.write('arch {} 1\narch all 10\n'.format(bigfeed.SCALE_ARCH))
+        f.write('src/gz test {}\n'.format(url))
+
+
+def reset_root(feed, url):
+    shutil.rmtree(cfg.offline_root, ignore_errors=True)
+    write_conf(url)
+    feed.write_installed()
+
+
+class Result:
+    def __init__(self, name, variant):
+        self.name = name
+        self.variant = variant
+        self.times = []
+        self.failures = 0
+        self.stats = None
+
+    def add(self, status, elapsed, stats):
+        if status != 0:
+            self.failures += 1
+            return
+        self.times.append(elapsed)
+        self.stats = stats
+
+    def report(self):
+        best = min(self.times) if self.times else None
+        print('{:<8} {:<40} {}  {} failed'.format(
+            self.name, self.variant,
+            '{:9.3f} s'.format(best) if best is not None else '      - s',
+            self.failures), file=sys.stderr)
+
+    def json(self):
+        r = {'name': self.name, 'variant': self.variant,
+             'reps': len(self.times) + self.failures,
+             'failures': self.failures}
+        if self.times:
+            r['best_s'] = min(self.times)
+            r['mean_s'] = sum(self.times) / len(self.times)
+        if self.stats:
+            r.update(self.stats)
+        return r
+
+
+def run_profile(feed, name, latency, bandwidth, drop_rate):
+    variant = '{} ({} ms, {}, drop {})'.format(
+        name, latency, '{} KiB/s'.format(bandwidth) if bandwidth else 'unlimited',
+        drop_rate)
+    update = Result('update', variant)
+    install = Result('install', variant)
+    targets = ' '.join(feed.names[i] for i in feed.targets)
+
+    with FeedServer(cfg.opkdir, latency=latency / 1000.0,
+                    bandwidth=bandwidth * 1024 or None,
+                    drop_rate=drop_rate) as server:
+        for _ in range(args.reps):
+            reset_root(feed, server.url)
+
+            server.reset_stats()
+            status, _, _, elapsed, _ = bigfeed.run('update')
+            update.add(status, elapsed, dict(server.stats))
+            if status != 0:
+                continue
+
+            server.reset_stats()
+            status, _, _, elapsed, _ = bigfeed.run(
+                '--force-postinstall install ' + targets)
+            install.add(status, elapsed, dict(server.stats))
+
+    update.report()
+    install.report()
+    return [update, install]
+
+
+def main():
+    profiles = []
+    if args.latency is not None:
+        profiles.append(('custom', args.latency, args.bandwidth,
+                         args.drop_rate))
+    for p in args.profile or ([] if profiles else ['lan', 'wan']):
+        profiles.append((p,) + PROFILES[p])
+
+    feed = bigfeed.BigFeed(n_packages=args.packages, n_targets=args.targets,
+                           n_upgrades=0, payload_size=args.payload * 1024)
+    feed.setup()
+    with open('Packages', 'rb') as f, gzip.open('Packages.gz', 'wb') as gz:
+        shutil.copyfileobj(f, gz)
+    print('{} packages, {} downloaded by install'.format(
+        feed.n_packages, len(feed.real)), file=sys.stderr)
+
+    results = []
+    for p in profiles:
+        results += run_profile(feed, *p)
+
+    out = {'opkg': os.environ['OPKG_PATH'], 'packages': feed.n_packages,
+           'downloads': len(feed.real), 'payload_kib': args.payload,
+           'benchmarks': [r.json() for r in results]}
+    if args.output:
+        with open(args.output, 'w') as f:
+            json.dump(out, f, indent=2)
+    else:
+        json.dump(out, sys.stdout, indent=2)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,1154 @@
+/* vi: set expandtab sw=4 sts=4: */
+/* opkg-bench.c - the opkg package management system
+
+   SPDX-License-Identifier: GPL-2.0-or-later
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   Microbenchmarks for the hot primitives of libopkg, run against
+   generated inputs. Results are written as JSON.
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <archive.h>
+#include <archive_entry.h>
+#if WITH_XZ
+#include <lzma.h>
+#endif
+
+#include "file_util.h"
+#include "hash_table.h"
+#include "opkg_archive.h"
+#include "opkg_conf.h"
+#include "opkg_message.h"
+#include "parse_util.h"
+#include "pkg.h"
+#include "pkg_hash.h"
+#include "pkg_parse.h"
+#include "sprintf_alloc.h"
+#include "xfuncs.h"
+
+struct bench_result {
+    const char *name;
+    char *variant;
+    unsigned long ops;          /* operations per repetition, or 0 */
+    unsigned long long bytes;   /* bytes processed per repetition, or 0 */
+    double best;
+    double total;
+    int reps;
+};
+
+static struct bench_result **results;
+static int result_count;
+
+static int reps = 3;
+static int quick;
+static char **filters;
+static int filter_count;
+static char *work_dir;
+
+static unsigned long long rng_state = 0x9e3779b97f4a7c15ULL;
+
+/* xorshift64*, so that every run sees the same inputs. */
+static unsigned int rng(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (unsigned int)((rng_state * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int selected(const char *name)
+{
+    int i;
+
+    if (filter_count == 0)
+        return 1;
+    for (i = 0; i < filter_count; i++)
+        if (strstr(name, filters[i]))
+            return 1;
+    return 0;
+}
+
+static struct bench_result *result_new(const char *name, const char *variant)
+{
+    struct bench_result *r;
+
+    r = xcalloc(1, sizeof(*r));
+    results = xrealloc(results, (result_count + 1) * sizeof(*results));
+    results[result_count++] = r;
+    r->name = name;
+    r->variant = xstrdup(variant);
+    return r;
+}
+
+static void result_add(struct bench_result *r, double elapsed)
+{
+    if (r->reps == 0 || elapsed < r->best)
+        r->best = elapsed;
+    r->total += elapsed;
+    r->reps++;
+}
+
+static void result_print(const struct bench_result *r)
+{
+    fprintf(stderr, "%-44s %-12s %10.3f ms", r->name, r->variant,
+            r->best * 1e3);
+    if (r->ops)
+        fprintf(stderr, " %12.1f ns/op", r->best * 1e9 / r->ops);
+    if (r->bytes)
+        fprintf(stderr, " %10.1f MB/s", r->bytes / r->best / 1e6);
+    fputc('\n', stderr);
+}
+
+/*
+ * Hash tables: the package, file and directory tables all use the default
+ * bucket count, so that is what is measured here.
+ */
+static char **make_keys(unsigned int n, const char *fmt)
+{
+    char **keys = xmalloc(n * sizeof(char *));
+    unsigned int i;
+
+    for (i = 0; i < n; i++)
+        sprintf_alloc(&keys[i], fmt, i);
+    return keys;
+}
+
+static void free_keys(char **keys, unsigned int n)
+{
+    unsigned int i;
+
+    for (i = 0; i < n; i++)
+        xfree(keys[i]);
+    xfree(keys);
+}
+
+static void bench_hash_table(void)
+{
+    static const unsigned int sizes[] = { 1000, 10000, 100000, 1000000 };
+    unsigned int s, i;
+    int rep;
+
+    if (!selected("hash_table"))
+        return;
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        unsigned int n = sizes[s];
+        struct bench_result *ins, *get;
+        char **keys, variant[32];
+
+        if (quick && n > 100000)
+            break;
+
+        keys = make_keys(n, "/usr/lib/pkg-%u/file");
+        snprintf(variant, sizeof(variant), "keys=%u", n);
+        ins = result_new("hash_table_insert", variant);
+        get = result_new("hash_table_get", variant);
+        ins->ops = get->ops = n;
+
+        for (rep = 0; rep < reps; rep++) {
+            hash_table_t table;
+            double t;
+
+            memset(&table, 0, sizeof(table));
+            hash_table_init("bench", &table, OPKG_CONF_DEFAULT_HASH_LEN);
+
+            t = now();
+            for (i = 0; i < n; i++)
+                hash_table_insert(&table, keys[i], keys[i]);
+            result_add(ins, now() - t);
+
+            t = now();
+            for (i = 0; i < n; i++)
+                if (hash_table_get(&table, keys[(i * 7919u) % n]) == NULL)
+                    abort();
+            result_add(get, now() - t);
+
+            hash_table_deinit(&table);
+        }
+
+        result_print(ins);
+        result_print(get);
+        free_keys(keys, n);
+    }
+}
+
+/*
+ * Versions in the shapes found in real feeds: plain, epochs, revisions,
+ * tildes, letters and long snapshot strings.
+ */
+static char *make_version(void)
+{
+    char *v;
+
+    switch (rng() % 6) {
+    case 0:
+        sprintf_alloc(&v, "%u.%u.%u", rng() % 10, rng() % 30, rng() % 100);
+        break;
+    case 1:
+        sprintf_alloc(&v, "%u:%u.%u-r%u", rng() % 3, rng() % 10, rng() % 30,
+                      rng() % 10);
+        break;
+    case 2:
+        sprintf_alloc(&v, "%u.%u~rc%u-r%u", rng() % 10, rng() % 30,
+                      rng() % 5, rng() % 10);
+        break;
+    case 3:
+        sprintf_alloc(&v, "%u.%u%c", rng() % 10, rng() % 30,
+                      'a' + rng() % 26);
+        break;
+    case 4:
+        sprintf_alloc(&v, "2024%02u%02u+git%08x-r%u", 1 + rng() % 12,
+                      1 + rng() % 28, rng(), rng() % 10);
+        break;
+    default:
+        sprintf_alloc(&v, "%u.%u.%u.%u+svn%u-r%u.%u", rng() % 10,
+                      rng() % 30, rng() % 100, rng() % 1000, rng() % 100000,
+                      rng() % 10, rng() % 5);
+        break;
+    }
+    return v;
+}
+
+static void bench_version_compare(void)
+{
+    unsigned int n = quick ? 10000 : 100000;
+    pkg_version_t *parsed;
+    char **versions;
+    struct bench_result *cmp, *str;
+    unsigned int i;
+    volatile int sink = 0;
+    int rep;
+
+    if (!selected("version_compare"))
+        return;
+
+    versions = xmalloc(n * sizeof(char *));
+    parsed = xcalloc(n, sizeof(pkg_version_t));
+    for (i = 0; i < n; i++) {
+        versions[i] = make_version();
+        pkg_version_parse(&parsed[i], versions[i]);
+    }
+
+    cmp = result_new("version_compare", "parsed");
+    str = result_new("version_compare", "strings");
+    cmp->ops = str->ops = n - 1;
+
+    for (rep = 0; rep < reps; rep++) {
+        int *out = xmalloc(n * sizeof(int));
+        double t;
+
+        t = now();
+        for (i = 0; i + 1 < n; i++)
+            sink += pkg_version_compare(&parsed[i], &parsed[i + 1]);
+        result_add(cmp, now() - t);
+
+        t = now();
+        pkg_versions_compare((const char *const *)versions,
+                             (const char *const *)versions + 1, out, n - 1);
+        result_add(str, now() - t);
+        xfree(out);
+    }
+    (void)sink;
+
+    result_print(cmp);
+    result_print(str);
+
+    for (i = 0; i < n; i++) {
+        pkg_version_deinit(&parsed[i]);
+        xfree(versions[i]);
+    }
+    xfree(parsed);
+    xfree(versions);
+}
+
+/*
+ * A feed of n packages. Roughly one in five packages is also available in
+ * an older version or for a second architecture, and one in eight provides
+ * a virtual package.
+ */
+static void write_feed(FILE *fp, unsigned int n)
+{
+    unsigned int i, j;
+
+    for (i = 0; i < n; i++) {
+        unsigned int copies = rng() % 5 == 0 ? 2 : 1;
+
+        for (j = 0; j < copies; j++) {
+            unsigned int ndeps = rng() % 5, d;
+            char *version = make_version();
+
+            fprintf(fp, "Package: pkg%05u\n", i);
+            fprintf(fp, "Version: %s\n", version);
+            if (ndeps) {
+                fprintf(fp, "Depends: ");
+                for (d = 0; d < ndeps; d++) {
+                    fprintf(fp, "%spkg%05u", d ? ", " : "", rng() % n);
+                    if (rng() % 3 == 0)
+                        fprintf(fp, " (>= %u.%u)", rng() % 10, rng() % 30);
+                }
+                fputc('\n', fp);
+            }
+            if (rng() % 8 == 0)
+                fprintf(fp, "Provides: virtual%03u\n", rng() % 200);
+            if (rng() % 20 == 0)
+                fprintf(fp, "Conflicts: pkg%05u\n", rng() % n);
+            if (rng() % 10 == 0)
+                fprintf(fp, "Recommends: pkg%05u\n", rng() % n);
+            fprintf(fp, "Section: %s\n", rng() % 2 ? "libs" : "utils");
+            fprintf(fp, "Architecture: %s\n",
+                    j == 1 && rng() % 2 ? "all" : "bench");
+            fprintf(fp, "Maintainer: Bench Maintainer <bench@example.com>\n");
+            fprintf(fp, "MD5Sum: %08x%08x%08x%08x\n", rng(), rng(), rng(),
+                    rng());
+            fprintf(fp, "Size: %u\n", 1000 + rng() % 1000000);
+            fprintf(fp, "Filename: pkg%05u_%s_bench.ipk\n", i, version);
+            fprintf(fp, "Source: pkg%05u.bb\n", i);
+            fprintf(fp, "Description: Package number %u of the benchmark feed\n"
+                    " This is the long description of the package, which is\n"
+                    " spread over a couple of lines like real ones are.\n", i);
+            fprintf(fp, "Installed-Size: %u\n\n", 1000 + rng() % 1000000);
+            xfree(version);
+        }
+    }
+}
+
+static int bench_setup_config(void)
+{
+    char *conf_file, *lists_dir;
+    FILE *fp;
+
+    sprintf_alloc(&conf_file, "%s/opkg.conf", work_dir);
+    fp = fopen(conf_file, "w");
+    if (fp == NULL) {
+        opkg_perror(ERROR, "Failed to create %s", conf_file);
+        xfree(conf_file);
+        return -1;
+    }
+    fprintf(fp, "arch all 1\narch bench 10\n");
+    fprintf(fp, "src bench file:/nonexistent\n");
+    fprintf(fp, "dest root /\n");
+    fprintf(fp, "option tmp_dir %s\n", work_dir);
+    fclose(fp);
+
+    opkg_config->conf_files = xmalloc(sizeof(char *));
+    opkg_config->conf_files[0] = conf_file;
+    opkg_config->conf_file_count = 1;
+    opkg_config->offline_root = xstrdup(work_dir);
+
+    if (opkg_conf_load())
+        return -1;
+    /* opkg_conf_load() sets the default again. */
+    opkg_config->verbosity = ERROR;
+
+    sprintf_alloc(&lists_dir, "%s", opkg_config->lists_dir);
+    file_mkdir_hier(lists_dir, 0755);
+    xfree(lists_dir);
+    return 0;
+}
+
+static void bench_feed(void)
+{
+    unsigned int n = quick ? 2000 : 20000;
+    struct bench_result *parse, *load, *best;
+    char *feed_file, *buf = NULL;
+    struct stat st;
+    char **names;
+    unsigned int i;
+    FILE *fp;
+    int rep;
+
+    if (!selected("pkg_parse_line") && !selected("pkg_hash_load_feeds")
+            && !selected("pkg_hash_fetch_best_installation_candidate"))
+        return;
+
+    if (bench_setup_config()) {
+        opkg_conf_deinit();
+        return;
+    }
+
+    sprintf_alloc(&feed_file, "%s/bench", opkg_config->lists_dir);
+    fp = fopen(feed_file, "w");
+    if (fp == NULL) {
+        opkg_perror(ERROR, "Failed to create %s", feed_file);
+        goto out;
+    }
+    write_feed(fp, n);
+    fclose(fp);
+    stat(feed_file, &st);
+
+    parse = result_new("pkg_parse_line", "");
+    xfree(parse->variant);
+    sprintf_alloc(&parse->variant, "pkgs=%u", n);
+    parse->bytes = st.st_size;
+    buf = xmalloc(4096);
+    for (rep = 0; rep < reps; rep++) {
+        double t = now();
+
+        fp = fopen(feed_file, "r");
+        while (!feof(fp)) {
+            pkg_t *pkg = pkg_new();
+
+            if (parse_from_stream_nomalloc(pkg_parse_line, pkg, fp, 0, &buf,
+                                           4096) == -1) {
+                pkg_deinit(pkg);
+                xfree(pkg);
+                break;
+            }
+            pkg_deinit(pkg);
+            xfree(pkg);
+        }
+        fclose(fp);
+        result_add(parse, now() - t);
+    }
+    result_print(parse);
+
+    load = result_new("pkg_hash_load_feeds", parse->variant);
+    load->bytes = st.st_size;
+    for (rep = 0; rep < reps; rep++) {
+        double t;
+
+        pkg_hash_deinit();
+        pkg_hash_init();
+
+        t = now();
+        pkg_hash_load_feeds();
+        result_add(load, now() - t);
+    }
+    result_print(load);
+
+    names = make_keys(n, "pkg%05u");
+    best = result_new("pkg_hash_fetch_best_installation_candidate",
+                      parse->variant);
+    best->ops = n;
+    for (rep = 0; rep < reps; rep++) {
+        double t = now();
+
+        for (i = 0; i < n; i++)
+            pkg_hash_fetch_best_installation_candidate_by_name(names[i]);
+        result_add(best, now() - t);
+    }
+    result_print(best);
+    free_keys(names, n);
+
+ out:
+    xfree(buf);
+    xfree(feed_file);
+    opkg_conf_deinit();
+}
+
+/* Text with enough repetition to compress like real binaries and data. */
+static void fill_buffer(char *buf, size_t len)
+{
+    static const char *words[] = {
+        "opkg", "package", "install", "\x7f" "ELF", "libc.so.6", "/usr/lib",
+        "\0\0\0\0", "depends", "version", "0123456789", "\n", " "
+    };
+    size_t i = 0;
+
+    while (i < len) {
+        const char *w = words[rng() % (sizeof(words) / sizeof(words[0]))];
+        size_t wl = strlen(w) ? strlen(w) : 4;
+
+        if (rng() % 4 == 0) {
+            buf[i++] = (char)rng();
+            continue;
+        }
+        if (wl > len - i)
+            wl = len - i;
+        memcpy(buf + i, w, wl);
+        i += wl;
+    }
+}
+
+static int write_test_file(const char *path, size_t len)
+{
+    char *buf = xmalloc(len);
+    FILE *fp;
+    int r = 0;
+
+    fill_buffer(buf, len);
+    fp = fopen(path, "w");
+    if (fp == NULL || fwrite(buf, 1, len, fp) != len) {
+        opkg_perror(ERROR, "Failed to write %s", path);
+        r = -1;
+    }
+    if (fp)
+        fclose(fp);
+    xfree(buf);
+    return r;
+}
+
+static void bench_checksums(void)
+{
+    size_t len = quick ? 4 << 20 : 64 << 20;
+    struct bench_result *md5;
+    char *path, *sum;
+    int rep;
+
+    if (!selected("md5sum") && !selected("sha256sum"))
+        return;
+
+    sprintf_alloc(&path, "%s/checksum.bin", work_dir);
+    if (write_test_file(path, len)) {
+        xfree(path);
+        return;
+    }
+
+    if (selected("md5sum")) {
+        md5 = result_new("md5sum", "file");
+        md5->bytes = len;
+        for (rep = 0; rep < reps; rep++) {
+            double t = now();
+
+            sum = file_md5sum_alloc(path);
+            result_add(md5, now() - t);
+            xfree(sum);
+        }
+        result_print(md5);
+    }
+
+#if WITH_SHA256
+    if (selected("sha256sum")) {
+        struct bench_result *sha = result_new("sha256sum", "file");
+
+        sha->bytes = len;
+        for (rep = 0; rep < reps; rep++) {
+            double t = now();
+
+            sum = file_sha256sum_alloc(path);
+            result_add(sha, now() - t);
+            xfree(sum);
+        }
+        result_print(sha);
+    }
+#endif
+
+    unlink(path);
+    xfree(path);
+}
+
+static int compress_list_file(const char *path, const char *out, int zstd)
+{
+#if WITH_ZSTD
+    if (zstd)
+        return zstd_write_archive(path, out);
+#endif
+    (void)zstd;
+    return gz_write_archive(path, out);
+}
+
+static void bench_list_file(const char *path, size_t len, int zstd,
+                            int threads)
+{
+    struct bench_result *res;
+    char variant[64];
+    char *out;
+    int rep;
+
+    if (zstd)
+        snprintf(variant, sizeof(variant), "zstd");
+    else
+        snprintf(variant, sizeof(variant), "gzip, %d thread%s", threads,
+                 threads > 1 ? "s" : "");
+    sprintf_alloc(&out, "%s%s", path, zstd ? ".zst" : ".gz");
+    opkg_config->compress_threads = threads;
+
+    if (selected("list_compress")) {
+        res = result_new("list_compress", variant);
+        res->bytes = len;
+        for (rep = 0; rep < reps; rep++) {
+            double t = now();
+            int err = compress_list_file(path, out, zstd);
+
+            result_add(res, now() - t);
+            if (err)
+                break;
+        }
+        result_print(res);
+    } else if (zstd || threads == 1) {
+        compress_list_file(path, out, zstd);
+    }
+
+    /* Reading back does not depend on the number of threads. */
+    if (selected("list_decompress") && (zstd || threads == 1)) {
+        res = result_new("list_decompress", zstd ? "zstd" : "gzip");
+        res->bytes = len;
+        for (rep = 0; rep < reps; rep++) {
+            FILE *null_fp = fopen("/dev/null", "w");
+            struct opkg_ar *ar;
+            double t = now();
+            int err;
+
+            ar = ar_open_compressed_file(out);
+            err = ar ? ar_copy_to_stream(ar, null_fp) : -1;
+            if (ar)
+                ar_close(ar);
+            result_add(res, now() - t);
+            fclose(null_fp);
+            if (err < 0)
+                break;
+        }
+        result_print(res);
+    }
+
+    opkg_config->compress_threads = 0;
+    unlink(out);
+    xfree(out);
+}
+
+/*
+ * Compress a feed-sized list file as compress_list_files does, with gzip on
+ * 1, 4 and one thread per core and with zstd, and read it back as
+ * pkg_hash_add_from_file() does.
+ */
+static void bench_list_compress(void)
+{
+    size_t len = quick ? 4 << 20 : 32 << 20;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    char *path;
+
+    if (!selected("list_compress") && !selected("list_decompress"))
+        return;
+
+    sprintf_alloc(&path, "%s/Packages", work_dir);
+    if (write_test_file(path, len)) {
+        xfree(path);
+        return;
+    }
+
+    bench_list_file(path, len, 0, 1);
+    bench_list_file(path, len, 0, 4);
+    if (cores > 4)
+        bench_list_file(path, len, 0, cores);
+#if WITH_ZSTD
+    bench_list_file(path, len, 1, 0);
+#endif
+
+    unlink(path);
+    xfree(path);
+}
+
+struct compressor {
+    const char *name;
+    const char *suffix;
+    int filter;
+};
+
+static const struct compressor compressors[] = {
+    {"gzip", "gz", ARCHIVE_FILTER_GZIP},
+#if WITH_XZ
+    {"xz", "xz", ARCHIVE_FILTER_XZ},
+#endif
+#if WITH_BZIP2
+    {"bzip2", "bz2", ARCHIVE_FILTER_BZIP2},
+#endif
+#if WITH_LZ4
+    {"lz4", "lz4", ARCHIVE_FILTER_LZ4},
+#endif
+#if WITH_ZSTD
+    {"zstd", "zst", ARCHIVE_FILTER_ZSTD},
+#endif
+};
+
+static int ar_add_member(struct archive *ar, const char *name,
+                         const void *data, size_t len)
+{
+    struct archive_entry *entry = archive_entry_new();
+    int r;
+
+    archive_entry_set_pathname(entry, name);
+    archive_entry_set_size(entry, len);
+    archive_entry_set_filetype(entry, AE_IFREG);
+    archive_entry_set_perm(entry, 0644);
+    r = archive_write_header(ar, entry);
+    if (r == ARCHIVE_OK && archive_write_data(ar, data, len) != (ssize_t)len)
+        r = ARCHIVE_FATAL;
+    archive_entry_free(entry);
+    return r;
+}
+
+/* Builds an in-memory tar of nfiles files of file_len bytes each. */
+static void *make_tar(const struct compressor *c, unsigned int nfiles,
+                      size_t file_len, size_t *out_len)
+{
+    size_t cap = nfiles * (file_len + 1024) + (1 << 20);
+    char *out = xmalloc(cap), *data = xmalloc(file_len);
+    struct archive *tar = archive_write_new();
+    unsigned int i;
+    char name[64];
+    int r;
+
+    archive_write_set_format_ustar(tar);
+    r = archive_write_add_filter(tar, c ? c->filter : ARCHIVE_FILTER_GZIP);
+    if (r != ARCHIVE_OK
+            || archive_write_open_memory(tar, out, cap, out_len) != ARCHIVE_OK)
+        goto err;
+
+    for (i = 0; i < nfiles; i++) {
+        fill_buffer(data, file_len);
+        snprintf(name, sizeof(name), "./usr/share/bench/file%04u", i);
+        if (ar_add_member(tar, name, data, file_len) != ARCHIVE_OK)
+            goto err;
+    }
+    if (archive_write_close(tar) != ARCHIVE_OK)
+        goto err;
+    archive_write_free(tar);
+    xfree(data);
+    return out;
+
+ err:
+    opkg_msg(ERROR, "Failed to build %s tarball: %s\n",
+             c ? c->name : "control", archive_error_string(tar));
+    archive_write_free(tar);
+    xfree(data);
+    xfree(out);
+    return NULL;
+}
+
+/* Write an ar-format package with the given data.tar.<suffix> member. */
+static int write_ar(const char *path, const char *suffix,
+                    const void *data, size_t data_len)
+{
+    size_t control_len = 0;
+    void *control;
+    struct archive *ar;
+    char member[32];
+    int r = -1;
+
+    control = make_tar(NULL, 1, 64, &control_len);
+    if (!control)
+        return -1;
+
+    ar = archive_write_new();
+    archive_write_set_format_ar_svr4(ar);
+    if (archive_write_open_filename(ar, path) == ARCHIVE_OK) {
+        snprintf(member, sizeof(member), "data.tar.%s", suffix);
+        if (ar_add_member(ar, "debian-binary", "2.0\n", 4) == ARCHIVE_OK
+                && ar_add_member(ar, "control.tar.gz", control,
+                                 control_len) == ARCHIVE_OK
+                && ar_add_member(ar, member, data, data_len) == ARCHIVE_OK
+                && archive_write_close(ar) == ARCHIVE_OK)
+            r = 0;
+    }
+    if (r)
+        opkg_msg(ERROR, "Failed to write %s: %s\n", path,
+                 archive_error_string(ar));
+    archive_write_free(ar);
+    xfree(control);
+    return r;
+}
+
+static int write_ipk(const char *path, const struct compressor *c,
+                     unsigned int nfiles, size_t file_len)
+{
+    size_t data_len = 0;
+    void *data;
+    int r;
+
+    data = make_tar(c, nfiles, file_len, &data_len);
+    if (!data)
+        return -1;
+    r = write_ar(path, c->suffix, data, data_len);
+    xfree(data);
+    return r;
+}
+
+static void bench_ar_extract_all(void)
+{
+    unsigned int nfiles = quick ? 32 : 256;
+    size_t file_len = 32 * 1024;
+    unsigned int i;
+    int rep;
+
+    if (!selected("ar_extract_all"))
+        return;
+
+    for (i = 0; i < sizeof(compressors) / sizeof(compressors[0]); i++) {
+        const struct compressor *c = &compressors[i];
+        struct bench_result *res = NULL;
+        char *ipk, *dest;
+
+        sprintf_alloc(&ipk, "%s/bench_%s.ipk", work_dir, c->name);
+        sprintf_alloc(&dest, "%s/extract/", work_dir);
+        if (write_ipk(ipk, c, nfiles, file_len) == 0) {
+            res = result_new("ar_extract_all", c->name);
+            res->bytes = (unsigned long long)nfiles * file_len;
+        }
+
+        for (rep = 0; res && rep < reps; rep++) {
+            unsigned long size = 0;
+            struct opkg_ar *ar;
+            double t;
+            int err;
+
+            if (file_exists(dest))
+                rm_r(dest);
+            file_mkdir_hier(dest, 0755);
+
+            t = now();
+            ar = ar_open_pkg_data_archive(ipk, NULL);
+            err = ar ? ar_extract_all(ar, dest, &size) : -1;
+            if (ar)
+                ar_close(ar);
+            result_add(res, now() - t);
+
+            if (err || size != res->bytes) {
+                opkg_msg(ERROR, "Extracting %s failed.\n", ipk);
+                break;
+            }
+        }
+        if (res)
+            result_print(res);
+
+        if (file_exists(dest))
+            rm_r(dest);
+        unlink(ipk);
+        xfree(dest);
+        xfree(ipk);
+    }
+}
+
+/*
+ * Open the control archive of a package and read through it, as installing
+ * does several times per package, either by scanning the ar headers with
+ * libarchive or through a member index.
+ */
+static void bench_ar_open_control(void)
+{
+    unsigned int nfiles = quick ? 32 : 256;
+    size_t file_len = 32 * 1024;
+    unsigned int i, indexed;
+    int rep;
+
+    if (!selected("ar_open_control"))
+        return;
+
+    for (i = 0; i < sizeof(compressors) / sizeof(compressors[0]); i++) {
+        const struct compressor *c = &compressors[i];
+        char *ipk;
+
+        sprintf_alloc(&ipk, "%s/bench_%s.ipk", work_dir, c->name);
+        if (write_ipk(ipk, c, nfiles, file_len) != 0) {
+            xfree(ipk);
+            continue;
+        }
+
+        for (indexed = 0; indexed < 2; indexed++) {
+            struct bench_result *res;
+            struct ar_index *index = NULL;
+            char variant[64];
+
+            snprintf(variant, sizeof(variant), "%s, %s", c->name,
+                     indexed ? "index" : "scan");
+            res = result_new("ar_open_control", variant);
+            if (indexed)
+                index = ar_index_open(ipk);
+
+            for (rep = 0; rep < reps; rep++) {
+                struct opkg_ar *ar;
+                FILE *null_fp = fopen("/dev/null", "w");
+                double t;
+                int err;
+
+                t = now();
+                ar = ar_open_pkg_control_archive(ipk, index);
+                err = ar ? ar_extract_paths_to_stream(ar, null_fp) : -1;
+                if (ar)
+                    ar_close(ar);
+                result_add(res, now() - t);
+                fclose(null_fp);
+
+                if (err) {
+                    opkg_msg(ERROR, "Reading the control archive of %s failed.\n",
+                             ipk);
+                    break;
+                }
+            }
+            result_print(res);
+            ar_index_free(index);
+        }
+
+        unlink(ipk);
+        xfree(ipk);
+    }
+}
+
+#if WITH_XZ
+/* Compress in 1 MiB blocks, as "xz -T" does, so that the blocks can be
+ * decoded in parallel. */
+static void *xz_compress_blocks(const void *in, size_t in_len, size_t *out_len)
+{
+    lzma_stream strm = LZMA_STREAM_INIT;
+    lzma_mt mt;
+    size_t cap = lzma_stream_buffer_bound(in_len);
+    uint8_t *out = xmalloc(cap);
+    lzma_ret ret;
+
+    memset(&mt, 0, sizeof(mt));
+    mt.threads = lzma_cputhreads() ? lzma_cputhreads() : 1;
+    mt.block_size = 1 << 20;
+    mt.preset = LZMA_PRESET_DEFAULT;
+    mt.check = LZMA_CHECK_CRC64;
+
+    ret = lzma_stream_encoder_mt(&strm, &mt);
+    if (ret == LZMA_OK) {
+        strm.next_in = in;
+        strm.avail_in = in_len;
+        strm.next_out = out;
+        strm.avail_out = cap;
+        do {
+            ret = lzma_code(&strm, LZMA_FINISH);
+        } while (ret == LZMA_OK);
+    }
+    *out_len = cap - strm.avail_out;
+    lzma_end(&strm);
+
+    if (ret != LZMA_STREAM_END) {
+        opkg_msg(ERROR, "Failed to compress xz data (lzma error %d).\n", ret);
+        xfree(out);
+        return NULL;
+    }
+    return out;
+}
+
+/*
+ * Extract a multi-block data.tar.xz through the package index, decompressed
+ * by libarchive's xz filter (1 thread) or by liblzma's multi-threaded
+ * decoder (see the decompress_threads option).
+ */
+static void bench_xz_decode(void)
+{
+    static const struct compressor plain = {"none", "tar", ARCHIVE_FILTER_NONE};
+    unsigned int nfiles = quick ? 64 : 512;
+    size_t file_len = 32 * 1024;
+    int thread_counts[] = {1, 2, 4, 0};
+    size_t tar_len = 0, xz_len = 0;
+    void *tar, *xz = NULL;
+    char *ipk, *dest;
+    struct ar_index *index = NULL;
+    unsigned int i;
+    int rep;
+
+    if (!selected("xz_decode"))
+        return;
+
+    sprintf_alloc(&ipk, "%s/bench_xz_mt.ipk", work_dir);
+    sprintf_alloc(&dest, "%s/extract/", work_dir);
+
+    tar = make_tar(&plain, nfiles, file_len, &tar_len);
+    if (tar)
+        xz = xz_compress_blocks(tar, tar_len, &xz_len);
+    if (xz && write_ar(ipk, "xz", xz, xz_len) == 0)
+        index = ar_index_open(ipk);
+    xfree(tar);
+    xfree(xz);
+
+    /* The last entry runs one thread per core, when that is not already
+     * covered. */
+    thread_counts[3] = lzma_cputhreads();
+    for (i = 0; index && i < sizeof(thread_counts) / sizeof(int); i++) {
+        struct bench_result *res;
+        char variant[64];
+
+        if (thread_counts[i] < 1 || (i == 3 && thread_counts[i] <= 4))
+            continue;
+        if (thread_counts[i] == 1)
+            snprintf(variant, sizeof(variant), "libarchive");
+        else
+            snprintf(variant, sizeof(variant), "mt, %d threads",
+                     thread_counts[i]);
+        res = result_new("xz_decode", variant);
+        res->bytes = (unsigned long long)nfiles * file_len;
+        opkg_config->decompress_threads = thread_counts[i];
+
+        for (rep = 0; rep < reps; rep++) {
+            unsigned long size = 0;
+            struct opkg_ar *ar;
+            double t;
+            int err;
+
+            if (file_exists(dest))
+                rm_r(dest);
+            file_mkdir_hier(dest, 0755);
+
+            t = now();
+            ar = ar_open_pkg_data_archive(ipk, index);
+            err = ar ? ar_extract_all(ar, dest, &size) : -1;
+            if (ar)
+                ar_close(ar);
+            result_add(res, now() - t);
+
+            if (err || size != res->bytes) {
+                opkg_msg(ERROR, "Extracting %s failed.\n", ipk);
+                break;
+            }
+        }
+        result_print(res);
+    }
+    opkg_config->decompress_threads = 0;
+
+    if (file_exists(dest))
+        rm_r(dest);
+    ar_index_free(index);
+    unlink(ipk);
+    xfree(dest);
+    xfree(ipk);
+}
+#endif
+
+static void json_string(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', fp);
+        fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+static int write_json(FILE *fp)
+{
+    int i;
+
+    fprintf(fp, "{\n  \"opkg_version\": ");
+    json_string(fp, VERSION);
+    fprintf(fp, ",\n  \"quick\": %s,\n  \"reps\": %d,\n  \"benchmarks\": [",
+            quick ? "true" : "false", reps);
+    for (i = 0; i < result_count; i++) {
+        struct bench_result *r = results[i];
+
+        fprintf(fp, "%s\n    {\"name\": ", i ? "," : "");
+        json_string(fp, r->name);
+        fprintf(fp, ", \"variant\": ");
+        json_string(fp, r->variant);
+        fprintf(fp, ", \"reps\": %d, \"best_s\": %.9f, \"mean_s\": %.9f",
+                r->reps, r->best, r->reps ? r->total / r->reps : 0.0);
+        if (r->ops)
+            fprintf(fp, ", \"ops\": %lu, \"ns_per_op\": %.3f", r->ops,
+                    r->best * 1e9 / r->ops);
+        if (r->bytes)
+            fprintf(fp, ", \"bytes\": %llu, \"mb_per_s\": %.3f", r->bytes,
+                    r->best > 0 ? r->bytes / r->best / 1e6 : 0.0);
+        fputc('}', fp);
+    }
+    fprintf(fp, "\n  ]\n}\n");
+    return ferror(fp) ? -1 : 0;
+}
+
+static void usage(void)
+{
+    printf("usage: opkg-bench [options...] [benchmark...]\n");
+    printf("\nRuns the benchmarks whose names contain one of the given strings,\n");
+    printf("or all of them, and prints the results as JSON.\n");
+    printf("\nOptions:\n");
+    printf("\t-o <file>       Write the JSON results to <file> instead of stdout\n");
+    printf("\t-r <count>      Repeat each benchmark <count> times (default 3)\n");
+    printf("\t-q              Use smaller inputs\n");
+    printf("\nBenchmarks: hash_table_insert, hash_table_get, version_compare,\n");
+    printf("pkg_parse_line, pkg_hash_load_feeds,\n");
+    printf("pkg_hash_fetch_best_installation_candidate, md5sum, sha256sum,\n");
+    printf("list_compress, list_decompress, ar_extract_all, ar_open_control");
+#if WITH_XZ
+    printf(", xz_decode");
+#endif
+    printf("\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *out_file = NULL;
+    char tmpl[] = "/tmp/opkg-bench-XXXXXX";
+    int c, err = 0, i;
+    FILE *out = stdout;
+
+    while ((c = getopt(argc, argv, "o:r:qh")) != -1) {
+        switch (c) {
+        case 'o':
+            out_file = optarg;
+            break;
+        case 'r':
+            reps = atoi(optarg);
+            if (reps < 1)
+                usage();
+            break;
+        case 'q':
+            quick = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    filters = argv + optind;
+    filter_count = argc - optind;
+
+    if (opkg_conf_init())
+        return 1;
+    opkg_config->verbosity = ERROR;
+
+    work_dir = mkdtemp(tmpl);
+    if (work_dir == NULL) {
+        opkg_perror(ERROR, "Failed to create %s", tmpl);
+        return 1;
+    }
+
+    bench_hash_table();
+    bench_version_compare();
+    bench_feed();
+    bench_checksums();
+    bench_list_compress();
+    bench_ar_extract_all();
+    bench_ar_open_control();
+#if WITH_XZ
+    bench_xz_decode();
+#endif
+
+    rm_r(work_dir);
+
+    if (out_file) {
+        out = fopen(out_file, "w");
+        if (out == NULL) {
+            opkg_perror(ERROR, "Failed to open %s", out_file);
+            return 1;
+        }
+    }
+    if (write_json(out))
+        err = 1;
+    if (out != stdout && fclose(out) != 0)
+        err = 1;
+
+    for (i = 0; i < result_count; i++) {
+        xfree(results[i]->variant);
+        xfree(results[i]);
+    }
+    xfree(results);
+
+    return err;
+}
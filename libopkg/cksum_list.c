@@ -36,10 +36,10 @@ static int cksum_init(cksum_t * cksum, char **itemlist)
 
 static void cksum_deinit(cksum_t * cksum)
 {
-    free(cksum->name);
+    xfree(cksum->name);
     cksum->name = NULL;
 
-    free(cksum->value);
+    xfree(cksum->value);
     cksum->value = NULL;
 }
 
@@ -58,7 +58,7 @@ void cksum_list_deinit(cksum_list_t * list)
         cksum_deinit(cksum);
 
         /* malloced in cksum_list_append */
-        free(cksum);
+        xfree(cksum);
         iter->data = NULL;
     }
     void_list_deinit((void_list_t *) list);
@@ -28,6 +28,7 @@
 #include "file_util.h"
 #include "sprintf_alloc.h"
 #include "opkg_conf.h"
+#include "xfuncs.h"
 
 int conffile_init(conffile_t * conffile, const char *file_name,
                   const char *md5sum)
@@ -55,7 +56,7 @@ int conffile_has_been_modified(conffile_t * conffile)
     root_filename = root_filename_alloc(filename);
     if (!file_exists(root_filename)) {
         opkg_msg(INFO, "Conffile %s deleted\n", conffile->name);
-        free(root_filename);
+        xfree(root_filename);
         return 1;
     }
 
@@ -66,9 +67,9 @@ int conffile_has_been_modified(conffile_t * conffile)
                  conffile->name, md5sum, conffile->value);
     }
 
-    free(root_filename);
+    xfree(root_filename);
     if (md5sum)
-        free(md5sum);
+        xfree(md5sum);
 
     return ret;
 }
@@ -36,10 +36,10 @@ static int file_info_init(file_info_t *info, char *path, mode_t mode, char *link
 
 static void file_info_deinit(file_info_t *info)
 {
-    free(info->path);
+    xfree(info->path);
     info->path = NULL;
 
-    free(info->link_target);
+    xfree(info->link_target);
     info->link_target = NULL;
 }
 
@@ -65,7 +65,7 @@ void file_list_deinit(file_list_t *list)
         file_info_deinit(info);
 
         /* malloced in file_list_append */
-        free(info);
+        xfree(info);
         iter->data = NULL;
     }
     void_list_deinit((void_list_t *)list);
@@ -94,7 +94,7 @@ void file_list_remove_elt(file_list_t *list, const char *path)
                                      (void *)path,
                                      file_list_cmp);
     if (str)
-        free(str);
+        xfree(str);
 }
 
 file_list_elt_t *file_list_first(file_list_t *list)
@@ -111,5 +111,5 @@ file_list_elt_t *file_list_next(file_list_t *list, file_list_elt_t * node)
 void file_list_purge(file_list_t * list)
 {
     file_list_deinit(list);
-    free(list);
+    xfree(list);
 }
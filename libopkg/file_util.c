@@ -36,6 +36,7 @@
 #include "sprintf_alloc.h"
 #include "file_util.h"
 #include "md5.h"
+#include "opkg_stats.h"
 #include "xfuncs.h"
 
 #if WITH_SHA256
@@ -55,8 +56,8 @@ int xlstat(const char *file_name, struct stat *st)
             return -1;
         clean_path[--size] = '\0';
     }
-    r = lstat(file_name, st);
-    free(clean_path);
+    r = opkg_lstat(file_name, st);
+    xfree(clean_path);
     return r;
 }
 
@@ -106,7 +107,7 @@ int file_is_symlink_to_dir(const char *file_name)
         link_target = realpath(file_name, NULL);
         if (link_target) {
             is_symlink_to_dir = (xlstat(link_target, &target_stat) == 0) && S_ISDIR(target_stat.st_mode);
-            free(link_target);
+            xfree(link_target);
         }
     }
     return is_symlink_to_dir;
@@ -126,7 +127,7 @@ char *file_readlink_alloc(const char *file_name)
     target = malloc(st.st_size + 1);
     link_len = readlink(file_name, target, st.st_size);
     if (link_len == -1) {
-        free(target);
+        xfree(target);
         return NULL;
     }
     target[link_len] = 0;
@@ -170,6 +171,41 @@ char *file_read_line_alloc(FILE * fp)
     return line;
 }
 
+/* Read a whole file into memory. The buffer is NUL-terminated, which *len
+   does not count. Returns NULL on error. */
+char *file_read_alloc(const char *file_name, size_t *len)
+{
+    char *buf = NULL;
+    size_t cap = 0, n;
+    FILE *fp;
+
+    fp = fopen(file_name, "r");
+    if (fp == NULL) {
+        opkg_perror(ERROR, "Failed to open %s", file_name);
+        return NULL;
+    }
+
+    *len = 0;
+    do {
+        if (*len + BUFSIZ + 1 > cap) {
+            cap = cap ? 2 * cap : 64 * 1024;
+            buf = xrealloc(buf, cap);
+        }
+        n = fread(buf + *len, 1, cap - *len - 1, fp);
+        *len += n;
+    } while (n > 0);
+
+    if (ferror(fp)) {
+        opkg_perror(ERROR, "Failed to read %s", file_name);
+        xfree(buf);
+        buf = NULL;
+    } else {
+        buf[*len] = '\0';
+    }
+    fclose(fp);
+    return buf;
+}
+
 static int copy_file_data(FILE * src_file, FILE * dst_file)
 {
     size_t nread, nwritten;
@@ -204,9 +240,9 @@ int file_link(const char *src, const char *dest)
     struct stat dest_stat;
     int r;
 
-    r = stat(dest, &dest_stat);
+    r = opkg_stat(dest, &dest_stat);
     if (r == 0) {
-        r = unlink(dest);
+        r = opkg_unlink(dest);
         if (r < 0) {
             opkg_perror(ERROR, "unable to remove `%s'", dest);
             return -1;
@@ -234,13 +270,13 @@ int file_copy(const char *src, const char *dest)
     int status = 0;
     int r;
 
-    r = stat(src, &src_stat);
+    r = opkg_stat(src, &src_stat);
     if (r < 0) {
         opkg_perror(ERROR, "%s", src);
         return -1;
     }
 
-    r = stat(dest, &dest_stat);
+    r = opkg_stat(dest, &dest_stat);
     if (r < 0) {
         if (errno != ENOENT) {
             opkg_perror(ERROR, "unable to stat `%s'", dest);
@@ -263,7 +299,7 @@ int file_copy(const char *src, const char *dest)
         if (dest_exists) {
             dfp = fopen(dest, "w");
             if (dfp == NULL) {
-                r = unlink(dest);
+                r = opkg_unlink(dest);
                 if (r < 0) {
                     opkg_perror(ERROR, "unable to remove `%s'", dest);
                     return -1;
@@ -357,14 +393,14 @@ int file_mkdir_hier(const char *path, long mode)
         mode = 0700;
     }
 
-    r = stat(path, &st);
+    r = opkg_stat(path, &st);
     if (r < 0 && errno == ENOENT) {
         int status;
         char *parent;
 
         parent = xdirname(path);
         status = file_mkdir_hier(parent, mode | 0300);
-        free(parent);
+        xfree(parent);
 
         if (status < 0)
             return -1;
@@ -491,7 +527,7 @@ int rm_r(const char *path)
 #endif
         {
             struct stat st;
-            ret = lstat(dent->d_name, &st);
+            ret = opkg_lstat(dent->d_name, &st);
             if (ret == -1) {
                 opkg_perror(ERROR, "Failed to lstat %s", dent->d_name);
                 break;
@@ -504,7 +540,7 @@ int rm_r(const char *path)
             }
         }
 
-        ret = unlink(dent->d_name);
+        ret = opkg_unlink(dent->d_name);
         if (ret == -1) {
             opkg_perror(ERROR, "Failed to unlink %s", dent->d_name);
             break;
@@ -567,18 +603,60 @@ int file_decompress(const char *in, const char *out)
     return r;
 }
 
-int file_gz_compress(const char *in)
+static int file_stamp_stat(const char *path, struct stat *st)
 {
-    char *in_gz;
-    int r = 0;
-
-    sprintf_alloc(&in_gz, "%s.gz", in);
-    if (!gz_write_archive(in, in_gz)) {
-        r = unlink(in);
-        if (r != 0)
-            opkg_perror(ERROR, "unable to remove `%s'", in);
-    }
+    if (opkg_stat(path, st) == 0)
+        return 1;
+    memset(st, 0, sizeof(*st));
+    return 0;
+}
 
-    free(in_gz);
-    return r;
+void file_stamp_init(file_stamp_t *stamp, const char *path)
+{
+    struct stat st;
+
+    stamp->path = xstrdup(path);
+    stamp->exists = file_stamp_stat(path, &st);
+    stamp->ctime = st.st_ctim;
+    stamp->size = st.st_size;
+    stamp->md5sum = stamp->exists ? file_md5sum_alloc(path) : NULL;
+}
+
+/*
+ * Whether the file has changed since the stamp was taken, in which case the
+ * stamp is brought up to date. A file which was rewritten with the same
+ * contents only costs a checksum.
+ */
+int file_stamp_changed(file_stamp_t *stamp)
+{
+    struct stat st;
+    int exists;
+    char *md5sum;
+    int changed;
+
+    exists = file_stamp_stat(stamp->path, &st);
+    if (exists == stamp->exists && (!exists
+            || (st.st_size == stamp->size
+                && st.st_ctim.tv_sec == stamp->ctime.tv_sec
+                && st.st_ctim.tv_nsec == stamp->ctime.tv_nsec)))
+        return 0;
+
+    md5sum = exists ? file_md5sum_alloc(stamp->path) : NULL;
+    changed = exists != stamp->exists || !md5sum || !stamp->md5sum
+            || strcmp(md5sum, stamp->md5sum);
+
+    stamp->exists = exists;
+    stamp->ctime = st.st_ctim;
+    stamp->size = st.st_size;
+    xfree(stamp->md5sum);
+    stamp->md5sum = md5sum;
+    return changed;
+}
+
+void file_stamp_deinit(file_stamp_t *stamp)
+{
+    xfree(stamp->path);
+    xfree(stamp->md5sum);
+    stamp->path = NULL;
+    stamp->md5sum = NULL;
 }
@@ -25,8 +25,23 @@
 extern "C" {
 #endif
 
+#include <sys/types.h>
+#include <time.h>
+
 struct stat;
 
+/* What a file looked like when it was last read: a reload compares this
+ * with the file on disk to tell whether it has to read it again. The change
+ * time is used as writers such as "opkg update" may set the modification
+ * time back to that of their source. */
+typedef struct {
+    char *path;
+    int exists;
+    struct timespec ctime;
+    off_t size;
+    char *md5sum;
+} file_stamp_t;
+
 int xlstat(const char *file_name, struct stat *st);
 int file_exists(const char *file_name);
 int file_is_dir(const char *file_name);
@@ -34,6 +49,7 @@ int file_is_symlink(const char *file_name);
 int file_is_symlink_to_dir(const char *file_name);
 char *file_readlink_alloc(const char *file_name);
 char *file_read_line_alloc(FILE * file);
+char *file_read_alloc(const char *file_name, size_t *len);
 int file_link(const char *src, const char *dest);
 int file_copy(const char *src, const char *dest);
 int file_mkdir_hier(const char *path, long mode);
@@ -41,7 +57,9 @@ char *file_md5sum_alloc(const char *file_name);
 char *file_sha256sum_alloc(const char *file_name);
 int rm_r(const char *path);
 int file_decompress(const char *in, const char *out);
-int file_gz_compress(const char *filename);
+void file_stamp_init(file_stamp_t *stamp, const char *path);
+int file_stamp_changed(file_stamp_t *stamp);
+void file_stamp_deinit(file_stamp_t *stamp);
 
 /* Buffer size used for extracting files from archives. */
 #define EXTRACT_BUFFER_LEN 0x8000
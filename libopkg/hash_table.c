@@ -25,6 +25,7 @@
 #include <string.h>
 #include "hash_table.h"
 #include "opkg_message.h"
+#include "opkg_stats.h"
 #include "xfuncs.h"
 
 static unsigned long djb2_hash(const unsigned char *str)
@@ -62,13 +63,175 @@ void hash_print_stats(hash_table_t * hash)
 {
     printf("hash_table: %s, %d bytes\n"
            "\tn_buckets=%d, n_elements=%d, n_collisions=%d\n"
-           "\tmax_bucket_len=%d, n_used_buckets=%d, ave_bucket_len=%.2f\n"
-           "\tn_hits=%d, n_misses=%d\n", hash->name,
+           "\tmax_bucket_len=%d, n_used_buckets=%d, ave_bucket_len=%.2f\n",
+           hash->name,
            hash->n_buckets * (int)sizeof(hash_entry_t), hash->n_buckets,
            hash->n_elements, hash->n_collisions, hash->max_bucket_len,
            hash->n_used_buckets,
-           (hash->n_used_buckets ? ((float)hash->n_elements) / hash->n_used_buckets : 0.0f),
-           hash->n_hits, hash->n_misses);
+           (hash->n_used_buckets ? ((float)hash->n_elements) / hash->n_used_buckets : 0.0f));
+    if (hash->diag)
+        printf("\tn_hits=%lu, n_misses=%lu\n", hash->diag->n_hits,
+               hash->diag->n_misses);
+}
+
+/*
+ * Start counting lookups, probe lengths and load samples for this table.
+ * The counters live until hash_table_deinit().
+ */
+void hash_table_enable_diagnostics(hash_table_t * hash)
+{
+    if (hash->diag)
+        return;
+
+    hash->diag = xcalloc(1, sizeof(struct hash_diagnostics));
+    hash->diag->next_sample = hash->n_elements + 1;
+    hash->diag->start_ns = opkg_stats_now();
+}
+
+static void hash_diag_lookup(struct hash_diagnostics *diag,
+                             unsigned int probes, int hit)
+{
+    if (hit)
+        diag->n_hits++;
+    else
+        diag->n_misses++;
+    diag->n_probes += probes;
+    if (probes >= HASH_HISTOGRAM_LEN)
+        probes = HASH_HISTOGRAM_LEN - 1;
+    diag->probe_hist[probes]++;
+}
+
+static void hash_diag_insert(hash_table_t * hash)
+{
+    struct hash_diagnostics *diag = hash->diag;
+    struct hash_load_sample *sample;
+
+    if (hash->n_elements < diag->next_sample
+            || diag->n_load_samples == HASH_LOAD_SAMPLES)
+        return;
+
+    sample = &diag->load[diag->n_load_samples++];
+    sample->n_elements = hash->n_elements;
+    sample->n_used_buckets = hash->n_used_buckets;
+    sample->ns = opkg_stats_now() - diag->start_ns;
+    diag->next_sample = hash->n_elements * 2;
+}
+
+/*
+ * Count the buckets by the length of their chain. hist must have
+ * HASH_HISTOGRAM_LEN slots.
+ */
+void hash_table_chain_histogram(hash_table_t * hash, unsigned long *hist)
+{
+    unsigned int i;
+
+    memset(hist, 0, HASH_HISTOGRAM_LEN * sizeof(*hist));
+    for (i = 0; i < hash->n_buckets; i++) {
+        hash_entry_t *hash_entry = hash->entries + i;
+        unsigned int len = 0;
+
+        if (hash_entry->key) {
+            for (; hash_entry; hash_entry = hash_entry->next)
+                len++;
+        }
+        if (len >= HASH_HISTOGRAM_LEN)
+            len = HASH_HISTOGRAM_LEN - 1;
+        hist[len]++;
+    }
+}
+
+/*
+ * Find the n keys which take the most comparisons to look up, deepest
+ * first. Returns how many were found.
+ */
+unsigned int hash_table_worst_keys(hash_table_t * hash, const char **keys,
+                                   unsigned int *depths, unsigned int n)
+{
+    unsigned int i, j, found = 0;
+
+    for (i = 0; i < hash->n_buckets; i++) {
+        hash_entry_t *hash_entry = hash->entries + i;
+        unsigned int depth = 0;
+
+        if (!hash_entry->key)
+            continue;
+        for (; hash_entry; hash_entry = hash_entry->next) {
+            depth++;
+            if (found == n && (n == 0 || depth <= depths[n - 1]))
+                continue;
+            if (found < n)
+                found++;
+            for (j = found - 1; j > 0 && depths[j - 1] < depth; j--) {
+                keys[j] = keys[j - 1];
+                depths[j] = depths[j - 1];
+            }
+            keys[j] = hash_entry->key;
+            depths[j] = depth;
+        }
+    }
+
+    return found;
+}
+
+static void print_histogram(FILE * fp, const char *what,
+                            const unsigned long *hist)
+{
+    int i, last = -1;
+
+    for (i = 0; i < HASH_HISTOGRAM_LEN; i++) {
+        if (hist[i])
+            last = i;
+    }
+    fprintf(fp, "  %s:", what);
+    for (i = 0; i <= last; i++)
+        fprintf(fp, " %d%s=%lu", i, i == HASH_HISTOGRAM_LEN - 1 ? "+" : "",
+                hist[i]);
+    fprintf(fp, "\n");
+}
+
+void hash_print_diagnostics(hash_table_t * hash, FILE * fp)
+{
+    struct hash_diagnostics *diag = hash->diag;
+    unsigned long hist[HASH_HISTOGRAM_LEN];
+    const char *keys[5];
+    unsigned int depths[5];
+    unsigned int i, n;
+
+    fprintf(fp, "%s: %u elements in %u buckets, load factor %.3f\n",
+            hash->name, hash->n_elements, hash->n_buckets,
+            hash->n_buckets ? (double)hash->n_elements / hash->n_buckets : 0.0);
+    fprintf(fp, "  used buckets: %u, collisions: %u, longest chain: %u\n",
+            hash->n_used_buckets, hash->n_collisions,
+            hash->n_elements ? hash->max_bucket_len + 1 : 0);
+
+    hash_table_chain_histogram(hash, hist);
+    print_histogram(fp, "chain lengths", hist);
+
+    n = hash_table_worst_keys(hash, keys, depths, 5);
+    if (n) {
+        fprintf(fp, "  deepest keys:");
+        for (i = 0; i < n; i++)
+            fprintf(fp, " %s (%u)", keys[i], depths[i]);
+        fprintf(fp, "\n");
+    }
+
+    if (!diag)
+        return;
+
+    fprintf(fp, "  lookups: %lu hits, %lu misses, %.2f keys compared on "
+            "average\n", diag->n_hits, diag->n_misses,
+            diag->n_hits + diag->n_misses ?
+            (double)diag->n_probes / (diag->n_hits + diag->n_misses) : 0.0);
+    print_histogram(fp, "keys compared per lookup", diag->probe_hist);
+
+    if (diag->n_load_samples) {
+        fprintf(fp, "  load factor over time:");
+        for (i = 0; i < diag->n_load_samples; i++)
+            fprintf(fp, " %.4f@%.3fs", hash->n_buckets ?
+                    (double)diag->load[i].n_elements / hash->n_buckets : 0.0,
+                    diag->load[i].ns / 1e9);
+        fprintf(fp, "\n");
+    }
 }
 
 void hash_table_deinit(hash_table_t * hash)
@@ -80,20 +243,22 @@ void hash_table_deinit(hash_table_t * hash)
     /* free the reminaing entries */
     for (i = 0; i < hash->n_buckets; i++) {
         hash_entry_t *hash_entry = (hash->entries + i);
-        free(hash_entry->key);
+        xfree(hash_entry->key);
         /* skip the first entry as this is part of the array */
         hash_entry = hash_entry->next;
         while (hash_entry) {
             hash_entry_t *old = hash_entry;
             hash_entry = hash_entry->next;
-            free(old->key);
-            free(old);
+            xfree(old->key);
+            xfree(old);
         }
     }
 
-    free(hash->entries);
+    xfree(hash->entries);
+    xfree(hash->diag);
 
     hash->entries = NULL;
+    hash->diag = NULL;
     hash->n_buckets = 0;
 }
 
@@ -101,16 +266,20 @@ void *hash_table_get(hash_table_t * hash, const char *key)
 {
     int ndx = hash_index(hash, key);
     hash_entry_t *hash_entry = hash->entries + ndx;
+    unsigned int probes = 0;
     while (hash_entry) {
         if (hash_entry->key) {
+            probes++;
             if (strcmp(key, hash_entry->key) == 0) {
-                hash->n_hits++;
+                if (hash->diag)
+                    hash_diag_lookup(hash->diag, probes, 1);
                 return hash_entry->data;
             }
         }
         hash_entry = hash_entry->next;
     }
-    hash->n_misses++;
+    if (hash->diag)
+        hash_diag_lookup(hash->diag, probes, 0);
     return NULL;
 }
 
@@ -152,6 +321,8 @@ int hash_table_insert(hash_table_t * hash, const char *key, void *value)
     hash->n_elements++;
     hash_entry->key = xstrdup(key);
     hash_entry->data = value;
+    if (hash->diag)
+        hash_diag_insert(hash);
 
     return 0;
 }
@@ -164,15 +335,15 @@ int hash_table_remove(hash_table_t * hash, const char *key)
     while (hash_entry) {
         if (hash_entry->key) {
             if (strcmp(key, hash_entry->key) == 0) {
-                free(hash_entry->key);
+                xfree(hash_entry->key);
                 if (last_entry) {
                     last_entry->next = hash_entry->next;
-                    free(hash_entry);
+                    xfree(hash_entry);
                 } else {
                     next_entry = hash_entry->next;
                     if (next_entry) {
                         memmove(hash_entry, next_entry, sizeof(hash_entry_t));
-                        free(next_entry);
+                        xfree(next_entry);
                     } else {
                         memset(hash_entry, 0, sizeof(hash_entry_t));
                     }
@@ -25,9 +25,35 @@
 extern "C" {
 #endif
 
+#include <stdio.h>
+
 typedef struct hash_entry hash_entry_t;
 typedef struct hash_table hash_table_t;
 
+/* Histogram slots; the last one also counts everything longer. */
+#define HASH_HISTOGRAM_LEN 16
+#define HASH_LOAD_SAMPLES 32
+
+struct hash_load_sample {
+    unsigned int n_elements;
+    unsigned int n_used_buckets;
+    long long ns;               /* since diagnostics were enabled */
+};
+
+/* Lookup counters, only kept for tables with diagnostics enabled so that
+ * hash_table_get() does not write to the table otherwise. */
+struct hash_diagnostics {
+    unsigned long n_hits, n_misses;
+    unsigned long probe_hist[HASH_HISTOGRAM_LEN];
+    unsigned long long n_probes;
+
+    /* Taken each time the element count reaches a power of two. */
+    struct hash_load_sample load[HASH_LOAD_SAMPLES];
+    unsigned int n_load_samples;
+    unsigned int next_sample;
+    long long start_ns;
+};
+
 struct hash_entry {
     char *key;
     void *data;
@@ -44,12 +70,17 @@ struct hash_table {
     unsigned int n_used_buckets;
     unsigned int n_collisions;
     unsigned int max_bucket_len;
-    unsigned int n_hits, n_misses;
+    struct hash_diagnostics *diag;
 };
 
 void hash_table_init(const char *name, hash_table_t * hash, int len);
 void hash_table_deinit(hash_table_t * hash);
 void hash_print_stats(hash_table_t * hash);
+void hash_table_enable_diagnostics(hash_table_t * hash);
+void hash_table_chain_histogram(hash_table_t * hash, unsigned long *hist);
+unsigned int hash_table_worst_keys(hash_table_t * hash, const char **keys,
+                                   unsigned int *depths, unsigned int n);
+void hash_print_diagnostics(hash_table_t * hash, FILE * fp);
 void *hash_table_get(hash_table_t * hash, const char *key);
 int hash_table_insert(hash_table_t * hash, const char *key, void *value);
 int hash_table_remove(hash_table_t * has, const char *key);
@@ -0,0 +1,354 @@
+/* vi: set expandtab sw=4 sts=4: */
+/* list_index.c - the opkg package management system
+
+   SPDX-License-Identifier: GPL-2.0-or-later
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+*/
+
+/*
+ * Compressed list files are written as a run of independent gzip members or
+ * zstd frames of LIST_INDEX_FRAME_PKGS stanzas each, next to an index which
+ * maps every package name to its frame and to its place in the decompressed
+ * frame. The index is a text file, "<list><suffix>.idx":
+ *
+ *   OPKG-LIST-INDEX 1 <list size> <list mtime sec>.<nsec>
+ *   <name> <frame offset> <frame length> <stanza offset> <stanza length>
+ *   ...
+ *
+ * with the entries sorted by name. The size and mtime of the compressed
+ * list tie the index to it, so that an index left over from another list is
+ * never used.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "file_util.h"
+#include "list_index.h"
+#include "opkg_archive.h"
+#include "opkg_message.h"
+#include "sprintf_alloc.h"
+#include "xfuncs.h"
+
+#define LIST_INDEX_MAGIC "OPKG-LIST-INDEX 1"
+#define LIST_INDEX_FRAME_PKGS 64
+
+struct stanza {
+    const char *name;
+    size_t name_len;
+    size_t start;
+    size_t end;
+    size_t frame;
+};
+
+static int stanza_cmp(const void *a, const void *b)
+{
+    const struct stanza *x = (const struct stanza *)a;
+    const struct stanza *y = (const struct stanza *)b;
+    size_t n = x->name_len < y->name_len ? x->name_len : y->name_len;
+    int r = n ? memcmp(x->name, y->name, n) : 0;
+
+    if (r)
+        return r;
+    if (x->name_len != y->name_len)
+        return x->name_len < y->name_len ? -1 : 1;
+    /* Keep stanzas of the same name in file order. */
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+static int is_blank(const char *line, const char *end)
+{
+    for (; line < end; line++)
+        if (*line != ' ' && *line != '\t' && *line != '\r')
+            return 0;
+    return 1;
+}
+
+/* Find the stanzas of a Packages file, each with the name from its
+ * "Package:" field. Stanzas without one are counted but get no name. */
+static struct stanza *split_stanzas(const char *buf, size_t len, size_t *n)
+{
+    struct stanza *st = NULL;
+    size_t cap = 0, pos = 0;
+    int in_stanza = 0;
+
+    *n = 0;
+    while (pos < len) {
+        const char *line = buf + pos;
+        const char *nl = memchr(line, '\n', len - pos);
+        size_t next = nl ? (size_t)(nl - buf) + 1 : len;
+        const char *eol = nl ? nl : buf + len;
+
+        if (is_blank(line, eol)) {
+            in_stanza = 0;
+        } else {
+            if (!in_stanza) {
+                if (*n == cap) {
+                    cap = cap ? 2 * cap : 1024;
+                    st = xrealloc(st, cap * sizeof(struct stanza));
+                }
+                memset(&st[*n], 0, sizeof(struct stanza));
+                st[*n].start = pos;
+                (*n)++;
+                in_stanza = 1;
+            }
+            st[*n - 1].end = next;
+            if (!st[*n - 1].name && strncmp(line, "Package:", 8) == 0) {
+                const char *s = line + 8, *e = eol;
+
+                while (s < e && (*s == ' ' || *s == '\t'))
+                    s++;
+                while (e > s && (e[-1] == ' ' || e[-1] == '\t'
+                                 || e[-1] == '\r'))
+                    e--;
+                if (e > s) {
+                    st[*n - 1].name = s;
+                    st[*n - 1].name_len = e - s;
+                }
+            }
+        }
+        pos = next;
+    }
+    return st;
+}
+
+static int write_index(const char *index_file, const char *list_file,
+                       struct stanza *st, size_t n, const size_t *frame_start,
+                       const off_t *offsets)
+{
+    struct stat sb;
+    char *tmp;
+    FILE *fp;
+    size_t i;
+    int r = 0;
+
+    if (stat(list_file, &sb) != 0) {
+        opkg_perror(ERROR, "Failed to stat %s", list_file);
+        return -1;
+    }
+
+    sprintf_alloc(&tmp, "%s.tmp", index_file);
+    fp = fopen(tmp, "w");
+    if (!fp) {
+        opkg_perror(ERROR, "Failed to create %s", tmp);
+        xfree(tmp);
+        return -1;
+    }
+
+    qsort(st, n, sizeof(struct stanza), stanza_cmp);
+    fprintf(fp, "%s %lld %lld.%09ld\n", LIST_INDEX_MAGIC,
+            (long long)sb.st_size, (long long)sb.st_mtim.tv_sec,
+            sb.st_mtim.tv_nsec);
+    for (i = 0; i < n; i++) {
+        size_t f = st[i].frame;
+
+        if (!st[i].name)
+            continue;
+        fprintf(fp, "%.*s %lld %lld %zu %zu\n", (int)st[i].name_len,
+                st[i].name, (long long)offsets[f],
+                (long long)(offsets[f + 1] - offsets[f]),
+                st[i].start - frame_start[f], st[i].end - st[i].start);
+    }
+
+    if (ferror(fp)) {
+        opkg_perror(ERROR, "Failed to write %s", tmp);
+        r = -1;
+    }
+    if (fclose(fp) != 0)
+        r = -1;
+    if (!r && rename(tmp, index_file) != 0) {
+        opkg_perror(ERROR, "Failed to rename %s to %s", tmp, index_file);
+        r = -1;
+    }
+    if (r)
+        unlink(tmp);
+    xfree(tmp);
+    return r;
+}
+
+/* Compress list_file into list_file plus suffix, ".gz" or ".zst", in frames
+ * of LIST_INDEX_FRAME_PKGS stanzas, write its index and remove list_file.
+ * The compressed list is usable without the index, so failing to write the
+ * index is only a warning.
+ */
+int list_index_compress(const char *list_file, const char *suffix)
+{
+    struct stanza *st;
+    size_t len, n, n_frames, i, *ends, *frame_start;
+    off_t *offsets;
+    char *buf, *out, *index_file;
+    int r;
+
+    buf = file_read_alloc(list_file, &len);
+    if (!buf)
+        return -1;
+
+    st = split_stanzas(buf, len, &n);
+    n_frames = n ? (n + LIST_INDEX_FRAME_PKGS - 1) / LIST_INDEX_FRAME_PKGS : 1;
+    ends = xcalloc(n_frames, sizeof(size_t));
+    frame_start = xcalloc(n_frames, sizeof(size_t));
+    offsets = xcalloc(n_frames + 1, sizeof(off_t));
+
+    /* A frame runs from the start of its first stanza to the start of the
+     * next frame's first one, so that the frames cover the whole file. */
+    for (i = 0; i < n; i++)
+        st[i].frame = i / LIST_INDEX_FRAME_PKGS;
+    for (i = 0; i < n_frames; i++) {
+        frame_start[i] = i ? ends[i - 1] : 0;
+        ends[i] = i + 1 < n_frames ? st[(i + 1) * LIST_INDEX_FRAME_PKGS].start
+                                   : len;
+    }
+
+    sprintf_alloc(&out, "%s%s", list_file, suffix);
+    sprintf_alloc(&index_file, "%s.idx", out);
+    r = ar_write_frames(out, strcmp(suffix, ".zst") == 0, buf, ends, n_frames,
+                        offsets);
+    if (!r) {
+        if (write_index(index_file, out, st, n, frame_start, offsets) != 0) {
+            opkg_msg(NOTICE, "Couldn't index %s, lookups will read all of it.\n",
+                     out);
+            unlink(index_file);
+        }
+        r = unlink(list_file);
+        if (r != 0)
+            opkg_perror(ERROR, "unable to remove `%s'", list_file);
+    }
+
+    xfree(index_file);
+    xfree(out);
+    xfree(offsets);
+    xfree(frame_start);
+    xfree(ends);
+    xfree(st);
+    xfree(buf);
+    return r;
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+    const struct list_index_entry *x = (const struct list_index_entry *)a;
+    const struct list_index_entry *y = (const struct list_index_entry *)b;
+
+    if (x->frame_offset != y->frame_offset)
+        return x->frame_offset < y->frame_offset ? -1 : 1;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/* Compare the name at the start of an index line with name. */
+static int line_cmp(const char *line, const char *name)
+{
+    size_t len = strcspn(line, " \n");
+    int r = strncmp(line, name, len);
+
+    if (r)
+        return r;
+    return name[len] ? -1 : 0;
+}
+
+/* Find where the stanzas of the named packages are in the compressed list
+ * list_file. On success, *entries is an allocated array of *n_entries
+ * entries sorted by position, none for a name the list does not have.
+ * Returns -1 if list_file has no usable index.
+ */
+int list_index_lookup(const char *list_file, const char *const *names,
+                      size_t n_names, struct list_index_entry **entries,
+                      size_t *n_entries)
+{
+    struct list_index_entry *e = NULL;
+    struct stat sb;
+    long long size, sec;
+    long nsec;
+    char *index_file, *buf, *p, **lines = NULL;
+    size_t len, n_lines = 0, cap = 0, n = 0, n_cap = 0, i;
+    int r = -1;
+
+    if (stat(list_file, &sb) != 0)
+        return -1;
+    sprintf_alloc(&index_file, "%s.idx", list_file);
+    if (!file_exists(index_file)) {
+        xfree(index_file);
+        return -1;
+    }
+    buf = file_read_alloc(index_file, &len);
+    if (!buf)
+        goto cleanup;
+
+    if (strncmp(buf, LIST_INDEX_MAGIC " ", sizeof(LIST_INDEX_MAGIC)) != 0
+        || sscanf(buf + sizeof(LIST_INDEX_MAGIC), "%lld %lld.%ld", &size,
+                  &sec, &nsec) != 3
+        || size != (long long)sb.st_size || sec != (long long)sb.st_mtim.tv_sec
+        || nsec != sb.st_mtim.tv_nsec) {
+        opkg_msg(DEBUG, "Index %s is stale, ignoring it.\n", index_file);
+        goto cleanup;
+    }
+
+    p = strchr(buf, '\n');
+    while (p && *++p) {
+        if (n_lines == cap) {
+            cap = cap ? 2 * cap : 1024;
+            lines = xrealloc(lines, cap * sizeof(char *));
+        }
+        lines[n_lines++] = p;
+        p = strchr(p, '\n');
+    }
+
+    for (i = 0; i < n_names; i++) {
+        size_t lo = 0, hi = n_lines;
+
+        /* Lower bound, then every line with that name. */
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+
+            if (line_cmp(lines[mid], names[i]) < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        for (; lo < n_lines && line_cmp(lines[lo], names[i]) == 0; lo++) {
+            const char *fields = lines[lo] + strlen(names[i]);
+            long long fo, fl;
+
+            if (n == n_cap) {
+                n_cap = n_cap ? 2 * n_cap : 16;
+                e = xrealloc(e, n_cap * sizeof(struct list_index_entry));
+            }
+            if (sscanf(fields, "%lld %lld %zu %zu", &fo, &fl, &e[n].offset,
+                       &e[n].len) != 4) {
+                opkg_msg(ERROR, "Malformed index %s.\n", index_file);
+                xfree(e);
+                e = NULL;
+                n = 0;
+                goto cleanup;
+            }
+            e[n].frame_offset = fo;
+            e[n].frame_len = fl;
+            n++;
+        }
+    }
+
+    if (n)
+        qsort(e, n, sizeof(struct list_index_entry), entry_cmp);
+    *entries = e;
+    *n_entries = n;
+    r = 0;
+
+ cleanup:
+    xfree(lines);
+    xfree(buf);
+    xfree(index_file);
+    return r;
+}
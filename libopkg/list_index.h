@@ -0,0 +1,44 @@
+/* vi: set expandtab sw=4 sts=4: */
+/* list_index.h - the opkg package management system
+
+   SPDX-License-Identifier: GPL-2.0-or-later
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+*/
+
+#ifndef LIST_INDEX_H
+#define LIST_INDEX_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Where one package stanza of a compressed list file is: the compressed
+ * frame holding it, and its place in the frame once decompressed. */
+struct list_index_entry {
+    off_t frame_offset;
+    size_t frame_len;
+    size_t offset;
+    size_t len;
+};
+
+int list_index_compress(const char *list_file, const char *suffix);
+int list_index_lookup(const char *list_file, const char *const *names,
+                      size_t n_names, struct list_index_entry **entries,
+                      size_t *n_entries);
+
+#ifdef __cplusplus
+}
+#endif
+#endif                          /* LIST_INDEX_H */
@@ -36,9 +36,9 @@ int nv_pair_init(nv_pair_t * nv_pair, const char *name, const char *value)
 
 void nv_pair_deinit(nv_pair_t * nv_pair)
 {
-    free(nv_pair->name);
+    xfree(nv_pair->name);
     nv_pair->name = NULL;
 
-    free(nv_pair->value);
+    xfree(nv_pair->value);
     nv_pair->value = NULL;
 }
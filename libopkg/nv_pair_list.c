@@ -45,9 +45,9 @@ void nv_pair_list_deinit(nv_pair_list_t * list)
         nv_pair = (nv_pair_t *) pos->data;
         nv_pair_deinit(nv_pair);
         /* malloced in nv_pair_list_append */
-        free(nv_pair);
+        xfree(nv_pair);
         pos->data = NULL;
-        free(pos);
+        xfree(pos);
     }
     void_list_deinit((void_list_t *) list);
 }
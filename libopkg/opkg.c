@@ -24,6 +24,10 @@
 #include <unistd.h>
 #include <fnmatch.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
 
 #include "opkg.h"
 #include "opkg_conf.h"
@@ -45,6 +49,8 @@
 
 /** Private Functions ***/
 
+static int async_cancelled(void);
+
 static void progress(opkg_progress_data_t * d, int p,
                      opkg_progress_callback_t callback, void *user_data)
 {
@@ -58,17 +64,12 @@ static void progress(opkg_progress_data_t * d, int p,
 
 static int opkg_configure_packages(char *pkg_name)
 {
-    pkg_vec_t *all;
-    unsigned int i;
+    pkg_hash_iter_t it;
     pkg_t *pkg;
     int r, err = 0;
 
-    all = pkg_vec_alloc();
-    pkg_hash_fetch_available(all);
-
-    for (i = 0; i < all->len; i++) {
-        pkg = all->pkgs[i];
-
+    pkg_hash_iter_init(&it, PKG_ITER_INSTALLED, NULL, NULL);
+    while ((pkg = pkg_hash_iter_next(&it))) {
         if (pkg_name && fnmatch(pkg_name, pkg->name, 0))
             continue;
 
@@ -85,7 +86,6 @@ static int opkg_configure_packages(char *pkg_name)
         }
     }
 
-    pkg_vec_free(all);
     return err;
 }
 
@@ -105,6 +105,10 @@ static int curl_progress_cb(struct _curl_cb_data *cb_data, double t,    /* dltot
     static int prev = -1;
     int progress = 0;
 
+    /* Aborts the transfer; nothing has been installed yet. */
+    if (async_cancelled())
+        return 1;
+
     /* prevent the same value being sent twice (can occur due to rounding) */
     if (p == prev)
         return 0;
@@ -123,6 +127,8 @@ static int curl_progress_cb(struct _curl_cb_data *cb_data, double t,    /* dltot
 }
 
 static opkg_conf_t saved_conf;
+/* Set by opkg_set_option(), which a reload has to start afresh to undo. */
+static int options_changed;
 /*** Public API ***/
 
 int opkg_new()
@@ -138,6 +144,10 @@ int opkg_new()
     if (r != 0)
         goto err0;
 
+    opkg_conf_stamp_files();
+    pkg_hash_stamp_files();
+    options_changed = 0;
+
     r = pkg_hash_load_feeds();
     if (r != 0)
         goto err1;
@@ -161,8 +171,16 @@ void opkg_free(void)
     opkg_conf_deinit();
 }
 
+/*
+ * After an update only some of the lists have changed, so unless the
+ * configuration or the status files have too, re-read just those feeds.
+ */
 int opkg_re_read_config_files(void)
 {
+    if (!options_changed && !opkg_conf_files_changed()
+            && pkg_hash_refresh() == 0)
+        return 0;
+
     opkg_free();
     *opkg_config = saved_conf;
     return opkg_new();
@@ -183,6 +201,7 @@ void opkg_set_option(char *option, void *value)
 
     /* Set option, overwriting any previously set value. */
     opkg_conf_set_option(option, value, 1);
+    options_changed = 1;
 }
 
 /**
@@ -197,32 +216,38 @@ int opkg_install_package(const char *package_url,
     int err;
     opkg_progress_data_t pdata;
     pkg_t *old, *new;
-    pkg_vec_t *deps, *all;
+    pkg_vec_t *deps;
     unsigned int i;
     char **unresolved = NULL;
-    char *package_name;
+    char *package_name = NULL;
 
     opkg_assert(package_url != NULL);
 
+    /* Before a local package is added: it may reload the package state. */
+    pkg_info_preinstall_check();
+
     /* Pre-process the package name to handle remote URLs and paths to
      * ipk/opk files.
      */
-    opkg_prepare_url_for_install(package_url, &package_name);
-
-    /* ... */
-    pkg_info_preinstall_check();
+    if (opkg_prepare_url_for_install(package_url, &package_name) != 0)
+        return -1;
+    /* Only set for URLs and files, a package name is used as it is. */
+    if (package_name == NULL)
+        package_name = xstrdup(package_url);
 
     /* check to ensure package is not already installed */
     old = pkg_hash_fetch_installed_by_name(package_name);
     if (old) {
         opkg_msg(ERROR, "Package %s is already installed\n", package_name);
-        return -1;
+        err = -1;
+        goto out;
     }
 
     new = pkg_hash_fetch_best_installation_candidate_by_name(package_name);
     if (!new) {
         opkg_msg(ERROR, "Couldn't find package %s\n", package_name);
-        return -1;
+        err = -1;
+        goto out;
     }
 
     new->state_flag |= SF_USER;
@@ -243,13 +268,14 @@ int opkg_install_package(const char *package_url,
                  package_name);
         while (*tmp) {
             opkg_msg(ERROR, "\t%s", *tmp);
-            free(*tmp);
+            xfree(*tmp);
             tmp++;
         }
-        free(unresolved);
+        xfree(unresolved);
         pkg_vec_free(deps);
         opkg_message(ERROR, "\n");
-        return -1;
+        err = -1;
+        goto out;
     }
 
     /* insert the package we are installing so that we download it */
@@ -259,7 +285,6 @@ int opkg_install_package(const char *package_url,
     for (i = 0; i < deps->len; i++) {
         pkg_t *pkg;
         struct _curl_cb_data cb_data;
-        char *url;
 
         pkg = deps->pkgs[i];
         if (pkg->local_filename)
@@ -272,11 +297,11 @@ int opkg_install_package(const char *package_url,
             opkg_msg(ERROR,
                      "Package %s not available from any " "configured src\n",
                      package_name);
-            return -1;
+            pkg_vec_free(deps);
+            err = -1;
+            goto out;
         }
 
-        sprintf_alloc(&url, "%s/%s", pkg->src->value, pkg->filename);
-
         cb_data.cb = progress_callback;
         cb_data.progress_data = &pdata;
         cb_data.user_data = user_data;
@@ -284,26 +309,22 @@ int opkg_install_package(const char *package_url,
         cb_data.start_range = 75 * i / deps->len;
         cb_data.finish_range = 75 * (i + 1) / deps->len;
 
-        pkg->local_filename = opkg_download_cache(url,
-                                (curl_progress_func) curl_progress_cb,
-                                &cb_data);
-        free(url);
-
-        if (pkg->local_filename == NULL) {
+        if (opkg_download_pkg_progress(pkg,
+                                       (curl_progress_func) curl_progress_cb,
+                                       &cb_data) != 0) {
             pkg_vec_free(deps);
-            return -1;
+            err = -1;
+            goto out;
         }
 
     }
     pkg_vec_free(deps);
 
-    /* clear depenacy checked marks, left by pkg_hash_fetch_unsatisfied_dependencies */
-    all = pkg_vec_alloc();
-    pkg_hash_fetch_available(all);
-    for (i = 0; i < all->len; i++) {
-        all->pkgs[i]->parent->dependencies_checked = 0;
+    if (async_cancelled()) {
+        opkg_msg(NOTICE, "Install of %s cancelled.\n", package_name);
+        err = -1;
+        goto out;
     }
-    pkg_vec_free(all);
 
     /* 75% of "install" progress is for downloading */
     pdata.pkg = new;
@@ -314,7 +335,8 @@ int opkg_install_package(const char *package_url,
     err = opkg_install_pkg(new, NULL);
 
     if (err) {
-        return -1;
+        err = -1;
+        goto out;
     }
 
     progress(&pdata, 90, progress_callback, user_data);
@@ -322,15 +344,19 @@ int opkg_install_package(const char *package_url,
     /* run configure scripts, etc. */
     err = opkg_configure_packages(NULL);
     if (err) {
-        return -1;
+        err = -1;
+        goto out;
     }
 
     /* write out status files and file lists */
-    opkg_conf_write_status_files();
     pkg_write_changed_filelists();
+    opkg_conf_write_status_files();
 
     progress(&pdata, 100, progress_callback, user_data);
-    return 0;
+
+ out:
+    xfree(package_name);
+    return err;
 }
 
 int opkg_remove_package(const char *package_name,
@@ -357,6 +383,9 @@ int opkg_remove_package(const char *package_name,
     pdata.pkg = pkg;
     progress(&pdata, 0, progress_callback, user_data);
 
+    if (async_cancelled())
+        return -1;
+
     if (opkg_config->restrict_to_default_dest) {
         pkg_to_remove = pkg_hash_fetch_installed_by_name_dest(pkg->name,
                                                               opkg_config->default_dest);
@@ -369,8 +398,8 @@ int opkg_remove_package(const char *package_name,
     err = opkg_remove_pkg(pkg_to_remove);
 
     /* write out status files and file lists */
-    opkg_conf_write_status_files();
     pkg_write_changed_filelists();
+    opkg_conf_write_status_files();
 
     progress(&pdata, 100, progress_callback, user_data);
     return (err) ? -1 : 0;
@@ -404,6 +433,9 @@ int opkg_upgrade_package(const char *package_name,
     pdata.pkg = pkg;
     progress(&pdata, 0, progress_callback, user_data);
 
+    if (async_cancelled())
+        return -1;
+
     err = opkg_upgrade_pkg(pkg);
     if (err) {
         return -1;
@@ -416,8 +448,8 @@ int opkg_upgrade_package(const char *package_name,
     }
 
     /* write out status files and file lists */
-    opkg_conf_write_status_files();
     pkg_write_changed_filelists();
+    opkg_conf_write_status_files();
 
     progress(&pdata, 100, progress_callback, user_data);
     return 0;
@@ -444,6 +476,13 @@ int opkg_upgrade_all(opkg_progress_callback_t progress_callback,
     for (i = 0; i < installed->len; i++) {
         pkg = installed->pkgs[i];
 
+        /* Stop between packages; those done so far are still configured
+         * and written out below. */
+        if (async_cancelled()) {
+            err++;
+            break;
+        }
+
         pdata.pkg = pkg;
         progress(&pdata, 99 * i / installed->len, progress_callback, user_data);
 
@@ -451,16 +490,15 @@ int opkg_upgrade_all(opkg_progress_callback_t progress_callback,
     }
     pkg_vec_free(installed);
 
-    if (err)
-        return 1;
-
-    err = opkg_configure_packages(NULL);
-    if (err)
-        return 1;
+    if (opkg_configure_packages(NULL))
+        err++;
 
     /* write out status files and file lists */
-    opkg_conf_write_status_files();
     pkg_write_changed_filelists();
+    opkg_conf_write_status_files();
+
+    if (err)
+        return 1;
 
     pdata.pkg = NULL;
     progress(&pdata, 100, progress_callback, user_data);
@@ -500,7 +538,7 @@ int opkg_update_package_lists(opkg_progress_callback_t progress_callback,
     dtemp = mkdtemp(tmp);
     if (dtemp == NULL) {
         opkg_perror(ERROR, "Coundn't create temporary directory %s", tmp);
-        free(tmp);
+        xfree(tmp);
         return 1;
     }
 
@@ -514,6 +552,12 @@ int opkg_update_package_lists(opkg_progress_callback_t progress_callback,
     list_for_each_entry(iter, &opkg_config->pkg_src_list.head, node) {
         src = (pkg_src_t *) iter->data;
 
+        /* The lists already fetched are kept and loaded below. */
+        if (async_cancelled()) {
+            result = -1;
+            break;
+        }
+
         err = pkg_src_update(src);
         if (err)
             result = -1;
@@ -524,7 +568,7 @@ int opkg_update_package_lists(opkg_progress_callback_t progress_callback,
     }
 
     rmdir(tmp);
-    free(tmp);
+    xfree(tmp);
 
     /* Now re-read the package lists to update package hash tables. */
     opkg_re_read_config_files();
@@ -532,41 +576,16 @@ int opkg_update_package_lists(opkg_progress_callback_t progress_callback,
     return result;
 }
 
-static int pkg_compare_names_and_version(const void *a0, const void *b0)
-{
-    const pkg_t *a = *(const pkg_t **)a0;
-    const pkg_t *b = *(const pkg_t **)b0;
-    int ret;
-
-    ret = strcmp(a->name, b->name);
-
-    if (ret == 0)
-        ret = pkg_compare_versions(a, b);
-
-    return ret;
-}
-
 int opkg_list_packages(opkg_package_callback_t callback, void *user_data)
 {
-    pkg_vec_t *all;
-    unsigned int i;
+    pkg_hash_iter_t it;
+    pkg_t *pkg;
 
     opkg_assert(callback);
 
-    all = pkg_vec_alloc();
-    pkg_hash_fetch_available(all);
-
-    pkg_vec_sort(all, pkg_compare_names_and_version);
-
-    for (i = 0; i < all->len; i++) {
-        pkg_t *pkg;
-
-        pkg = all->pkgs[i];
-
+    pkg_hash_iter_init(&it, PKG_ITER_SORTED_VERSION, NULL, NULL);
+    while ((pkg = pkg_hash_iter_next(&it)))
         callback(pkg, user_data);
-    }
-
-    pkg_vec_free(all);
 
     return 0;
 }
@@ -596,8 +615,8 @@ int opkg_list_upgradable_packages(opkg_package_callback_t callback,
 pkg_t *opkg_find_package(const char *name, const char *ver, const char *arch,
                          const char *repo)
 {
+    abstract_pkg_t *ab_pkg;
     pkg_t *pkg = NULL;
-    pkg_vec_t *all;
     unsigned int i;
 
     /* We expect to be given a name to search for, all other arguments are
@@ -605,19 +624,16 @@ pkg_t *opkg_find_package(const char *name, const char *ver, const char *arch,
      */
     opkg_assert(name);
 
-    all = pkg_vec_alloc();
-    pkg_hash_fetch_available(all);
-    for (i = 0; i < all->len; i++) {
-        char *pkgv;
+    /* The versions of a package all hang off the abstract package of that
+     * name, so there is no need to look at any other. */
+    ab_pkg = abstract_pkg_fetch_by_name(name);
+    if (!ab_pkg || !ab_pkg->pkgs)
+        return NULL;
 
-        pkg = all->pkgs[i];
+    for (i = 0; i < ab_pkg->pkgs->len; i++) {
+        char *pkgv;
 
-        /* check name */
-        /* We can assume all packages have a name and we always want to
-         * check the name.
-         */
-        if (strcmp(pkg->name, name))
-            continue;
+        pkg = ab_pkg->pkgs->pkgs[i];
 
         /* check version */
         /* We can assume all packages have a version but we might not
@@ -626,10 +642,10 @@ pkg_t *opkg_find_package(const char *name, const char *ver, const char *arch,
          */
         pkgv = pkg_version_str_alloc(pkg);
         if (ver && strcmp(pkgv, ver)) {
-            free(pkgv);
+            xfree(pkgv);
             continue;
         }
-        free(pkgv);
+        xfree(pkgv);
 
         /* check architecture */
         if (arch && pkg->architecture && strcmp(pkg->architecture, arch))
@@ -640,12 +656,10 @@ pkg_t *opkg_find_package(const char *name, const char *ver, const char *arch,
             continue;
 
         /* match found */
-        pkg_vec_free(all);
         return pkg;
     }
 
     /* no match found */
-    pkg_vec_free(all);
     return NULL;
 }
 
@@ -684,10 +698,10 @@ int opkg_repository_accessibility_check(void)
             continue;
 
         sprintf_alloc(&repo_ptr, "%s/index.html", stmp);
-        free(stmp);
+        xfree(stmp);
 
         str_list_append(src, repo_ptr);
-        free(repo_ptr);
+        xfree(repo_ptr);
         repositories++;
     }
 
@@ -698,26 +712,310 @@ int opkg_repository_accessibility_check(void)
 
         cache_location = opkg_download_cache(iter1->data, NULL, NULL);
         if (cache_location) {
-            free(cache_location);
+            xfree(cache_location);
             ret++;
         }
         str_list_elt_deinit(iter1);
     }
 
-    free(src);
+    xfree(src);
 
     return ret;
 }
 
 int opkg_compare_versions(const char *ver1, const char *ver2)
 {
-    pkg_t *pkg1, *pkg2;
+    pkg_version_t v1, v2;
+    int r;
+
+    pkg_version_parse(&v1, ver1);
+    pkg_version_parse(&v2, ver2);
+    r = pkg_version_compare(&v1, &v2);
+    pkg_version_deinit(&v1);
+    pkg_version_deinit(&v2);
+
+    return r;
+}
+
+void opkg_compare_versions_array(const char *const *ver1,
+                                 const char *const *ver2, int *results,
+                                 size_t n)
+{
+    pkg_versions_compare(ver1, ver2, results, n);
+}
 
-    pkg1 = pkg_new();
-    pkg2 = pkg_new();
+void opkg_sort_versions(const char **versions, size_t n)
+{
+    pkg_versions_sort(versions, n);
+}
 
-    parse_version(pkg1, ver1);
-    parse_version(pkg2, ver2);
+/*** Asynchronous API ***/
 
-    return pkg_compare_versions(pkg1, pkg2);
+enum async_action {
+    ASYNC_INSTALL,
+    ASYNC_REMOVE,
+    ASYNC_UPGRADE,
+    ASYNC_UPGRADE_ALL,
+    ASYNC_UPDATE
+};
+
+struct async_event {
+    opkg_event_t event;
+    char *pkg_name;
+    struct async_event *next;
+};
+
+struct _opkg_async_t {
+    enum async_action action;
+    char *arg;
+    pthread_t thread;
+    int joined;
+    int result;
+
+    /* Guards everything below. The eventfd is readable exactly while the
+     * queue is not empty. */
+    pthread_mutex_t lock;
+    int event_fd;
+    struct async_event *head, *tail;
+    struct async_event *last;   /* returned by the last next_event call */
+    int cancelled;
+};
+
+/* libopkg keeps its state in globals, so one operation runs at a time. */
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static opkg_async_t *async_current;
+
+static int async_cancelled(void)
+{
+    opkg_async_t *op;
+    int r = 0;
+
+    pthread_mutex_lock(&async_lock);
+    op = async_current;
+    if (op && pthread_equal(op->thread, pthread_self())) {
+        pthread_mutex_lock(&op->lock);
+        r = op->cancelled;
+        pthread_mutex_unlock(&op->lock);
+    }
+    pthread_mutex_unlock(&async_lock);
+    return r;
+}
+
+static void async_push(opkg_async_t * op, int type, int action,
+                       int percentage, const pkg_t * pkg, int result)
+{
+    struct async_event *e = xcalloc(1, sizeof(*e));
+    uint64_t one = 1;
+
+    e->event.type = type;
+    e->event.action = action;
+    e->event.percentage = percentage;
+    e->event.result = result;
+    if (pkg && pkg->name)
+        e->pkg_name = xstrdup(pkg->name);
+    e->event.pkg_name = e->pkg_name;
+
+    pthread_mutex_lock(&op->lock);
+    e->event.cancelled = op->cancelled;
+    if (op->tail)
+        op->tail->next = e;
+    else
+        op->head = e;
+    op->tail = e;
+    if (write(op->event_fd, &one, sizeof(one)) != sizeof(one))
+        opkg_perror(ERROR, "Failed to signal event");
+    pthread_mutex_unlock(&op->lock);
+}
+
+static void async_progress(const opkg_progress_data_t * progress,
+                           void *user_data)
+{
+    async_push(user_data, OPKG_EVENT_PROGRESS, progress->action,
+               progress->percentage, progress->pkg, 0);
+}
+
+static void *async_worker(void *data)
+{
+    opkg_async_t *op = data;
+    int r = -1;
+
+    switch (op->action) {
+    case ASYNC_INSTALL:
+        r = opkg_install_package(op->arg, async_progress, op);
+        break;
+    case ASYNC_REMOVE:
+        r = opkg_remove_package(op->arg, async_progress, op);
+        break;
+    case ASYNC_UPGRADE:
+        r = opkg_upgrade_package(op->arg, async_progress, op);
+        break;
+    case ASYNC_UPGRADE_ALL:
+        r = opkg_upgrade_all(async_progress, op);
+        break;
+    case ASYNC_UPDATE:
+        r = opkg_update_package_lists(async_progress, op);
+        break;
+    }
+    op->result = r;
+
+    /* The caller may start the next operation once it sees this event. */
+    pthread_mutex_lock(&async_lock);
+    async_current = NULL;
+    pthread_mutex_unlock(&async_lock);
+    async_push(op, OPKG_EVENT_DONE, -1, 100, NULL, r);
+    return NULL;
+}
+
+static opkg_async_t *async_start(enum async_action action, const char *arg)
+{
+    opkg_async_t *op;
+    int r;
+
+    pthread_mutex_lock(&async_lock);
+    if (async_current) {
+        pthread_mutex_unlock(&async_lock);
+        errno = EBUSY;
+        return NULL;
+    }
+
+    op = xcalloc(1, sizeof(*op));
+    op->action = action;
+    op->arg = arg ? xstrdup(arg) : NULL;
+    pthread_mutex_init(&op->lock, NULL);
+    op->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (op->event_fd == -1) {
+        opkg_perror(ERROR, "Failed to create eventfd");
+        goto err;
+    }
+
+    /* Set before the worker can look for it. */
+    async_current = op;
+    r = pthread_create(&op->thread, NULL, async_worker, op);
+    if (r != 0) {
+        async_current = NULL;
+        errno = r;
+        opkg_perror(ERROR, "Failed to start worker thread");
+        close(op->event_fd);
+        goto err;
+    }
+    pthread_mutex_unlock(&async_lock);
+    return op;
+
+ err:
+    pthread_mutex_unlock(&async_lock);
+    pthread_mutex_destroy(&op->lock);
+    xfree(op->arg);
+    xfree(op);
+    return NULL;
+}
+
+opkg_async_t *opkg_async_install_package(const char *package_url)
+{
+    opkg_assert(package_url != NULL);
+    return async_start(ASYNC_INSTALL, package_url);
+}
+
+opkg_async_t *opkg_async_remove_package(const char *package_name)
+{
+    opkg_assert(package_name != NULL);
+    return async_start(ASYNC_REMOVE, package_name);
+}
+
+opkg_async_t *opkg_async_upgrade_package(const char *package_name)
+{
+    opkg_assert(package_name != NULL);
+    return async_start(ASYNC_UPGRADE, package_name);
+}
+
+opkg_async_t *opkg_async_upgrade_all(void)
+{
+    return async_start(ASYNC_UPGRADE_ALL, NULL);
+}
+
+opkg_async_t *opkg_async_update_package_lists(void)
+{
+    return async_start(ASYNC_UPDATE, NULL);
+}
+
+int opkg_async_fd(opkg_async_t * op)
+{
+    opkg_assert(op);
+    return op->event_fd;
+}
+
+int opkg_async_next_event(opkg_async_t * op, opkg_event_t * event)
+{
+    struct async_event *e;
+    uint64_t count;
+
+    opkg_assert(op);
+    opkg_assert(event);
+
+    pthread_mutex_lock(&op->lock);
+    if (op->last) {
+        xfree(op->last->pkg_name);
+        xfree(op->last);
+        op->last = NULL;
+    }
+
+    e = op->head;
+    if (e) {
+        op->head = e->next;
+        if (op->head == NULL) {
+            op->tail = NULL;
+            /* Clear the counter so the fd stops polling readable. */
+            if (read(op->event_fd, &count, sizeof(count)) == -1
+                    && errno != EAGAIN)
+                opkg_perror(ERROR, "Failed to read eventfd");
+        }
+        *event = e->event;
+        op->last = e;
+    }
+    pthread_mutex_unlock(&op->lock);
+
+    return e != NULL;
+}
+
+void opkg_async_cancel(opkg_async_t * op)
+{
+    opkg_assert(op);
+
+    pthread_mutex_lock(&op->lock);
+    op->cancelled = 1;
+    pthread_mutex_unlock(&op->lock);
+}
+
+int opkg_async_wait(opkg_async_t * op)
+{
+    opkg_assert(op);
+
+    if (!op->joined) {
+        pthread_join(op->thread, NULL);
+        op->joined = 1;
+    }
+    return op->result;
+}
+
+void opkg_async_free(opkg_async_t * op)
+{
+    struct async_event *e;
+
+    if (op == NULL)
+        return;
+
+    opkg_async_wait(op);
+
+    while ((e = op->head)) {
+        op->head = e->next;
+        xfree(e->pkg_name);
+        xfree(e);
+    }
+    if (op->last) {
+        xfree(op->last->pkg_name);
+        xfree(op->last);
+    }
+    close(op->event_fd);
+    pthread_mutex_destroy(&op->lock);
+    xfree(op->arg);
+    xfree(op);
 }
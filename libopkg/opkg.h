@@ -73,6 +73,50 @@ pkg_t *opkg_find_package(const char *name, const char *version,
 int opkg_repository_accessibility_check(void);
 
 int opkg_compare_versions(const char *ver1, const char *ver2);
+void opkg_compare_versions_array(const char *const *ver1,
+                                 const char *const *ver2, int *results,
+                                 size_t n);
+void opkg_sort_versions(const char **versions, size_t n);
+
+/*
+ * Asynchronous operations. Each runs the matching function above on a
+ * worker thread and reports progress and completion as events, which are
+ * read with opkg_async_next_event() whenever opkg_async_fd() polls
+ * readable. Only one operation may run at a time, and no other libopkg
+ * function may be called until its OPKG_EVENT_DONE has been read; starting
+ * another fails with errno set to EBUSY.
+ *
+ * opkg_async_cancel() stops the operation at the next point where the
+ * database is consistent: before anything is unpacked, between the
+ * packages of an upgrade, or between the feeds of an update. Work already
+ * done is written out and the DONE event has cancelled set.
+ */
+typedef struct _opkg_async_t opkg_async_t;
+
+enum _opkg_event_type_t {
+    OPKG_EVENT_PROGRESS,
+    OPKG_EVENT_DONE
+};
+
+typedef struct {
+    int type;                   /* OPKG_EVENT_* */
+    int action;                 /* as in opkg_progress_data_t, -1 for DONE */
+    int percentage;
+    const char *pkg_name;       /* valid until the next event is read */
+    int result;                 /* for DONE: the operation's return value */
+    int cancelled;
+} opkg_event_t;
+
+opkg_async_t *opkg_async_install_package(const char *package_url);
+opkg_async_t *opkg_async_remove_package(const char *package_name);
+opkg_async_t *opkg_async_upgrade_package(const char *package_name);
+opkg_async_t *opkg_async_upgrade_all(void);
+opkg_async_t *opkg_async_update_package_lists(void);
+int opkg_async_fd(opkg_async_t * op);
+int opkg_async_next_event(opkg_async_t * op, opkg_event_t * event);
+void opkg_async_cancel(opkg_async_t * op);
+int opkg_async_wait(opkg_async_t * op);
+void opkg_async_free(opkg_async_t * op);
 
 #ifdef __cplusplus
 }
@@ -20,18 +20,38 @@
 
 #include <archive.h>
 #include <archive_entry.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "opkg_conf.h"
 #include "opkg_message.h"
 #include "opkg_archive.h"
 #include "file_util.h"
 #include "sprintf_alloc.h"
+#include "opkg_stats.h"
 #include "xfuncs.h"
 
+#if WITH_XZ
+#include <lzma.h>
+
+/* lzma_stream_decoder_mt() is stable from liblzma 5.4.0 on. */
+#if LZMA_VERSION >= UINT32_C(50040002)
+#define XZ_MT 1
+#else
+#define XZ_MT 0
+#endif
+#else
+#define XZ_MT 0
+#endif
+
 /*******************************************************************************
  * internal functions
  */
@@ -42,6 +62,9 @@ struct inner_data {
 
     /* Buffer for extracted data. */
     void *buffer;
+
+    /* Whether the outer archive outlives this inner one. */
+    int keep_outer;
 };
 
 static ssize_t inner_read(struct archive *a, void *client_data,
@@ -61,9 +84,10 @@ static int inner_close(struct archive *inner, void *client_data)
 
     struct inner_data *data = (struct inner_data *)client_data;
 
-    archive_read_free(data->outer);
-    free(data->buffer);
-    free(data);
+    if (!data->keep_outer)
+        archive_read_free(data->outer);
+    xfree(data->buffer);
+    xfree(data);
 
     return ARCHIVE_OK;
 }
@@ -124,16 +148,19 @@ static int copy_to_stream(struct archive *a, FILE * stream)
     size_t sz_out, sz_in;
     int eof;
     size_t len = EXTRACT_BUFFER_LEN;
+    opkg_mem_tag_t mem;
 
     if (archive_format(a) == ARCHIVE_FORMAT_EMPTY)
         return 0;
 
+    mem = opkg_mem_enter(OPKG_MEM_ARCHIVE);
     buffer = xmalloc(len);
+    opkg_mem_leave(mem);
 
     while (1) {
         sz_in = read_data(a, buffer, len, &eof);
         if (eof) {
-            free(buffer);
+            xfree(buffer);
             return 0;
         }
         if (sz_in == 0)
@@ -149,7 +176,7 @@ static int copy_to_stream(struct archive *a, FILE * stream)
     }
 
  err_cleanup:
-    free(buffer);
+    xfree(buffer);
     return -1;
 }
 
@@ -204,7 +231,7 @@ static int transform_dest_path(struct archive_entry *entry, const char *dest)
         return 1;
 
     archive_entry_set_pathname(entry, path);
-    free(path);
+    xfree(path);
 
     return 0;
 }
@@ -239,7 +266,7 @@ static int transform_all_paths(struct archive_entry *entry, const char *dest)
         }
 
         archive_entry_set_hardlink(entry, path);
-        free(path);
+        xfree(path);
     }
 
     /* Currently no transform to perform for symlinks. */
@@ -547,23 +574,13 @@ static struct archive *open_outer(const char *filename)
     return NULL;
 }
 
-/* Open an inner archive at the current position within the given outer archive. */
-static struct archive *open_inner(struct archive *outer)
+/* Enable the compression filters and formats which the control and data
+ * archives of a package may use. Returns 0 on success, <0 otherwise.
+ */
+static int inner_support_formats(struct archive *inner)
 {
-    struct archive *inner;
-    struct inner_data *data;
     int r;
 
-    inner = archive_read_new();
-    if (!inner) {
-        opkg_msg(ERROR, "Failed to create inner archive object.\n");
-        return NULL;
-    }
-
-    data = (struct inner_data *)xmalloc(sizeof(struct inner_data));
-    data->buffer = xmalloc(EXTRACT_BUFFER_LEN);
-    data->outer = outer;
-
     /* Inner package is in 'tar' format, gzip compressed. */
     r = archive_read_support_filter_gzip(inner);
     if (r == ARCHIVE_WARN) {
@@ -573,7 +590,7 @@ static struct archive *open_inner(struct archive *outer)
         opkg_msg(INFO, "Gzip support provided by external program.\n");
     } else if (r != ARCHIVE_OK) {
         opkg_msg(ERROR, "Gzip format not supported.\n");
-        goto err_cleanup;
+        return -1;
     }
 
 #if WITH_XZ
@@ -585,7 +602,7 @@ static struct archive *open_inner(struct archive *outer)
         opkg_msg(INFO, "Xz support provided by external program.\n");
     } else if (r != ARCHIVE_OK) {
         opkg_msg(ERROR, "Xz format not supported.\n");
-        goto err_cleanup;
+        return -1;
     }
 #endif
 
@@ -598,7 +615,7 @@ static struct archive *open_inner(struct archive *outer)
         opkg_msg(INFO, "Bzip2 support provided by external program.\n");
     } else if (r != ARCHIVE_OK) {
         opkg_msg(ERROR, "Bzip2 format not supported.\n");
-        goto err_cleanup;
+        return -1;
     }
 #endif
 
@@ -611,7 +628,7 @@ static struct archive *open_inner(struct archive *outer)
         opkg_msg(INFO, "Lz4 support provided by external program.\n");
     } else if (r != ARCHIVE_OK) {
         opkg_msg(ERROR, "Lz4 format not supported.\n");
-        goto err_cleanup;
+        return -1;
     }
 #endif
 
@@ -624,24 +641,54 @@ static struct archive *open_inner(struct archive *outer)
         opkg_msg(INFO, "Zstandard support provided by external program.\n");
     } else if (r != ARCHIVE_OK) {
         opkg_msg(ERROR, "Zstandard format not supported.\n");
-        goto err_cleanup;
+        return -1;
     }
 #endif
 
     r = archive_read_support_format_tar(inner);
     if (r != ARCHIVE_OK) {
         opkg_msg(ERROR, "Tar format not supported: %s (errno=%d)\n",
-                 archive_error_string(outer), archive_errno(outer));
-        goto err_cleanup;
+                 archive_error_string(inner), archive_errno(inner));
+        return -1;
     }
 
     r = archive_read_support_format_empty(inner);
     if (r != ARCHIVE_OK) {
         opkg_msg(ERROR, "Empty format not supported: %s (errno=%d)\n",
                  archive_error_string(inner), archive_errno(inner));
-        goto err_cleanup;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Open an inner archive at the current position within the given outer
+ * archive. Closing the inner archive frees the outer one unless keep_outer is
+ * set.
+ */
+static struct archive *open_inner(struct archive *outer, int keep_outer)
+{
+    struct archive *inner;
+    struct inner_data *data;
+    opkg_mem_tag_t mem;
+    int r;
+
+    inner = archive_read_new();
+    if (!inner) {
+        opkg_msg(ERROR, "Failed to create inner archive object.\n");
+        return NULL;
     }
 
+    mem = opkg_mem_enter(OPKG_MEM_ARCHIVE);
+    data = (struct inner_data *)xmalloc(sizeof(struct inner_data));
+    data->buffer = xmalloc(EXTRACT_BUFFER_LEN);
+    opkg_mem_leave(mem);
+    data->outer = outer;
+    data->keep_outer = keep_outer;
+
+    if (inner_support_formats(inner) < 0)
+        goto err_cleanup;
+
     r = archive_read_open(inner, data, NULL, inner_read, inner_close);
     if (r != ARCHIVE_OK) {
         opkg_msg(ERROR, "Failed to open inner archive: %s (errno=%d)\n",
@@ -653,8 +700,8 @@ static struct archive *open_inner(struct archive *outer)
 
  err_cleanup:
     archive_read_free(inner);
-    free(data->buffer);
-    free(data);
+    xfree(data->buffer);
+    xfree(data);
     return NULL;
 }
 
@@ -705,7 +752,7 @@ static struct archive *extract_outer(const char *filename, const char *arname)
     if (r < 0)
         goto err_cleanup;
 
-    inner = open_inner(outer);
+    inner = open_inner(outer, 0);
     if (!inner)
         return NULL;
 
@@ -716,229 +763,1271 @@ static struct archive *extract_outer(const char *filename, const char *arname)
     return NULL;
 }
 
-static struct archive *open_compressed_file(const char *filename)
+/*
+ * Native access to the members of an ar-format package. The index records
+ * where each member starts, so control.tar.* and data.tar.* are each read
+ * straight from their offset instead of through an outer libarchive reader
+ * which walks every header before them.
+ */
+
+#define AR_MAGIC "!<arch>\n"
+#define AR_MAGIC_LEN 8
+#define AR_HEADER_LEN 60
+
+struct ar_member {
+    char *name;
+    off_t offset;
+    off_t size;
+};
+
+struct ar_index {
+    char *filename;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    unsigned int n_members;
+    struct ar_member *members;
+};
+
+static ssize_t pread_full(int fd, void *buf, size_t len, off_t offset)
 {
-    struct archive *ar;
-    int r;
+    size_t done = 0;
 
-    ar = archive_read_new();
-    if (!ar) {
-        opkg_msg(ERROR,
-                 "Failed to create archive object for compressed file.\n");
-        return NULL;
+    while (done < len) {
+        ssize_t r = pread(fd, (char *)buf + done, len - done, offset + done);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return r < 0 ? -1 : (ssize_t) done;
+        done += r;
     }
+    return done;
+}
 
-    /* Support raw data in gzip compression format. */
-    r = archive_read_support_filter_gzip(ar);
-    if (r == ARCHIVE_WARN) {
-        /* libarchive returns ARCHIVE_WARN if the filter is provided by
-         * an external program.
-         */
-        opkg_msg(INFO, "Gzip support provided by external program.\n");
-    } else if (r != ARCHIVE_OK) {
-        opkg_msg(ERROR, "Gzip format not supported: %s (errno=%d)\n",
-                 archive_error_string(ar), archive_errno(ar));
-        goto err_cleanup;
-    }
+/* Parse an unterminated decimal header field. */
+static long long ar_field(const char *field, size_t len)
+{
+    char buf[16];
 
-    r = archive_read_support_format_raw(ar);
-    if (r != ARCHIVE_OK) {
-        opkg_msg(ERROR, "Raw format not supported: %s (errno=%d)\n",
-                 archive_error_string(ar), archive_errno(ar));
-        goto err_cleanup;
+    memcpy(buf, field, len);
+    buf[len] = '\0';
+    return strtoll(buf, NULL, 10);
+}
+
+/* Member names are padded with spaces and may end in '/' (GNU) or start
+ * with "./"; BSD long names follow the header as "#1/<len>". */
+static char *ar_member_name(int fd, const char *header, off_t *offset,
+                            off_t *size)
+{
+    char name[17];
+    size_t len = 16;
+    char *p = name;
+
+    memcpy(name, header, 16);
+    while (len && name[len - 1] == ' ')
+        len--;
+    name[len] = '\0';
+
+    if (strncmp(name, "#1/", 3) == 0) {
+        long long n = strtoll(name + 3, NULL, 10);
+        char *long_name;
+
+        if (n <= 0 || n > 4096 || n > *size)
+            return NULL;
+        long_name = xmalloc(n + 1);
+        if (pread_full(fd, long_name, n, *offset) != n) {
+            xfree(long_name);
+            return NULL;
+        }
+        long_name[n] = '\0';
+        *offset += n;
+        *size -= n;
+        return long_name;
     }
 
-    r = archive_read_support_format_empty(ar);
-    if (r != ARCHIVE_OK) {
-        opkg_msg(ERROR, "Empty format not supported: %s (errno=%d)\n",
-                 archive_error_string(ar), archive_errno(ar));
-        goto err_cleanup;
+    if (len > 1 && name[len - 1] == '/')
+        name[--len] = '\0';
+    while (strncmp(p, "./", 2) == 0)
+        p += 2;
+    return xstrdup(p);
+}
+
+void ar_index_free(struct ar_index *index)
+{
+    unsigned int i;
+
+    if (!index)
+        return;
+
+    for (i = 0; i < index->n_members; i++)
+        xfree(index->members[i].name);
+    xfree(index->members);
+    xfree(index->filename);
+    xfree(index);
+}
+
+/*
+ * Read the member headers of an ar archive. Returns NULL if the file is not
+ * in ar format, such as a package which is a tarball, or cannot be read;
+ * the caller then falls back to libarchive.
+ */
+struct ar_index *ar_index_open(const char *filename)
+{
+    struct ar_index *index = NULL;
+    char header[AR_HEADER_LEN];
+    struct stat st;
+    off_t offset;
+    opkg_mem_tag_t mem;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0
+            || pread_full(fd, header, AR_MAGIC_LEN, 0) != AR_MAGIC_LEN
+            || memcmp(header, AR_MAGIC, AR_MAGIC_LEN) != 0)
+        goto out;
+
+    mem = opkg_mem_enter(OPKG_MEM_ARCHIVE);
+    index = xcalloc(1, sizeof(*index));
+    index->filename = xstrdup(filename);
+    index->dev = st.st_dev;
+    index->ino = st.st_ino;
+    index->size = st.st_size;
+    index->mtime = st.st_mtim;
+
+    offset = AR_MAGIC_LEN;
+    while (offset + AR_HEADER_LEN <= st.st_size) {
+        struct ar_member *m;
+        off_t data, size;
+        char *name;
+
+        if (pread_full(fd, header, AR_HEADER_LEN, offset) != AR_HEADER_LEN
+                || header[58] != '`' || header[59] != '\n')
+            break;
+        size = ar_field(header + 48, 10);
+        data = offset + AR_HEADER_LEN;
+        if (size < 0 || data + size > st.st_size)
+            break;
+        offset = data + size + (size & 1);
+
+        name = ar_member_name(fd, header, &data, &size);
+        if (!name)
+            continue;
+        index->members = xrealloc(index->members,
+                (index->n_members + 1) * sizeof(*index->members));
+        m = &index->members[index->n_members++];
+        m->name = name;
+        m->offset = data;
+        m->size = size;
     }
+    opkg_mem_leave(mem);
 
-    /* Open input file and prepare for reading. */
-    r = archive_read_open_filename(ar, filename, EXTRACT_BUFFER_LEN);
-    if (r != ARCHIVE_OK) {
-        opkg_msg(ERROR, "Failed to open compressed file '%s': %s (errno=%d)\n",
-                 filename, archive_error_string(ar), archive_errno(ar));
-        goto err_cleanup;
+    if (!index->n_members) {
+        ar_index_free(index);
+        index = NULL;
     }
 
-    return ar;
+ out:
+    close(fd);
+    return index;
+}
 
- err_cleanup:
-    archive_read_free(ar);
-    return NULL;
+/* Whether filename is no longer the file which the index was built from. */
+int ar_index_stale(const struct ar_index *index, const char *filename)
+{
+    struct stat st;
+
+    if (strcmp(index->filename, filename) != 0 || opkg_stat(filename, &st) < 0)
+        return 1;
+    return st.st_dev != index->dev || st.st_ino != index->ino
+            || st.st_size != index->size
+            || st.st_mtim.tv_sec != index->mtime.tv_sec
+            || st.st_mtim.tv_nsec != index->mtime.tv_nsec;
 }
 
-int gz_write_archive(const char *filename, const char *gz_filename)
+static const struct ar_member *ar_index_find(const struct ar_index *index,
+                                             const char *name)
 {
-    struct archive *a;
-    struct archive_entry *entry;
-    char buff[8192];
-    int len;
-    FILE *fd;
-    int r = 0;
+    unsigned int i;
 
-    a = archive_write_new();
-    archive_write_add_filter_gzip(a);
-    archive_write_set_format_raw(a);
-    archive_write_open_filename(a, gz_filename);
+    for (i = 0; i < index->n_members; i++) {
+        if (strcmp(index->members[i].name, name) == 0)
+            return &index->members[i];
+    }
+    return NULL;
+}
 
-    struct archive *disk = archive_read_disk_new();
+struct member_data {
+    int fd;
+    off_t remaining;
+    void *buffer;
+#if XZ_MT
+    /* Multi-threaded decoder in front of the tar reader, or NULL when
+     * libarchive's own filters decompress the member. */
+    lzma_stream *xz;
+    void *xz_out;
+    int xz_end;
+#endif
+};
 
-    r = archive_read_disk_open(disk, filename);
+/* Read the next chunk of the member into data->buffer. Returns the number of
+ * bytes read, 0 at the end of the member or -1 on error. */
+static ssize_t member_fill(struct archive *a, struct member_data *data)
+{
+    size_t len = EXTRACT_BUFFER_LEN;
+    ssize_t r;
 
-    entry = archive_entry_new();
+    if ((off_t) len > data->remaining)
+        len = data->remaining;
+    if (!len)
+        return 0;
 
-    r = archive_read_next_header2(disk, entry);
-    if (r != ARCHIVE_OK) {
-        opkg_msg(ERROR, "Failed to read file: '%s' : %s (errno=%d)",
-                 filename, archive_error_string(disk), archive_errno(disk));
-        goto cleanup;
+    do {
+        r = read(data->fd, data->buffer, len);
+    } while (r < 0 && errno == EINTR);
+    if (r < 0) {
+        archive_set_error(a, errno, "Failed to read package");
+        return -1;
     }
 
-    /* Remove path hierarchy, as we are only compressing a single file */
-    char* tmp = xstrdup(filename);
-    archive_entry_set_pathname(entry, basename(tmp));
-    free(tmp);
-    r = archive_write_header(a, entry);
-    if (r != ARCHIVE_OK) {
-        opkg_msg(ERROR, "Failed to create compressed file: '%s' : %s (errno=%d)",
-                 gz_filename, archive_error_string(a), archive_errno(a));
-        goto cleanup;
+    /* A truncated package ends the member early. */
+    data->remaining = r ? data->remaining - r : 0;
+    return r;
+}
+
+#if XZ_MT
+/* Decode up to EXTRACT_BUFFER_LEN bytes of an xz member. */
+static ssize_t xz_member_read(struct archive *a, struct member_data *data,
+                              const void **buff)
+{
+    lzma_stream *strm = data->xz;
+    lzma_ret ret;
+
+    if (data->xz_end)
+        return 0;
+
+    strm->next_out = data->xz_out;
+    strm->avail_out = EXTRACT_BUFFER_LEN;
+    while (strm->avail_out == EXTRACT_BUFFER_LEN) {
+        lzma_action action = LZMA_RUN;
+
+        if (strm->avail_in == 0) {
+            ssize_t r = member_fill(a, data);
+            if (r < 0)
+                return -1;
+            strm->next_in = data->buffer;
+            strm->avail_in = r;
+            if (r == 0)
+                action = LZMA_FINISH;
+        }
+
+        ret = lzma_code(strm, action);
+        if (ret == LZMA_STREAM_END) {
+            data->xz_end = 1;
+            break;
+        }
+        if (ret != LZMA_OK) {
+            archive_set_error(a, EILSEQ,
+                              "Xz decompression failed (lzma error %d)", ret);
+            return -1;
+        }
     }
 
-    fd = fopen(filename, "r");
-    len = fread(buff, 1, sizeof(buff), fd);
-    while (len > 0) {
-        archive_write_data(a, buff, len);
-        len = fread(buff, 1, sizeof(buff), fd);
+    *buff = data->xz_out;
+    return EXTRACT_BUFFER_LEN - strm->avail_out;
+}
+
+/* Put a multi-threaded xz decoder in front of the member. Returns 0 on
+ * success, <0 otherwise. */
+static int xz_member_init(struct member_data *data, unsigned int threads)
+{
+    lzma_mt mt;
+    lzma_ret ret;
+    opkg_mem_tag_t mem;
+
+    memset(&mt, 0, sizeof(mt));
+    mt.flags = LZMA_CONCATENATED;
+    mt.threads = threads;
+    /* Past a quarter of the RAM the decoder falls back to one thread
+     * rather than failing. */
+    mt.memlimit_threading = lzma_physmem() / 4;
+    if (!mt.memlimit_threading)
+        mt.memlimit_threading = 128 << 20;
+    mt.memlimit_stop = UINT64_MAX;
+
+    mem = opkg_mem_enter(OPKG_MEM_ARCHIVE);
+    data->xz = (lzma_stream *)xcalloc(1, sizeof(lzma_stream));
+    data->xz_out = xmalloc(EXTRACT_BUFFER_LEN);
+    opkg_mem_leave(mem);
+
+    ret = lzma_stream_decoder_mt(data->xz, &mt);
+    if (ret != LZMA_OK) {
+        opkg_msg(ERROR, "Failed to create xz decoder (lzma error %d).\n", ret);
+        return -1;
     }
-    fclose(fd);
-    archive_entry_free(entry);
+    return 0;
+}
+#endif
 
-cleanup:
-    archive_read_close(disk);
-    archive_read_free(disk);
-    archive_write_close(a);
-    archive_write_free(a);
+static ssize_t member_read(struct archive *a, void *client_data,
+                           const void **buff)
+{
+    struct member_data *data = (struct member_data *)client_data;
+    ssize_t r;
+
+#if XZ_MT
+    if (data->xz)
+        return xz_member_read(a, data, buff);
+#endif
 
+    r = member_fill(a, data);
+    *buff = data->buffer;
     return r;
 }
 
-/*******************************************************************************
- * Glue layer.
- */
+static la_int64_t member_skip(struct archive *a, void *client_data,
+                              la_int64_t request)
+{
+    struct member_data *data = (struct member_data *)client_data;
+
+    (void)a;
 
-struct opkg_ar *ar_open_pkg_control_archive(const char *filename)
+    if (request > data->remaining)
+        request = data->remaining;
+    if (lseek(data->fd, request, SEEK_CUR) < 0)
+        return 0;
+    data->remaining -= request;
+    return request;
+}
+
+static int member_close(struct archive *a, void *client_data)
 {
-    struct opkg_ar *ar;
+    struct member_data *data = (struct member_data *)client_data;
 
-    ar = (struct opkg_ar *)xmalloc(sizeof(struct opkg_ar));
+    (void)a;
 
-    ar->ar = extract_outer(filename, "control.tar.gz");
-#if WITH_XZ
-    if (!ar->ar) {
-        ar->ar = extract_outer(filename, "control.tar.xz");
+    close(data->fd);
+#if XZ_MT
+    if (data->xz) {
+        lzma_end(data->xz);
+        xfree(data->xz);
+        xfree(data->xz_out);
     }
 #endif
-#if WITH_BZIP2
-    if (!ar->ar) {
-        ar->ar = extract_outer(filename, "control.tar.bz2");
-    }
+    xfree(data->buffer);
+    xfree(data);
+    return ARCHIVE_OK;
+}
+
+/* Number of threads to decode a data archive with, 1 to leave it to
+ * libarchive. */
+static unsigned int decompress_threads(const char *arname)
+{
+#if XZ_MT
+    size_t len = strlen(arname);
+    int threads = opkg_config->decompress_threads;
+
+    if (len < 3 || strcmp(arname + len - 3, ".xz") != 0)
+        return 1;
+    if (threads <= 0)
+        threads = lzma_cputhreads();
+    return threads > 1 ? threads : 1;
+#else
+    (void)arname;
+    return 1;
 #endif
-#if WITH_LZ4
-    if (!ar->ar) {
-        ar->ar = extract_outer(filename, "control.tar.lz4");
+}
+
+/* Open the archive stored in one member of an indexed package. With more
+ * than one thread, an xz member is decompressed by liblzma's multi-threaded
+ * decoder and handed to libarchive as a plain tar. */
+static struct archive *open_member(const struct ar_index *index,
+                                   const struct ar_member *member,
+                                   unsigned int threads)
+{
+    struct archive *inner;
+    struct member_data *data;
+    opkg_mem_tag_t mem;
+    int fd, r;
+
+    fd = open(index->filename, O_RDONLY);
+    if (fd < 0) {
+        opkg_perror(ERROR, "Failed to open package '%s'", index->filename);
+        return NULL;
     }
-#endif
-#if WITH_ZSTD
-    if (!ar->ar) {
-        ar->ar = extract_outer(filename, "control.tar.zst");
+    if (lseek(fd, member->offset, SEEK_SET) < 0) {
+        opkg_perror(ERROR, "Failed to seek in package '%s'", index->filename);
+        close(fd);
+        return NULL;
     }
-#endif
-    if (!ar->ar) {
-        free(ar);
+
+    inner = archive_read_new();
+    if (!inner) {
+        opkg_msg(ERROR, "Failed to create inner archive object.\n");
+        close(fd);
         return NULL;
     }
 
-    /* We don't want to set ownership and permissions of control files
-     * incase they're incorrect in the archive. They should instead be owned
-     * by the user who ran opkg (usually root) and given permissions
-     * according to the current umask.
-     */
-    ar->extract_flags = 0;
+    mem = opkg_mem_enter(OPKG_MEM_ARCHIVE);
+    data = (struct member_data *)xmalloc(sizeof(struct member_data));
+    data->buffer = xmalloc(EXTRACT_BUFFER_LEN);
+    opkg_mem_leave(mem);
+    data->fd = fd;
+    data->remaining = member->size;
+    r = 0;
+#if XZ_MT
+    data->xz = NULL;
+    data->xz_end = 0;
+    if (threads > 1)
+        r = xz_member_init(data, threads);
+#else
+    (void)threads;
+#endif
 
-    return ar;
-}
+    /* The decoded stream is a plain tar, which none of the filters bid on. */
+    if (r < 0 || inner_support_formats(inner) < 0) {
+        archive_read_free(inner);
+        member_close(NULL, data);
+        return NULL;
+    }
 
-struct opkg_ar *ar_open_pkg_data_archive(const char *filename)
-{
-    struct opkg_ar *ar;
+    archive_read_set_read_callback(inner, member_read);
+    /* Skipping is only possible in the compressed member itself. */
+#if XZ_MT
+    if (!data->xz)
+#endif
+        archive_read_set_skip_callback(inner, member_skip);
+    archive_read_set_close_callback(inner, member_close);
+    archive_read_set_callback_data(inner, data);
+    r = archive_read_open1(inner);
+    if (r != ARCHIVE_OK) {
+        opkg_msg(ERROR, "Failed to open %s in package '%s': %s (errno=%d)\n",
+                 member->name, index->filename, archive_error_string(inner),
+                 archive_errno(inner));
+        archive_read_free(inner);
+        return NULL;
+    }
 
-    ar = (struct opkg_ar *)xmalloc(sizeof(struct opkg_ar));
+    return inner;
+}
 
-    ar->ar = extract_outer(filename, "data.tar.gz");
+/* Compression suffixes of control.tar.* and data.tar.*, in order of
+ * preference. */
+static const char *const inner_suffixes[] = {
+    "gz",
 #if WITH_XZ
-    if (!ar->ar) {
-        ar->ar = extract_outer(filename, "data.tar.xz");
-    }
+    "xz",
 #endif
 #if WITH_BZIP2
-    if (!ar->ar) {
-        ar->ar = extract_outer(filename, "data.tar.bz2");
-    }
+    "bz2",
 #endif
 #if WITH_LZ4
-    if (!ar->ar) {
-        ar->ar = extract_outer(filename, "data.tar.lz4");
-    }
+    "lz4",
 #endif
 #if WITH_ZSTD
-    if (!ar->ar) {
-        ar->ar = extract_outer(filename, "data.tar.zst");
-    }
+    "zst",
 #endif
+    NULL
+};
 
-    if (!ar->ar) {
-        free(ar);
-        return NULL;
+/* Open control.tar.* or data.tar.*, given "control" or "data", from the
+ * package through its index if it has one. */
+static struct archive *open_pkg_member(const char *filename,
+                                       const struct ar_index *index,
+                                       const char *base)
+{
+    struct archive *a = NULL;
+    unsigned int i;
+    char *arname;
+
+    for (i = 0; inner_suffixes[i] && !a; i++) {
+        sprintf_alloc(&arname, "%s.tar.%s", base, inner_suffixes[i]);
+        if (index) {
+            const struct ar_member *member = ar_index_find(index, arname);
+            unsigned int threads = 1;
+
+            if (member && strcmp(base, "data") == 0)
+                threads = decompress_threads(arname);
+            if (member)
+                a = open_member(index, member, threads);
+        } else {
+            a = extract_outer(filename, arname);
+        }
+        xfree(arname);
     }
 
-    /** Flags:
-     *
+    return a;
+}
+
+/* Create an archive object which reads a single compressed file. */
+static struct archive *new_compressed_reader(void)
+{
+    struct archive *ar;
+    int r;
+
+    ar = archive_read_new();
+    if (!ar) {
+        opkg_msg(ERROR,
+                 "Failed to create archive object for compressed file.\n");
+        return NULL;
+    }
+
+    /* Support raw data in gzip compression format. */
+    r = archive_read_support_filter_gzip(ar);
+    if (r == ARCHIVE_WARN) {
+        /* libarchive returns ARCHIVE_WARN if the filter is provided by
+         * an external program.
+         */
+        opkg_msg(INFO, "Gzip support provided by external program.\n");
+    } else if (r != ARCHIVE_OK) {
+        opkg_msg(ERROR, "Gzip format not supported: %s (errno=%d)\n",
+                 archive_error_string(ar), archive_errno(ar));
+        goto err_cleanup;
+    }
+
+#if WITH_ZSTD
+    /* List files may be stored in zstd, see list_compression. */
+    r = archive_read_support_filter_zstd(ar);
+    if (r == ARCHIVE_WARN) {
+        opkg_msg(INFO, "Zstandard support provided by external program.\n");
+    } else if (r != ARCHIVE_OK) {
+        opkg_msg(ERROR, "Zstandard format not supported: %s (errno=%d)\n",
+                 archive_error_string(ar), archive_errno(ar));
+        goto err_cleanup;
+    }
+#endif
+
+    r = archive_read_support_format_raw(ar);
+    if (r != ARCHIVE_OK) {
+        opkg_msg(ERROR, "Raw format not supported: %s (errno=%d)\n",
+                 archive_error_string(ar), archive_errno(ar));
+        goto err_cleanup;
+    }
+
+    r = archive_read_support_format_empty(ar);
+    if (r != ARCHIVE_OK) {
+        opkg_msg(ERROR, "Empty format not supported: %s (errno=%d)\n",
+                 archive_error_string(ar), archive_errno(ar));
+        goto err_cleanup;
+    }
+
+    return ar;
+
+ err_cleanup:
+    archive_read_free(ar);
+    return NULL;
+}
+
+static struct archive *open_compressed_file(const char *filename)
+{
+    struct archive *ar;
+    int r;
+
+    ar = new_compressed_reader();
+    if (!ar)
+        return NULL;
+
+    /* Open input file and prepare for reading. */
+    r = archive_read_open_filename(ar, filename, EXTRACT_BUFFER_LEN);
+    if (r != ARCHIVE_OK) {
+        opkg_msg(ERROR, "Failed to open compressed file '%s': %s (errno=%d)\n",
+                 filename, archive_error_string(ar), archive_errno(ar));
+        goto err_cleanup;
+    }
+
+    return ar;
+
+ err_cleanup:
+    archive_read_free(ar);
+    return NULL;
+}
+
+static struct archive *open_compressed_buffer(const void *buf, size_t len)
+{
+    struct archive *ar;
+    int r;
+
+    ar = new_compressed_reader();
+    if (!ar)
+        return NULL;
+
+    r = archive_read_open_memory(ar, buf, len);
+    if (r != ARCHIVE_OK) {
+        opkg_msg(ERROR, "Failed to open compressed data: %s (errno=%d)\n",
+                 archive_error_string(ar), archive_errno(ar));
+        archive_read_free(ar);
+        return NULL;
+    }
+
+    return ar;
+}
+
+/* Number of threads to compress list files with. */
+static unsigned int compress_threads(void)
+{
+    long threads = opkg_config->compress_threads;
+
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    return threads > 1 ? threads : 1;
+}
+
+struct frame {
+    const char *in;
+    size_t in_len;
+    char *out;
+    size_t out_len;
+    int err;
+};
+
+struct frame_job {
+    struct frame *frames;
+    size_t n;
+    size_t first;
+    size_t stride;
+    int filter;
+};
+
+/* Compress one frame into a complete gzip member or zstd frame. */
+static void frame_compress(struct frame *frame, int filter)
+{
+    struct archive *a = archive_write_new();
+    struct archive_entry *entry = archive_entry_new();
+    /* Compression can grow incompressible data slightly. */
+    size_t cap = frame->in_len + frame->in_len / 8 + 4096;
+    opkg_mem_tag_t mem;
+
+    mem = opkg_mem_enter(OPKG_MEM_ARCHIVE);
+    frame->out = xmalloc(cap);
+    opkg_mem_leave(mem);
+    frame->out_len = 0;
+    frame->err = -1;
+    archive_entry_set_pathname(entry, "data");
+    archive_entry_set_filetype(entry, AE_IFREG);
+    archive_entry_set_size(entry, frame->in_len);
+
+    if (archive_write_add_filter(a, filter) == ARCHIVE_OK
+            && archive_write_set_format_raw(a) == ARCHIVE_OK
+            && archive_write_set_bytes_in_last_block(a, 1) == ARCHIVE_OK
+            && archive_write_open_memory(a, frame->out, cap,
+                                         &frame->out_len) == ARCHIVE_OK
+            && archive_write_header(a, entry) == ARCHIVE_OK
+            && (!frame->in_len
+                || archive_write_data(a, frame->in, frame->in_len)
+                    == (la_ssize_t)frame->in_len)
+            && archive_write_close(a) == ARCHIVE_OK)
+        frame->err = 0;
+
+    archive_entry_free(entry);
+    archive_write_free(a);
+}
+
+static void *frame_job_run(void *arg)
+{
+    struct frame_job *job = (struct frame_job *)arg;
+    size_t i;
+
+    for (i = job->first; i < job->n; i += job->stride)
+        frame_compress(&job->frames[i], job->filter);
+    return NULL;
+}
+
+/* Compress buf into filename as a run of independent gzip members or zstd
+ * frames, frame i ending at ends[i], on compress_threads threads. Any gzip or
+ * zstd reader decompresses the frames as one stream, and each one can also
+ * be decompressed on its own. If offsets is not NULL, it receives the offset
+ * of each frame in the file, and the file size in offsets[n].
+ */
+int ar_write_frames(const char *filename, int zstd, const char *buf,
+                    const size_t *ends, size_t n, off_t *offsets)
+{
+    unsigned int threads = compress_threads();
+    int filter = zstd ? ARCHIVE_FILTER_ZSTD : ARCHIVE_FILTER_GZIP;
+    struct frame *frames;
+    struct frame_job *jobs;
+    pthread_t *tids;
+    int *started;
+    opkg_mem_tag_t mem;
+    off_t pos = 0;
+    size_t i;
+    FILE *out;
+    int r = 0;
+
+    out = fopen(filename, "w");
+    if (!out) {
+        opkg_perror(ERROR, "Failed to create '%s'", filename);
+        return -1;
+    }
+
+    if (threads > n)
+        threads = n ? n : 1;
+    mem = opkg_mem_enter(OPKG_MEM_ARCHIVE);
+    frames = (struct frame *)xcalloc(n, sizeof(struct frame));
+    jobs = (struct frame_job *)xcalloc(threads, sizeof(struct frame_job));
+    tids = (pthread_t *)xcalloc(threads, sizeof(pthread_t));
+    started = (int *)xcalloc(threads, sizeof(int));
+    opkg_mem_leave(mem);
+
+    for (i = 0; i < n; i++) {
+        frames[i].in = buf + (i ? ends[i - 1] : 0);
+        frames[i].in_len = ends[i] - (i ? ends[i - 1] : 0);
+    }
+
+    /* Frames are dealt out round-robin; the first share is compressed on
+     * this thread. */
+    for (i = 0; i < threads; i++) {
+        jobs[i].frames = frames;
+        jobs[i].n = n;
+        jobs[i].first = i;
+        jobs[i].stride = threads;
+        jobs[i].filter = filter;
+        if (i > 0)
+            started[i] = pthread_create(&tids[i], NULL, frame_job_run,
+                                        &jobs[i]) == 0;
+    }
+    for (i = 0; i < threads; i++) {
+        if (i == 0 || !started[i])
+            frame_job_run(&jobs[i]);
+        else
+            pthread_join(tids[i], NULL);
+    }
+
+    for (i = 0; i < n; i++) {
+        if (offsets)
+            offsets[i] = pos;
+        if (!r && frames[i].err) {
+            opkg_msg(ERROR, "Failed to compress '%s'.\n", filename);
+            r = -1;
+        } else if (!r && fwrite(frames[i].out, 1, frames[i].out_len, out)
+                   != frames[i].out_len) {
+            opkg_perror(ERROR, "Failed to write '%s'", filename);
+            r = -1;
+        }
+        pos += frames[i].out_len;
+        xfree(frames[i].out);
+    }
+    if (offsets)
+        offsets[n] = pos;
+
+    xfree(frames);
+    xfree(jobs);
+    xfree(tids);
+    xfree(started);
+    if (fclose(out) != 0 && !r) {
+        opkg_perror(ERROR, "Failed to write '%s'", filename);
+        r = -1;
+    }
+    if (r)
+        opkg_unlink(filename);
+    return r;
+}
+
+/* Size of the frames of a compressed list file without an index. */
+#define COMPRESS_FRAME_LEN (1024 * 1024)
+
+static int write_compressed_file(const char *filename, const char *out_filename,
+                                 int zstd)
+{
+    char *buf;
+    size_t len, n, i, *ends;
+    int r;
+
+    buf = file_read_alloc(filename, &len);
+    if (!buf)
+        return -1;
+
+    /* An empty file still gets one (empty) frame. */
+    n = len ? (len + COMPRESS_FRAME_LEN - 1) / COMPRESS_FRAME_LEN : 1;
+    ends = (size_t *)xcalloc(n, sizeof(size_t));
+    for (i = 0; i < n; i++)
+        ends[i] = i + 1 < n ? (i + 1) * COMPRESS_FRAME_LEN : len;
+
+    r = ar_write_frames(out_filename, zstd, buf, ends, n, NULL);
+    xfree(ends);
+    xfree(buf);
+    return r;
+}
+
+/* Compress a file into a gzip file made of one member per MiB of input, as
+ * pigz does, so that the members can be compressed in parallel.
+ */
+int gz_write_archive(const char *filename, const char *gz_filename)
+{
+    return write_compressed_file(filename, gz_filename, 0);
+}
+
+/* Compress a file into a zstd file, one frame per MiB of input. */
+int zstd_write_archive(const char *filename, const char *zst_filename)
+{
+    return write_compressed_file(filename, zst_filename, 1);
+}
+
+/* Flags for extracting the data files of a package. */
+static int data_extract_flags(void)
+{
+    int flags;
+
+    /** Flags:
+     *
      * TODO: Do we want to support ACLs, extended flags and extended
      * attributes? (ARCHIVE_EXTRACT_ACL, ARCHIVE_EXTRACT_FFLAGS,
      * ARCHIVE_EXTRACT_XATTR).
      */
-    ar->extract_flags = ARCHIVE_EXTRACT_OWNER | ARCHIVE_EXTRACT_PERM |
+    flags = ARCHIVE_EXTRACT_OWNER | ARCHIVE_EXTRACT_PERM |
         ARCHIVE_EXTRACT_TIME | ARCHIVE_EXTRACT_UNLINK | ARCHIVE_EXTRACT_NO_OVERWRITE;
 
 #if WITH_ACL
-    ar->extract_flags |= ARCHIVE_EXTRACT_ACL;
+    flags |= ARCHIVE_EXTRACT_ACL;
 #endif
 
 #if USE_XATTR
-    ar->extract_flags |= ARCHIVE_EXTRACT_FFLAGS | ARCHIVE_EXTRACT_XATTR;
+    flags |= ARCHIVE_EXTRACT_FFLAGS | ARCHIVE_EXTRACT_XATTR;
 #endif
 
     if (opkg_config->ignore_uid)
-        ar->extract_flags &= ~ARCHIVE_EXTRACT_OWNER;
+        flags &= ~ARCHIVE_EXTRACT_OWNER;
+
+    return flags;
+}
+
+/*******************************************************************************
+ * Streamed packages.
+ *
+ * A package read from a stream, as it is downloaded, cannot be verified until
+ * its last byte has arrived. Its control files are extracted to a temporary
+ * directory, and its data files are written next to where they belong under
+ * temporary names, which ar_stage_commit() renames into place once the
+ * package has been verified and the install goes ahead. Directories are
+ * created as they come, as the staged files need them; those which did not
+ * exist before are removed again if the stage is dropped.
+ */
+
+struct staged_file {
+    char *path;
+    char *staged;
+};
+
+struct ar_stage {
+    struct staged_file *files;
+    size_t n_files;
+    size_t committed;
+
+    /* Directories created while staging, removed again on failure. */
+    char **new_dirs;
+    size_t n_new_dirs;
+
+    /* Entries for directories which already existed, applied on commit. */
+    struct archive_entry **dirs;
+    size_t n_dirs;
+
+    /* The data file list, as ar_extract_paths_to_stream() writes it. */
+    char *paths;
+    size_t paths_len;
+    FILE *paths_stream;
+
+    unsigned long installed_size;
+    unsigned int serial;
+    int done;
+};
+
+struct stream_source {
+    ar_stream_read_fn read;
+    void *data;
+    char *buffer;
+};
+
+static ssize_t stream_read(struct archive *a, void *client_data,
+                           const void **buff)
+{
+    struct stream_source *src = (struct stream_source *)client_data;
+    ssize_t r;
+
+    *buff = src->buffer;
+    r = src->read(src->data, src->buffer, EXTRACT_BUFFER_LEN);
+    if (r < 0)
+        archive_set_error(a, errno, "Failed to read package stream");
+    return r;
+}
+
+static void *stage_grow(void *array, size_t n, size_t size)
+{
+    /* Grow in powers of two. */
+    if (n == 0 || (n & (n - 1)) == 0)
+        array = xrealloc(array, (n ? 2 * n : 16) * size);
+    return array;
+}
+
+/* A temporary name in the same directory as path, so that it can be renamed
+ * over path. */
+static char *stage_name(struct ar_stage *stage, const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    int dir_len = slash ? (int)(slash - path) + 1 : 0;
+    char *staged;
+
+    sprintf_alloc(&staged, "%.*s.opkg-stage-%ld-%u", dir_len, path,
+                  (long)getpid(), stage->serial++);
+    return staged;
+}
+
+static const char *staged_name_of(const struct ar_stage *stage,
+                                  const char *path)
+{
+    size_t i;
+
+    for (i = stage->n_files; i > 0; i--)
+        if (strcmp(stage->files[i - 1].path, path) == 0)
+            return stage->files[i - 1].staged;
+    return NULL;
+}
+
+/* Record the parent directories of path which do not exist yet, outermost
+ * first, as libarchive creates them along with the entry. */
+static void stage_parents(struct ar_stage *stage, const char *path)
+{
+    char *dir = xstrdup(path);
+    char *slash;
+    size_t first = stage->n_new_dirs, i, j;
+    struct stat st;
+
+    while ((slash = strrchr(dir, '/')) != NULL && slash != dir) {
+        *slash = '\0';
+        if (opkg_lstat(dir, &st) == 0)
+            break;
+        stage->new_dirs = stage_grow(stage->new_dirs, stage->n_new_dirs,
+                                     sizeof(char *));
+        stage->new_dirs[stage->n_new_dirs++] = xstrdup(dir);
+    }
+    xfree(dir);
+
+    /* Found innermost first. */
+    for (i = first, j = stage->n_new_dirs; j > i + 1; i++, j--) {
+        char *tmp = stage->new_dirs[i];
+        stage->new_dirs[i] = stage->new_dirs[j - 1];
+        stage->new_dirs[j - 1] = tmp;
+    }
+}
+
+static int stage_entry(struct ar_stage *stage, struct archive *a,
+                       struct archive_entry *entry, struct archive *disk)
+{
+    const char *path = archive_entry_pathname(entry);
+    const char *hardlink = archive_entry_hardlink(entry);
+    struct staged_file *f;
+    struct stat st;
+
+    stage_parents(stage, path);
+    if (archive_entry_filetype(entry) == AE_IFDIR) {
+        if (opkg_lstat(path, &st) == 0) {
+            stage->dirs = stage_grow(stage->dirs, stage->n_dirs,
+                                     sizeof(struct archive_entry *));
+            stage->dirs[stage->n_dirs++] = archive_entry_clone(entry);
+            return 0;
+        }
+        stage->new_dirs = stage_grow(stage->new_dirs, stage->n_new_dirs,
+                                     sizeof(char *));
+        stage->new_dirs[stage->n_new_dirs++] = xstrdup(path);
+        return extract_entry(a, entry, disk);
+    }
+
+    /* A hardlink points at the staged name of a file staged before it. */
+    if (hardlink) {
+        const char *target = staged_name_of(stage, hardlink);
+
+        if (target)
+            archive_entry_set_hardlink(entry, target);
+    }
+
+    stage->files = stage_grow(stage->files, stage->n_files,
+                              sizeof(struct staged_file));
+    f = &stage->files[stage->n_files];
+    f->path = xstrdup(path);
+    f->staged = stage_name(stage, path);
+    archive_entry_set_pathname(entry, f->staged);
+    stage->n_files++;
+
+    print_paths(entry);
+    return extract_entry(a, entry, disk);
+}
+
+/* Stage the data files of a package from its data archive. */
+static int stage_data(struct ar_stage *stage, struct archive *a,
+                      const char *dest)
+{
+    struct archive *disk;
+    struct archive_entry *entry;
+    const struct stat *entry_stat;
+    int eof, r = 0;
+
+    disk = open_disk(data_extract_flags());
+    if (!disk)
+        return -1;
+
+    while (r == 0) {
+        entry = read_header(a, &eof);
+        if (eof)
+            break;
+        if (!entry) {
+            r = -1;
+            break;
+        }
+
+        entry_stat = archive_entry_stat(entry);
+        if (S_ISLNK(entry_stat->st_mode))
+            fprintf(stage->paths_stream, "%s\t%#03o\t%s\n",
+                    archive_entry_pathname(entry),
+                    (unsigned int)entry_stat->st_mode,
+                    archive_entry_symlink(entry));
+        else
+            fprintf(stage->paths_stream, "%s\t%#03o\n",
+                    archive_entry_pathname(entry),
+                    (unsigned int)entry_stat->st_mode);
+
+        r = transform_all_paths(entry, dest);
+        if (r == 1) {
+            r = 0;
+            continue;
+        }
+        if (r < 0) {
+            opkg_msg(ERROR, "Failed to transform path.\n");
+            break;
+        }
+
+        r = stage_entry(stage, a, entry, disk);
+        if (r == 0)
+            stage->installed_size += archive_entry_size(entry);
+    }
+
+    archive_write_free(disk);
+    return r;
+}
+
+/* Read a package from a stream, extracting its control files under
+ * control_dir, which ends in '/', and staging its data files under dest. On
+ * success, the stream has been read to its end. Returns NULL on error,
+ * having removed whatever was staged.
+ */
+struct ar_stage *ar_stage_pkg(ar_stream_read_fn read_fn, void *data,
+                              const char *control_dir, const char *dest)
+{
+    struct stream_source src;
+    struct ar_stage *stage;
+    struct archive *outer, *inner;
+    struct archive_entry *entry;
+    const char *name;
+    int have_control = 0, have_data = 0;
+    int eof, r = -1;
+
+    stage = (struct ar_stage *)xcalloc(1, sizeof(struct ar_stage));
+    stage->paths_stream = open_memstream(&stage->paths, &stage->paths_len);
+
+    src.read = read_fn;
+    src.data = data;
+    src.buffer = xmalloc(EXTRACT_BUFFER_LEN);
+
+    /* The same formats as open_outer(), for ar and tar packages. */
+    outer = archive_read_new();
+    if (!outer
+        || archive_read_support_format_ar(outer) != ARCHIVE_OK
+        || archive_read_support_filter_gzip(outer) < ARCHIVE_WARN
+        || archive_read_support_format_tar(outer) != ARCHIVE_OK
+        || archive_read_open(outer, &src, NULL, stream_read, NULL)
+           != ARCHIVE_OK) {
+        opkg_msg(ERROR, "Failed to open package stream: %s\n",
+                 outer ? archive_error_string(outer) : "out of memory");
+        goto cleanup;
+    }
+
+    while (1) {
+        entry = read_header(outer, &eof);
+        if (eof)
+            break;
+        if (!entry)
+            goto cleanup;
+
+        transform_dest_path(entry, NULL);
+        name = archive_entry_pathname(entry);
+        if (strncmp(name, "control.tar", 11) != 0
+            && strncmp(name, "data.tar", 8) != 0)
+            continue;
+
+        inner = open_inner(outer, 1);
+        if (!inner)
+            goto cleanup;
+        if (name[0] == 'c') {
+            r = extract_all(inner, control_dir, 0, NULL);
+            have_control = 1;
+        } else {
+            r = stage_data(stage, inner, dest);
+            have_data = 1;
+        }
+        archive_read_free(inner);
+        if (r < 0)
+            goto cleanup;
+    }
+
+    if (!have_control || !have_data) {
+        opkg_msg(ERROR, "Package stream has no %s archive.\n",
+                 have_control ? "data" : "control");
+        r = -1;
+    }
+
+ cleanup:
+    /* Whatever libarchive did not need is read too, so that the caller
+     * can check the whole stream. */
+    if (r == 0)
+        while (read_fn(data, src.buffer, EXTRACT_BUFFER_LEN) > 0)
+            ;
+    if (outer)
+        archive_read_free(outer);
+    xfree(src.buffer);
+    fclose(stage->paths_stream);
+    stage->paths_stream = NULL;
+
+    if (r < 0) {
+        ar_stage_free(stage);
+        return NULL;
+    }
+    return stage;
+}
+
+/* Move the staged files into place. */
+int ar_stage_commit(struct ar_stage *stage, unsigned long *size)
+{
+    struct archive *disk;
+    size_t i;
+    int r = 0;
+
+    disk = open_disk(data_extract_flags());
+    if (!disk)
+        return -1;
+    for (i = 0; i < stage->n_dirs; i++) {
+        if (archive_write_header(disk, stage->dirs[i]) < ARCHIVE_WARN
+            || archive_write_finish_entry(disk) < ARCHIVE_WARN)
+            opkg_msg(NOTICE, "Failed to update directory '%s': %s\n",
+                     archive_entry_pathname(stage->dirs[i]),
+                     archive_error_string(disk));
+    }
+    archive_write_free(disk);
+
+    for (; stage->committed < stage->n_files; stage->committed++) {
+        struct staged_file *f = &stage->files[stage->committed];
+
+        if (opkg_rename(f->staged, f->path) != 0) {
+            opkg_perror(ERROR, "Failed to rename '%s' to '%s'", f->staged,
+                        f->path);
+            r = -1;
+            break;
+        }
+    }
+
+    if (r == 0) {
+        stage->done = 1;
+        if (size)
+            *size += stage->installed_size;
+    }
+    return r;
+}
+
+int ar_stage_paths_to_stream(const struct ar_stage *stage, FILE *stream)
+{
+    if (fwrite(stage->paths, 1, stage->paths_len, stream) != stage->paths_len) {
+        opkg_msg(ERROR, "Failed to path to stream: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Free a stage, removing the files which were not committed and the
+ * directories created for them. */
+void ar_stage_free(struct ar_stage *stage)
+{
+    size_t i;
+
+    if (!stage)
+        return;
+
+    for (i = stage->committed; i < stage->n_files; i++)
+        opkg_unlink(stage->files[i].staged);
+    if (!stage->done)
+        for (i = stage->n_new_dirs; i > 0; i--)
+            rmdir(stage->new_dirs[i - 1]);
+
+    for (i = 0; i < stage->n_files; i++) {
+        xfree(stage->files[i].path);
+        xfree(stage->files[i].staged);
+    }
+    for (i = 0; i < stage->n_new_dirs; i++)
+        xfree(stage->new_dirs[i]);
+    for (i = 0; i < stage->n_dirs; i++)
+        archive_entry_free(stage->dirs[i]);
+    if (stage->paths_stream)
+        fclose(stage->paths_stream);
+    xfree(stage->files);
+    xfree(stage->new_dirs);
+    xfree(stage->dirs);
+    xfree(stage->paths);
+    xfree(stage);
+}
+
+/*******************************************************************************
+ * Glue layer.
+ */
+
+struct opkg_ar *ar_open_pkg_control_archive(const char *filename,
+                                            const struct ar_index *index)
+{
+    struct opkg_ar *ar;
+
+    ar = (struct opkg_ar *)xmalloc(sizeof(struct opkg_ar));
+
+    ar->ar = open_pkg_member(filename, index, "control");
+    if (!ar->ar) {
+        xfree(ar);
+        return NULL;
+    }
+
+    /* We don't want to set ownership and permissions of control files
+     * incase they're incorrect in the archive. They should instead be owned
+     * by the user who ran opkg (usually root) and given permissions
+     * according to the current umask.
+     */
+    ar->extract_flags = 0;
 
     return ar;
 }
 
-struct opkg_ar *ar_open_compressed_file(const char *filename)
+struct opkg_ar *ar_open_pkg_data_archive(const char *filename,
+                                         const struct ar_index *index)
+{
+    struct opkg_ar *ar;
+
+    ar = (struct opkg_ar *)xmalloc(sizeof(struct opkg_ar));
+
+    ar->ar = open_pkg_member(filename, index, "data");
+    if (!ar->ar) {
+        xfree(ar);
+        return NULL;
+    }
+
+    ar->extract_flags = data_extract_flags();
+
+    return ar;
+}
+
+static struct opkg_ar *wrap_compressed(struct archive *a)
 {
     struct opkg_ar *ar;
     struct archive_entry *entry;
     int eof;
 
-    ar = (struct opkg_ar *)xmalloc(sizeof(struct opkg_ar));
+    if (!a)
+        return NULL;
 
-    ar->ar = open_compressed_file(filename);
-    if (!ar->ar)
-        goto err_cleanup;
+    ar = (struct opkg_ar *)xmalloc(sizeof(struct opkg_ar));
+    ar->ar = a;
 
     /* Flags aren't used when handling compressed files. */
     ar->extract_flags = 0;
@@ -956,11 +2045,23 @@ struct opkg_ar *ar_open_compressed_file(const char *filename)
  err_cleanup:
     if (ar->ar)
         archive_read_free(ar->ar);
-    free(ar);
+    xfree(ar);
 
     return NULL;
 }
 
+struct opkg_ar *ar_open_compressed_file(const char *filename)
+{
+    return wrap_compressed(open_compressed_file(filename));
+}
+
+/* Like ar_open_compressed_file(), for compressed data in memory, which must
+ * stay valid until ar_close(). */
+struct opkg_ar *ar_open_compressed_buffer(const void *buf, size_t len)
+{
+    return wrap_compressed(open_compressed_buffer(buf, len));
+}
+
 int ar_copy_to_stream(struct opkg_ar *ar, FILE * stream)
 {
     return copy_to_stream(ar->ar, stream);
@@ -982,8 +2083,84 @@ int ar_extract_all(struct opkg_ar *ar, const char *prefix, long unsigned int *si
     return extract_all(ar->ar, prefix, ar->extract_flags, size);
 }
 
+/* Read the regular files of an archive into memory, as small archives such
+ * as control.tar.* are needed without going through temporary files.
+ * Returns NULL on error. */
+struct ar_mem_files *ar_extract_all_to_memory(struct opkg_ar *ar)
+{
+    struct ar_mem_files *m;
+    struct ar_mem_file *f;
+    struct archive_entry *entry;
+    FILE *stream;
+    int eof, r = 0;
+
+    m = xcalloc(1, sizeof(struct ar_mem_files));
+    while (r == 0) {
+        entry = read_header(ar->ar, &eof);
+        if (eof)
+            break;
+        if (!entry) {
+            r = -1;
+            break;
+        }
+        if (archive_entry_filetype(entry) != AE_IFREG)
+            continue;
+
+        /* Names are as ar_extract_file_to_stream() matches them. */
+        transform_dest_path(entry, NULL);
+
+        m->files = xrealloc(m->files,
+                            (m->count + 1) * sizeof(struct ar_mem_file));
+        f = &m->files[m->count++];
+        f->name = xstrdup(archive_entry_pathname(entry));
+        f->mode = archive_entry_perm(entry);
+        f->data = NULL;
+        f->len = 0;
+
+        stream = open_memstream(&f->data, &f->len);
+        if (!stream) {
+            opkg_perror(ERROR, "Failed to open memory stream");
+            r = -1;
+            break;
+        }
+        r = copy_to_stream(ar->ar, stream);
+        fclose(stream);
+    }
+
+    if (r < 0) {
+        ar_mem_files_free(m);
+        return NULL;
+    }
+    return m;
+}
+
+const struct ar_mem_file *ar_mem_files_find(const struct ar_mem_files *m,
+                                            const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < m->count; i++)
+        if (strcmp(m->files[i].name, name) == 0)
+            return &m->files[i];
+    return NULL;
+}
+
+void ar_mem_files_free(struct ar_mem_files *m)
+{
+    size_t i;
+
+    if (!m)
+        return;
+    for (i = 0; i < m->count; i++) {
+        xfree(m->files[i].name);
+        xfree(m->files[i].data);
+    }
+    xfree(m->files);
+    xfree(m);
+}
+
 void ar_close(struct opkg_ar *ar)
 {
     archive_read_free(ar->ar);
-    free(ar);
+    xfree(ar);
 }
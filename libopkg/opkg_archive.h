@@ -19,6 +19,9 @@
 #ifndef OPKG_ARCHIVE_H
 #define OPKG_ARCHIVE_H
 
+#include <stdio.h>
+#include <sys/types.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -28,17 +31,61 @@ struct opkg_ar {
     int extract_flags;
 };
 
-struct opkg_ar *ar_open_pkg_control_archive(const char *filename);
-struct opkg_ar *ar_open_pkg_data_archive(const char *filename);
+/* Member offsets of an ar-format package, see ar_index_open(). */
+struct ar_index;
+
+struct ar_index *ar_index_open(const char *filename);
+int ar_index_stale(const struct ar_index *index, const char *filename);
+void ar_index_free(struct ar_index *index);
+
+/* index may be NULL, to scan the package with libarchive. */
+struct opkg_ar *ar_open_pkg_control_archive(const char *filename,
+                                            const struct ar_index *index);
+struct opkg_ar *ar_open_pkg_data_archive(const char *filename,
+                                         const struct ar_index *index);
 struct opkg_ar *ar_open_compressed_file(const char *filename);
+struct opkg_ar *ar_open_compressed_buffer(const void *buf, size_t len);
 int ar_copy_to_stream(struct opkg_ar *ar, FILE * stream);
 int ar_extract_file_to_stream(struct opkg_ar *ar, const char *filename,
                               FILE * stream);
 int ar_extract_paths_to_stream(struct opkg_ar *ar, FILE * stream);
 int ar_extract_all(struct opkg_ar *ar, const char *prefix, long unsigned int *size);
+
+/* The regular files of an archive, read into memory by
+ * ar_extract_all_to_memory(). */
+struct ar_mem_file {
+    char *name;
+    mode_t mode;
+    char *data;
+    size_t len;
+};
+
+struct ar_mem_files {
+    struct ar_mem_file *files;
+    size_t count;
+};
+
+struct ar_mem_files *ar_extract_all_to_memory(struct opkg_ar *ar);
+const struct ar_mem_file *ar_mem_files_find(const struct ar_mem_files *m,
+                                            const char *name);
+void ar_mem_files_free(struct ar_mem_files *m);
 int gz_write_archive(const char *filename, const char *gz_filename);
+int zstd_write_archive(const char *filename, const char *zst_filename);
+int ar_write_frames(const char *filename, int zstd, const char *buf,
+                    const size_t *ends, size_t n, off_t *offsets);
 void ar_close(struct opkg_ar *ar);
 
+/* A package read from a stream, staged for install, see ar_stage_pkg(). */
+struct ar_stage;
+
+typedef ssize_t (*ar_stream_read_fn) (void *data, void *buf, size_t len);
+
+struct ar_stage *ar_stage_pkg(ar_stream_read_fn read_fn, void *data,
+                              const char *control_dir, const char *dest);
+int ar_stage_commit(struct ar_stage *stage, unsigned long *size);
+int ar_stage_paths_to_stream(const struct ar_stage *stage, FILE *stream);
+void ar_stage_free(struct ar_stage *stage);
+
 #ifdef __cplusplus
 }
 #endif
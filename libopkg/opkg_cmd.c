@@ -44,8 +44,10 @@
 #include "opkg_configure.h"
 #include "opkg_verify.h"
 #include "xsystem.h"
+#include "opkg_stats.h"
 #include "xfuncs.h"
 #include "opkg_solver.h"
+#include "opkg_profile.h"
 
 static void print_pkg(pkg_t * pkg)
 {
@@ -60,17 +62,24 @@ static void print_pkg(pkg_t * pkg)
     if (pkg->description)
         printf(" - %s", pkg->description);
     printf("\n");
-    free(version);
+    xfree(version);
 }
 
 int opkg_state_changed;
 
+/* Set while `opkg batch' runs its commands; the status database is then
+ * written once when the batch is done. */
+static int batch_running;
+
 static void write_status_files_if_changed(void)
 {
+    if (batch_running)
+        return;
+
     if (opkg_state_changed && !opkg_config->noaction) {
         opkg_msg(INFO, "Writing status file.\n");
-        opkg_conf_write_status_files();
         pkg_write_changed_filelists();
+        opkg_conf_write_status_files();
         if (!opkg_config->offline_root)
             sync();
     } else {
@@ -82,6 +91,7 @@ static void sigint_handler(int sig)
 {
     signal(sig, SIG_DFL);
     opkg_msg(NOTICE, "Interrupted. Writing out status database.\n");
+    batch_running = 0;
     write_status_files_if_changed();
     exit(128 + sig);
 }
@@ -139,14 +149,14 @@ static int opkg_update_cmd(int argc, char **argv)
             }
             release_deinit(release);
             if (err)
-                unlink(list_file_name);
+                opkg_unlink(list_file_name);
         }
 
         if (err)
             failures++;
 
-        free(list_file_name);
-        free(url);
+        xfree(list_file_name);
+        xfree(url);
     }
 
     for (iter = void_list_first(&opkg_config->pkg_src_list); iter;
@@ -158,7 +168,7 @@ static int opkg_update_cmd(int argc, char **argv)
             failures++;
     }
     rmdir(tmp);
-    free(tmp);
+    xfree(tmp);
 
     return failures;
 }
@@ -187,17 +197,17 @@ static opkg_intercept_t opkg_prep_intercepts(void)
     dtemp = mkdtemp(ctx->statedir);
     if (dtemp == NULL) {
         opkg_perror(ERROR, "Failed to make temp dir %s", ctx->statedir);
-        free(ctx->oldpath);
-        free(ctx->statedir);
-        free(newpath);
-        free(ctx);
+        xfree(ctx->oldpath);
+        xfree(ctx->statedir);
+        xfree(newpath);
+        xfree(ctx);
         return NULL;
     }
 
     setenv("OPKG_INTERCEPT_DIR", ctx->statedir, 1);
     setenv("PATH", newpath, 1);
     opkg_msg(DEBUG, "Added intercepts dir to PATH; new PATH=%s\n", newpath);
-    free(newpath);
+    xfree(newpath);
 
     return ctx;
 }
@@ -206,6 +216,7 @@ static int opkg_finalize_intercepts(opkg_intercept_t ctx)
 {
     DIR *dir;
     int err = 0;
+    int span = opkg_profile_begin("intercepts", NULL);
 
     if (ctx->oldpath)
         setenv("PATH", ctx->oldpath, 1);
@@ -213,7 +224,7 @@ static int opkg_finalize_intercepts(opkg_intercept_t ctx)
         unsetenv("PATH");
 
     opkg_msg(DEBUG, "Removed intercepts dir from PATH; old PATH=%s\n", ctx->oldpath);
-    free(ctx->oldpath);
+    xfree(ctx->oldpath);
 
     dir = opendir(ctx->statedir);
     if (dir) {
@@ -230,16 +241,17 @@ static int opkg_finalize_intercepts(opkg_intercept_t ctx)
                 opkg_msg(DEBUG, "Run intercepted script %s\n", path);
                 xsystem(argv);
             }
-            free(path);
+            xfree(path);
         }
         closedir(dir);
     } else
         opkg_perror(ERROR, "Failed to open dir %s", ctx->statedir);
 
     rm_r(ctx->statedir);
-    free(ctx->statedir);
-    free(ctx);
+    xfree(ctx->statedir);
+    xfree(ctx);
 
+    opkg_profile_end(span);
     return err;
 }
 
@@ -403,25 +415,20 @@ static int opkg_remove_cmd(int argc, char **argv);
 
 static int opkg_install_cmd(int argc, char **argv)
 {
-    int i;
-    char *arg;
     int err = 0;
     int r;
 
     signal(SIGINT, sigint_handler);
 
+    /* Before local packages are added: it may reload the package state. */
+    pkg_info_preinstall_check();
+
     /*
      * Now scan through package names and install
      */
-    for (i = 0; i < argc; i++) {
-        arg = argv[i];
-
-        opkg_msg(DEBUG2, "%s\n", arg);
-        r = opkg_prepare_url_for_install(arg, &argv[i]);
-        if (r != 0)
-            return -1;
-    }
-    pkg_info_preinstall_check();
+    r = opkg_prepare_urls_for_install(argc, argv);
+    if (r != 0)
+        return -1;
 
     err = opkg_solver_install(argc, argv);
 
@@ -515,28 +522,39 @@ static int opkg_download_cmd(int argc, char **argv)
     return err;
 }
 
+/*
+ * The literal start of a shell pattern, which every name it matches begins
+ * with, to narrow a walk of the package hash.
+ */
+static char *pattern_prefix_alloc(const char *pattern)
+{
+    if (!pattern)
+        return NULL;
+    return xstrndup(pattern, strcspn(pattern, "*?[\\"));
+}
+
 static int opkg_list_find_cmd(int argc, char **argv, int use_desc)
 {
-    unsigned int i;
-    pkg_vec_t *available;
+    pkg_hash_iter_t it;
     pkg_t *pkg;
     char *pkg_name = NULL;
+    char *prefix = NULL;
 
     if (argc > 0) {
         pkg_name = argv[0];
     }
-    available = pkg_vec_alloc();
-    pkg_hash_fetch_available(available);
-    pkg_vec_sort(available, pkg_compare_names);
-    for (i = 0; i < available->len; i++) {
-        pkg = available->pkgs[i];
+    /* find also matches descriptions, so it has to look at every package */
+    if (!use_desc)
+        prefix = pattern_prefix_alloc(pkg_name);
+    pkg_hash_iter_init(&it, PKG_ITER_SORTED, prefix, NULL);
+    while ((pkg = pkg_hash_iter_next(&it))) {
         /* if we have package name or pattern and pkg does not match, then skip it */
         if (pkg_name && fnmatch(pkg_name, pkg->name, 0) &&
            (!use_desc || !pkg->description || fnmatch(pkg_name, pkg->description, 0)))
             continue;
         print_pkg(pkg);
     }
-    pkg_vec_free(available);
+    xfree(prefix);
 
     return 0;
 }
@@ -553,21 +571,19 @@ static int opkg_find_cmd(int argc, char **argv)
 
 static int opkg_verify_cmd(int argc, char **argv)
 {
-    unsigned int i;
-    pkg_vec_t *available;
+    pkg_hash_iter_t it;
     pkg_t *pkg;
     char *pkg_name = NULL;
+    char *prefix;
 
     if (argc > 0) {
         pkg_name = argv[0];
     }
-    available = pkg_vec_alloc();
-    pkg_hash_fetch_all_installed(available, INSTALLED);
-    pkg_vec_sort(available, pkg_compare_names);
-    for (i = 0; i < available->len; i++) {
+    prefix = pattern_prefix_alloc(pkg_name);
+    pkg_hash_iter_init(&it, PKG_ITER_INSTALLED | PKG_ITER_SORTED, prefix, NULL);
+    while ((pkg = pkg_hash_iter_next(&it))) {
         char *md5sums_file;
 
-        pkg = available->pkgs[i];
         /* if we have package name or pattern and pkg does not match, then skip it */
         if (pkg_name && fnmatch(pkg_name, pkg->name, 0))
             continue;
@@ -582,6 +598,8 @@ static int opkg_verify_cmd(int argc, char **argv)
             file  = fopen(md5sums_file, "r");
             if (file == NULL) {
                 opkg_perror(ERROR, "Failed to open %s", md5sums_file);
+                xfree(md5sums_file);
+                xfree(prefix);
                 return -1;
             }
 
@@ -604,17 +622,17 @@ static int opkg_verify_cmd(int argc, char **argv)
                                     pkg->name, installed_file_name);
                         }
                     }
-                    free(installed_file_name);
-                    free(actual_md5sum);
+                    xfree(installed_file_name);
+                    xfree(actual_md5sum);
                 }
-                free(line);
+                xfree(line);
             }
             fclose(file);
         }
-        free(md5sums_file);
+        xfree(md5sums_file);
     }
 
-    pkg_vec_free(available);
+    xfree(prefix);
 
     return 0;
 
@@ -622,19 +640,17 @@ static int opkg_verify_cmd(int argc, char **argv)
 
 static int opkg_list_installed_cmd(int argc, char **argv)
 {
-    unsigned int i;
-    pkg_vec_t *available;
+    pkg_hash_iter_t it;
     pkg_t *pkg;
     char *pkg_name = NULL;
+    char *prefix;
 
     if (argc > 0) {
         pkg_name = argv[0];
     }
-    available = pkg_vec_alloc();
-    pkg_hash_fetch_all_installed(available, INSTALLED);
-    pkg_vec_sort(available, pkg_compare_names);
-    for (i = 0; i < available->len; i++) {
-        pkg = available->pkgs[i];
+    prefix = pattern_prefix_alloc(pkg_name);
+    pkg_hash_iter_init(&it, PKG_ITER_INSTALLED | PKG_ITER_SORTED, prefix, NULL);
+    while ((pkg = pkg_hash_iter_next(&it))) {
         /* if we have package name or pattern and pkg does not match, then skip it */
         if (pkg_name && fnmatch(pkg_name, pkg->name, 0))
             continue;
@@ -654,28 +670,26 @@ static int opkg_list_installed_cmd(int argc, char **argv)
         print_pkg(pkg);
     }
 
-    pkg_vec_free(available);
+    xfree(prefix);
 
     return 0;
 }
 
 static int opkg_list_changed_conffiles_cmd(int argc, char **argv)
 {
-    unsigned int i;
-    pkg_vec_t *available;
+    pkg_hash_iter_t it;
     pkg_t *pkg;
     char *pkg_name = NULL;
     conffile_list_elt_t *iter;
     conffile_t *cf;
+    char *prefix;
 
     if (argc > 0) {
         pkg_name = argv[0];
     }
-    available = pkg_vec_alloc();
-    pkg_hash_fetch_all_installed(available, INSTALLED);
-    pkg_vec_sort(available, pkg_compare_names);
-    for (i = 0; i < available->len; i++) {
-        pkg = available->pkgs[i];
+    prefix = pattern_prefix_alloc(pkg_name);
+    pkg_hash_iter_init(&it, PKG_ITER_INSTALLED | PKG_ITER_SORTED, prefix, NULL);
+    while ((pkg = pkg_hash_iter_next(&it))) {
         /* if we have package name or pattern and pkg does not match, then skip it */
         if (pkg_name && fnmatch(pkg_name, pkg->name, 0))
             continue;
@@ -688,7 +702,7 @@ static int opkg_list_changed_conffiles_cmd(int argc, char **argv)
                 printf("%s\n", cf->name);
         }
     }
-    pkg_vec_free(available);
+    xfree(prefix);
     return 0;
 }
 
@@ -701,24 +715,21 @@ static int opkg_list_upgradable_cmd(int argc, char **argv)
 
 static int opkg_info_status_cmd(int argc, char **argv, int installed_only)
 {
-    unsigned int i, err;
-    pkg_vec_t *available;
+    unsigned int err;
+    pkg_hash_iter_t it;
     pkg_t *pkg;
     char *pkg_name = NULL;
+    char *prefix;
     char b_match = 0;
 
     if (argc > 0) {
         pkg_name = argv[0];
     }
 
-    available = pkg_vec_alloc();
-    if (installed_only)
-        pkg_hash_fetch_all_installed(available, INSTALLED_HALF_INSTALLED);
-    else
-        pkg_hash_fetch_available(available);
-
-    for (i = 0; i < available->len; i++) {
-        pkg = available->pkgs[i];
+    prefix = pattern_prefix_alloc(pkg_name);
+    pkg_hash_iter_init(&it, installed_only ? PKG_ITER_HALF_INSTALLED : 0,
+                       prefix, NULL);
+    while ((pkg = pkg_hash_iter_next(&it))) {
         if (pkg_name && fnmatch(pkg_name, pkg->name, 0)) {
             continue;
         }
@@ -750,7 +761,7 @@ static int opkg_info_status_cmd(int argc, char **argv, int installed_only)
         }
         b_match = 1;
     }
-    pkg_vec_free(available);
+    xfree(prefix);
 
     if (!b_match && pkg_name && file_exists(pkg_name)) {
         pkg = pkg_new();
@@ -930,7 +941,7 @@ static int opkg_files_cmd(int argc, char **argv)
         printf("%s\n", info->path);
     }
 
-    free(pkg_version);
+    xfree(pkg_version);
     pkg_free_installed_files(pkg);
 
     return 0;
@@ -974,7 +985,7 @@ static int opkg_depends_cmd(int argc, char **argv)
 
                 str = pkg_depend_str(pkg, k);
                 opkg_msg(NOTICE, "\t%s\n", str);
-                free(str);
+                xfree(str);
             }
 
         }
@@ -1087,7 +1098,7 @@ static int opkg_what_depends_conflicts_replaces_cmd(enum depend_type what_field_
                     ver = pkg_version_str_alloc(pkg);
                     opkg_msg(NOTICE, "\t%s %s\t%s %s", pkg->name, ver, rel_str,
                              possibility->pkg->name);
-                    free(ver);
+                    xfree(ver);
                     if (possibility->version) {
                         opkg_msg(NOTICE, " (%s%s)",
                                  constraint_to_str(possibility->constraint),
@@ -1178,9 +1189,7 @@ static int opkg_whatreplaces_cmd(int argc, char **argv)
 
 static int opkg_search_cmd(int argc, char **argv)
 {
-    unsigned int i;
-
-    pkg_vec_t *installed;
+    pkg_hash_iter_t it;
     pkg_t *pkg;
     file_list_t *installed_files;
     file_list_elt_t *iter;
@@ -1191,13 +1200,8 @@ static int opkg_search_cmd(int argc, char **argv)
         return -1;
     }
 
-    installed = pkg_vec_alloc();
-    pkg_hash_fetch_all_installed(installed, INSTALLED);
-    pkg_vec_sort(installed, pkg_compare_names);
-
-    for (i = 0; i < installed->len; i++) {
-        pkg = installed->pkgs[i];
-
+    pkg_hash_iter_init(&it, PKG_ITER_INSTALLED | PKG_ITER_SORTED, NULL, NULL);
+    while ((pkg = pkg_hash_iter_next(&it))) {
         installed_files = pkg_get_installed_files(pkg);
 
         for (iter = file_list_first(installed_files); iter;
@@ -1212,8 +1216,6 @@ static int opkg_search_cmd(int argc, char **argv)
         pkg_free_installed_files(pkg);
     }
 
-    pkg_vec_free(installed);
-
     if (!found_match) {
         opkg_msg(ERROR, "no path found matching pattern '%s'\n", argv[0]);
         return -1;
@@ -1222,18 +1224,71 @@ static int opkg_search_cmd(int argc, char **argv)
     return 0;
 }
 
+static int compare_versions(const char *v1, const char *op, const char *v2)
+{
+    pkg_version_t p1, p2;
+    int r;
+
+    pkg_version_parse(&p1, v1);
+    pkg_version_parse(&p2, v2);
+    r = pkg_version_compare_op(&p1, op, &p2);
+    pkg_version_deinit(&p1);
+    pkg_version_deinit(&p2);
+
+    if (r < 0)
+        return -1;
+    return r ? 0 : 1;
+}
+
+/*
+ * Reads "<v1> <op> <v2>" lines from stdin and prints, for each, the status
+ * `opkg compare-versions <v1> <op> <v2>' would have exited with.
+ */
+static int compare_versions_stdin(void)
+{
+    char *line = NULL;
+    size_t size = 0;
+    int err = 0;
+
+    while (getline(&line, &size, stdin) != -1) {
+        char *v1, *op, *v2, *extra, *save;
+        int r;
+
+        v1 = strtok_r(line, " \t\r\n", &save);
+        if (v1 == NULL)
+            continue;
+        op = strtok_r(NULL, " \t\r\n", &save);
+        v2 = strtok_r(NULL, " \t\r\n", &save);
+        extra = strtok_r(NULL, " \t\r\n", &save);
+
+        if (v2 == NULL || extra != NULL) {
+            opkg_msg(ERROR, "Expected <v1> <op> <v2>, got '%s'.\n", v1);
+            r = -1;
+        } else {
+            r = compare_versions(v1, op, v2);
+        }
+        if (r < 0)
+            err = -1;
+
+        printf("%d\n", r);
+        /* Callers may be waiting for this answer before sending more. */
+        fflush(stdout);
+    }
+    xfree(line);
+
+    return err;
+}
+
 static int opkg_compare_versions_cmd(int argc, char **argv)
 {
-    if (argc == 3) {
-        /* this is a bit gross */
-        struct pkg p1, p2;
-        parse_version(&p1, argv[0]);
-        parse_version(&p2, argv[2]);
-        p1.force_reinstall = p2.force_reinstall = 0;
-        return pkg_version_satisfied(&p1, &p2, argv[1]) ? 0 : 1;
+    if (opkg_config->use_stdin && argc == 0) {
+        return compare_versions_stdin();
+    } else if (argc == 3) {
+        return compare_versions(argv[0], argv[1], argv[2]);
     } else {
         opkg_msg(ERROR,
                  "opkg compare_versions <v1> <op> <v2>\n"
+                 "opkg compare_versions --stdin\n"
                  "<op> is one of <= >= << >> =\n");
         return -1;
     }
@@ -1250,6 +1305,257 @@ static int opkg_print_architecture_cmd(int argc, char **argv)
     return 0;
 }
 
+/*
+ * Report on the hash tables once the package lists, the status files and
+ * the file lists of installed packages are loaded. main() turns on
+ * hash_diagnostics for this command, so lookups made while loading are
+ * counted too.
+ */
+static int opkg_debug_stats_cmd(int argc, char **argv)
+{
+    hash_table_t *tables[] = {
+        &opkg_config->pkg_hash,
+        &opkg_config->file_hash,
+        &opkg_config->dir_hash,
+        &opkg_config->obs_file_hash,
+    };
+    unsigned int i;
+
+    pkg_info_preinstall_check();
+
+    for (i = 0; i < sizeof(tables) / sizeof(tables[0]); i++) {
+        if (tables[i]->entries)
+            hash_print_diagnostics(tables[i], stdout);
+    }
+    return 0;
+}
+
+struct batch_entry {
+    const char *line;       /* as read, for the output framing */
+    char *words;            /* backing store for argv */
+    int argc;
+    char **argv;
+};
+
+/*
+ * Split a batch line into words. Words are separated by blanks; single and
+ * double quotes group words and a backslash escapes the next character.
+ * The line is modified in place.
+ */
+static int batch_split_line(char *line, char ***argv)
+{
+    char *src = line, *dst = line;
+    int argc = 0;
+
+    *argv = NULL;
+    while (1) {
+        char quote = 0;
+
+        while (*src == ' ' || *src == '\t' || *src == '\r')
+            src++;
+        if (*src == '\0')
+            break;
+
+        *argv = xrealloc(*argv, (argc + 2) * sizeof(char *));
+        (*argv)[argc++] = dst;
+
+        for (; *src; src++) {
+            if (quote) {
+                if (*src == quote)
+                    quote = 0;
+                else if (*src == '\\' && quote == '"' && src[1])
+                    *dst++ = *++src;
+                else
+                    *dst++ = *src;
+            } else if (*src == '\'' || *src == '"') {
+                quote = *src;
+            } else if (*src == '\\' && src[1]) {
+                *dst++ = *++src;
+            } else if (*src == ' ' || *src == '\t' || *src == '\r') {
+                break;
+            } else {
+                *dst++ = *src;
+            }
+        }
+
+        if (quote) {
+            opkg_msg(ERROR, "Unterminated quote in batch line '%s'.\n", line);
+            xfree(*argv);
+            *argv = NULL;
+            return -1;
+        }
+
+        if (*src)
+            src++;
+        *dst++ = '\0';
+    }
+
+    if (*argv)
+        (*argv)[argc] = NULL;
+    return argc;
+}
+
+static char *batch_read_input(const char *filename, size_t *len)
+{
+    FILE *fp;
+    char *buf = NULL;
+    size_t size = 0, n;
+
+    if (filename == NULL || strcmp(filename, "-") == 0) {
+        fp = stdin;
+    } else {
+        fp = fopen(filename, "r");
+        if (fp == NULL) {
+            opkg_perror(ERROR, "Failed to open %s", filename);
+            return NULL;
+        }
+    }
+
+    *len = 0;
+    do {
+        if (*len == size) {
+            size = size ? size * 2 : 4096;
+            buf = xrealloc(buf, size + 1);
+        }
+        n = fread(buf + *len, 1, size - *len, fp);
+        *len += n;
+    } while (n > 0);
+
+    if (ferror(fp)) {
+        opkg_perror(ERROR, "Failed to read batch input");
+        xfree(buf);
+        buf = NULL;
+    } else {
+        buf[*len] = '\0';
+    }
+
+    if (fp != stdin)
+        fclose(fp);
+    return buf;
+}
+
+/*
+ * Run many sub-commands in one process. Commands are read one per line (or
+ * NUL terminated) from the named file or stdin. The package database is
+ * loaded once, the lock is taken once if any command needs it and the status
+ * database is written once at the end. Each command's output is framed by
+ * "@@ begin <n> <command>" and "@@ end <n> <status>" lines on stdout.
+ */
+static int opkg_batch_cmd(int argc, char **argv)
+{
+    struct batch_entry *entries = NULL;
+    unsigned int n_entries = 0, i;
+    char *input, *p, *end;
+    size_t len;
+    int locked = 0, failed = 0, err = 0;
+
+    input = batch_read_input(argc > 0 ? argv[0] : NULL, &len);
+    if (input == NULL)
+        return -1;
+
+    end = input + len;
+    for (p = input; p < end; p += strlen(p) + 1) {
+        char *nl = strchr(p, '\n');
+        struct batch_entry *e;
+
+        if (nl && nl < end)
+            *nl = '\0';
+        if (*p == '#')
+            continue;
+
+        entries = xrealloc(entries, (n_entries + 1) * sizeof(*entries));
+        e = &entries[n_entries];
+        e->line = p;
+        e->words = xstrdup(p);
+        e->argc = batch_split_line(e->words, &e->argv);
+        if (e->argc <= 0) {
+            xfree(e->words);
+            xfree(e->argv);
+            if (e->argc < 0) {
+                err = -1;
+                goto cleanup;
+            }
+            continue;
+        }
+        n_entries++;
+    }
+
+    for (i = 0; i < n_entries; i++) {
+        opkg_cmd_t *cmd = opkg_cmd_find(entries[i].argv[0]);
+        if (cmd && cmd->privileged) {
+            if (opkg_lock() != 0) {
+                opkg_perror(ERROR, "Batch failed to capture privilege lock");
+                err = -1;
+                goto cleanup;
+            }
+            locked = 1;
+            break;
+        }
+    }
+
+    batch_running = 1;
+    for (i = 0; i < n_entries; i++) {
+        struct batch_entry *e = &entries[i];
+        opkg_cmd_t *cmd = opkg_cmd_find(e->argv[0]);
+        int r;
+
+        printf("@@ begin %u %s\n", i + 1, e->line);
+        fflush(stdout);
+
+        if (cmd == NULL) {
+            opkg_msg(ERROR, "Unknown sub-command %s.\n", e->argv[0]);
+            r = -1;
+        } else if (cmd->fun == (opkg_cmd_fun_t) opkg_batch_cmd) {
+            opkg_msg(ERROR, "Batches can't be nested.\n");
+            r = -1;
+        } else if (cmd->requires_args && e->argc == 1) {
+            opkg_msg(ERROR, "The ``%s'' command requires at least one argument.\n",
+                     cmd->name);
+            r = -1;
+        } else {
+            opkg_config->pfm = cmd->pfm;
+            r = opkg_cmd_exec(cmd, e->argc - 1, (const char **)e->argv + 1);
+
+            /* Later commands must see the freshly downloaded lists. */
+            if (r == 0 && cmd->fun == (opkg_cmd_fun_t) opkg_update_cmd) {
+                batch_running = 0;
+                write_status_files_if_changed();
+                batch_running = 1;
+                opkg_state_changed = 0;
+                if (pkg_hash_reload() != 0) {
+                    opkg_msg(ERROR, "Failed to reload package lists.\n");
+                    r = -1;
+                }
+            }
+        }
+
+        fflush(stderr);
+        printf("@@ end %u %d\n", i + 1, r);
+        fflush(stdout);
+
+        if (r != 0)
+            failed = 1;
+    }
+    batch_running = 0;
+
+    write_status_files_if_changed();
+
+    if (locked)
+        opkg_unlock();
+
+    if (failed)
+        err = -1;
+
+ cleanup:
+    for (i = 0; i < n_entries; i++) {
+        xfree(entries[i].words);
+        xfree(entries[i].argv);
+    }
+    xfree(entries);
+    xfree(input);
+    return err;
+}
+
 /* XXX: CLEANUP: The usage strings should be incorporated into this
    array for easier maintenance */
 static opkg_cmd_t cmds[] = {
@@ -1293,14 +1599,15 @@ static opkg_cmd_t cmds[] = {
     {"verify", 0, (opkg_cmd_fun_t) opkg_verify_cmd, 0, false},
     {"download", 1, (opkg_cmd_fun_t) opkg_download_cmd,
         PFM_DESCRIPTION | PFM_SOURCE, false},
-    {"compare_versions", 1, (opkg_cmd_fun_t) opkg_compare_versions_cmd, 0,
+    {"compare_versions", 0, (opkg_cmd_fun_t) opkg_compare_versions_cmd, 0,
         false},
-    {"compare-versions", 1, (opkg_cmd_fun_t) opkg_compare_versions_cmd, 0,
+    {"compare-versions", 0, (opkg_cmd_fun_t) opkg_compare_versions_cmd, 0,
         false},
     {"print-architecture", 0, (opkg_cmd_fun_t) opkg_print_architecture_cmd,
         PFM_DESCRIPTION | PFM_SOURCE, false},
     {"print_architecture", 0, (opkg_cmd_fun_t) opkg_print_architecture_cmd,
         PFM_DESCRIPTION | PFM_SOURCE, false},
+    {"debug-stats", 0, (opkg_cmd_fun_t) opkg_debug_stats_cmd, 0, false},
     {"depends", 1, (opkg_cmd_fun_t) opkg_depends_cmd,
         PFM_DESCRIPTION | PFM_SOURCE, false},
     {"whatdepends", 1, (opkg_cmd_fun_t) opkg_whatdepends_cmd,
@@ -1317,6 +1624,7 @@ static opkg_cmd_t cmds[] = {
         PFM_DESCRIPTION | PFM_SOURCE, false},
     {"whatconflicts", 1, (opkg_cmd_fun_t) opkg_whatconflicts_cmd,
         PFM_DESCRIPTION | PFM_SOURCE, false},
+    {"batch", 0, (opkg_cmd_fun_t) opkg_batch_cmd, 0, false},
 };
 
 opkg_cmd_t *opkg_cmd_find(const char *name)
@@ -22,6 +22,7 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <sys/file.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -36,9 +37,19 @@
 #include "sprintf_alloc.h"
 #include "opkg_message.h"
 #include "file_util.h"
+#include "opkg_stats.h"
 #include "xfuncs.h"
+#include "opkg_profile.h"
 
 static int lock_fd;
+static int lock_depth;
+
+/* Files written or removed since the last opkg_state_publish(). A removal
+ * has no temp file. */
+static char **staged_tmp;
+static char **staged_name;
+static unsigned int staged_count;
+static int state_read_fd = -1;
 
 static opkg_conf_t _conf;
 opkg_conf_t *opkg_config = &_conf;
@@ -48,6 +59,7 @@ opkg_conf_t *opkg_config = &_conf;
  */
 static opkg_option_t options[] = {
     {"cache_dir", OPKG_OPT_TYPE_STRING, &_conf.cache_dir},
+    {"cache_max_kb", OPKG_OPT_TYPE_INT, &_conf.cache_max_kb},
     {"intercepts_dir", OPKG_OPT_TYPE_STRING, &_conf.intercepts_dir},
     {"lists_dir", OPKG_OPT_TYPE_STRING, &_conf.lists_dir},
     {"lock_file", OPKG_OPT_TYPE_STRING, &_conf.lock_file},
@@ -91,6 +103,17 @@ static opkg_option_t options[] = {
     {"cache_local_files", OPKG_OPT_TYPE_BOOL, &_conf.cache_local_files},
     {"verbose_status_file", OPKG_OPT_TYPE_BOOL, &_conf.verbose_status_file},
     {"compress_list_files", OPKG_OPT_TYPE_BOOL, &_conf.compress_list_files},
+    {"list_compression", OPKG_OPT_TYPE_STRING, &_conf.list_compression},
+    {"compress_threads", OPKG_OPT_TYPE_INT, &_conf.compress_threads},
+    {"read_threads", OPKG_OPT_TYPE_INT, &_conf.read_threads},
+    {"stats_file", OPKG_OPT_TYPE_STRING, &_conf.stats_file},
+    {"hash_diagnostics", OPKG_OPT_TYPE_BOOL, &_conf.hash_diagnostics},
+#if WITH_XZ
+    {"decompress_threads", OPKG_OPT_TYPE_INT, &_conf.decompress_threads},
+#endif
+#if USE_OPKGD
+    {"daemon_socket", OPKG_OPT_TYPE_STRING, &_conf.daemon_socket},
+#endif
 #if WITH_GPGME
     {"gpg_dir", OPKG_OPT_TYPE_STRING, &_conf.gpg_dir},
     {"gpg_trust_level", OPKG_OPT_TYPE_STRING, &_conf.gpg_trust_level},
@@ -99,6 +122,7 @@ static opkg_option_t options[] = {
     {"connect_timeout_ms", OPKG_OPT_TYPE_INT, &_conf.connect_timeout_ms},
     {"transfer_timeout_ms", OPKG_OPT_TYPE_INT, &_conf.transfer_timeout_ms},
     {"follow_location", OPKG_OPT_TYPE_BOOL, &_conf.follow_location},
+    {"stream_install", OPKG_OPT_TYPE_BOOL, &_conf.stream_install},
     {"http_auth", OPKG_OPT_TYPE_STRING, &_conf.http_auth},
 #endif
 #if WITH_SSLCURL && WITH_CURL
@@ -136,7 +160,7 @@ static int resolve_pkg_dest_list(void)
 
         dest = pkg_dest_list_append(&opkg_config->pkg_dest_list, nv_pair->name,
                                     root_dir);
-        free(root_dir);
+        xfree(root_dir);
 
         if (opkg_config->default_dest == NULL)
             opkg_config->default_dest = dest;
@@ -189,7 +213,7 @@ static void parse_pkg_src_options_str(pkg_src_options_t *src_options,
                 else
                     src_options->signature_verified = 0;
             }
-            free(src_option);
+            xfree(src_option);
         }
         token = strtok(NULL, " ");
     }
@@ -205,6 +229,7 @@ static void opkg_conf_free(void)
     hash_table_deinit(&opkg_config->file_hash);
     hash_table_deinit(&opkg_config->dir_hash);
     hash_table_deinit(&opkg_config->obs_file_hash);
+    opkg_config->file_hash_loaded = 0;
 
     pkg_src_list_deinit(&opkg_config->pkg_src_list);
     pkg_src_list_deinit(&opkg_config->dist_src_list);
@@ -221,7 +246,7 @@ static void opkg_conf_free(void)
         if (options[i].type == OPKG_OPT_TYPE_STRING) {
             tmp_val = (char **)options[i].value;
             if (*tmp_val) {
-                free(*tmp_val);
+                xfree(*tmp_val);
                 *tmp_val = NULL;
             }
         }
@@ -229,14 +254,14 @@ static void opkg_conf_free(void)
 
     if (opkg_config->conf_file_count > 0) {
         for (i = 0; i < opkg_config->conf_file_count; i++)
-            free(opkg_config->conf_files[i]);
-        free(opkg_config->conf_files);
+            xfree(opkg_config->conf_files[i]);
+        xfree(opkg_config->conf_files);
         opkg_config->conf_file_count = 0;
         opkg_config->conf_files = NULL;
     }
-    free(opkg_config->dest_str);
+    xfree(opkg_config->dest_str);
     opkg_config->dest_str = NULL;
-    free(opkg_config->fields_filter);
+    xfree(opkg_config->fields_filter);
     opkg_config->fields_filter = NULL;
 }
 
@@ -319,7 +344,7 @@ int opkg_conf_set_option(const char *name, const char *value, int overwrite)
                 return 0;
             } else {
                 /* Let's not leak memory. */
-                free(*((char **const)o->value));
+                xfree(*((char **const)o->value));
             }
         }
 
@@ -344,6 +369,7 @@ static int opkg_conf_parse_file(const char *filename,
     regex_t valid_line_re, comment_re;
 #define regmatch_size 16
     regmatch_t regmatch[regmatch_size];
+    int span = opkg_profile_begin("config", filename);
 
     file = fopen(filename, "r");
     if (file == NULL) {
@@ -422,7 +448,7 @@ static int opkg_conf_parse_file(const char *filename,
                                     (regmatch[11].rm_eo - regmatch[11].rm_so) - 2);
             src_options = xmalloc(sizeof(pkg_src_options_t));
             parse_pkg_src_options_str(src_options, options_str);
-            free(options_str);
+            xfree(options_str);
         }
         if (regmatch[13].rm_so > 0) {
             if (regmatch[15].rm_so > 0 && regmatch[15].rm_so != regmatch[15].rm_eo)
@@ -497,14 +523,14 @@ static int opkg_conf_parse_file(const char *filename,
 
         }
 
-        free(type);
-        free(name);
-        free(value);
-        free(src_options);
-        free(extra);
+        xfree(type);
+        xfree(name);
+        xfree(value);
+        xfree(src_options);
+        xfree(extra);
 
  NEXT_LINE:
-        free(line);
+        xfree(line);
     }
 
     regfree(&valid_line_re);
@@ -517,6 +543,7 @@ static int opkg_conf_parse_file(const char *filename,
         err = -1;
     }
  err0:
+    opkg_profile_end(span);
     return err;
 }
 
@@ -552,13 +579,17 @@ int opkg_conf_write_status_files(void)
     pkg_dest_t *dest;
     pkg_vec_t *all;
     pkg_t *pkg;
+    char *tmp_name;
     unsigned int i;
     int ret = 0;
     int r;
+    int span;
 
     if (opkg_config->noaction)
         return 0;
 
+    span = opkg_profile_begin("status write", NULL);
+
     list_for_each_entry(iter, &opkg_config->pkg_dest_list.head, node) {
         dest = (pkg_dest_t *) iter->data;
 
@@ -571,12 +602,14 @@ int opkg_conf_write_status_files(void)
             continue;
         }
 
-        dest->status_fp = fopen(dest->status_file_name, "w");
+        /* Readers must never see a half-written status file. */
+        sprintf_alloc(&tmp_name, "%s.new", dest->status_file_name);
+        dest->status_fp = fopen(tmp_name, "w");
         if (dest->status_fp == NULL && errno != EROFS) {
-            opkg_perror(ERROR, "Can't open status file %s",
-                        dest->status_file_name);
+            opkg_perror(ERROR, "Can't open status file %s", tmp_name);
             ret = -1;
         }
+        xfree(tmp_name);
     }
 
     all = pkg_vec_alloc();
@@ -607,14 +640,25 @@ int opkg_conf_write_status_files(void)
     list_for_each_entry(iter, &opkg_config->pkg_dest_list.head, node) {
         dest = (pkg_dest_t *) iter->data;
         if (dest->status_fp) {
+            sprintf_alloc(&tmp_name, "%s.new", dest->status_file_name);
             r = fclose(dest->status_fp);
+            dest->status_fp = NULL;
             if (r == EOF) {
-                opkg_perror(ERROR, "Couldn't close %s", dest->status_file_name);
+                opkg_perror(ERROR, "Couldn't close %s", tmp_name);
+                opkg_unlink(tmp_name);
                 ret = -1;
+            } else {
+                opkg_state_stage(tmp_name, dest->status_file_name);
             }
+            xfree(tmp_name);
         }
     }
 
+    /* Along with any .list files written since the last publish. */
+    if (opkg_state_publish() != 0)
+        ret = -1;
+
+    opkg_profile_end(span);
     return ret;
 }
 
@@ -658,6 +702,13 @@ int opkg_lock()
     int r;
     char *lock_dir;
 
+    /* Nested callers, e.g. commands run from a batch which already holds
+     * the lock, share it. */
+    if (lock_depth > 0) {
+        lock_depth++;
+        return 0;
+    }
+
     /* Ensure that the dir in which the lock file will be created exists. */
     lock_dir = xdirname(opkg_config->lock_file);
     if (!file_exists(lock_dir)) {
@@ -665,11 +716,11 @@ int opkg_lock()
         if (r == -1) {
             opkg_perror(ERROR, "Could not create lock file directory %s",
                         lock_dir);
-            free(lock_dir);
+            xfree(lock_dir);
             return -1;
         }
     }
-    free(lock_dir);
+    xfree(lock_dir);
 
     lock_fd = creat(opkg_config->lock_file, S_IRUSR | S_IWUSR | S_IRGRP);
     if (lock_fd == -1) {
@@ -689,6 +740,7 @@ int opkg_lock()
         return -1;
     }
 
+    lock_depth = 1;
     return 0;
 }
 
@@ -697,6 +749,12 @@ int opkg_unlock()
     int r;
     int err = 0;
 
+    if (lock_depth > 1) {
+        lock_depth--;
+        return 0;
+    }
+    lock_depth = 0;
+
     if (lock_fd != -1) {
         r = lockf(lock_fd, F_ULOCK, (off_t) 0);
         if (r == -1) {
@@ -713,7 +771,7 @@ int opkg_unlock()
     }
 
     if (opkg_config->lock_file && file_exists(opkg_config->lock_file)) {
-        r = unlink(opkg_config->lock_file);
+        r = opkg_unlink(opkg_config->lock_file);
         if (r == -1) {
             opkg_perror(ERROR, "Couldn't unlink %s", opkg_config->lock_file);
             err = -1;
@@ -725,6 +783,224 @@ int opkg_unlock()
     return err;
 }
 
+/*
+ * The status files and the .list files are never rewritten in place.
+ * Writers put the new contents next to the old file and queue it with
+ * opkg_state_stage(); opkg_state_publish() then renames everything queued
+ * into place while holding an exclusive lock on the generation file, and
+ * bumps the generation it holds. The .list of a removed package is queued
+ * the same way, so that it goes together with its status entry. Readers which take the shared lock around
+ * opening the status files therefore see all of a publish or none of it,
+ * and only wait for the renames, never for a whole install.
+ */
+static char *state_generation_file(void)
+{
+    char *name;
+
+    sprintf_alloc(&name, "%s.gen", opkg_config->lock_file);
+    return name;
+}
+
+static unsigned long state_generation_read(int fd)
+{
+    char buf[32];
+    ssize_t n;
+
+    n = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0)
+        return 0;
+    buf[n] = '\0';
+    return strtoul(buf, NULL, 10);
+}
+
+static int state_sync(const char *file_name)
+{
+    int fd, r;
+
+    fd = open(file_name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    r = fsync(fd);
+    close(fd);
+    return r;
+}
+
+void opkg_state_stage(const char *tmp_name, const char *file_name)
+{
+    unsigned int i;
+
+    /* Written twice before a publish: the temp file has the latest. Written
+     * and removed, or the other way around: the last one counts. */
+    for (i = 0; i < staged_count; i++) {
+        if (strcmp(staged_name[i], file_name) != 0)
+            continue;
+        if (tmp_name == NULL && staged_tmp[i] != NULL) {
+            opkg_unlink(staged_tmp[i]);
+            xfree(staged_tmp[i]);
+            staged_tmp[i] = NULL;
+        } else if (tmp_name != NULL && staged_tmp[i] == NULL) {
+            staged_tmp[i] = xstrdup(tmp_name);
+        }
+        return;
+    }
+
+    staged_tmp = xrealloc(staged_tmp, (staged_count + 1) * sizeof(char *));
+    staged_name = xrealloc(staged_name, (staged_count + 1) * sizeof(char *));
+    staged_tmp[staged_count] = tmp_name ? xstrdup(tmp_name) : NULL;
+    staged_name[staged_count] = xstrdup(file_name);
+    staged_count++;
+}
+
+const char *opkg_state_staged(const char *file_name)
+{
+    unsigned int i;
+
+    for (i = 0; i < staged_count; i++) {
+        if (strcmp(staged_name[i], file_name) == 0)
+            return staged_tmp[i];
+    }
+    return NULL;
+}
+
+void opkg_state_unstage(const char *file_name)
+{
+    unsigned int i;
+
+    for (i = 0; i < staged_count; i++) {
+        if (strcmp(staged_name[i], file_name) == 0)
+            break;
+    }
+    if (i == staged_count)
+        return;
+
+    if (staged_tmp[i] != NULL)
+        opkg_unlink(staged_tmp[i]);
+    xfree(staged_tmp[i]);
+    xfree(staged_name[i]);
+    staged_count--;
+    staged_tmp[i] = staged_tmp[staged_count];
+    staged_name[i] = staged_name[staged_count];
+}
+
+int opkg_state_publish(void)
+{
+    char *gen_file, *gen_dir;
+    char buf[32];
+    unsigned long gen;
+    unsigned int i;
+    int fd, len;
+    int ret = 0;
+
+    if (staged_count == 0)
+        return 0;
+
+    /* A rename must not reach the disk before the contents it exposes,
+     * and the readers need not wait for this. */
+    for (i = 0; i < staged_count; i++) {
+        if (staged_tmp[i] != NULL && state_sync(staged_tmp[i]) == -1) {
+            opkg_perror(ERROR, "Couldn't sync %s", staged_tmp[i]);
+            ret = -1;
+        }
+    }
+
+    gen_file = state_generation_file();
+    gen_dir = xdirname(gen_file);
+    if (!file_exists(gen_dir))
+        file_mkdir_hier(gen_dir, 0755);
+    xfree(gen_dir);
+
+    /* Without the generation file the renames still can't be seen half
+     * done, only out of step with each other. */
+    fd = open(gen_file, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1)
+        opkg_perror(ERROR, "Could not open %s", gen_file);
+    else if (flock(fd, LOCK_EX) == -1)
+        opkg_perror(ERROR, "Could not lock %s", gen_file);
+
+    for (i = 0; i < staged_count; i++) {
+        if (staged_tmp[i] == NULL) {
+            if (opkg_unlink(staged_name[i]) == -1 && errno != ENOENT)
+                opkg_perror(ERROR, "Couldn't remove %s", staged_name[i]);
+        } else if (opkg_rename(staged_tmp[i], staged_name[i]) == -1) {
+            opkg_perror(ERROR, "Couldn't rename %s to %s", staged_tmp[i],
+                        staged_name[i]);
+            opkg_unlink(staged_tmp[i]);
+            ret = -1;
+        }
+        xfree(staged_tmp[i]);
+        xfree(staged_name[i]);
+    }
+    staged_count = 0;
+
+    if (fd != -1) {
+        gen = state_generation_read(fd) + 1;
+        len = snprintf(buf, sizeof(buf), "%lu\n", gen);
+        if (pwrite(fd, buf, len, 0) != len || ftruncate(fd, len) == -1) {
+            opkg_perror(ERROR, "Couldn't update %s", gen_file);
+            ret = -1;
+        } else {
+            opkg_config->state_generation = gen;
+        }
+        /* Closing the descriptor drops the lock. */
+        close(fd);
+    }
+
+    xfree(gen_file);
+    return ret;
+}
+
+/*
+ * Hold off publishes while the status files are opened. Nothing has been
+ * published yet when there is no generation file, and a reader which may
+ * not open it still sees whole files, so both go ahead unlocked.
+ */
+void opkg_state_read_lock(void)
+{
+    char *gen_file;
+
+    if (state_read_fd != -1)
+        return;
+
+    gen_file = state_generation_file();
+    state_read_fd = open(gen_file, O_RDONLY | O_CLOEXEC);
+    if (state_read_fd == -1) {
+        if (errno != ENOENT)
+            opkg_perror(DEBUG, "Could not open %s", gen_file);
+        xfree(gen_file);
+        return;
+    }
+
+    if (flock(state_read_fd, LOCK_SH) == -1)
+        opkg_perror(DEBUG, "Could not lock %s", gen_file);
+    opkg_config->state_generation = state_generation_read(state_read_fd);
+    xfree(gen_file);
+}
+
+void opkg_state_read_unlock(void)
+{
+    if (state_read_fd == -1)
+        return;
+
+    close(state_read_fd);
+    state_read_fd = -1;
+}
+
+/* The generation most recently published, by any process. */
+unsigned long opkg_state_generation(void)
+{
+    char *gen_file = state_generation_file();
+    unsigned long gen = 0;
+    int fd;
+
+    fd = open(gen_file, O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        gen = state_generation_read(fd);
+        close(fd);
+    }
+    xfree(gen_file);
+    return gen;
+}
+
 int opkg_conf_load(void)
 {
     int r = 0;
@@ -736,13 +1012,42 @@ int opkg_conf_load(void)
     return opkg_conf_finalize();
 }
 
+/*
+ * Glob the *.conf files of the configuration directory, under the offline
+ * root if there is one.
+ */
+static int conf_dir_glob(glob_t *globbuf)
+{
+    int glob_ret;
+    char *etc_opkg_conf_pattern;
+    const char *conf_file_dir = getenv("OPKG_CONF_DIR");
+
+    if (conf_file_dir == NULL)
+        conf_file_dir=OPKG_CONF_DEFAULT_CONF_FILE_DIR;
+    if (opkg_config->offline_root) {
+        sprintf_alloc(&etc_opkg_conf_pattern, "%s/%s/*.conf",
+                    opkg_config->offline_root,
+                    conf_file_dir);
+    } else {
+        sprintf_alloc(&etc_opkg_conf_pattern, "%s/*.conf", conf_file_dir);
+    }
+
+    memset(globbuf, 0, sizeof(*globbuf));
+    glob_ret = glob(etc_opkg_conf_pattern, 0, glob_errfunc, globbuf);
+    xfree(etc_opkg_conf_pattern);
+    if (glob_ret && glob_ret != GLOB_NOMATCH) {
+        globfree(globbuf);
+        return -1;
+    }
+
+    return 0;
+}
+
 int opkg_conf_read(void)
 {
     unsigned int i;
     int r;
-    int glob_ret;
     glob_t globbuf;
-    char *etc_opkg_conf_pattern;
 
     opkg_config->restrict_to_default_dest = 0;
     opkg_config->default_dest = NULL;
@@ -753,7 +1058,7 @@ int opkg_conf_read(void)
         opkg_msg(INFO, "Loading %d conf file(s).\n", (int)opkg_config->conf_file_count);
         for (i = 0; i < opkg_config->conf_file_count; i++) {
             struct stat st;
-            r = stat(opkg_config->conf_files[i], &st);
+            r = opkg_stat(opkg_config->conf_files[i], &st);
             if (r == -1) {
                 opkg_perror(ERROR, "Couldn't stat %s", opkg_config->conf_files[i]);
                 goto err;
@@ -764,26 +1069,8 @@ int opkg_conf_read(void)
                 goto err;
         }
     } else {
-        const char *conf_file_dir = getenv("OPKG_CONF_DIR");
-        if (conf_file_dir == NULL)
-            conf_file_dir=OPKG_CONF_DEFAULT_CONF_FILE_DIR;
-        if (opkg_config->offline_root) {
-            sprintf_alloc(&etc_opkg_conf_pattern, "%s/%s/*.conf",
-                        opkg_config->offline_root,
-                        conf_file_dir);
-        } else {
-            sprintf_alloc(&etc_opkg_conf_pattern, "%s/*.conf", conf_file_dir);
-        }
-
-        memset(&globbuf, 0, sizeof(globbuf));
-        glob_ret = glob(etc_opkg_conf_pattern, 0, glob_errfunc, &globbuf);
-        if (glob_ret && glob_ret != GLOB_NOMATCH) {
-            free(etc_opkg_conf_pattern);
-            globfree(&globbuf);
+        if (conf_dir_glob(&globbuf))
             goto err;
-        }
-
-        free(etc_opkg_conf_pattern);
 
         for (i = 0; i < globbuf.gl_pathc; i++) {
             int mismatch = globbuf.gl_pathv[i] && opkg_config->conf_file_count > 0
@@ -808,9 +1095,99 @@ err:
     return -1;
 }
 
+/*
+ * Stamps of the configuration files, for opkg_conf_files_changed(). Only
+ * long-lived libopkg users take them.
+ */
+static file_stamp_t *conf_stamps;
+static size_t n_conf_stamps;
+static int conf_stamped;
+
+/* The configuration files which opkg_conf_read() parses. */
+static int conf_file_list(glob_t *globbuf, char ***paths, size_t *n)
+{
+    memset(globbuf, 0, sizeof(*globbuf));
+    if (opkg_config->conf_file_count > 0) {
+        *paths = opkg_config->conf_files;
+        *n = opkg_config->conf_file_count;
+        return 0;
+    }
+    if (conf_dir_glob(globbuf))
+        return -1;
+    *paths = globbuf->gl_pathv;
+    *n = globbuf->gl_pathc;
+    return 0;
+}
+
+static void conf_unstamp_files(void)
+{
+    size_t i;
+
+    for (i = 0; i < n_conf_stamps; i++)
+        file_stamp_deinit(&conf_stamps[i]);
+    xfree(conf_stamps);
+    conf_stamps = NULL;
+    n_conf_stamps = 0;
+    conf_stamped = 0;
+}
+
+void opkg_conf_stamp_files(void)
+{
+    glob_t globbuf;
+    char **paths;
+    size_t i, n;
+
+    conf_unstamp_files();
+    if (conf_file_list(&globbuf, &paths, &n))
+        return;
+
+    conf_stamps = xcalloc(n + 1, sizeof(*conf_stamps));
+    for (i = 0; i < n; i++)
+        file_stamp_init(&conf_stamps[i], paths[i]);
+    n_conf_stamps = n;
+    conf_stamped = 1;
+    globfree(&globbuf);
+}
+
+/*
+ * Whether a configuration file has been added, removed or changed since
+ * opkg_conf_stamp_files(). Without stamps, assume so.
+ */
+int opkg_conf_files_changed(void)
+{
+    glob_t globbuf;
+    char **paths;
+    size_t i, n;
+    int changed;
+
+    if (!conf_stamped)
+        return 1;
+    if (conf_file_list(&globbuf, &paths, &n))
+        return 1;
+
+    changed = n != n_conf_stamps;
+    for (i = 0; !changed && i < n; i++)
+        changed = strcmp(paths[i], conf_stamps[i].path)
+                || file_stamp_changed(&conf_stamps[i]);
+    globfree(&globbuf);
+    return changed;
+}
+
+/* The suffix of the feed list files in lists_dir: none, ".gz" or ".zst". */
+const char *opkg_conf_list_suffix(void)
+{
+    if (!opkg_config->compress_list_files)
+        return "";
+    if (opkg_config->list_compression
+            && strcmp(opkg_config->list_compression, "zstd") == 0)
+        return ".zst";
+    return ".gz";
+}
+
 int opkg_conf_finalize(void)
 {
     int r;
+    opkg_mem_tag_t mem;
     char *tmp, *tmp_dir_base;
 
     /* Option not available on the internal solver since it currently
@@ -827,10 +1204,22 @@ int opkg_conf_finalize(void)
 
         sprintf_alloc(&tmp, "%s/%s", opkg_config->offline_root,
                       opkg_config->lock_file);
-        free(opkg_config->lock_file);
+        xfree(opkg_config->lock_file);
         opkg_config->lock_file = tmp;
     }
 
+#if USE_OPKGD
+    if (opkg_config->daemon_socket == NULL)
+        opkg_config->daemon_socket = xstrdup(OPKG_CONF_DEFAULT_DAEMON_SOCKET);
+
+    if (opkg_config->offline_root) {
+        sprintf_alloc(&tmp, "%s/%s", opkg_config->offline_root,
+                      opkg_config->daemon_socket);
+        xfree(opkg_config->daemon_socket);
+        opkg_config->daemon_socket = tmp;
+    }
+#endif
+
     if (opkg_config->tmp_dir)
         tmp_dir_base = opkg_config->tmp_dir;
     else
@@ -839,22 +1228,27 @@ int opkg_conf_finalize(void)
     sprintf_alloc(&tmp, "%s/%s",
                   tmp_dir_base ? tmp_dir_base : OPKG_CONF_DEFAULT_TMP_DIR_BASE,
                   OPKG_CONF_TMP_DIR_SUFFIX);
-    free(opkg_config->tmp_dir);
+    xfree(opkg_config->tmp_dir);
     opkg_config->tmp_dir = mkdtemp(tmp);
     if (opkg_config->tmp_dir == NULL) {
         opkg_perror(ERROR, "Creating temp dir %s failed", tmp);
-        free(tmp);
+        xfree(tmp);
         tmp = NULL;
         goto err;
     }
 
     pkg_hash_init();
+    mem = opkg_mem_enter(OPKG_MEM_FILE_HASH);
     hash_table_init("file-hash", &opkg_config->file_hash,
                     OPKG_CONF_DEFAULT_HASH_LEN);
+    opkg_mem_leave(mem);
+    mem = opkg_mem_enter(OPKG_MEM_DIR_HASH);
     hash_table_init("dir-hash", &opkg_config->dir_hash,
                     OPKG_CONF_DEFAULT_HASH_LEN);
+    opkg_mem_leave(mem);
     hash_table_init("obs-file-hash", &opkg_config->obs_file_hash,
                     OPKG_CONF_DEFAULT_HASH_LEN / 16);
+    pkg_hash_enable_diagnostics();
 
     if (opkg_config->intercepts_dir == NULL)
         opkg_config->intercepts_dir = xstrdup(DATADIR "/opkg/intercept");
@@ -868,18 +1262,18 @@ int opkg_conf_finalize(void)
     if (opkg_config->offline_root) {
         sprintf_alloc(&tmp, "%s/%s", opkg_config->offline_root,
                       opkg_config->intercepts_dir);
-        free(opkg_config->intercepts_dir);
+        xfree(opkg_config->intercepts_dir);
         opkg_config->intercepts_dir = tmp;
 
         sprintf_alloc(&tmp, "%s/%s", opkg_config->offline_root,
                       opkg_config->lists_dir);
-        free(opkg_config->lists_dir);
+        xfree(opkg_config->lists_dir);
         opkg_config->lists_dir = tmp;
 
         if (!opkg_config->host_cache_dir) {
             sprintf_alloc(&tmp, "%s/%s", opkg_config->offline_root,
                           opkg_config->cache_dir);
-            free(opkg_config->cache_dir);
+            xfree(opkg_config->cache_dir);
             opkg_config->cache_dir = tmp;
         }
     }
@@ -893,6 +1287,18 @@ int opkg_conf_finalize(void)
     if (opkg_config->signature_type == NULL)
         opkg_config->signature_type = xstrdup(OPKG_CONF_DEFAULT_SIGNATURE_TYPE);
 
+    if (opkg_config->list_compression == NULL)
+        opkg_config->list_compression = xstrdup(OPKG_CONF_DEFAULT_LIST_COMPRESSION);
+    if (strcmp(opkg_config->list_compression, "gz") != 0
+#if WITH_ZSTD
+            && strcmp(opkg_config->list_compression, "zstd") != 0
+#endif
+            ) {
+        opkg_msg(ERROR, "Unsupported list_compression %s.\n",
+                 opkg_config->list_compression);
+        goto err;
+    }
+
 #if WITH_GPGME
     if (opkg_config->gpg_dir == NULL){
         opkg_config->gpg_dir = xstrdup(OPKG_CONF_GPG_DEFAULT_DIR);
@@ -901,7 +1307,7 @@ int opkg_conf_finalize(void)
     if (opkg_config->offline_root) {
         sprintf_alloc(&tmp, "%s/%s", opkg_config->offline_root,
                       opkg_config->gpg_dir);
-        free(opkg_config->gpg_dir);
+        xfree(opkg_config->gpg_dir);
         opkg_config->gpg_dir = tmp;
     }
 
@@ -939,7 +1345,7 @@ int opkg_conf_finalize(void)
     if (opkg_config->volatile_cache) {
         sprintf_alloc(&tmp, "%s/%s.%d", opkg_config->cache_dir, "volatile",
                       (int)getpid());
-        free(opkg_config->cache_dir);
+        xfree(opkg_config->cache_dir);
         opkg_config->cache_dir = tmp;
     }
 
@@ -963,6 +1369,8 @@ void opkg_conf_deinit(void)
 {
     int i;
 
+    conf_unstamp_files();
+
     if (opkg_config->tmp_dir && file_exists(opkg_config->tmp_dir))
         rm_r(opkg_config->tmp_dir);
 
@@ -974,6 +1382,7 @@ void opkg_conf_deinit(void)
         hash_print_stats(&opkg_config->file_hash);
         hash_print_stats(&opkg_config->dir_hash);
         hash_print_stats(&opkg_config->obs_file_hash);
+        opkg_mem_report("exit");
     }
 
     opkg_conf_free();
@@ -43,6 +43,7 @@ extern "C" {
 #define OPKG_CONF_DEFAULT_CACHE_DIR     VARDIR "/cache/opkg"
 #define OPKG_CONF_DEFAULT_CONF_FILE_DIR SYSCONFDIR "/opkg"
 #define OPKG_CONF_DEFAULT_LOCK_FILE     VARDIR "/run/opkg.lock"
+#define OPKG_CONF_DEFAULT_DAEMON_SOCKET VARDIR "/run/opkgd.sock"
 
 /* In case the config file defines no dest */
 #define OPKG_CONF_DEFAULT_DEST_NAME "root"
@@ -51,6 +52,7 @@ extern "C" {
 #define OPKG_CONF_DEFAULT_HASH_LEN 1024
 
 #define OPKG_CONF_DEFAULT_SIGNATURE_TYPE "gpg"
+#define OPKG_CONF_DEFAULT_LIST_COMPRESSION "gz"
 #define OPKG_CONF_GPG_DEFAULT_DIR OPKG_CONF_DEFAULT_CONF_FILE_DIR "/gpg"
 #define OPKG_CONF_GPG_TRUST_ONLY "TrustOnly"
 #define OPKG_CONF_GPG_TRUST_ANY "TrustAny"
@@ -77,6 +79,9 @@ typedef struct opkg_conf {
     char *lists_dir;
     char *cache_dir;
     char *lock_file;
+    char *daemon_socket;
+    char *stats_file;       /* JSON run statistics, a path or "fd:<n>" */
+    int hash_diagnostics;   /* count lookups in the package and file tables */
     char *info_dir;
     char *status_file;
     char *image_status_file;
@@ -125,10 +130,16 @@ typedef struct opkg_conf {
     int volatile_cache;
     int combine;
     int cache_local_files;
+    int cache_max_kb;       /* 0 for no limit on the package cache */
     int host_cache_dir;
     int verbose_status_file;
     int compress_list_files;
+    char *list_compression; /* "gz" or "zstd" */
+    int compress_threads;   /* 0 for one per core */
+    int decompress_threads; /* xz data archives, 0 for one per core */
+    int read_threads;       /* local package files, 0 for one per core */
     int short_description;
+    int use_stdin;          /* read operands from stdin (--stdin) */
 
     /* ssl options: used only when opkg is configured with '--enable-curl',
      * otherwise always NULL or 0.
@@ -136,6 +147,7 @@ typedef struct opkg_conf {
     int connect_timeout_ms;
     int transfer_timeout_ms;
     int follow_location;
+    int stream_install;
 
     /* ssl-curl options: used only when opkg is configured with
      * '--enable-ssl-curl', otherwise always NULL or 0.
@@ -172,6 +184,8 @@ typedef struct opkg_conf {
     hash_table_t file_hash;
     hash_table_t obs_file_hash;
     hash_table_t dir_hash;
+    int file_hash_loaded;   /* set once pkg_info_preinstall_check() ran */
+    unsigned long state_generation; /* of the status files as loaded */
 } opkg_conf_t;
 
 enum opkg_option_type {
@@ -195,6 +209,9 @@ int opkg_conf_load(void);
 int opkg_conf_read(void);
 int opkg_conf_finalize(void);
 void opkg_conf_deinit(void);
+void opkg_conf_stamp_files(void);
+int opkg_conf_files_changed(void);
+const char *opkg_conf_list_suffix(void);
 
 int opkg_conf_write_status_files(void);
 char *root_filename_alloc(char *filename);
@@ -206,6 +223,18 @@ int opkg_conf_set_option(const char *name, const char *value,
 int opkg_lock(void);
 int opkg_unlock(void);
 
+/* Queues tmp_name to replace file_name at the next publish, or file_name to
+ * be removed then if tmp_name is NULL. */
+void opkg_state_stage(const char *tmp_name, const char *file_name);
+/* The file which will replace file_name at the next publish, or NULL. */
+const char *opkg_state_staged(const char *file_name);
+/* Drops the pending replacement of file_name, if any. */
+void opkg_state_unstage(const char *file_name);
+int opkg_state_publish(void);
+void opkg_state_read_lock(void);
+void opkg_state_read_unlock(void);
+unsigned long opkg_state_generation(void);
+
 char *opkg_solver_version_alloc(void);
 
 #ifdef __cplusplus
@@ -0,0 +1,524 @@
+/* vi: set expandtab sw=4 sts=4: */
+/* opkg_daemon.c - the opkg package management system
+
+   SPDX-License-Identifier: GPL-2.0-or-later
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "file_util.h"
+#include "opkg_cmd.h"
+#include "opkg_conf.h"
+#include "opkg_daemon.h"
+#include "opkg_message.h"
+#include "pkg.h"
+#include "pkg_hash.h"
+#include "pkg_parse.h"
+#include "pkg_vec.h"
+#include "sprintf_alloc.h"
+#include "xfuncs.h"
+
+/*
+ * Commands which only read the package database. Those in daemon_cmds load
+ * both the feeds and the status files on the command line, and those in
+ * installed_cmds only the status files, so each view is served from a
+ * database loaded exactly the way the command would have loaded it itself.
+ */
+static const char *daemon_cmds[] = {
+    "list",
+    "list-upgradable",
+    "list_upgradable",
+    "info",
+    "find",
+    "depends",
+    "whatdepends",
+    "whatdependsrec",
+    "whatrecommends",
+    "whatsuggests",
+    "whatprovides",
+    "whatconflicts",
+    "whatreplaces",
+    NULL
+};
+
+static const char *installed_cmds[] = {
+    "status",
+    "files",
+    "search",
+    "list-installed",
+    "list_installed",
+    "list-changed-conffiles",
+    "list_changed_conffiles",
+    NULL
+};
+
+static int cmd_in(const char **cmds, const char *cmd_name)
+{
+    int i;
+
+    for (i = 0; cmds[i]; i++) {
+        if (strcmp(cmds[i], cmd_name) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+int opkg_daemon_cmd_view(const char *cmd_name)
+{
+    if (cmd_in(daemon_cmds, cmd_name))
+        return OPKG_DAEMON_VIEW_FEEDS;
+    if (cmd_in(installed_cmds, cmd_name))
+        return OPKG_DAEMON_VIEW_INSTALLED;
+    return -1;
+}
+
+char *opkg_daemon_socket_path(const char *socket_path, int view)
+{
+    char *path;
+
+    if (view == OPKG_DAEMON_VIEW_INSTALLED)
+        sprintf_alloc(&path, "%s.installed", socket_path);
+    else
+        path = xstrdup(socket_path);
+    return path;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+
+    while (len) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0) {
+            errno = EPIPE;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int daemon_sockaddr(struct sockaddr_un *addr, const char *socket_path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr->sun_path)) {
+        opkg_msg(ERROR, "Socket path %s is too long.\n", socket_path);
+        return -1;
+    }
+    strcpy(addr->sun_path, socket_path);
+    return 0;
+}
+
+static void payload_append(char **buf, size_t *len, const char *str)
+{
+    size_t n = strlen(str) + 1;
+
+    *buf = xrealloc(*buf, *len + n);
+    memcpy(*buf + *len, str, n);
+    *len += n;
+}
+
+int opkg_daemon_exec(const char *base_path, const char *cmd_name,
+                     int argc, const char **argv, int *result)
+{
+    struct sockaddr_un addr;
+    char *socket_path;
+    struct opkg_daemon_request req;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+    char cwd[PATH_MAX];
+    char *payload = NULL;
+    size_t payload_len = 0;
+    int32_t status;
+    int fd, i, r;
+
+    socket_path = opkg_daemon_socket_path(base_path,
+                                          opkg_daemon_cmd_view(cmd_name));
+    r = daemon_sockaddr(&addr, socket_path);
+    xfree(socket_path);
+    if (r != 0)
+        return 1;
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        opkg_perror(DEBUG, "Failed to create socket");
+        return 1;
+    }
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        opkg_msg(DEBUG, "No daemon listening on %s: %s.\n", addr.sun_path,
+                 strerror(errno));
+        close(fd);
+        return 1;
+    }
+
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+        strcpy(cwd, "/");
+
+    payload_append(&payload, &payload_len, cwd);
+    payload_append(&payload, &payload_len,
+                   opkg_config->fields_filter ? opkg_config->fields_filter : "");
+    payload_append(&payload, &payload_len, cmd_name);
+    for (i = 0; i < argc; i++)
+        payload_append(&payload, &payload_len, argv[i]);
+
+    memset(&req, 0, sizeof(req));
+    req.magic = OPKG_DAEMON_MAGIC;
+    req.version = OPKG_DAEMON_PROTOCOL_VERSION;
+    req.verbosity = opkg_config->verbosity;
+    req.payload_len = payload_len;
+    if (opkg_config->query_all)
+        req.flags |= OPKG_DAEMON_QUERY_ALL;
+    if (opkg_config->size)
+        req.flags |= OPKG_DAEMON_SIZE;
+    if (opkg_config->short_description)
+        req.flags |= OPKG_DAEMON_SHORT_DESCRIPTION;
+    if (opkg_config->query_writable_only)
+        req.flags |= OPKG_DAEMON_WRITABLE_ONLY;
+    if (opkg_config->query_image_only)
+        req.flags |= OPKG_DAEMON_IMAGE_ONLY;
+    if (opkg_config->show_source)
+        req.flags |= OPKG_DAEMON_SHOW_SOURCE;
+
+    iov.iov_base = &req;
+    iov.iov_len = sizeof(req);
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    /* Anything already buffered must reach the terminal before the daemon
+     * starts writing to the same descriptors. */
+    fflush(stdout);
+    fflush(stderr);
+
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(req)
+            || write_all(fd, payload, payload_len) != 0) {
+        opkg_perror(DEBUG, "Failed to send request to %s", addr.sun_path);
+        xfree(payload);
+        close(fd);
+        return 1;
+    }
+    xfree(payload);
+
+    /* From here on the daemon may have produced output, so falling back to
+     * running the command locally would duplicate it. */
+    if (read_all(fd, &status, sizeof(status)) != 0) {
+        opkg_perror(ERROR, "Lost connection to daemon on %s", addr.sun_path);
+        close(fd);
+        *result = -1;
+        return 0;
+    }
+
+    close(fd);
+
+    /* The daemon could not load the database and wrote nothing. */
+    if (status == OPKG_DAEMON_NOT_SERVED) {
+        opkg_msg(DEBUG, "Daemon on %s has no database loaded.\n",
+                 addr.sun_path);
+        return 1;
+    }
+
+    opkg_msg(DEBUG, "Served by the daemon on %s.\n", addr.sun_path);
+    *result = status;
+    return 0;
+}
+
+int opkg_daemon_listen(const char *socket_path)
+{
+    struct sockaddr_un addr;
+    char *socket_dir;
+    int fd;
+
+    if (daemon_sockaddr(&addr, socket_path) != 0)
+        return -1;
+
+    socket_dir = xdirname(socket_path);
+    if (!file_exists(socket_dir)
+            && file_mkdir_hier(socket_dir, 0755) == -1) {
+        opkg_perror(ERROR, "Could not create socket directory %s",
+                    socket_dir);
+        xfree(socket_dir);
+        return -1;
+    }
+    xfree(socket_dir);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        opkg_perror(ERROR, "Failed to create socket");
+        return -1;
+    }
+
+    /* A socket left behind by a daemon which did not shut down cleanly would
+     * make bind() fail. */
+    if (unlink(socket_path) == -1 && errno != ENOENT) {
+        opkg_perror(ERROR, "Failed to remove stale socket %s", socket_path);
+        close(fd);
+        return -1;
+    }
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        opkg_perror(ERROR, "Failed to bind to %s", socket_path);
+        close(fd);
+        return -1;
+    }
+
+    if (listen(fd, SOMAXCONN) != 0) {
+        opkg_perror(ERROR, "Failed to listen on %s", socket_path);
+        close(fd);
+        unlink(socket_path);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * The daemon parses every field so that it can serve any command. Drop the
+ * fields masked by the command so its output matches the command line tool,
+ * which never parsed them. This runs in the per-request child, so the
+ * daemon's copy of the package database is untouched.
+ */
+static void apply_field_mask(unsigned int pfm)
+{
+    pkg_vec_t *all;
+    unsigned int i;
+
+    if (!(pfm & (PFM_DESCRIPTION | PFM_SOURCE))
+            || opkg_config->verbose_status_file)
+        return;
+
+    all = pkg_vec_alloc();
+    pkg_hash_fetch_available(all);
+    for (i = 0; i < all->len; i++) {
+        pkg_t *pkg = all->pkgs[i];
+
+        if (pfm & PFM_DESCRIPTION) {
+            xfree(pkg->description);
+            pkg->description = NULL;
+        }
+        if (pfm & PFM_SOURCE) {
+            xfree(pkg->source);
+            pkg->source = NULL;
+        }
+    }
+    pkg_vec_free(all);
+}
+
+static int receive_request(int client_fd, struct opkg_daemon_request *req,
+                           int fds[2])
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    ssize_t n;
+
+    iov.iov_base = req;
+    iov.iov_len = sizeof(*req);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    do {
+        n = recvmsg(client_fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (n == -1 && errno == EINTR);
+
+    if (n != (ssize_t)sizeof(*req)) {
+        opkg_msg(ERROR, "Short read on request header.\n");
+        return -1;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET
+            || cmsg->cmsg_type != SCM_RIGHTS
+            || cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+        opkg_msg(ERROR, "Request did not carry output descriptors.\n");
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+
+    if (req->magic != OPKG_DAEMON_MAGIC
+            || req->version != OPKG_DAEMON_PROTOCOL_VERSION
+            || req->payload_len > OPKG_DAEMON_MAX_PAYLOAD) {
+        opkg_msg(ERROR, "Malformed request.\n");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    return 0;
+}
+
+int opkg_daemon_refuse_client(int client_fd)
+{
+    struct opkg_daemon_request req;
+    int32_t status = OPKG_DAEMON_NOT_SERVED;
+    char *payload;
+    int fds[2];
+    int r;
+
+    if (receive_request(client_fd, &req, fds) != 0)
+        return -1;
+    close(fds[0]);
+    close(fds[1]);
+
+    payload = xmalloc(req.payload_len);
+    r = read_all(client_fd, payload, req.payload_len);
+    xfree(payload);
+    if (r != 0)
+        return -1;
+
+    return write_all(client_fd, &status, sizeof(status));
+}
+
+int opkg_daemon_handle_client(int client_fd, int view)
+{
+    struct opkg_daemon_request req;
+    int fds[2];
+    char *payload, *p, *end;
+    const char **strs = NULL;
+    int nstrs = 0;
+    opkg_cmd_t *cmd;
+    int32_t status = -1;
+
+    if (receive_request(client_fd, &req, fds) != 0)
+        return -1;
+
+    /* Output of the command goes straight to the client's terminal. */
+    if (dup2(fds[0], STDOUT_FILENO) == -1
+            || dup2(fds[1], STDERR_FILENO) == -1) {
+        opkg_perror(ERROR, "Failed to attach client output");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    close(fds[0]);
+    close(fds[1]);
+
+    opkg_config->verbosity = req.verbosity;
+
+    payload = xmalloc(req.payload_len + 1);
+    if (read_all(client_fd, payload, req.payload_len) != 0) {
+        opkg_perror(ERROR, "Failed to read request");
+        xfree(payload);
+        return -1;
+    }
+    payload[req.payload_len] = '\0';
+
+    end = payload + req.payload_len;
+    for (p = payload; p < end; p += strlen(p) + 1) {
+        strs = xrealloc(strs, (nstrs + 1) * sizeof(*strs));
+        strs[nstrs++] = p;
+    }
+
+    if (nstrs < 3) {
+        opkg_msg(ERROR, "Malformed request.\n");
+        goto out;
+    }
+
+    cmd = opkg_cmd_find(strs[2]);
+    if (cmd == NULL || opkg_daemon_cmd_view(strs[2]) != view) {
+        opkg_msg(ERROR, "Command %s is not served by the daemon.\n", strs[2]);
+        goto out;
+    }
+
+    if (chdir(strs[0]) != 0) {
+        opkg_perror(ERROR, "Failed to change directory to %s", strs[0]);
+        goto out;
+    }
+
+    if (strs[1][0] != '\0') {
+        xfree(opkg_config->fields_filter);
+        opkg_config->fields_filter = xstrdup(strs[1]);
+    }
+    opkg_config->query_all = !!(req.flags & OPKG_DAEMON_QUERY_ALL);
+    opkg_config->size = !!(req.flags & OPKG_DAEMON_SIZE);
+    opkg_config->short_description =
+        !!(req.flags & OPKG_DAEMON_SHORT_DESCRIPTION);
+    opkg_config->query_writable_only =
+        !!(req.flags & OPKG_DAEMON_WRITABLE_ONLY);
+    opkg_config->query_image_only = !!(req.flags & OPKG_DAEMON_IMAGE_ONLY);
+    opkg_config->show_source = !!(req.flags & OPKG_DAEMON_SHOW_SOURCE);
+
+    opkg_config->pfm = cmd->pfm;
+    apply_field_mask(cmd->pfm);
+
+    status = opkg_cmd_exec(cmd, nstrs - 3, strs + 3);
+
+ out:
+    fflush(stdout);
+    fflush(stderr);
+    xfree(strs);
+    xfree(payload);
+
+    if (write_all(client_fd, &status, sizeof(status)) != 0)
+        return -1;
+
+    return 0;
+}
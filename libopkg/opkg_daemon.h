@@ -0,0 +1,86 @@
+/* vi: set expandtab sw=4 sts=4: */
+/* opkg_daemon.h - the opkg package management system
+
+   SPDX-License-Identifier: GPL-2.0-or-later
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+*/
+
+#ifndef OPKG_DAEMON_H
+#define OPKG_DAEMON_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define OPKG_DAEMON_MAGIC 0x6f706b64    /* "opkd" */
+#define OPKG_DAEMON_PROTOCOL_VERSION 2
+
+/* Upper bound on the size of the string payload of a request. */
+#define OPKG_DAEMON_MAX_PAYLOAD (1024 * 1024)
+
+/* Per-request options forwarded from the command line. */
+#define OPKG_DAEMON_QUERY_ALL           (1 << 0)
+#define OPKG_DAEMON_SIZE                (1 << 1)
+#define OPKG_DAEMON_SHORT_DESCRIPTION   (1 << 2)
+#define OPKG_DAEMON_WRITABLE_ONLY       (1 << 3)
+#define OPKG_DAEMON_IMAGE_ONLY          (1 << 4)
+#define OPKG_DAEMON_SHOW_SOURCE         (1 << 5)
+
+/* The daemon runs one server for the commands which read the feeds and the
+ * status files, and one for those which only read the status files. */
+#define OPKG_DAEMON_VIEW_FEEDS          0
+#define OPKG_DAEMON_VIEW_INSTALLED      1
+
+/* Answered instead of a command result when the daemon has no database to
+ * run the command against. Nothing has been written to the client output. */
+#define OPKG_DAEMON_NOT_SERVED          INT32_MIN
+
+/*
+ * A request is this header followed by payload_len bytes of NUL terminated
+ * strings: the client working directory, the --fields filter (possibly
+ * empty), the sub-command name and its arguments. The client stdout and
+ * stderr descriptors are passed along with the header as SCM_RIGHTS.
+ * The daemon answers with a single int32_t holding the command result.
+ */
+struct opkg_daemon_request {
+    uint32_t magic;
+    uint32_t version;
+    int32_t verbosity;
+    uint32_t flags;
+    uint32_t payload_len;
+};
+
+/* The view serving cmd_name, or -1 if the daemon does not serve it. */
+int opkg_daemon_cmd_view(const char *cmd_name);
+
+/* The socket of the server for view, given the daemon_socket option. */
+char *opkg_daemon_socket_path(const char *socket_path, int view);
+
+/*
+ * Runs a read-only command in a running opkgd. Returns 0 and stores the
+ * command result in *result if the daemon handled the request, or 1 if no
+ * daemon is serving the command under the daemon_socket base_path and the
+ * caller should do the work itself.
+ */
+int opkg_daemon_exec(const char *base_path, const char *cmd_name,
+                     int argc, const char **argv, int *result);
+
+int opkg_daemon_listen(const char *socket_path);
+int opkg_daemon_handle_client(int client_fd, int view);
+int opkg_daemon_refuse_client(int client_fd);
+
+#ifdef __cplusplus
+}
+#endif
+#endif                          /* OPKG_DAEMON_H */
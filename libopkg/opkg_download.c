@@ -21,8 +21,15 @@
 
 #include "config.h"
 
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <libgen.h>
 #include <sys/stat.h>
@@ -32,10 +39,17 @@
 #include "opkg_verify.h"
 #include "opkg_utils.h"
 #include "pkg_depends.h"
+#include "pkg_hash.h"
+#include "opkg_profile.h"
 
 #include "md5.h"
+#if WITH_SHA256
+#include "sha256.h"
+#endif
+#include "opkg_archive.h"
 #include "sprintf_alloc.h"
 #include "file_util.h"
+#include "opkg_stats.h"
 #include "xfuncs.h"
 
 /* Limit the short file name used to generate cache file names to 90 characters
@@ -121,6 +135,11 @@ static int opkg_download_internal(const char *src, const char *dest,
                            curl_progress_func cb, void *data, int use_cache)
 {
     int ret;
+    int span;
+    struct stat st;
+    off_t before = 0;
+    unsigned long cache_hits;
+    long long start;
 
     if (use_cache) {
         ret = file_mkdir_hier(opkg_config->cache_dir, 0755);
@@ -131,19 +150,38 @@ static int opkg_download_internal(const char *src, const char *dest,
 
     opkg_msg(NOTICE, "Downloading %s.\n", src);
 
+    span = opkg_profile_begin("download", src);
+    cache_hits = opkg_stats.cache_hits;
+    start = opkg_stats_now();
+
     if (str_starts_with(src, "file:")) {
         const char *file_src = src + 5;
 
-        return opkg_download_file(file_src, dest);
+        ret = opkg_download_file(file_src, dest);
+        goto out;
     }
 
     ret = opkg_download_set_env();
     if (ret != 0) {
         /* Error message already printed. */
-        return ret;
+        goto out;
     }
 
-    return opkg_download_backend(src, dest, cb, data, use_cache);
+    /* A cached partial download is resumed, so only count what is added. */
+    if (use_cache && opkg_stat(dest, &st) == 0)
+        before = st.st_size;
+
+    ret = opkg_download_backend(src, dest, cb, data, use_cache);
+
+ out:
+    opkg_stats.download_ns += opkg_stats_now() - start;
+    if (ret == 0 && opkg_stats.cache_hits == cache_hits) {
+        opkg_stats.downloads++;
+        if (opkg_stat(dest, &st) == 0 && st.st_size > before)
+            opkg_stats.download_bytes += st.st_size - before;
+    }
+    opkg_profile_end(span);
+    return ret;
 }
 
 /** \brief get_cache_location: generate cached file path
@@ -174,11 +212,248 @@ static char *get_cache_location(const char *src)
 
     sprintf_alloc(&cache_location, "%s/%s_%s", opkg_config->cache_dir,
                   md5sum_hex, short_file_name);
-    free(md5sum_hex);
-    free(tmp);
+    xfree(md5sum_hex);
+    xfree(tmp);
+    return cache_location;
+}
+
+/*
+ * Packages with a checksum in their index entry are cached by content, as
+ * <cache_dir>/sha256/<sum> or <cache_dir>/md5/<sum>, so that the same package
+ * from two feeds or mirrors is kept once, and whether it is cached is known
+ * from the index alone. The time of a file is its last use; when the cache
+ * is over cache_max_kb, the least recently used packages are evicted, except
+ * for those used by this process and the installed or held versions.
+ */
+
+/* The cache keys used or downloaded by this process. Their times can't tell:
+ * a file:// download keeps the time of its source. */
+static char **cache_used;
+static size_t cache_used_count;
+
+static long long timespec_ns(const struct timespec *ts)
+{
+    return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static int is_hex(const char *s, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        if (!isxdigit((unsigned char)s[i]))
+            return 0;
+    return s[len] == '\0';
+}
+
+/* The name of a package in the cache, relative to cache_dir, or NULL if it
+ * has no usable checksum. The checksum comes from a feed, so it is checked
+ * before it is used as a file name. */
+static char *pkg_cache_key(const pkg_t * pkg)
+{
+    char *key, *p;
+
+    if (pkg->sha256sum && is_hex(pkg->sha256sum, 64))
+        sprintf_alloc(&key, "sha256/%s", pkg->sha256sum);
+    else if (pkg->md5sum && is_hex(pkg->md5sum, 32))
+        sprintf_alloc(&key, "md5/%s", pkg->md5sum);
+    else
+        return NULL;
+
+    for (p = key; *p; p++)
+        *p = tolower((unsigned char)*p);
+    return key;
+}
+
+static char *get_pkg_cache_location(const pkg_t * pkg, const char *url)
+{
+    char *key = pkg_cache_key(pkg);
+    char *cache_location;
+
+    if (!key)
+        return get_cache_location(url);
+
+    sprintf_alloc(&cache_location, "%s/%s", opkg_config->cache_dir, key);
+    xfree(key);
     return cache_location;
 }
 
+/* Record a use of a cached file. */
+static void cache_touch(const char *path)
+{
+    if (utimensat(AT_FDCWD, path, NULL, AT_SYMLINK_NOFOLLOW) != 0)
+        opkg_msg(DEBUG, "Failed to update the time of %s: %s\n", path,
+                 strerror(errno));
+}
+
+/* Keep the package with this cache key from eviction by this process. */
+static void cache_use(const char *key)
+{
+    size_t i;
+
+    for (i = 0; i < cache_used_count; i++)
+        if (strcmp(cache_used[i], key) == 0)
+            return;
+
+    cache_used = xrealloc(cache_used, (cache_used_count + 1) * sizeof(char *));
+    cache_used[cache_used_count++] = xstrdup(key);
+}
+
+struct cache_entry {
+    char *key;
+    off_t size;
+    long long used;
+};
+
+static int cache_entry_cmp(const void *a, const void *b)
+{
+    const struct cache_entry *x = (const struct cache_entry *)a;
+    const struct cache_entry *y = (const struct cache_entry *)b;
+
+    return (x->used > y->used) - (x->used < y->used);
+}
+
+static int str_ptr_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void cache_scan(const char *subdir, struct cache_entry **entries,
+                       size_t *n, size_t *alloc, unsigned long long *total)
+{
+    char *dir_path, *path;
+    DIR *dir;
+    struct dirent *d;
+    struct stat st;
+
+    sprintf_alloc(&dir_path, "%s/%s", opkg_config->cache_dir, subdir);
+    dir = opendir(dir_path);
+    if (!dir) {
+        xfree(dir_path);
+        return;
+    }
+
+    while ((d = readdir(dir)) != NULL) {
+        if (d->d_name[0] == '.')
+            continue;
+        sprintf_alloc(&path, "%s/%s", dir_path, d->d_name);
+        if (opkg_lstat(path, &st) == 0 && !S_ISDIR(st.st_mode)) {
+            if (*n == *alloc) {
+                *alloc = *alloc ? 2 * *alloc : 64;
+                *entries = xrealloc(*entries,
+                                    *alloc * sizeof(struct cache_entry));
+            }
+            sprintf_alloc(&(*entries)[*n].key, "%s/%s", subdir, d->d_name);
+            (*entries)[*n].size = st.st_size;
+            (*entries)[*n].used = timespec_ns(&st.st_mtim);
+            (*n)++;
+            *total += st.st_size;
+        }
+        xfree(path);
+    }
+
+    closedir(dir);
+    xfree(dir_path);
+}
+
+/* Evict the least recently used packages until the cache fits in
+ * cache_max_kb. */
+static void cache_evict(void)
+{
+    struct cache_entry *entries = NULL;
+    size_t n = 0, alloc = 0, n_keep = 0, i;
+    unsigned long long total = 0, budget;
+    char **keep = NULL;
+    pkg_hash_iter_t it;
+    pkg_t *pkg;
+    char *path, *key;
+
+    if (!opkg_config->cache_max_kb || opkg_config->volatile_cache)
+        return;
+
+    budget = (unsigned long long)opkg_config->cache_max_kb * 1024;
+    cache_scan("sha256", &entries, &n, &alloc, &total);
+    cache_scan("md5", &entries, &n, &alloc, &total);
+    if (total <= budget)
+        goto cleanup;
+
+    /* Installed and held versions stay, so that they can be reinstalled. */
+    pkg_hash_iter_init(&it, 0, NULL, NULL);
+    while ((pkg = pkg_hash_iter_next(&it))) {
+        if (pkg->state_status == SS_NOT_INSTALLED
+            && !(pkg->state_flag & SF_HOLD))
+            continue;
+        key = pkg_cache_key(pkg);
+        if (!key)
+            continue;
+        keep = xrealloc(keep, (n_keep + 1) * sizeof(char *));
+        keep[n_keep++] = key;
+    }
+    /* So do the packages this process is installing. */
+    keep = xrealloc(keep, (n_keep + cache_used_count) * sizeof(char *));
+    for (i = 0; i < cache_used_count; i++)
+        keep[n_keep++] = xstrdup(cache_used[i]);
+    if (n_keep)
+        qsort(keep, n_keep, sizeof(char *), str_ptr_cmp);
+
+    qsort(entries, n, sizeof(struct cache_entry), cache_entry_cmp);
+    for (i = 0; i < n && total > budget; i++) {
+        if (n_keep && bsearch(&entries[i].key, keep, n_keep, sizeof(char *),
+                              str_ptr_cmp))
+            continue;
+
+        sprintf_alloc(&path, "%s/%s", opkg_config->cache_dir, entries[i].key);
+        opkg_msg(INFO, "Evicting %s from the cache.\n", path);
+        if (opkg_unlink(path) == 0) {
+            total -= entries[i].size;
+            opkg_stats.cache_evictions++;
+        } else {
+            opkg_perror(ERROR, "Failed to remove %s", path);
+        }
+        xfree(path);
+    }
+
+ cleanup:
+    for (i = 0; i < n; i++)
+        xfree(entries[i].key);
+    xfree(entries);
+    for (i = 0; i < n_keep; i++)
+        xfree(keep[i]);
+    xfree(keep);
+}
+
+/* Download a package to its place in the content-addressed cache. It is
+ * written under a temporary name first, so that the cache never holds part
+ * of a package under its checksum. */
+static int download_to_cache_key(const char *url, const char *dest,
+                                 curl_progress_func cb, void *data)
+{
+    char *dir, *part;
+    int err;
+
+    dir = xdirname(dest);
+    err = file_mkdir_hier(dir, 0755);
+    if (err)
+        opkg_perror(ERROR, "Creating cache dir %s failed", dir);
+    xfree(dir);
+    if (err)
+        return -1;
+
+    sprintf_alloc(&part, "%s.part", dest);
+    err = opkg_download_internal(url, part, cb, data, 0);
+    if (err == 0 && opkg_rename(part, dest) != 0) {
+        opkg_perror(ERROR, "Failed to rename '%s' to '%s'", part, dest);
+        err = -1;
+    }
+    if (err)
+        opkg_unlink(part);
+    else
+        /* A copy from a file:// feed has the time of its source. */
+        cache_touch(dest);
+    xfree(part);
+    return err;
+}
+
 /** \brief opkg_download_direct: downloads file directly
  *
  * \param src absolute URI of file to download
@@ -211,7 +486,7 @@ char *opkg_download_cache(const char *src, curl_progress_func cb, void *data)
     cache_location = get_cache_location(src);
     err = opkg_download_internal(src, cache_location, cb, data, 1);
     if (err) {
-        free(cache_location);
+        xfree(cache_location);
         cache_location = NULL;
     }
     return cache_location;
@@ -226,7 +501,7 @@ int opkg_download(const char *src, const char *dest_file_name,
         char *cache_location = opkg_download_cache(src, cb, data);
         if (cache_location) {
             err = file_copy(cache_location, dest_file_name);
-            free(cache_location);
+            xfree(cache_location);
         } else {
             err = -1;
         }
@@ -272,12 +547,12 @@ void pkg_remove_signature(pkg_t * pkg)
             sig_ext = "sig";
 
         sprintf_alloc(&sig_url, "%s.%s", pkg_url, sig_ext);
-        free(pkg_url);
+        xfree(pkg_url);
 
         sig_file = get_cache_location(sig_url);
-        unlink(sig_file);
-        free(sig_file);
-        free(sig_url);
+        opkg_unlink(sig_file);
+        xfree(sig_file);
+        xfree(sig_url);
     }
 }
 
@@ -306,55 +581,95 @@ char *pkg_download_signature(pkg_t * pkg)
         sig_ext = "sig";
 
     sprintf_alloc(&sig_url, "%s.%s", pkg_url, sig_ext);
-    free(pkg_url);
+    xfree(pkg_url);
 
     sig_file = get_cache_location(sig_url);
-    if (stat(sig_file, &sig_stat)) {
-        free(sig_file);
+    if (opkg_stat(sig_file, &sig_stat)) {
+        xfree(sig_file);
         sig_file = opkg_download_cache(sig_url, NULL, NULL);
     }
-    free(sig_url);
+    xfree(sig_url);
 
     return sig_file;
 }
 
-/** \brief opkg_download_pkg: download and verify a package
+/** \brief opkg_download_pkg_progress: download and verify a package
  *
  * \param pkg the package to download
+ * \param cb callback for curl download progress
+ * \param data data to pass to progress callback
  * \return 0 if success, -1 if error occurs
  *
  */
-int opkg_download_pkg(pkg_t * pkg)
+int opkg_download_pkg_progress(pkg_t * pkg, curl_progress_func cb, void *data)
 {
-    char *url;
+    char *url, *key;
     int err = 0;
 
     url = get_pkg_url(pkg);
     if (!url)
         return -1;
 
-    pkg->local_filename = get_cache_location(url);
+    key = pkg_cache_key(pkg);
+    pkg->local_filename = get_pkg_cache_location(pkg, url);
 
     /* Check if valid package exists in cache */
     err = pkg_verify(pkg);
+    if (err == 0) {
+        opkg_stats.cache_hits++;
+        if (key) {
+            cache_touch(pkg->local_filename);
+            cache_use(key);
+        }
+    }
     if (err != 1)
         goto cleanup;
 
-    err = opkg_download_internal(url, pkg->local_filename, NULL, NULL, 1);
+    if (key)
+        err = download_to_cache_key(url, pkg->local_filename, cb, data);
+    else
+        err = opkg_download_internal(url, pkg->local_filename, cb, data, 1);
     if (err) {
-	free(pkg->local_filename);
+	xfree(pkg->local_filename);
 	pkg->local_filename = NULL;
         goto cleanup;
     }
+    if (key)
+        cache_use(key);
 
     /* Ensure downloaded package is valid. */
     err = pkg_verify(pkg);
+    if (err == 0 && key)
+        cache_evict();
 
  cleanup:
-    free(url);
+    xfree(key);
+    xfree(url);
     return err;
 }
 
+int opkg_download_pkg(pkg_t * pkg)
+{
+    return opkg_download_pkg_progress(pkg, NULL, NULL);
+}
+
+/* Whether a package is in the cache already, without verifying it. */
+int opkg_download_pkg_is_cached(pkg_t * pkg)
+{
+    char *url, *cache_location;
+    int cached;
+
+    if (pkg->src == NULL || pkg->filename == NULL)
+        return 0;
+
+    url = get_pkg_url(pkg);
+    cache_location = get_pkg_cache_location(pkg, url);
+    cached = access(cache_location, F_OK) == 0;
+    xfree(cache_location);
+    xfree(url);
+    return cached;
+}
+
 int opkg_download_pkg_to_dir(pkg_t * pkg, const char *dir)
 {
     char *dest_file_name;
@@ -387,8 +702,8 @@ int opkg_download_pkg_to_dir(pkg_t * pkg, const char *dir)
     }
 
  cleanup:
-    free(url);
-    free(dest_file_name);
+    xfree(url);
+    xfree(dest_file_name);
     return err;
 }
 
@@ -415,15 +730,249 @@ static int url_has_remote_protocol(const char *url)
     return 0;
 }
 
-static int opkg_prepare_file_for_install(const char *path, char **namep)
+#if WITH_CURL
+/* A package on its way from the download thread, through a pipe, to
+ * ar_stage_pkg(), which hashes it as it reads it. */
+struct pkg_stream {
+    const char *url;
+    int fds[2];
+    int result;
+    unsigned long size;
+    struct md5_ctx md5;
+#if WITH_SHA256
+    struct sha256_ctx sha256;
+#endif
+};
+
+static size_t pkg_stream_write(char *ptr, size_t size, size_t nmemb,
+                               void *data)
+{
+    struct pkg_stream *s = (struct pkg_stream *)data;
+    size_t len = size * nmemb, done = 0;
+    ssize_t r;
+
+    while (done < len) {
+        r = write(s->fds[1], ptr + done, len - done);
+        if (r < 0 && errno == EINTR)
+            continue;
+        /* The reader has given up, which aborts the transfer. */
+        if (r < 0)
+            return 0;
+        done += r;
+    }
+    return len;
+}
+
+static void *pkg_stream_download(void *arg)
+{
+    struct pkg_stream *s = (struct pkg_stream *)arg;
+    sigset_t set;
+
+    /* A write to a pipe the reader has closed fails with EPIPE instead of
+     * raising SIGPIPE, which is discarded when this thread exits. */
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    s->result = opkg_download_backend_stream(s->url, pkg_stream_write, s);
+    close(s->fds[1]);
+    return NULL;
+}
+
+static ssize_t pkg_stream_read(void *data, void *buf, size_t len)
+{
+    struct pkg_stream *s = (struct pkg_stream *)data;
+    ssize_t r;
+
+    do {
+        r = read(s->fds[0], buf, len);
+    } while (r < 0 && errno == EINTR);
+
+    if (r > 0) {
+        md5_process_bytes(buf, r, &s->md5);
+#if WITH_SHA256
+        sha256_process_bytes(buf, r, &s->sha256);
+#endif
+        s->size += r;
+    }
+    return r;
+}
+
+/* Whether pkg has a checksum which this build can verify. */
+static int pkg_stream_has_checksum(pkg_t * pkg)
 {
+#if WITH_SHA256
+    if (pkg->sha256sum)
+        return 1;
+#endif
+    return pkg->md5sum != NULL;
+}
+
+/* Check a streamed package as pkg_verify() checks a downloaded one. */
+static int pkg_stream_verify(pkg_t * pkg, struct pkg_stream *s)
+{
+    const char *want;
+    char *sum;
     int r;
-    pkg_t *pkg = pkg_new();
 
-    r = pkg_init_from_file(pkg, path);
-    if (r)
-        return r;
+    if (s->size != pkg->size) {
+        opkg_msg(ERROR, "File size mismatch: %s is %lu bytes, expecting %lu bytes\n",
+                 s->url, s->size, pkg->size);
+        goto fail;
+    }
+
+#if WITH_SHA256
+    if (pkg->sha256sum) {
+        unsigned char bin[32];
+
+        want = pkg->sha256sum;
+        sum = sha256_to_string(sha256_finish_ctx(&s->sha256, bin));
+    } else
+#endif
+    if (pkg->md5sum) {
+        unsigned char bin[16];
+
+        want = pkg->md5sum;
+        sum = md5_to_string(md5_finish_ctx(&s->md5, bin));
+    } else {
+        /* Only streamed with --force-checksum. */
+        return 0;
+    }
+
+    r = strcmp(sum, want);
+    xfree(sum);
+    if (r == 0)
+        return 0;
+    opkg_msg(ERROR, "Checksum mismatch for %s.\n", s->url);
+
+ fail:
+    /* As pkg_verify() does for a downloaded file. */
+    if (!opkg_config->force_checksum)
+        return -1;
+    opkg_msg(NOTICE, "Ignored %s checksum mismatch.\n", s->url);
+    return 0;
+}
+#endif
+
+/** \brief opkg_download_pkg_stream: download a package as it is installed
+ *
+ * The package is read as it arrives: its control files are extracted to
+ * tmp_unpack_dir and its data files staged under its destination (see
+ * ar_stage_pkg()), so that it is never stored whole. The staged files are
+ * dropped unless the size and checksum of the package match.
+ *
+ * \param pkg the package to download
+ * \return 0 if success, -1 if error occurs, 1 if the package cannot be
+ * streamed and must be downloaded with opkg_download_pkg()
+ *
+ */
+int opkg_download_pkg_stream(pkg_t * pkg)
+{
+#if WITH_CURL
+    struct pkg_stream s;
+    struct ar_stage *stage;
+    pthread_t tid;
+    char *url, *cache_location, *control_dir;
+    long long start;
+    int cached, span, made_dir = 0, err = 1;
+
+    /* Signatures are checked over the whole file. */
+    if (opkg_config->check_pkg_signature)
+        return 1;
+    /* pkg_verify() reports a package without a checksum to check. */
+    if (!pkg_stream_has_checksum(pkg) && !opkg_config->force_checksum)
+        return 1;
 
+    url = get_pkg_url(pkg);
+    if (!url)
+        return -1;
+
+    /* Local packages need no download, and one in the cache is used. */
+    cache_location = get_pkg_cache_location(pkg, url);
+    cached = file_exists(cache_location);
+    xfree(cache_location);
+    if (!url_has_remote_protocol(url) || cached)
+        goto cleanup;
+
+    sprintf_alloc(&pkg->tmp_unpack_dir, "%s/%s-XXXXXX", opkg_config->tmp_dir,
+                  pkg->name);
+    made_dir = 1;
+    if (mkdtemp(pkg->tmp_unpack_dir) == NULL) {
+        opkg_perror(ERROR, "Failed to create temporary directory '%s'",
+                    pkg->tmp_unpack_dir);
+        err = -1;
+        goto cleanup;
+    }
+
+    memset(&s, 0, sizeof(s));
+    s.url = url;
+    md5_init_ctx(&s.md5);
+#if WITH_SHA256
+    sha256_init_ctx(&s.sha256);
+#endif
+    if (pipe(s.fds) != 0) {
+        opkg_perror(ERROR, "Failed to create pipe");
+        err = -1;
+        goto cleanup;
+    }
+
+    opkg_msg(NOTICE, "Downloading %s.\n", url);
+    opkg_msg(INFO, "Staging %s as it is downloaded.\n", pkg->name);
+    span = opkg_profile_begin("download", url);
+    start = opkg_stats_now();
+
+    if (pthread_create(&tid, NULL, pkg_stream_download, &s) != 0) {
+        opkg_msg(ERROR, "Failed to start download thread.\n");
+        close(s.fds[0]);
+        close(s.fds[1]);
+        opkg_profile_end(span);
+        err = -1;
+        goto cleanup;
+    }
+
+    sprintf_alloc(&control_dir, "%s/", pkg->tmp_unpack_dir);
+    stage = ar_stage_pkg(pkg_stream_read, &s, control_dir,
+                         pkg->dest->root_dir);
+    xfree(control_dir);
+    close(s.fds[0]);
+    pthread_join(tid, NULL);
+
+    opkg_stats.download_ns += opkg_stats_now() - start;
+    opkg_profile_end(span);
+
+    err = 0;
+    if (!stage || s.result != 0 || pkg_stream_verify(pkg, &s) != 0)
+        err = -1;
+    if (s.result == 0) {
+        opkg_stats.downloads++;
+        opkg_stats.download_bytes += s.size;
+    }
+
+    if (err)
+        ar_stage_free(stage);
+    else
+        pkg->stage = stage;
+
+ cleanup:
+    /* A failed download leaves its control files for the cleanup of
+     * tmp_dir. */
+    if (err && made_dir) {
+        xfree(pkg->tmp_unpack_dir);
+        pkg->tmp_unpack_dir = NULL;
+    }
+    xfree(url);
+    return err;
+#else
+    (void)pkg;
+    return 1;
+#endif
+}
+
+/* Add pkg, loaded from the package file at path, to the hash as wanted for
+ * installation. pkg is freed if it cannot be installed. */
+static int opkg_prepare_pkg_for_install(pkg_t * pkg, const char *path,
+                                        char **namep)
+{
     opkg_msg(DEBUG2, "Package %s provided by file '%s'.\n", pkg->name,
              pkg->local_filename);
     pkg->provided_by_hand = 1;
@@ -445,9 +994,9 @@ static int opkg_prepare_file_for_install(const char *path, char **namep)
             opkg_msg(ERROR,
                      "Refusing to load file '%s' as it matches the installed version of %s (%s).\n",
                      path, old_pkg->name, version);
-            free(version);
+            xfree(version);
             pkg_deinit(pkg);
-            free(pkg);
+            xfree(pkg);
             return -1;
         }
     }
@@ -459,6 +1008,21 @@ static int opkg_prepare_file_for_install(const char *path, char **namep)
     return 0;
 }
 
+static int opkg_prepare_file_for_install(const char *path, char **namep)
+{
+    int r;
+    pkg_t *pkg = pkg_new();
+
+    r = pkg_init_from_file(pkg, path);
+    if (r) {
+        pkg_deinit(pkg);
+        xfree(pkg);
+        return r;
+    }
+
+    return opkg_prepare_pkg_for_install(pkg, path, namep);
+}
+
 /* Prepare a given URL for installation. We use a few simple heuristics to
  * determine whether this is a remote URL, file name or abstract package name.
  */
@@ -479,7 +1043,7 @@ int opkg_prepare_url_for_install(const char *url, char **namep)
             return -1;
 
         r = opkg_prepare_file_for_install(cache_location, namep);
-        free(cache_location);
+        xfree(cache_location);
         return r;
     }
 
@@ -523,7 +1087,7 @@ int opkg_prepare_url_for_install(const char *url, char **namep)
                             0,
                             1);
 
-                    free(dependence_to_satisfy);
+                    xfree(dependence_to_satisfy);
                 } else {
                     pkg = pkg_hash_fetch_best_installation_candidate_by_name(ab_pkg->name);
                 }
@@ -558,9 +1122,169 @@ int opkg_prepare_url_for_install(const char *url, char **namep)
     r = -1;
 
 CLEANUP:
-    free(pkg_name);
-    free(pkg_version);
+    xfree(pkg_name);
+    xfree(pkg_version);
     abstract_pkg_vec_free(apkgs);
 
     return r;
 }
+
+/* Whether opkg_prepare_url_for_install() would take url for a local package
+ * file. */
+static int url_is_local_file(const char *url)
+{
+    char *pkg_name, *pkg_version;
+    version_constraint_t constraint;
+    abstract_pkg_vec_t *apkgs;
+    int r;
+
+    if (url_has_remote_protocol(url) || !file_exists(url))
+        return 0;
+
+    strip_pkg_name_and_version(url, &pkg_name, &pkg_version, &constraint);
+    if (is_str_glob(pkg_name)) {
+        apkgs = abstract_pkg_vec_alloc();
+        abstract_pkgs_fetch_by_glob(pkg_name, apkgs);
+        r = apkgs->len == 0;
+        abstract_pkg_vec_free(apkgs);
+    } else {
+        r = abstract_pkg_fetch_by_name(pkg_name) == NULL;
+    }
+
+    xfree(pkg_name);
+    xfree(pkg_version);
+    return r;
+}
+
+struct local_file {
+    int arg;
+    pkg_t *pkg;
+    char *control;
+    size_t control_len;
+    int err;
+};
+
+struct local_file_job {
+    struct local_file *files;
+    char **argv;
+    size_t n;
+    size_t first;
+    size_t stride;
+};
+
+/* Runs on a worker thread; see pkg_read_control_file() for what it may
+ * touch. */
+static void *local_file_job_run(void *arg)
+{
+    struct local_file_job *job = (struct local_file_job *)arg;
+    struct local_file *file;
+    size_t i;
+
+    for (i = job->first; i < job->n; i += job->stride) {
+        file = &job->files[i];
+        file->err = pkg_read_control_file(file->pkg, job->argv[file->arg],
+                                          &file->control, &file->control_len);
+    }
+    return NULL;
+}
+
+/* Read the control files of n local package files, on read_threads
+ * threads or one per core. */
+static void read_local_files(struct local_file *files, size_t n, char **argv)
+{
+    long threads = opkg_config->read_threads;
+    struct local_file_job *jobs;
+    pthread_t *tids;
+    int *started;
+    size_t i;
+
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1)
+        threads = 1;
+    if ((size_t)threads > n)
+        threads = n ? n : 1;
+    opkg_msg(DEBUG, "Reading %zu package files on %ld threads.\n", n,
+             threads);
+
+    jobs = xcalloc(threads, sizeof(struct local_file_job));
+    tids = xcalloc(threads, sizeof(pthread_t));
+    started = xcalloc(threads, sizeof(int));
+
+    /* Files are dealt out round-robin; the first share is read on this
+     * thread. */
+    for (i = 0; i < (size_t)threads; i++) {
+        jobs[i].files = files;
+        jobs[i].argv = argv;
+        jobs[i].n = n;
+        jobs[i].first = i;
+        jobs[i].stride = threads;
+        if (i > 0)
+            started[i] = pthread_create(&tids[i], NULL, local_file_job_run,
+                                        &jobs[i]) == 0;
+    }
+    for (i = 0; i < (size_t)threads; i++) {
+        if (i == 0 || !started[i])
+            local_file_job_run(&jobs[i]);
+        else
+            pthread_join(tids[i], NULL);
+    }
+
+    xfree(jobs);
+    xfree(tids);
+    xfree(started);
+}
+
+int opkg_prepare_urls_for_install(int argc, char **argv)
+{
+    struct local_file *files;
+    size_t i, n = 0, next = 0;
+    int r = 0;
+    int arg;
+
+    files = xcalloc(argc, sizeof(struct local_file));
+    for (arg = 0; arg < argc; arg++) {
+        if (url_is_local_file(argv[arg])) {
+            files[n].arg = arg;
+            files[n].pkg = pkg_new();
+            n++;
+        }
+    }
+    read_local_files(files, n, argv);
+
+    for (arg = 0; arg < argc && r == 0; arg++) {
+        struct local_file *file = NULL;
+
+        opkg_msg(DEBUG2, "%s\n", argv[arg]);
+
+        if (next < n && files[next].arg == arg)
+            file = &files[next++];
+
+        /* A package added for an earlier argument may have taken the name
+         * of this file since it was read. */
+        if (file && url_is_local_file(argv[arg])) {
+            r = file->err;
+            if (r == 0)
+                r = pkg_init_from_control(file->pkg, file->control,
+                                          file->control_len);
+            if (r == 0) {
+                r = opkg_prepare_pkg_for_install(file->pkg, argv[arg],
+                                                 &argv[arg]);
+                file->pkg = NULL;
+            }
+        } else {
+            r = opkg_prepare_url_for_install(argv[arg], &argv[arg]);
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        if (files[i].pkg) {
+            pkg_deinit(files[i].pkg);
+            xfree(files[i].pkg);
+        }
+        xfree(files[i].control);
+    }
+    xfree(files);
+
+    return r;
+}
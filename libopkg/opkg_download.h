@@ -30,11 +30,17 @@ extern "C" {
 typedef void (*opkg_download_progress_callback) (int percent, char *url);
 typedef int (*curl_progress_func) (void *data, double t, double d,
                                    double ultotal, double ulnow);
+/* Receives downloaded data, as curl's CURLOPT_WRITEFUNCTION does. */
+typedef size_t (*opkg_download_write_fn) (char *ptr, size_t size,
+                                          size_t nmemb, void *data);
 
 int opkg_download(const char *src, const char *dest_file_name,
                   curl_progress_func cb, void *data);
 char *opkg_download_cache(const char *src, curl_progress_func cb, void *data);
 int opkg_download_pkg(pkg_t * pkg);
+int opkg_download_pkg_progress(pkg_t * pkg, curl_progress_func cb, void *data);
+int opkg_download_pkg_stream(pkg_t * pkg);
+int opkg_download_pkg_is_cached(pkg_t * pkg);
 int opkg_download_pkg_to_dir(pkg_t * pkg, const char *dir);
 void pkg_remove_signature(pkg_t * pkg);
 char *pkg_download_signature(pkg_t * pkg);
@@ -44,6 +50,13 @@ char *pkg_download_signature(pkg_t * pkg);
  */
 int opkg_prepare_url_for_install(const char *url, char **namep);
 
+/*
+ * opkg_prepare_url_for_install() for each of argv in turn, replacing it with
+ * the package name. The control files of the local package files among them
+ * are read in parallel first.
+ */
+int opkg_prepare_urls_for_install(int argc, char **argv);
+
 /* Cleanup function, does nothing unless opkg is configured with
  * '--enable-curl'.
  *
@@ -58,6 +71,9 @@ void opkg_download_cleanup(void);
  */
 int opkg_download_backend(const char *src, const char *dest,
                           curl_progress_func cb, void *data, int use_cache);
+/* Streaming download, only provided by the curl backend. */
+int opkg_download_backend_stream(const char *src, opkg_download_write_fn write_fn,
+                                 void *data);
 
 #ifdef __cplusplus
 }
@@ -33,6 +33,7 @@
 
 #include "sprintf_alloc.h"
 #include "file_util.h"
+#include "opkg_stats.h"
 #include "xfuncs.h"
 
 
@@ -189,12 +190,12 @@ static int create_file_stamp(const char *file_name, char *stamp)
     file = fopen(file_path, "wb");
     if (file == NULL) {
         opkg_msg(ERROR, "Failed to open file %s\n", file_path);
-        free(file_path);
+        xfree(file_path);
         return -1;
     }
     fwrite(stamp, strlen(stamp), 1, file);
     fclose(file);
-    free(file_path);
+    xfree(file_path);
     return 0;
 }
 
@@ -217,13 +218,13 @@ static int check_file_stamp(const char *file_name, char *stamp)
 
     sprintf_alloc(&file_path, "%s.@stamp", file_name);
     if (!file_exists(file_path)) {
-        free(file_path);
+        xfree(file_path);
         return -1;
     }
     file = fopen(file_path, "rb");
     if (file == NULL) {
         opkg_msg(ERROR, "Failed to open file %s\n", file_path);
-        free(file_path);
+        xfree(file_path);
         return -1;
     }
     while (*stamp) {
@@ -244,7 +245,7 @@ static int check_file_stamp(const char *file_name, char *stamp)
     r = fclose(file);
     if (r != 0)
         opkg_msg(ERROR, "Failed to close file %s\n", file_path);
-    free(file_path);
+    xfree(file_path);
     return diff;
 }
 
@@ -285,7 +286,7 @@ static int opkg_validate_cached_file(const char *src, const char *cache_location
         if (etag && (check_file_stamp(cache_location, etag) == 0))
             match = 1;
         else
-            unlink(cache_location);
+            opkg_unlink(cache_location);
     }
     if (!match && etag) {
         int r = create_file_stamp(cache_location, etag);
@@ -311,7 +312,7 @@ static int opkg_validate_cached_file(const char *src, const char *cache_location
     }
 
 cleanup:
-    free(etag);
+    xfree(etag);
 
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, NULL);
     curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, NULL);
@@ -321,18 +322,8 @@ cleanup:
     return ret;
 }
 
-/* Download using curl backend. */
-int opkg_download_backend(const char *src, const char *dest,
-                          curl_progress_func cb, void *data, int use_cache)
+static void opkg_curl_set_url(const char *src)
 {
-    CURLcode res;
-    FILE *file;
-    int ret;
-
-    curl = opkg_curl_init(cb, data);
-    if (!curl)
-        return -1;
-
     curl_easy_setopt(curl, CURLOPT_URL, src);
 
 #if WITH_SSLCURL
@@ -353,16 +344,33 @@ int opkg_download_backend(const char *src, const char *dest,
          */
         char *fixed_src = replace_token_in_str(src, "ftps://", "ftp://");
         curl_easy_setopt(curl, CURLOPT_URL, fixed_src);
-        free(fixed_src);
+        xfree(fixed_src);
     }
 #endif                          /* WITH_SSLCURL */
+}
+
+/* Download using curl backend. */
+int opkg_download_backend(const char *src, const char *dest,
+                          curl_progress_func cb, void *data, int use_cache)
+{
+    CURLcode res;
+    FILE *file;
+    int ret;
+
+    curl = opkg_curl_init(cb, data);
+    if (!curl)
+        return -1;
+
+    opkg_curl_set_url(src);
 
     if (use_cache) {
         ret = opkg_validate_cached_file(src, dest);
+        if (ret == 0)
+            opkg_stats.cache_hits++;
         if (ret <= 0)
             return ret;
     } else {
-        unlink(dest);
+        opkg_unlink(dest);
     }
 
     file = fopen(dest, "ab");
@@ -383,6 +391,32 @@ int opkg_download_backend(const char *src, const char *dest,
     return 0;
 }
 
+/* Download src, handing the data to write_fn as it arrives. This may run on
+ * a thread of its own, as long as no other download runs at the same time. */
+int opkg_download_backend_stream(const char *src, opkg_download_write_fn write_fn,
+                                 void *data)
+{
+    CURLcode res;
+
+    curl = opkg_curl_init(NULL, NULL);
+    if (!curl)
+        return -1;
+
+    opkg_curl_set_url(src);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_fn);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, data);
+    res = perform_curl_request(curl);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, NULL);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 0L);
+    if (res) {
+        log_curl_download_error("Failed to download", src, res);
+        return -1;
+    }
+
+    return 0;
+}
+
 void opkg_download_cleanup(void)
 {
     if (curl != NULL) {
@@ -390,7 +424,7 @@ void opkg_download_cleanup(void)
         curl = NULL;
     }
     if (curl_errorbuffer != NULL) {
-        free(curl_errorbuffer);
+        xfree(curl_errorbuffer);
         curl_errorbuffer = NULL;
     }
 }
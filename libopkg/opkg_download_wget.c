@@ -24,6 +24,7 @@
 
 #include "opkg_download.h"
 #include "opkg_message.h"
+#include "opkg_stats.h"
 #include "xsystem.h"
 
 /* Download using wget backend.
@@ -48,7 +49,7 @@ int opkg_download_backend(const char *src, const char *dest,
     (void)data;
     (void)use_cache;
 
-    unlink(dest);
+    opkg_unlink(dest);
 
     argv[i++] = "wget";
     argv[i++] = "-q";
@@ -24,6 +24,7 @@
 #include <time.h>
 #include <signal.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <stdlib.h>
 
@@ -32,18 +33,22 @@
 #include "pkg_extract.h"
 
 #include "opkg_configure.h"
+#include "opkg_archive.h"
 #include "opkg_download.h"
 #include "opkg_remove.h"
+#include "opkg_space.h"
 #include "opkg_verify.h"
 
 #include "opkg_utils.h"
 #include "opkg_message.h"
 #include "opkg_cmd.h"
 #include "opkg_conf.h"
+#include "opkg_profile.h"
 
 #include "sprintf_alloc.h"
 #include "file_util.h"
 #include "xsystem.h"
+#include "opkg_stats.h"
 #include "xfuncs.h"
 
 static int update_file_ownership(pkg_t * new_pkg, pkg_t * old_pkg)
@@ -106,32 +111,26 @@ static int update_file_ownership(pkg_t * new_pkg, pkg_t * old_pkg)
     return 0;
 }
 
-static int verify_pkg_installable(pkg_t * pkg)
+/* The transaction as a whole is checked by opkg_space_plan_check() before it
+ * starts; this is the last check, for the package at hand, which may only
+ * need the space it takes beyond the version it replaces. */
+static int verify_pkg_installable(pkg_t * pkg, pkg_t * old_pkg)
 {
     unsigned long kbs_available, pkg_size_kbs;
-    char *root_dir = NULL;
-    struct stat s;
+    unsigned long installed_size = pkg->installed_size;
+    const char *root_dir;
 
-    if (opkg_config->force_space || pkg->installed_size == 0)
-        return 0;
-
-    if (pkg->dest) {
-        int have_overlay_root = !strcmp(pkg->dest->name, "root")
-                && opkg_config->overlay_root
-                && !stat(opkg_config->overlay_root, &s)
-                && (s.st_mode & S_IFDIR);
-        if (have_overlay_root)
-            root_dir = opkg_config->overlay_root;
-        else
-            root_dir = pkg->dest->root_dir;
-    }
+    if (old_pkg && old_pkg->dest == pkg->dest)
+        installed_size = installed_size > old_pkg->installed_size
+            ? installed_size - old_pkg->installed_size : 0;
 
-    if (!root_dir)
-        root_dir = opkg_config->default_dest->root_dir;
+    if (opkg_config->force_space || installed_size == 0)
+        return 0;
 
+    root_dir = opkg_space_dest_dir(pkg->dest);
     kbs_available = get_available_kbytes(root_dir);
 
-    pkg_size_kbs = (pkg->installed_size + 1023) / 1024;
+    pkg_size_kbs = (installed_size + 1023) / 1024;
 
     if (pkg_size_kbs >= kbs_available) {
         opkg_msg(ERROR,
@@ -144,51 +143,46 @@ static int verify_pkg_installable(pkg_t * pkg)
     return 0;
 }
 
-static int unpack_pkg_control_files(pkg_t * pkg)
+/* Read the conffiles of a package from its control files, in memory or
+ * unpacked. */
+static int read_pkg_conffiles(pkg_t * pkg)
 {
-    int err;
     char *conffiles_file_name;
     char *root_dir;
     FILE *conffiles_file;
 
-    sprintf_alloc(&pkg->tmp_unpack_dir, "%s/%s-XXXXXX", opkg_config->tmp_dir,
-                  pkg->name);
-
-    pkg->tmp_unpack_dir = mkdtemp(pkg->tmp_unpack_dir);
-    if (pkg->tmp_unpack_dir == NULL) {
-        opkg_perror(ERROR, "Failed to create temporary directory '%s'",
-                    pkg->tmp_unpack_dir);
-        return -1;
-    }
-
-    err = pkg_extract_control_files_to_dir(pkg, pkg->tmp_unpack_dir);
-    if (err) {
-        return err;
-    }
-
-    /* XXX: CLEANUP: There might be a cleaner place to read in the
-     * conffiles. Seems like I should be able to get everything to go
-     * through pkg_init_from_file. If so, maybe it would make sense to
-     * move all of unpack_pkg_control_files to that function. */
-
     /* Don't need to re-read conffiles if we already have it */
     if (!nv_pair_list_empty(&pkg->conffiles)) {
         return 0;
     }
 
-    sprintf_alloc(&conffiles_file_name, "%s/conffiles", pkg->tmp_unpack_dir);
-    if (!file_exists(conffiles_file_name)) {
-        free(conffiles_file_name);
-        return 0;
-    }
+    if (pkg->control_files) {
+        const struct ar_mem_file *m = ar_mem_files_find(pkg->control_files,
+                                                        "conffiles");
+        if (!m || m->len == 0)
+            return 0;
 
-    conffiles_file = fopen(conffiles_file_name, "r");
-    if (conffiles_file == NULL) {
-        opkg_perror(ERROR, "Failed to open %s", conffiles_file_name);
-        free(conffiles_file_name);
-        return -1;
+        conffiles_file = fmemopen(m->data, m->len, "r");
+        if (conffiles_file == NULL) {
+            opkg_perror(ERROR, "Failed to open conffiles of %s", pkg->name);
+            return -1;
+        }
+    } else {
+        sprintf_alloc(&conffiles_file_name, "%s/conffiles",
+                      pkg->tmp_unpack_dir);
+        if (!file_exists(conffiles_file_name)) {
+            xfree(conffiles_file_name);
+            return 0;
+        }
+
+        conffiles_file = fopen(conffiles_file_name, "r");
+        if (conffiles_file == NULL) {
+            opkg_perror(ERROR, "Failed to open %s", conffiles_file_name);
+            xfree(conffiles_file_name);
+            return -1;
+        }
+        xfree(conffiles_file_name);
     }
-    free(conffiles_file_name);
 
     while (1) {
         char *cf_name;
@@ -220,8 +214,8 @@ static int unpack_pkg_control_files(pkg_t * pkg)
          * We'll wait until resolve_conffiles */
         conffile_list_append(&pkg->conffiles, cf_name_in_dest, NULL);
 
-        free(cf_name);
-        free(cf_name_in_dest);
+        xfree(cf_name);
+        xfree(cf_name_in_dest);
     }
 
     fclose(conffiles_file);
@@ -229,6 +223,59 @@ static int unpack_pkg_control_files(pkg_t * pkg)
     return 0;
 }
 
+/* Scripts which may be run before a package is installed, from
+ * tmp_unpack_dir. */
+static const char *const maintainer_scripts[] = {
+    "preinst", "postinst", "prerm", "postrm", NULL
+};
+
+/* Read the control files of a package into memory. Only its maintainer
+ * scripts, if it has any, are written out, to tmp_unpack_dir, from where
+ * they are run until the package is installed. */
+static int unpack_pkg_control_files(pkg_t * pkg)
+{
+    const struct ar_mem_file *m;
+    char *path;
+    int i, fd, err = 0;
+
+    pkg->control_files = pkg_extract_control_files_to_memory(pkg);
+    if (!pkg->control_files)
+        return -1;
+
+    for (i = 0; err == 0 && maintainer_scripts[i]; i++) {
+        m = ar_mem_files_find(pkg->control_files, maintainer_scripts[i]);
+        if (!m)
+            continue;
+
+        if (!pkg->tmp_unpack_dir) {
+            sprintf_alloc(&pkg->tmp_unpack_dir, "%s/%s-XXXXXX",
+                          opkg_config->tmp_dir, pkg->name);
+            if (mkdtemp(pkg->tmp_unpack_dir) == NULL) {
+                opkg_perror(ERROR, "Failed to create temporary directory '%s'",
+                            pkg->tmp_unpack_dir);
+                xfree(pkg->tmp_unpack_dir);
+                pkg->tmp_unpack_dir = NULL;
+                return -1;
+            }
+        }
+
+        sprintf_alloc(&path, "%s/%s", pkg->tmp_unpack_dir, m->name);
+        fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+        if (fd < 0 || write(fd, m->data, m->len) != (ssize_t)m->len
+            || fchmod(fd, m->mode) != 0) {
+            opkg_perror(ERROR, "Failed to write '%s'", path);
+            err = -1;
+        }
+        if (fd >= 0)
+            close(fd);
+        xfree(path);
+    }
+    if (err)
+        return err;
+
+    return read_pkg_conffiles(pkg);
+}
+
 static int prerm_upgrade_old_pkg(pkg_t * pkg, pkg_t * old_pkg)
 {
     int err;
@@ -241,9 +288,9 @@ static int prerm_upgrade_old_pkg(pkg_t * pkg, pkg_t * old_pkg)
     new_version = pkg_version_str_alloc(pkg);
 
     sprintf_alloc(&script_args, "upgrade %s", new_version);
-    free(new_version);
+    xfree(new_version);
     err = pkg_run_script(old_pkg, "prerm", script_args);
-    free(script_args);
+    xfree(script_args);
     if (err != 0) {
         opkg_msg(ERROR, "prerm script for package \"%s\" failed\n",
                  old_pkg->name);
@@ -272,11 +319,11 @@ static int preinst_configure(pkg_t * pkg, pkg_t * old_pkg)
     if (old_pkg) {
         char *old_version = pkg_version_str_alloc(old_pkg);
         sprintf_alloc(&preinst_args, "upgrade %s", old_version);
-        free(old_version);
+        xfree(old_version);
     } else if (pkg->state_status == SS_CONFIG_FILES) {
         char *pkg_version = pkg_version_str_alloc(pkg);
         sprintf_alloc(&preinst_args, "install %s", pkg_version);
-        free(pkg_version);
+        xfree(pkg_version);
     } else {
         preinst_args = xstrdup("install");
     }
@@ -284,11 +331,11 @@ static int preinst_configure(pkg_t * pkg, pkg_t * old_pkg)
     err = pkg_run_script(pkg, "preinst", preinst_args);
     if (err) {
         opkg_msg(ERROR, "Aborting installation of %s.\n", pkg->name);
-        free(preinst_args);
+        xfree(preinst_args);
         return -1;
     }
 
-    free(preinst_args);
+    xfree(preinst_args);
 
     return 0;
 }
@@ -323,7 +370,7 @@ static int backup_make_backup(const char *file_name)
     if (err)
         opkg_msg(ERROR, "Failed to copy %s to %s\n", file_name, backup);
 
-    free(backup);
+    xfree(backup);
 
     return err;
 }
@@ -337,7 +384,7 @@ static int backup_exists_for(const char *file_name)
 
     ret = file_exists(backup);
 
-    free(backup);
+    xfree(backup);
 
     return ret;
 }
@@ -347,8 +394,8 @@ static int backup_remove(const char *file_name)
     char *backup;
 
     backup = backup_filename_alloc(file_name);
-    unlink(backup);
-    free(backup);
+    opkg_unlink(backup);
+    xfree(backup);
 
     return 0;
 }
@@ -378,7 +425,7 @@ static int backup_modified_conffiles(pkg_t * pkg, pkg_t * old_pkg)
                     return err;
                 }
             }
-            free(cf_name);
+            xfree(cf_name);
         }
     }
 
@@ -390,7 +437,7 @@ static int backup_modified_conffiles(pkg_t * pkg, pkg_t * old_pkg)
         cf_name = root_filename_alloc(cf->name);
         /* Ignore if this was a conffile in old_pkg as well */
         if (pkg_get_conffile(old_pkg, cf->name)) {
-            free(cf_name);
+            xfree(cf_name);
             continue;
         }
 
@@ -400,7 +447,7 @@ static int backup_modified_conffiles(pkg_t * pkg, pkg_t * old_pkg)
                 return err;
             }
         }
-        free(cf_name);
+        xfree(cf_name);
     }
 
     return 0;
@@ -475,7 +522,7 @@ static int check_data_file_clashes(pkg_t * pkg, pkg_t * old_pkg)
                        if (xlstat(link_target, &target_stat) == 0) {
                           is_directory = S_ISDIR(target_stat.st_mode);
                        }
-                       free(link_target);
+                       xfree(link_target);
                     }
 
                     if (!is_directory) {
@@ -509,7 +556,7 @@ static int check_data_file_clashes(pkg_t * pkg, pkg_t * old_pkg)
 
                 link_target = file_readlink_alloc(filename);
                 r = strcmp(link_target, file_info->link_target);
-                free(link_target);
+                xfree(link_target);
 
                 if (r == 0) {
                     /* Ensure the target is a directory, not a file.
@@ -519,7 +566,7 @@ static int check_data_file_clashes(pkg_t * pkg, pkg_t * old_pkg)
                     link_target = realpath(filename, NULL);
                     if (link_target && xlstat(link_target, &target_stat) == 0)
                         target_is_same_directory = S_ISDIR(target_stat.st_mode);
-                    free(link_target);
+                    xfree(link_target);
                 }
 
                 if (target_is_same_directory)
@@ -676,9 +723,9 @@ static int postrm_upgrade_old_pkg(pkg_t * pkg, pkg_t * old_pkg)
     new_version = pkg_version_str_alloc(pkg);
 
     sprintf_alloc(&script_args, "upgrade %s", new_version);
-    free(new_version);
+    xfree(new_version);
     err = pkg_run_script(old_pkg, "postrm", script_args);
-    free(script_args);
+    xfree(script_args);
     if (err != 0) {
         opkg_msg(ERROR, "postrm script for package \"%s\" failed\n",
                  old_pkg->name);
@@ -746,7 +793,7 @@ static int remove_obsolesced_files(pkg_t * pkg, pkg_t * old_pkg)
         /* old file is obsolete */
         opkg_msg(NOTICE, "Removing obsolete file %s.\n", old->path);
         if (!opkg_config->noaction) {
-            err = unlink(old->path);
+            err = opkg_unlink(old->path);
             if (err) {
                 opkg_perror(ERROR, "unlinking %s failed", old->path);
             }
@@ -768,7 +815,7 @@ static int install_maintainer_scripts(pkg_t * pkg, pkg_t * old_pkg)
     sprintf_alloc(&prefix, "%s.", pkg->name);
     ret = pkg_extract_control_files_to_dir_with_prefix(pkg, pkg->dest->info_dir,
                                                        prefix);
-    free(prefix);
+    xfree(prefix);
     return ret;
 }
 
@@ -807,6 +854,8 @@ static int install_data_files(pkg_t * pkg)
         return err;
     }
 
+    /* The list is published along with the status file, so that readers
+     * never see it for a package which the status says isn't there yet. */
     opkg_msg(DEBUG, "Calling pkg_write_filelist.\n");
     err = pkg_write_filelist(pkg);
     if (err)
@@ -848,7 +897,7 @@ static int resolve_conffiles(pkg_t * pkg)
         }
 
         if (!file_exists(root_filename)) {
-            free(root_filename);
+            xfree(root_filename);
             continue;
         }
 
@@ -866,7 +915,7 @@ static int resolve_conffiles(pkg_t * pkg)
                     opkg_msg(NOTICE,
                              "Conffile %s ignoring maintainer's changes.\n",
                              root_filename);
-                    rename(cf_backup, root_filename);
+                    opkg_rename(cf_backup, root_filename);
                 } else {
                     char *new_conffile;
                     sprintf_alloc(&new_conffile, "%s-opkg", root_filename);
@@ -875,18 +924,18 @@ static int resolve_conffiles(pkg_t * pkg)
                              "is different from the conffile in the new package.\n"
                              " The new conffile will be placed at %s.\n",
                              root_filename, new_conffile);
-                    rename(root_filename, new_conffile);
-                    rename(cf_backup, root_filename);
-                    free(new_conffile);
+                    opkg_rename(root_filename, new_conffile);
+                    opkg_rename(cf_backup, root_filename);
+                    xfree(new_conffile);
                 }
             }
-            unlink(cf_backup);
+            opkg_unlink(cf_backup);
             if (md5sum)
-                free(md5sum);
+                xfree(md5sum);
         }
 
-        free(cf_backup);
-        free(root_filename);
+        xfree(cf_backup);
+        xfree(root_filename);
     }
 
     return 0;
@@ -895,12 +944,13 @@ static int resolve_conffiles(pkg_t * pkg)
 /**
  *  @brief Really install a pkg_t
  */
-int opkg_install_pkg(pkg_t * pkg, pkg_t * old_pkg)
+static int install_pkg(pkg_t * pkg, pkg_t * old_pkg)
 {
     int err = 0;
     abstract_pkg_t *ab_pkg = NULL;
     int old_state_flag;
     sigset_t newset, oldset;
+    int span;
 
     opkg_msg(DEBUG2, "Calling pkg_arch_supported.\n");
 
@@ -924,7 +974,7 @@ int opkg_install_pkg(pkg_t * pkg, pkg_t * old_pkg)
         /* needed for check_data_file_clashes of dependencies */
     }
 
-    err = verify_pkg_installable(pkg);
+    err = verify_pkg_installable(pkg, old_pkg);
     if (err)
         return -1;
 
@@ -940,7 +990,17 @@ int opkg_install_pkg(pkg_t * pkg, pkg_t * old_pkg)
         return 0;
 
     if (pkg->local_filename == NULL && !opkg_config->download_first) {
-        err = opkg_download_pkg(pkg);
+        /* A streamed package arrives with its control files unpacked and its
+         * data files staged; opkg_download_pkg_stream() returns 1 when the
+         * package has to be downloaded to the cache first. */
+        err = 1;
+        if (opkg_config->stream_install && !opkg_config->download_only) {
+            err = opkg_download_pkg_stream(pkg);
+            if (err == 0)
+                err = read_pkg_conffiles(pkg);
+        }
+        if (err == 1)
+            err = opkg_download_pkg(pkg);
         if (err) {
             opkg_msg(ERROR,
                      "Failed to download %s. "
@@ -952,8 +1012,10 @@ int opkg_install_pkg(pkg_t * pkg, pkg_t * old_pkg)
     if (opkg_config->download_only)
         return 0;
 
-    if (pkg->tmp_unpack_dir == NULL) {
+    if (pkg->tmp_unpack_dir == NULL && pkg->control_files == NULL) {
+        span = opkg_profile_begin("unpack", pkg->name);
         err = unpack_pkg_control_files(pkg);
+        opkg_profile_end(span);
         if (err == -1) {
             opkg_msg(ERROR, "Failed to unpack control files from %s.\n",
                      pkg->local_filename);
@@ -986,7 +1048,9 @@ int opkg_install_pkg(pkg_t * pkg, pkg_t * old_pkg)
     if (err)
         goto UNWIND_BACKUP_MODIFIED_CONFFILES;
 
+    span = opkg_profile_begin("clash check", pkg->name);
     err = check_data_file_clashes(pkg, old_pkg);
+    opkg_profile_end(span);
     if (err)
         goto UNWIND_CHECK_DATA_FILE_CLASHES;
 
@@ -1038,7 +1102,9 @@ int opkg_install_pkg(pkg_t * pkg, pkg_t * old_pkg)
 
     opkg_msg(INFO, "Installing data files for %s.\n", pkg->name);
 
+    span = opkg_profile_begin("extract", pkg->name);
     err = install_data_files(pkg);
+    opkg_profile_end(span);
     if (err) {
         opkg_msg(ERROR,
                  "Failed to extract data files for %s. "
@@ -1103,3 +1169,17 @@ int opkg_install_pkg(pkg_t * pkg, pkg_t * old_pkg)
     sigprocmask(SIG_UNBLOCK, &newset, &oldset);
     return -1;
 }
+
+int opkg_install_pkg(pkg_t * pkg, pkg_t * old_pkg)
+{
+    int span = opkg_profile_begin("install", pkg->name);
+    int err = install_pkg(pkg, old_pkg);
+
+    /* Drop whatever is still staged from a streamed package. */
+    if (err) {
+        ar_stage_free(pkg->stage);
+        pkg->stage = NULL;
+    }
+    opkg_profile_end(span);
+    return err;
+}
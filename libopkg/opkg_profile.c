@@ -0,0 +1,189 @@
+/* vi: set expandtab sw=4 sts=4: */
+/* opkg_profile.c - the opkg package management system
+
+   SPDX-License-Identifier: GPL-2.0-or-later
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "opkg_message.h"
+#include "opkg_profile.h"
+#include "opkg_stats.h"
+#include "xfuncs.h"
+
+struct profile_span {
+    const char *name;
+    char *detail;
+    long long start;            /* nanoseconds since opkg_profile_enable() */
+    long long end;              /* -1 while the span is open */
+};
+
+int opkg_profile_enabled;
+
+static char *trace_file;
+static struct timespec epoch;
+static struct profile_span *spans;
+static int span_count;
+static int span_alloc;
+
+static long long profile_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)(ts.tv_sec - epoch.tv_sec) * 1000000000LL
+        + (ts.tv_nsec - epoch.tv_nsec);
+}
+
+void opkg_profile_enable(const char *file)
+{
+    xfree(trace_file);
+    trace_file = file ? xstrdup(file) : NULL;
+
+    if (!opkg_profile_enabled)
+        clock_gettime(CLOCK_MONOTONIC, &epoch);
+    opkg_profile_enabled = 1;
+}
+
+int opkg_profile_begin_detail(const char *name, const char *detail)
+{
+    struct profile_span *span;
+
+    if (span_count == span_alloc) {
+        span_alloc = span_alloc ? span_alloc * 2 : 64;
+        spans = xrealloc(spans, span_alloc * sizeof(*spans));
+    }
+
+    span = &spans[span_count];
+    span->name = name;
+    span->detail = detail ? xstrdup(detail) : NULL;
+    span->end = -1;
+    span->start = profile_now();
+
+    return span_count++;
+}
+
+void opkg_profile_end(int span)
+{
+    if (span < 0 || span >= span_count)
+        return;
+
+    spans[span].end = profile_now();
+}
+
+static int write_trace(const char *file_name, long long now)
+{
+    FILE *fp;
+    int i, err;
+
+    fp = fopen(file_name, "w");
+    if (fp == NULL) {
+        opkg_perror(ERROR, "Failed to open %s", file_name);
+        return -1;
+    }
+
+    fprintf(fp, "{\"traceEvents\":[");
+    for (i = 0; i < span_count; i++) {
+        struct profile_span *span = &spans[i];
+        long long end = span->end < 0 ? now : span->end;
+
+        fprintf(fp, "%s\n{\"name\":", i ? "," : "");
+        opkg_json_write_string(fp, span->name);
+        fprintf(fp, ",\"cat\":\"opkg\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                "\"pid\":%d,\"tid\":1", span->start / 1000.0,
+                (end - span->start) / 1000.0, (int)getpid());
+        if (span->detail) {
+            fprintf(fp, ",\"args\":{\"detail\":");
+            opkg_json_write_string(fp, span->detail);
+            fputc('}', fp);
+        }
+        fputc('}', fp);
+    }
+    fprintf(fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+    err = ferror(fp);
+    if (fclose(fp) != 0 || err) {
+        opkg_perror(ERROR, "Failed to write %s", file_name);
+        return -1;
+    }
+
+    return 0;
+}
+
+int opkg_profile_report(FILE * out)
+{
+    const char **names;
+    long long *totals, *maxima, now;
+    int *counts;
+    int i, j, nphases = 0, err = 0;
+
+    if (!opkg_profile_enabled)
+        return 0;
+
+    now = profile_now();
+
+    /* Aggregate by phase name, in order of first appearance. Spans nest, so
+     * the time of an outer phase includes that of the phases inside it. */
+    names = xcalloc(span_count + 1, sizeof(*names));
+    totals = xcalloc(span_count + 1, sizeof(*totals));
+    maxima = xcalloc(span_count + 1, sizeof(*maxima));
+    counts = xcalloc(span_count + 1, sizeof(*counts));
+
+    for (i = 0; i < span_count; i++) {
+        long long end = spans[i].end < 0 ? now : spans[i].end;
+        long long dur = end - spans[i].start;
+
+        for (j = 0; j < nphases; j++)
+            if (strcmp(names[j], spans[i].name) == 0)
+                break;
+        if (j == nphases)
+            names[nphases++] = spans[i].name;
+
+        counts[j]++;
+        totals[j] += dur;
+        if (dur > maxima[j])
+            maxima[j] = dur;
+    }
+
+    fprintf(out, "%-32s %8s %12s %12s\n", "phase", "count", "total ms",
+            "max ms");
+    for (j = 0; j < nphases; j++)
+        fprintf(out, "%-32s %8d %12.3f %12.3f\n", names[j], counts[j],
+                totals[j] / 1e6, maxima[j] / 1e6);
+    fprintf(out, "%-32s %8s %12.3f\n", "wall", "", now / 1e6);
+
+    xfree(names);
+    xfree(totals);
+    xfree(maxima);
+    xfree(counts);
+
+    if (trace_file)
+        err = write_trace(trace_file, now);
+
+    for (i = 0; i < span_count; i++)
+        xfree(spans[i].detail);
+    xfree(spans);
+    spans = NULL;
+    span_count = span_alloc = 0;
+    xfree(trace_file);
+    trace_file = NULL;
+    opkg_profile_enabled = 0;
+
+    return err;
+}
@@ -0,0 +1,59 @@
+/* vi: set expandtab sw=4 sts=4: */
+/* opkg_profile.h - the opkg package management system
+
+   SPDX-License-Identifier: GPL-2.0-or-later
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+*/
+
+#ifndef OPKG_PROFILE_H
+#define OPKG_PROFILE_H
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern int opkg_profile_enabled;
+
+/*
+ * Starts recording phase spans. trace_file may be NULL; otherwise the
+ * spans are also written there as Chrome trace events by
+ * opkg_profile_report().
+ */
+void opkg_profile_enable(const char *trace_file);
+
+/*
+ * Opens a span for the phase 'name', which must be a string literal.
+ * 'detail' (a package or file name, may be NULL) is copied. Returns a
+ * handle for opkg_profile_end(), or -1 when profiling is disabled.
+ */
+int opkg_profile_begin_detail(const char *name, const char *detail);
+void opkg_profile_end(int span);
+
+static inline int opkg_profile_begin(const char *name, const char *detail)
+{
+    if (!opkg_profile_enabled)
+        return -1;
+    return opkg_profile_begin_detail(name, detail);
+}
+
+/*
+ * Prints the per-phase summary to 'out', writes the trace file if one was
+ * requested and releases all recorded spans.
+ */
+int opkg_profile_report(FILE * out);
+
+#ifdef __cplusplus
+}
+#endif
+#endif                          /* OPKG_PROFILE_H */
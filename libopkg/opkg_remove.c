@@ -31,7 +31,9 @@
 #include "opkg_remove.h"
 #include "opkg_cmd.h"
 #include "file_util.h"
+#include "opkg_profile.h"
 #include "sprintf_alloc.h"
+#include "opkg_stats.h"
 #include "xfuncs.h"
 
 void remove_data_files_and_list(pkg_t * pkg)
@@ -110,10 +112,10 @@ void remove_data_files_and_list(pkg_t * pkg)
                         file_hash_remove(file_name);
                     }
 
-                    free(link_target);
+                    xfree(link_target);
                     continue;
                 }
-                free(link_target);
+                xfree(link_target);
             }
         }
 
@@ -128,7 +130,7 @@ void remove_data_files_and_list(pkg_t * pkg)
 
         if (!opkg_config->noaction) {
             opkg_msg(INFO, "Deleting %s.\n", file_name);
-            unlink(file_name);
+            opkg_unlink(file_name);
         } else
             opkg_msg(INFO, "Not deleting %s. (noaction)\n", file_name);
 
@@ -157,7 +159,7 @@ void remove_data_files_and_list(pkg_t * pkg)
                     iter = str_list_next(&installed_dirs_symlinks, iter)) {
                 file_name = (char *)iter->data;
 
-                r = unlink(file_name);
+                r = opkg_unlink(file_name);
                 if (r == 0) {
                     opkg_msg(INFO, "Deleting %s.\n", file_name);
                     removed_a_dir_symlink = 1;
@@ -177,7 +179,7 @@ void remove_data_files_and_list(pkg_t * pkg)
 
         owner = file_hash_get_file_owner(file_name);
         if (owner) {
-            free(iter->data);
+            xfree(iter->data);
             iter->data = NULL;
             str_list_remove(&installed_dirs, &iter);
         }
@@ -186,13 +188,13 @@ void remove_data_files_and_list(pkg_t * pkg)
     /* cleanup */
     while (!void_list_empty(&installed_dirs)) {
         iter = str_list_pop(&installed_dirs);
-        free(iter->data);
-        free(iter);
+        xfree(iter->data);
+        xfree(iter);
     }
     while (!void_list_empty(&installed_dirs_symlinks)) {
         iter = str_list_pop(&installed_dirs_symlinks);
-        free(iter->data);
-        free(iter);
+        xfree(iter->data);
+        xfree(iter);
     }
     str_list_deinit(&installed_dirs);
     str_list_deinit(&installed_dirs_symlinks);
@@ -211,7 +213,7 @@ void remove_maintainer_scripts(pkg_t * pkg)
     sprintf_alloc(&globpattern, "%s/%s.*", pkg->dest->info_dir, pkg->name);
 
     err = glob(globpattern, 0, NULL, &globbuf);
-    free(globpattern);
+    xfree(globpattern);
     if (err)
         return;
 
@@ -220,12 +222,12 @@ void remove_maintainer_scripts(pkg_t * pkg)
         lastdot = strrchr(filename, '.');
         *lastdot = '\0';
         // Only delete files that match the package name (the glob may match files
-        // with similar names)
-        if (!strcmp(filename, pkg->name)) {
+        // with similar names). The .list goes with the status entry instead.
+        if (!strcmp(filename, pkg->name) && strcmp(lastdot + 1, "list")) {
             opkg_msg(INFO, "Deleting %s.\n", globbuf.gl_pathv[i]);
-            unlink(globbuf.gl_pathv[i]);
+            opkg_unlink(globbuf.gl_pathv[i]);
         }
-        free(filename);
+        xfree(filename);
     }
     globfree(&globbuf);
 }
@@ -234,6 +236,7 @@ int opkg_remove_pkg(pkg_t * pkg)
 {
     int err;
     int r;
+    int span;
 
     if (opkg_config->download_only)
 	return 0;
@@ -286,7 +289,9 @@ int opkg_remove_pkg(pkg_t * pkg)
      * like a big pain, and I don't see that that should make a big
      * difference, but for anyone who wants tighter compatibility,
      * feel free to fix this. */
+    span = opkg_profile_begin("remove files", pkg->name);
     remove_data_files_and_list(pkg);
+    opkg_profile_end(span);
 
     err = pkg_run_script(pkg, "postrm", "remove");
 
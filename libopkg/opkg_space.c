@@ -0,0 +1,172 @@
+/* vi: set expandtab sw=4 sts=4: */
+/* opkg_space.c - the opkg package management system
+
+   SPDX-License-Identifier: GPL-2.0-or-later
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+*/
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "opkg_conf.h"
+#include "opkg_download.h"
+#include "opkg_message.h"
+#include "opkg_space.h"
+#include "opkg_utils.h"
+#include "xfuncs.h"
+
+/* What a transaction does to one filesystem, in bytes. */
+struct space_fs {
+    dev_t dev;
+    char *dir;
+    unsigned long long installed;
+    unsigned long long freed;
+    unsigned long long downloaded;
+    struct space_fs *next;
+};
+
+struct opkg_space_plan {
+    struct space_fs *fs;
+};
+
+const char *opkg_space_dest_dir(pkg_dest_t *dest)
+{
+    struct stat s;
+
+    if (!dest)
+        dest = opkg_config->default_dest;
+
+    if (!strcmp(dest->name, "root") && opkg_config->overlay_root
+        && !stat(opkg_config->overlay_root, &s) && (s.st_mode & S_IFDIR))
+        return opkg_config->overlay_root;
+    return dest->root_dir;
+}
+
+opkg_space_plan_t *opkg_space_plan_alloc(void)
+{
+    return xcalloc(1, sizeof(opkg_space_plan_t));
+}
+
+void opkg_space_plan_free(opkg_space_plan_t *plan)
+{
+    struct space_fs *fs, *next;
+
+    if (!plan)
+        return;
+    for (fs = plan->fs; fs; fs = next) {
+        next = fs->next;
+        xfree(fs->dir);
+        xfree(fs);
+    }
+    xfree(plan);
+}
+
+/* The entry for the filesystem holding dir, which is looked up through its
+ * closest existing parent if it does not exist yet, as for a cache_dir which
+ * has never been downloaded to. */
+static struct space_fs *space_fs_for(opkg_space_plan_t *plan, const char *dir)
+{
+    struct space_fs *fs, **tail;
+    struct stat s;
+    char *path = xstrdup(dir);
+    char *slash;
+    int have_dev;
+
+    while (!(have_dev = stat(path, &s) == 0)
+           && (slash = strrchr(path, '/')) != NULL && slash != path)
+        *slash = '\0';
+
+    for (tail = &plan->fs; (fs = *tail) != NULL; tail = &fs->next) {
+        if (have_dev ? fs->dev == s.st_dev : !strcmp(fs->dir, path)) {
+            xfree(path);
+            return fs;
+        }
+    }
+
+    fs = xcalloc(1, sizeof(struct space_fs));
+    fs->dev = have_dev ? s.st_dev : 0;
+    fs->dir = path;
+    *tail = fs;
+    return fs;
+}
+
+void opkg_space_plan_install(opkg_space_plan_t *plan, pkg_t *pkg, pkg_t *old)
+{
+    int streamed = opkg_config->stream_install && !opkg_config->download_only;
+
+    if (opkg_config->force_space)
+        return;
+
+    /* A streamed package is staged straight into its destination, which its
+     * installed size accounts for. */
+    if (pkg->local_filename == NULL && !streamed
+        && !opkg_download_pkg_is_cached(pkg))
+        space_fs_for(plan, opkg_config->cache_dir)->downloaded += pkg->size;
+
+    if (opkg_config->download_only)
+        return;
+
+    space_fs_for(plan, opkg_space_dest_dir(pkg->dest))->installed +=
+        pkg->installed_size;
+    if (old)
+        opkg_space_plan_remove(plan, old);
+}
+
+void opkg_space_plan_remove(opkg_space_plan_t *plan, pkg_t *pkg)
+{
+    if (opkg_config->force_space || opkg_config->download_only)
+        return;
+
+    space_fs_for(plan, opkg_space_dest_dir(pkg->dest))->freed +=
+        pkg->installed_size;
+}
+
+static unsigned long long to_kbytes(unsigned long long bytes)
+{
+    return (bytes + 1023) / 1024;
+}
+
+int opkg_space_plan_check(opkg_space_plan_t *plan)
+{
+    struct space_fs *fs;
+    unsigned long long needed;
+    unsigned long kbs_available;
+    int err = 0;
+
+    if (opkg_config->force_space)
+        return 0;
+
+    for (fs = plan->fs; fs; fs = fs->next) {
+        if (!fs->installed && !fs->downloaded)
+            continue;
+        needed = fs->installed + fs->downloaded;
+        needed = needed > fs->freed ? to_kbytes(needed - fs->freed) : 0;
+
+        kbs_available = get_available_kbytes(fs->dir);
+        opkg_msg(INFO, "Filesystem %s: %llukb installed, %llukb freed, "
+                 "%llukb downloaded, %lukb available.\n", fs->dir,
+                 to_kbytes(fs->installed), to_kbytes(fs->freed),
+                 to_kbytes(fs->downloaded), kbs_available);
+
+        if (needed && needed >= kbs_available) {
+            opkg_msg(ERROR, "Only have %lukb available on filesystem %s, "
+                     "the transaction needs %llu\n", kbs_available, fs->dir,
+                     needed);
+            err = -1;
+        }
+    }
+
+    return err;
+}
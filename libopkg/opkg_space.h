@@ -0,0 +1,55 @@
+/* vi: set expandtab sw=4 sts=4: */
+/* opkg_space.h - the opkg package management system
+
+   SPDX-License-Identifier: GPL-2.0-or-later
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+*/
+
+#ifndef OPKG_SPACE_H
+#define OPKG_SPACE_H
+
+#include "pkg.h"
+#include "pkg_dest.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The disk space a transaction needs, planned once it has been solved and
+ * before any of it is carried out: per filesystem, the installed sizes of
+ * the new packages, less those of the packages they upgrade or which are
+ * removed, plus the packages still to be downloaded to the cache.
+ */
+typedef struct opkg_space_plan opkg_space_plan_t;
+
+opkg_space_plan_t *opkg_space_plan_alloc(void);
+void opkg_space_plan_free(opkg_space_plan_t *plan);
+
+/* Plan the install of pkg, replacing old if that is not NULL. */
+void opkg_space_plan_install(opkg_space_plan_t *plan, pkg_t *pkg, pkg_t *old);
+void opkg_space_plan_remove(opkg_space_plan_t *plan, pkg_t *pkg);
+
+/*
+ * Reports the plan per filesystem and checks it against the space
+ * available. Returns -1 if any filesystem is short, unless force_space is
+ * set.
+ */
+int opkg_space_plan_check(opkg_space_plan_t *plan);
+
+/* The directory whose filesystem receives the packages installed to dest. */
+const char *opkg_space_dest_dir(pkg_dest_t *dest);
+
+#ifdef __cplusplus
+}
+#endif
+#endif                          /* OPKG_SPACE_H */
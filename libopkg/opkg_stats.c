@@ -0,0 +1,265 @@
+/* vi: set expandtab sw=4 sts=4: */
+/* opkg_stats.c - the opkg package management system
+
+   SPDX-License-Identifier: GPL-2.0-or-later
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "hash_table.h"
+#include "opkg_conf.h"
+#include "opkg_message.h"
+#include "opkg_stats.h"
+#include "xfuncs.h"
+
+struct script_run {
+    char *pkg_name;
+    const char *script;
+    long long ns;
+    int status;
+};
+
+struct opkg_stats opkg_stats;
+
+static struct script_run *scripts;
+static int script_count;
+
+long long opkg_stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void opkg_stats_start(void)
+{
+    opkg_stats.start_ns = opkg_stats_now();
+}
+
+void opkg_stats_add_script(const char *pkg_name, const char *script,
+                           long long ns, int status)
+{
+    struct script_run *run;
+
+    scripts = xrealloc(scripts, (script_count + 1) * sizeof(*scripts));
+    run = &scripts[script_count++];
+    run->pkg_name = xstrdup(pkg_name);
+    run->script = script;
+    run->ns = ns;
+    run->status = status;
+}
+
+/* These are also called from worker threads, so the counters are bumped
+ * atomically; nothing is ordered by them. */
+#define opkg_stats_count(counter) \
+    __atomic_fetch_add(&opkg_stats.counter, 1, __ATOMIC_RELAXED)
+
+int opkg_stat(const char *path, struct stat *st)
+{
+    opkg_stats_count(n_stat);
+    return stat(path, st);
+}
+
+int opkg_lstat(const char *path, struct stat *st)
+{
+    opkg_stats_count(n_lstat);
+    return lstat(path, st);
+}
+
+int opkg_unlink(const char *path)
+{
+    opkg_stats_count(n_unlink);
+    return unlink(path);
+}
+
+int opkg_rename(const char *from, const char *to)
+{
+    opkg_stats_count(n_rename);
+    return rename(from, to);
+}
+
+void opkg_json_write_string(FILE * fp, const char *s)
+{
+    fputc('"', fp);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+
+        if (c == '"' || c == '\\')
+            fprintf(fp, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(fp, "\\u%04x", c);
+        else
+            fputc(c, fp);
+    }
+    fputc('"', fp);
+}
+
+static void json_write_histogram(FILE * fp, const char *name,
+                                 const unsigned long *hist)
+{
+    int i, last = 0;
+
+    for (i = 0; i < HASH_HISTOGRAM_LEN; i++) {
+        if (hist[i])
+            last = i;
+    }
+    fprintf(fp, ", \"%s\": [", name);
+    for (i = 0; i <= last; i++)
+        fprintf(fp, "%s%lu", i ? ", " : "", hist[i]);
+    fprintf(fp, "]");
+}
+
+static void write_hash_table(FILE * fp, hash_table_t * hash, int first)
+{
+    struct hash_diagnostics *diag = hash->diag;
+    unsigned long hist[HASH_HISTOGRAM_LEN];
+    unsigned int i;
+
+    fprintf(fp, "%s\n    {\"name\": ", first ? "" : ",");
+    opkg_json_write_string(fp, hash->name ? hash->name : "");
+    /* max_bucket_len counts the entries chained behind the first one. */
+    fprintf(fp, ", \"buckets\": %u, \"elements\": %u, \"load_factor\": %.3f, "
+            "\"used_buckets\": %u, \"collisions\": %u, "
+            "\"max_chain_length\": %u",
+            hash->n_buckets, hash->n_elements,
+            hash->n_buckets ? (double)hash->n_elements / hash->n_buckets : 0.0,
+            hash->n_used_buckets, hash->n_collisions,
+            hash->n_elements ? hash->max_bucket_len + 1 : 0);
+    hash_table_chain_histogram(hash, hist);
+    json_write_histogram(fp, "chain_lengths", hist);
+
+    if (diag) {
+        fprintf(fp, ", \"hits\": %lu, \"misses\": %lu", diag->n_hits,
+                diag->n_misses);
+        json_write_histogram(fp, "probes", diag->probe_hist);
+        fprintf(fp, ", \"load\": [");
+        for (i = 0; i < diag->n_load_samples; i++)
+            fprintf(fp, "%s{\"elements\": %u, \"used_buckets\": %u, "
+                    "\"time_s\": %.6f}", i ? ", " : "",
+                    diag->load[i].n_elements, diag->load[i].n_used_buckets,
+                    diag->load[i].ns / 1e9);
+        fprintf(fp, "]");
+    }
+    fprintf(fp, "}");
+}
+
+static void write_stats(FILE * fp, const char *command, int exit_status)
+{
+    hash_table_t *tables[] = {
+        &opkg_config->pkg_hash,
+        &opkg_config->file_hash,
+        &opkg_config->dir_hash,
+        &opkg_config->obs_file_hash,
+    };
+    struct rusage usage;
+    unsigned int i;
+    int first = 1;
+
+    fprintf(fp, "{\n  \"opkg_version\": ");
+    opkg_json_write_string(fp, VERSION);
+    fprintf(fp, ",\n  \"command\": ");
+    opkg_json_write_string(fp, command ? command : "");
+    fprintf(fp, ",\n  \"exit_status\": %d", exit_status);
+    if (opkg_stats.start_ns)
+        fprintf(fp, ",\n  \"wall_s\": %.6f",
+                (opkg_stats_now() - opkg_stats.start_ns) / 1e9);
+
+    fprintf(fp, ",\n  \"downloads\": {\"count\": %lu, \"bytes\": %llu, "
+            "\"time_s\": %.6f, \"cache_hits\": %lu, \"cache_evictions\": %lu}",
+            opkg_stats.downloads, opkg_stats.download_bytes,
+            opkg_stats.download_ns / 1e9, opkg_stats.cache_hits,
+            opkg_stats.cache_evictions);
+    fprintf(fp, ",\n  \"packages_parsed\": %lu", opkg_stats.packages_parsed);
+    fprintf(fp, ",\n  \"list_frames_read\": %lu", opkg_stats.list_frames_read);
+
+    fprintf(fp, ",\n  \"hash_tables\": [");
+    for (i = 0; i < sizeof(tables) / sizeof(tables[0]); i++) {
+        if (tables[i]->entries == NULL)
+            continue;
+        write_hash_table(fp, tables[i], first);
+        first = 0;
+    }
+    fprintf(fp, "\n  ]");
+
+    fprintf(fp, ",\n  \"syscalls\": {\"stat\": %lu, \"lstat\": %lu, "
+            "\"unlink\": %lu, \"rename\": %lu}", opkg_stats.n_stat,
+            opkg_stats.n_lstat, opkg_stats.n_unlink, opkg_stats.n_rename);
+
+    fprintf(fp, ",\n  \"scripts\": [");
+    for (i = 0; i < (unsigned int)script_count; i++) {
+        fprintf(fp, "%s\n    {\"package\": ", i ? "," : "");
+        opkg_json_write_string(fp, scripts[i].pkg_name);
+        fprintf(fp, ", \"script\": ");
+        opkg_json_write_string(fp, scripts[i].script);
+        fprintf(fp, ", \"duration_s\": %.6f, \"status\": %d}",
+                scripts[i].ns / 1e9, scripts[i].status);
+    }
+    fprintf(fp, "%s]", script_count ? "\n  " : "");
+
+    /* ru_maxrss is in kilobytes on Linux. */
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        fprintf(fp, ",\n  \"peak_rss_kib\": %ld", usage.ru_maxrss);
+    fprintf(fp, "\n}\n");
+}
+
+int opkg_stats_write(const char *dest, const char *command, int exit_status)
+{
+    FILE *fp;
+    int i, err;
+
+    if (strncmp(dest, "fd:", 3) == 0) {
+        char *end;
+        long fd = strtol(dest + 3, &end, 10);
+        int dup_fd;
+
+        if (*end != '\0' || end == dest + 3 || fd < 0) {
+            opkg_msg(ERROR, "Invalid stats file descriptor %s.\n", dest);
+            return -1;
+        }
+        dup_fd = dup((int)fd);
+        fp = dup_fd < 0 ? NULL : fdopen(dup_fd, "w");
+        if (fp == NULL && dup_fd >= 0)
+            close(dup_fd);
+    } else {
+        fp = fopen(dest, "w");
+    }
+    if (fp == NULL) {
+        opkg_perror(ERROR, "Failed to open stats file %s", dest);
+        return -1;
+    }
+
+    write_stats(fp, command, exit_status);
+
+    err = ferror(fp);
+    if (fclose(fp) != 0 || err) {
+        opkg_perror(ERROR, "Failed to write stats file %s", dest);
+        err = -1;
+    }
+
+    for (i = 0; i < script_count; i++)
+        xfree(scripts[i].pkg_name);
+    xfree(scripts);
+    scripts = NULL;
+    script_count = 0;
+
+    return err ? -1 : 0;
+}
@@ -0,0 +1,76 @@
+/* vi: set expandtab sw=4 sts=4: */
+/* opkg_stats.h - the opkg package management system
+
+   SPDX-License-Identifier: GPL-2.0-or-later
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+*/
+
+#ifndef OPKG_STATS_H
+#define OPKG_STATS_H
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Counters for the machine-readable run statistics. They are always
+ * collected, as they are cheap, and only written out when a stats_file is
+ * configured.
+ */
+struct opkg_stats {
+    long long start_ns;
+    unsigned long downloads;
+    unsigned long long download_bytes;
+    long long download_ns;
+    unsigned long cache_hits;
+    unsigned long cache_evictions;
+    unsigned long packages_parsed;
+    unsigned long list_frames_read;
+    unsigned long n_stat;
+    unsigned long n_lstat;
+    unsigned long n_unlink;
+    unsigned long n_rename;
+};
+
+extern struct opkg_stats opkg_stats;
+
+/* Monotonic clock in nanoseconds. */
+long long opkg_stats_now(void);
+
+void opkg_stats_start(void);
+/* Records a maintainer script run; 'script' must be a string literal. */
+void opkg_stats_add_script(const char *pkg_name, const char *script,
+                           long long ns, int status);
+
+/*
+ * Writes the statistics as one JSON object to 'dest', which is a file
+ * name or "fd:<n>" for an already open file descriptor.
+ */
+int opkg_stats_write(const char *dest, const char *command, int exit_status);
+
+/* Writes 's' as a quoted and escaped JSON string. */
+void opkg_json_write_string(FILE * fp, const char *s);
+
+/* stat(), lstat(), unlink() and rename(), counted in the statistics. */
+int opkg_stat(const char *path, struct stat *st);
+int opkg_lstat(const char *path, struct stat *st);
+int opkg_unlink(const char *path);
+int opkg_rename(const char *from, const char *to);
+
+#ifdef __cplusplus
+}
+#endif
+#endif                          /* OPKG_STATS_H */
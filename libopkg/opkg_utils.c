@@ -27,7 +27,7 @@
 #include "opkg_message.h"
 #include "xfuncs.h"
 
-unsigned long get_available_kbytes(char *filesystem)
+unsigned long get_available_kbytes(const char *filesystem)
 {
     struct statvfs f;
     int r;
@@ -25,7 +25,7 @@
 extern "C" {
 #endif
 
-unsigned long get_available_kbytes(char *filesystem);
+unsigned long get_available_kbytes(const char *filesystem);
 char *trim_xstrdup(const char *line);
 int line_is_blank(const char *line);
 int str_starts_with(const char *str, const char *prefix);
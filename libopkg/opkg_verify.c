@@ -26,6 +26,7 @@
 #include "opkg_conf.h"
 #include "opkg_message.h"
 #include "opkg_verify.h"
+#include "xfuncs.h"
 
 #if WITH_GPGME
 #include "opkg_gpg.h"
@@ -54,7 +55,7 @@ int opkg_verify_md5sum(const char *file, const char *md5sum)
         return -1;
 
     r = strcmp(file_md5sum, md5sum);
-    free(file_md5sum);
+    xfree(file_md5sum);
 
     return r;
 }
@@ -73,7 +74,7 @@ int opkg_verify_sha256sum(const char *file, const char *sha256sum)
         return -1;
 
     r = strcmp(file_sha256sum, sha256sum);
-    free(file_sha256sum);
+    xfree(file_sha256sum);
 
     return r;
 #else
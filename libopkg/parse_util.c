@@ -44,7 +44,7 @@ char *parse_simple(const char *type, const char *line)
 {
     char *field = trim_xstrdup(line + strlen(type) + 1);
     if (strlen(field) == 0) {
-	    free(field);
+	    xfree(field);
 	    return NULL;
     }
     return field;
@@ -32,16 +32,23 @@
 
 #include "pkg_parse.h"
 #include "pkg_extract.h"
+#include "opkg_archive.h"
 #include "opkg_download.h"
 #include "opkg_message.h"
 #include "opkg_utils.h"
 #include "opkg_verify.h"
 
+#include "opkg_stats.h"
 #include "xfuncs.h"
 #include "sprintf_alloc.h"
 #include "file_util.h"
 #include "xsystem.h"
 #include "opkg_conf.h"
+#include "opkg_profile.h"
+
+/* Times the package state is read again when another opkg published a new
+ * one while it was being read. */
+#define PKG_STATE_RELOAD_TRIES 3
 
 typedef struct enum_map enum_map_t;
 struct enum_map {
@@ -151,22 +158,22 @@ static void compound_depend_deinit(compound_depend_t * depends)
     for (i = 0; i < depends->possibility_count; i++) {
         depend_t *d;
         d = depends->possibilities[i];
-        free(d->version);
-        free(d);
+        xfree(d->version);
+        xfree(d);
     }
-    free(depends->possibilities);
+    xfree(depends->possibilities);
 }
 
 void pkg_deinit(pkg_t * pkg)
 {
     unsigned int i;
 
-    free(pkg->name);
+    xfree(pkg->name);
     pkg->name = NULL;
 
     pkg->epoch = 0;
 
-    free(pkg->version);
+    xfree(pkg->version);
     pkg->version = NULL;
     /* revision shares storage with version, so don't free */
     pkg->revision = NULL;
@@ -178,16 +185,16 @@ void pkg_deinit(pkg_t * pkg)
     /* owned by opkg_conf_t */
     pkg->src = NULL;
 
-    free(pkg->architecture);
+    xfree(pkg->architecture);
     pkg->architecture = NULL;
 
-    free(pkg->maintainer);
+    xfree(pkg->maintainer);
     pkg->maintainer = NULL;
 
-    free(pkg->section);
+    xfree(pkg->section);
     pkg->section = NULL;
 
-    free(pkg->description);
+    xfree(pkg->description);
     pkg->description = NULL;
 
     pkg->state_want = SW_UNKNOWN;
@@ -198,7 +205,7 @@ void pkg_deinit(pkg_t * pkg)
     if (pkg->replaces) {
         for (i = 0; i < pkg->replaces_count; i++)
             compound_depend_deinit(&pkg->replaces[i]);
-        free(pkg->replaces);
+        xfree(pkg->replaces);
     }
 
     if (pkg->depends) {
@@ -207,39 +214,45 @@ void pkg_deinit(pkg_t * pkg)
 
         for (i = 0; i < count; i++)
             compound_depend_deinit(&pkg->depends[i]);
-        free(pkg->depends);
+        xfree(pkg->depends);
     }
 
     if (pkg->conflicts) {
         for (i = 0; i < pkg->conflicts_count; i++)
             compound_depend_deinit(&pkg->conflicts[i]);
-        free(pkg->conflicts);
+        xfree(pkg->conflicts);
     }
 
-    free(pkg->provides);
+    xfree(pkg->provides);
 
     pkg->pre_depends_count = 0;
     pkg->provides_count = 0;
 
-    free(pkg->filename);
+    xfree(pkg->filename);
     pkg->filename = NULL;
 
-    free(pkg->local_filename);
+    xfree(pkg->local_filename);
     pkg->local_filename = NULL;
+    ar_index_free(pkg->ar_index);
+    pkg->ar_index = NULL;
+    ar_stage_free(pkg->stage);
+    pkg->stage = NULL;
+    ar_mem_files_free(pkg->control_files);
+    pkg->control_files = NULL;
 
     /* CLEANUP: It'd be nice to pullin the cleanup function from
      * opkg_install.c here. See comment in
      * opkg_install.c:cleanup_temporary_files */
-    free(pkg->tmp_unpack_dir);
+    xfree(pkg->tmp_unpack_dir);
     pkg->tmp_unpack_dir = NULL;
 
-    free(pkg->md5sum);
+    xfree(pkg->md5sum);
     pkg->md5sum = NULL;
 
-    free(pkg->sha256sum);
+    xfree(pkg->sha256sum);
     pkg->sha256sum = NULL;
 
-    free(pkg->priority);
+    xfree(pkg->priority);
     pkg->priority = NULL;
 
     conffile_list_deinit(&pkg->conffiles);
@@ -254,65 +267,80 @@ void pkg_deinit(pkg_t * pkg)
     pkg_free_installed_files(pkg);
     pkg->essential = 0;
 
-    free(pkg->tags);
+    xfree(pkg->tags);
     pkg->tags = NULL;
 }
 
-int pkg_init_from_file(pkg_t * pkg, const char *filename)
+int pkg_read_control_file(pkg_t * pkg, const char *filename, char **control,
+                          size_t *control_len)
 {
-    int fd, err = 0;
+    int err;
     FILE *control_file;
-    char *control_path, *tmp;
-
-    pkg_init(pkg);
 
     pkg->local_filename = xstrdup(filename);
 
-    tmp = xstrdup(filename);
-    sprintf_alloc(&control_path, "%s/%s.control.XXXXXX", opkg_config->tmp_dir,
-                  basename(tmp));
-    free(tmp);
-    fd = mkstemp(control_path);
-    if (fd == -1) {
-        opkg_perror(ERROR, "Failed to make temp file %s", control_path);
-        err = -1;
-        goto err0;
-    }
-
-    control_file = fdopen(fd, "r+");
+    *control = NULL;
+    *control_len = 0;
+    control_file = open_memstream(control, control_len);
     if (control_file == NULL) {
-        opkg_perror(ERROR, "Failed to fdopen %s", control_path);
-        close(fd);
-        err = -1;
-        goto err1;
+        opkg_perror(ERROR, "Failed to open memory stream");
+        return -1;
     }
-
     err = pkg_extract_control_file_to_stream(pkg, control_file);
+    fclose(control_file);
     if (err) {
         opkg_msg(ERROR, "Failed to extract control file from %s.\n", filename);
-        goto err2;
+        xfree(*control);
+        *control = NULL;
+        return -1;
     }
 
-    rewind(control_file);
+    return 0;
+}
+
+int pkg_init_from_control(pkg_t * pkg, char *control, size_t control_len)
+{
+    int err;
+    FILE *control_file;
+
+    control_file = fmemopen(control, control_len, "r");
+    if (control_file == NULL) {
+        opkg_perror(ERROR, "Failed to read control file of %s",
+                    pkg->local_filename);
+        return -1;
+    }
 
     err = pkg_parse_from_stream(pkg, control_file, 0);
     if (err) {
         if (err == 1) {
-            opkg_msg(ERROR, "Malformed package file %s.\n", filename);
+            opkg_msg(ERROR, "Malformed package file %s.\n",
+                     pkg->local_filename);
         }
         err = -1;
     }
-
- err2:
     fclose(control_file);
- err1:
-    unlink(control_path);
- err0:
-    free(control_path);
 
     return err;
 }
 
+int pkg_init_from_file(pkg_t * pkg, const char *filename)
+{
+    int err;
+    char *control;
+    size_t control_len;
+
+    pkg_init(pkg);
+
+    /* The control file is read into memory and parsed from there. */
+    err = pkg_read_control_file(pkg, filename, &control, &control_len);
+    if (err)
+        return err;
+
+    err = pkg_init_from_control(pkg, control, control_len);
+    xfree(control);
+    return err;
+}
+
 /* Merge any new information in newpkg into oldpkg */
 int pkg_merge(pkg_t * oldpkg, pkg_t * newpkg)
 {
@@ -369,7 +397,7 @@ int pkg_merge(pkg_t * oldpkg, pkg_t * newpkg)
         oldpkg->provides_count = newpkg->provides_count;
         newpkg->provides_count = 0;
 
-        free(oldpkg->provides);
+        xfree(oldpkg->provides);
         oldpkg->provides = newpkg->provides;
         newpkg->provides = NULL;
     }
@@ -632,7 +660,7 @@ static void pkg_formatted_field(FILE * fp, pkg_t * pkg, const char *field, const
                         continue;
                     str = pkg_depend_str(pkg, i);
                     fprintf(fp, "%s %s", j == 0 ? "" : ",", str);
-                    free(str);
+                    xfree(str);
                     j++;
                 }
                 fprintf(fp, "\n");
@@ -726,7 +754,7 @@ static void pkg_formatted_field(FILE * fp, pkg_t * pkg, const char *field, const
                         continue;
                     str = pkg_depend_str(pkg, i);
                     fprintf(fp, "%s %s", j == 0 ? "" : ",", str);
-                    free(str);
+                    xfree(str);
                     j++;
                 }
                 fprintf(fp, "\n");
@@ -761,7 +789,7 @@ static void pkg_formatted_field(FILE * fp, pkg_t * pkg, const char *field, const
                         continue;
                     str = pkg_depend_str(pkg, i);
                     fprintf(fp, "%s %s", j == 0 ? "" : ",", str);
-                    free(str);
+                    xfree(str);
                     j++;
                 }
                 fprintf(fp, "\n");
@@ -793,7 +821,7 @@ static void pkg_formatted_field(FILE * fp, pkg_t * pkg, const char *field, const
             fprintf(fp, "Status: %s %s %s\n",
                     pkg_state_want_to_str(pkg->state_want), pflag,
                     pkg_state_status_to_str(pkg->state_status));
-            free(pflag);
+            xfree(pflag);
         } else if (strcasecmp(field, "Suggests") == 0) {
             if (pkg->suggests_count) {
                 fprintf(fp, "Suggests:");
@@ -802,7 +830,7 @@ static void pkg_formatted_field(FILE * fp, pkg_t * pkg, const char *field, const
                         continue;
                     str = pkg_depend_str(pkg, i);
                     fprintf(fp, "%s %s", j == 0 ? "" : ",", str);
-                    free(str);
+                    xfree(str);
                     j++;
                 }
                 fprintf(fp, "\n");
@@ -828,7 +856,7 @@ static void pkg_formatted_field(FILE * fp, pkg_t * pkg, const char *field, const
             if (version == NULL)
                 return;
             fprintf(fp, "Version: %s\n", version);
-            free(version);
+            xfree(version);
         } else {
             goto UNKNOWN_FMT_FIELD;
         }
@@ -1062,11 +1090,10 @@ int pkg_compare_versions(const pkg_t * pkg, const pkg_t * ref_pkg)
     return r;
 }
 
-int pkg_version_satisfied(pkg_t * it, pkg_t * ref, const char *op)
+/* Returns 1 if the comparison result r satisfies op, 0 if it doesn't and -1
+ * if op isn't a version operator. */
+static int constraint_satisfied(int r, const char *op)
 {
-    int r;
-
-    r = pkg_compare_versions(it, ref);
     enum version_constraint constraint = str_to_constraint(&op);
 
     switch (constraint) {
@@ -1083,7 +1110,120 @@ int pkg_version_satisfied(pkg_t * it, pkg_t * ref, const char *op)
     case NONE:
         opkg_msg(ERROR, "Unknown operator: %s.\n", op);
     }
-    return 0;
+    return -1;
+}
+
+int pkg_version_satisfied(pkg_t * it, pkg_t * ref, const char *op)
+{
+    int r;
+
+    r = pkg_compare_versions(it, ref);
+    return constraint_satisfied(r, op) == 1;
+}
+
+void pkg_version_deinit(pkg_version_t * v)
+{
+    xfree(v->version);
+    v->version = NULL;
+    v->revision = NULL;
+}
+
+int pkg_version_compare(const pkg_version_t * a, const pkg_version_t * b)
+{
+    int r;
+
+    if (a->epoch != b->epoch)
+        return a->epoch < b->epoch ? -1 : 1;
+
+    r = verrevcmp(a->version, b->version);
+    if (r)
+        return r;
+
+    return verrevcmp(a->revision, b->revision);
+}
+
+int pkg_version_compare_op(const pkg_version_t * a, const char *op,
+                           const pkg_version_t * b)
+{
+    return constraint_satisfied(pkg_version_compare(a, b), op);
+}
+
+/*
+ * Compares a[i] with b[i] for each i < n, storing a negative, zero or
+ * positive value in results[i]. Each distinct string pointer is only parsed
+ * once, so comparing many versions against one reference is cheap.
+ */
+void pkg_versions_compare(const char *const *a, const char *const *b,
+                          int *results, size_t n)
+{
+    pkg_version_t va = { 0 }, vb = { 0 };
+    const char *last_a = NULL, *last_b = NULL;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if (a[i] != last_a) {
+            pkg_version_deinit(&va);
+            pkg_version_parse(&va, a[i]);
+            last_a = a[i];
+        }
+        if (b[i] != last_b) {
+            pkg_version_deinit(&vb);
+            pkg_version_parse(&vb, b[i]);
+            last_b = b[i];
+        }
+        results[i] = pkg_version_compare(&va, &vb);
+    }
+
+    pkg_version_deinit(&va);
+    pkg_version_deinit(&vb);
+}
+
+struct sort_version {
+    pkg_version_t v;
+    const char *str;
+    size_t index;
+};
+
+static int sort_version_compare(const void *p1, const void *p2)
+{
+    const struct sort_version *a = p1;
+    const struct sort_version *b = p2;
+    int r;
+
+    r = pkg_version_compare(&a->v, &b->v);
+    if (r)
+        return r;
+
+    /* Keep equal versions in their original order. */
+    return a->index < b->index ? -1 : a->index > b->index;
+}
+
+/*
+ * Sorts an array of version strings from oldest to newest. Every string is
+ * parsed once up front rather than on each comparison.
+ */
+void pkg_versions_sort(const char **versions, size_t n)
+{
+    struct sort_version *sv;
+    size_t i;
+
+    if (n < 2)
+        return;
+
+    sv = xcalloc(n, sizeof(*sv));
+    for (i = 0; i < n; i++) {
+        pkg_version_parse(&sv[i].v, versions[i]);
+        sv[i].str = versions[i];
+        sv[i].index = i;
+    }
+
+    qsort(sv, n, sizeof(*sv), sort_version_compare);
+
+    for (i = 0; i < n; i++) {
+        versions[i] = sv[i].str;
+        pkg_version_deinit(&sv[i].v);
+    }
+    xfree(sv);
 }
 
 int pkg_name_version_and_architecture_compare(const void *p1, const void *p2)
@@ -1154,9 +1294,11 @@ char *pkg_version_str_alloc(pkg_t * pkg)
  */
 file_list_t *pkg_get_installed_files(pkg_t * pkg)
 {
-    int err, fd;
+    int err;
     char *list_file_name = NULL;
     FILE *list_file = NULL;
+    char *list_buf = NULL;
+    size_t list_len = 0;
     char *line;
     char *installed_file_name;
     int list_from_package;
@@ -1179,53 +1321,51 @@ file_list_t *pkg_get_installed_files(pkg_t * pkg)
         list_from_package = 0;
 
     if (list_from_package) {
-        if (pkg->local_filename == NULL) {
+        if (pkg->local_filename == NULL && pkg->stage == NULL) {
             return pkg->installed_files;
         }
-        /* XXX: CLEANUP: Maybe rewrite this to avoid using a temporary
-         * file. In other words, change deb_extract so that it can
-         * simply return the file list as a char *[] rather than
-         * insisting on writing it to a FILE * as it does now. */
-        sprintf_alloc(&list_file_name, "%s/%s.list.XXXXXX",
-                      opkg_config->tmp_dir, pkg->name);
-        fd = mkstemp(list_file_name);
-        if (fd == -1) {
-            opkg_perror(ERROR, "Failed to make temp file %s.", list_file_name);
-            free(list_file_name);
-            return pkg->installed_files;
-        }
-        list_file = fdopen(fd, "r+");
+        /* The file list is read into memory and parsed from there. */
+        list_file = open_memstream(&list_buf, &list_len);
         if (list_file == NULL) {
-            opkg_perror(ERROR, "Failed to fdopen temp file %s.",
-                        list_file_name);
-            close(fd);
-            unlink(list_file_name);
-            free(list_file_name);
+            opkg_perror(ERROR, "Failed to open memory stream");
             return pkg->installed_files;
         }
         err = pkg_extract_data_file_names_to_stream(pkg, list_file);
+        fclose(list_file);
         if (err) {
             opkg_msg(ERROR, "Error extracting file list from %s.\n",
                      pkg->local_filename);
-            fclose(list_file);
-            unlink(list_file_name);
-            free(list_file_name);
+            xfree(list_buf);
             file_list_deinit(pkg->installed_files);
             pkg->installed_files = NULL;
             return NULL;
         }
-        rewind(list_file);
+        if (list_len == 0) {
+            xfree(list_buf);
+            return pkg->installed_files;
+        }
+        list_file = fmemopen(list_buf, list_len, "r");
+        if (list_file == NULL) {
+            opkg_perror(ERROR, "Failed to read file list of %s",
+                        pkg->local_filename);
+            xfree(list_buf);
+            return pkg->installed_files;
+        }
     } else {
+        const char *staged;
+
         sprintf_alloc(&list_file_name, "%s/%s.list", pkg->dest->info_dir,
                       pkg->name);
-        list_file = fopen(list_file_name, "r");
+        /* Written earlier in this transaction but not published yet. */
+        staged = opkg_state_staged(list_file_name);
+        list_file = fopen(staged ? staged : list_file_name, "r");
         if (list_file == NULL) {
             if (pkg->state_status != SS_HALF_INSTALLED)
                 opkg_perror(ERROR, "Failed to open %s", list_file_name);
-            free(list_file_name);
+            xfree(list_file_name);
             return pkg->installed_files;
         }
-        free(list_file_name);
+        xfree(list_file_name);
     }
 
     while (1) {
@@ -1286,17 +1426,13 @@ file_list_t *pkg_get_installed_files(pkg_t * pkg)
                 link_target = readlink_buf = file_readlink_alloc(installed_file_name);
         }
         file_list_append(pkg->installed_files, installed_file_name, mode, link_target);
-        free(installed_file_name);
-        free(readlink_buf);
-        free(line);
+        xfree(installed_file_name);
+        xfree(readlink_buf);
+        xfree(line);
     }
 
     fclose(list_file);
-
-    if (list_from_package) {
-        unlink(list_file_name);
-        free(list_file_name);
-    }
+    xfree(list_buf);
 
     return pkg->installed_files;
 }
@@ -1327,10 +1463,11 @@ void pkg_remove_installed_files_list(pkg_t * pkg)
     sprintf_alloc(&list_file_name, "%s/%s.list", pkg->dest->info_dir,
                   pkg->name);
 
+    /* Removed with the status entry which still refers to it. */
     if (!opkg_config->noaction)
-        (void)unlink(list_file_name);
+        opkg_state_stage(NULL, list_file_name);
 
-    free(list_file_name);
+    xfree(list_file_name);
 }
 
 conffile_t *pkg_get_conffile(pkg_t * pkg, const char *file_name)
@@ -1380,6 +1517,11 @@ int pkg_run_script(pkg_t * pkg, const char *script, const char *args)
         sprintf_alloc(&path, "%s/%s.%s", pkg->dest->info_dir, pkg->name,
                       script);
     } else {
+        /* Control files read into memory only leave a directory for the
+         * maintainer scripts, if there are any. */
+        if (pkg->tmp_unpack_dir == NULL && pkg->control_files) {
+            return 0;
+        }
         if (pkg->tmp_unpack_dir == NULL) {
             opkg_msg(ERROR, "Internal error: %s has a NULL tmp_unpack_dir.\n",
                      pkg->name);
@@ -1395,17 +1537,22 @@ int pkg_run_script(pkg_t * pkg, const char *script, const char *args)
            1);
 
     if (!file_exists(path)) {
-        free(path);
+        xfree(path);
         return 0;
     }
 
     sprintf_alloc(&cmd, "%s %s", path, args);
-    free(path);
     {
         const char *argv[] = { "/bin/sh", "-c", cmd, NULL };
+        int span = opkg_profile_begin("maintainer script", path);
+        long long start = opkg_stats_now();
         err = xsystem(argv);
+        opkg_stats_add_script(pkg->name, script, opkg_stats_now() - start,
+                              err);
+        opkg_profile_end(span);
     }
-    free(cmd);
+    xfree(path);
+    xfree(cmd);
 
     if (err) {
         if (!opkg_config->offline_root)
@@ -1441,10 +1588,46 @@ int pkg_arch_supported(pkg_t * pkg)
 void pkg_info_preinstall_check(void)
 {
     unsigned int i;
-    pkg_vec_t *installed_pkgs = pkg_vec_alloc();
+    pkg_vec_t *installed_pkgs;
+    unsigned long loaded;
+    int span, tries;
+
+    /* Once loaded, install and remove keep the file owner data up to date
+     * themselves. Loading it a second time would count every directory
+     * twice in the dir_hash. */
+    if (opkg_config->file_hash_loaded)
+        return;
+
+    /*
+     * The .list files must be those of the status files which were read.
+     * Hold off publishes while they are read, and if another opkg has
+     * published since the status files were read, read everything again.
+     * This runs before anything holds on to a package.
+     */
+    for (tries = 0;; tries++) {
+        loaded = opkg_config->state_generation;
+        opkg_state_read_lock();
+        if (opkg_config->state_generation == loaded)
+            break;
+        if (tries == PKG_STATE_RELOAD_TRIES) {
+            opkg_msg(NOTICE, "Package state keeps changing, file lists may "
+                     "be newer than the status.\n");
+            break;
+        }
+        opkg_state_read_unlock();
+        opkg_msg(INFO, "Package state changed while it was being read, "
+                 "reloading it.\n");
+        if (pkg_hash_reload() != 0) {
+            opkg_msg(ERROR, "Failed to reload package state.\n");
+            break;
+        }
+    }
+    opkg_config->file_hash_loaded = 1;
 
     /* update the file owner data structure */
     opkg_msg(INFO, "Updating file owner list.\n");
+    span = opkg_profile_begin("preinstall check", NULL);
+    installed_pkgs = pkg_vec_alloc();
     pkg_hash_fetch_all_installed(installed_pkgs, INSTALLED);
     for (i = 0; i < installed_pkgs->len; i++) {
         pkg_t *pkg = installed_pkgs->pkgs[i];
@@ -1454,7 +1637,7 @@ void pkg_info_preinstall_check(void)
             opkg_msg(ERROR,
                      "Failed to determine installed " "files for pkg %s.\n",
                      pkg->name);
-            break;
+            continue;
         }
         for (iter = file_list_first(installed_files), niter = file_list_next(installed_files, iter);
                 iter;
@@ -1475,6 +1658,9 @@ void pkg_info_preinstall_check(void)
         pkg_free_installed_files(pkg);
     }
     pkg_vec_free(installed_pkgs);
+    opkg_state_read_unlock();
+    opkg_profile_end(span);
+    opkg_mem_report("preinstall check");
 }
 
 struct pkg_write_filelist_data {
@@ -1522,40 +1708,58 @@ static void pkg_write_filelist_helper(const char *key, void *entry_,
         else
             fprintf(data->stream, "%s\n", entry);
 
-        free(entry);
-        free(link_target);
-        free(installed_file_name);
+        xfree(entry);
+        xfree(link_target);
+        xfree(installed_file_name);
     }
 }
 
+/*
+ * Write the .list file of pkg next to the old one. It replaces the old one
+ * at the next opkg_state_publish().
+ */
 int pkg_write_filelist(pkg_t * pkg)
 {
     struct pkg_write_filelist_data data;
-    char *list_file_name;
+    char *list_file_name, *tmp_name;
 
     sprintf_alloc(&list_file_name, "%s/%s.list", pkg->dest->info_dir,
                   pkg->name);
+    sprintf_alloc(&tmp_name, "%s.new", list_file_name);
 
     opkg_msg(INFO, "Creating %s file for pkg %s.\n", list_file_name, pkg->name);
 
-    data.stream = fopen(list_file_name, "w");
+    data.stream = fopen(tmp_name, "w");
     if (!data.stream) {
-        opkg_perror(ERROR, "Failed to open %s", list_file_name);
-        free(list_file_name);
+        opkg_perror(ERROR, "Failed to open %s", tmp_name);
+        xfree(tmp_name);
+        xfree(list_file_name);
         return -1;
     }
 
     data.pkg = pkg;
     hash_table_foreach(&opkg_config->file_hash, pkg_write_filelist_helper,
                        &data);
-    fclose(data.stream);
-    free(list_file_name);
+    if (fclose(data.stream) == EOF) {
+        opkg_perror(ERROR, "Failed to write %s", tmp_name);
+        opkg_unlink(tmp_name);
+        xfree(tmp_name);
+        xfree(list_file_name);
+        return -1;
+    }
+    opkg_state_stage(tmp_name, list_file_name);
+    xfree(tmp_name);
+    xfree(list_file_name);
 
     pkg->state_flag &= ~SF_FILELIST_CHANGED;
 
     return 0;
 }
 
+/*
+ * The lists are published by the opkg_conf_write_status_files() which
+ * must follow, together with the status files.
+ */
 int pkg_write_changed_filelists(void)
 {
     pkg_vec_t *installed_pkgs = pkg_vec_alloc();
@@ -1587,8 +1791,9 @@ int pkg_verify(pkg_t * pkg)
     int err;
     struct stat pkg_stat;
     char *local_sig_filename = NULL;
+    int span = -1;
 
-    err = stat(pkg->local_filename, &pkg_stat);
+    err = opkg_stat(pkg->local_filename, &pkg_stat);
     if (err) {
         if (errno == ENOENT) {
             /* Exit with soft error 1 if the package doesn't exist.
@@ -1608,6 +1813,8 @@ int pkg_verify(pkg_t * pkg)
         }
     }
 
+    span = opkg_profile_begin("verify", pkg->name);
+
     /* Check size to mitigate hash collisions. */
     if (pkg_stat.st_size < 1 || pkg_stat.st_size != pkg->size) {
         err = -1;
@@ -1631,6 +1838,7 @@ int pkg_verify(pkg_t * pkg)
     } else if (!opkg_config->force_checksum) {
          opkg_msg(ERROR, "Checksum is either missing or unsupported on opkg. To bypass verification "
                   "use --force-checksum. Aborting \n");
+         opkg_profile_end(span);
          return -1;
     }
 
@@ -1648,16 +1856,18 @@ int pkg_verify(pkg_t * pkg)
 	opkg_msg(DEBUG, "Signature verification passed for %s.\n", pkg->local_filename);
     }
 
-    free(local_sig_filename);
+    xfree(local_sig_filename);
+    opkg_profile_end(span);
     return 0;
 
  fail:
-    free(local_sig_filename);
+    xfree(local_sig_filename);
+    opkg_profile_end(span);
     if (!opkg_config->force_checksum)
     {
 	opkg_msg(NOTICE, "Removing corrupt package file %s.\n",
              pkg->local_filename);
-	unlink(pkg->local_filename);
+	opkg_unlink(pkg->local_filename);
         if (opkg_config->check_pkg_signature) {
             pkg_remove_signature(pkg);
         }
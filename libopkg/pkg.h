@@ -101,6 +101,15 @@ struct abstract_pkg {
     abstract_pkg_vec_t *replaced_by;
 };
 
+/* A "[epoch:]version[-revision]" string split into its parts. Comparing
+   these avoids setting up a whole pkg_t per version. */
+struct pkg_version {
+    unsigned long epoch;
+    char *version;          /* owns the storage */
+    char *revision;         /* points into version, or NULL */
+};
+typedef struct pkg_version pkg_version_t;
+
 /* XXX: CLEANUP: I'd like to clean up pkg_t in several ways:
 
    The 3 version fields should go into a single version struct. (This
@@ -121,6 +130,10 @@ struct abstract_pkg {
    storage and use less memory. We might even do reference counting,
    but probably not since most often we only create new pkg_t structs,
    we don't often free them.  */
+struct ar_index;
+struct ar_mem_files;
+struct ar_stage;
+
 struct pkg {
     char *name;
     unsigned long epoch;
@@ -166,6 +179,14 @@ struct pkg {
 
     char *filename;
     char *local_filename;
+    /* Member offsets within local_filename, built on first access. */
+    struct ar_index *ar_index;
+    /* Files streamed from the network and not yet in place, see
+     * opkg_download_pkg_stream(). */
+    struct ar_stage *stage;
+    /* Control files read into memory for the install, see
+     * pkg_extract_control_files_to_memory(). */
+    struct ar_mem_files *control_files;
     char *tmp_unpack_dir;
     char *md5sum;
     char *sha256sum;
@@ -198,6 +219,18 @@ struct pkg {
 pkg_t *pkg_new(void);
 void pkg_deinit(pkg_t * pkg);
 int pkg_init_from_file(pkg_t * pkg, const char *filename);
+
+/*
+ * pkg_init_from_file() in two steps. The control file of filename is read
+ * into a buffer which the caller frees. Besides pkg, reading only reaches
+ * stat(), whose count is kept atomically, and opkg_msg(), which writes
+ * through stdio or the opkg_vmessage callback. Several package files can
+ * so be read at once on separate threads. Parsing into pkg must happen on
+ * one thread at a time.
+ */
+int pkg_read_control_file(pkg_t * pkg, const char *filename, char **control,
+                          size_t *control_len);
+int pkg_init_from_control(pkg_t * pkg, char *control, size_t control_len);
 abstract_pkg_t *abstract_pkg_new(void);
 
 /*
@@ -231,6 +264,14 @@ pkg_state_status_t pkg_state_status_from_str(const char *str);
 
 int pkg_version_satisfied(pkg_t * it, pkg_t * ref, const char *op);
 
+void pkg_version_deinit(pkg_version_t * v);
+int pkg_version_compare(const pkg_version_t * a, const pkg_version_t * b);
+int pkg_version_compare_op(const pkg_version_t * a, const char *op,
+                           const pkg_version_t * b);
+void pkg_versions_compare(const char *const *a, const char *const *b,
+                          int *results, size_t n);
+void pkg_versions_sort(const char **versions, size_t n);
+
 int pkg_arch_supported(pkg_t * pkg);
 void pkg_info_preinstall_check(void);
 
@@ -18,6 +18,8 @@
    General Public License for more details.
 */
 
+#include "config.h"
+
 #include <stdio.h>
 #include <ctype.h>
 #include <stdlib.h>
@@ -50,7 +52,7 @@ int version_constraints_satisfied(depend_t * depends, pkg_t * pkg)
     comparison = pkg_compare_versions(pkg, temp);
 
     pkg_deinit(temp);
-    free(temp);
+    xfree(temp);
 
     if ((depends->constraint == EARLIER) && (comparison < 0))
         return 1;
@@ -262,14 +264,14 @@ void buildProvides(abstract_pkg_t * ab_pkg, pkg_t * pkg)
     for (i = 1; i < pkg->provides_count; i++) {
         char* provides = trim_xstrdup(pkg->provides_str[i-1]);
         abstract_pkg_t *provided_abpkg = ensure_abstract_pkg_by_name(provides);
-        free(pkg->provides_str[i - 1]);
-        free(provides);
+        xfree(pkg->provides_str[i - 1]);
+        xfree(provides);
 
         pkg->provides[i] = provided_abpkg;
 
         abstract_pkg_vec_insert(provided_abpkg->provided_by, ab_pkg);
     }
-    free(pkg->provides_str);
+    xfree(pkg->provides_str);
 }
 
 void buildConflicts(pkg_t * pkg)
@@ -285,10 +287,10 @@ void buildConflicts(pkg_t * pkg)
     for (i = 0; i < pkg->conflicts_count; i++) {
         parseDepends(conflicts, pkg->conflicts_str[i]);
         conflicts->type = CONFLICTS;
-        free(pkg->conflicts_str[i]);
+        xfree(pkg->conflicts_str[i]);
         conflicts++;
     }
-    free(pkg->conflicts_str);
+    xfree(pkg->conflicts_str);
 }
 
 void buildReplaces(abstract_pkg_t * ab_pkg, pkg_t * pkg)
@@ -305,7 +307,7 @@ void buildReplaces(abstract_pkg_t * ab_pkg, pkg_t * pkg)
     for (i = 0; i < pkg->replaces_count; i++) {
         parseDepends(replaces, pkg->replaces_str[i]);
         replaces->type = REPLACES;
-        free(pkg->replaces_str[i]);
+        xfree(pkg->replaces_str[i]);
 
         /* Replaces field doesn't support or'ed conditions */
         abstract_pkg_t *old_abpkg = replaces->possibilities[0]->pkg;
@@ -321,7 +323,7 @@ void buildReplaces(abstract_pkg_t * ab_pkg, pkg_t * pkg)
         }
         replaces++;
     }
-    free(pkg->replaces_str);
+    xfree(pkg->replaces_str);
 }
 
 void buildDepends(pkg_t * pkg)
@@ -339,34 +341,34 @@ void buildDepends(pkg_t * pkg)
 
     for (i = 0; i < pkg->pre_depends_count; i++) {
         parseDepends(depends, pkg->pre_depends_str[i]);
-        free(pkg->pre_depends_str[i]);
+        xfree(pkg->pre_depends_str[i]);
         depends->type = PREDEPEND;
         depends++;
     }
-    free(pkg->pre_depends_str);
+    xfree(pkg->pre_depends_str);
 
     for (i = 0; i < pkg->depends_count; i++) {
         parseDepends(depends, pkg->depends_str[i]);
-        free(pkg->depends_str[i]);
+        xfree(pkg->depends_str[i]);
         depends++;
     }
-    free(pkg->depends_str);
+    xfree(pkg->depends_str);
 
     for (i = 0; i < pkg->recommends_count; i++) {
         parseDepends(depends, pkg->recommends_str[i]);
-        free(pkg->recommends_str[i]);
+        xfree(pkg->recommends_str[i]);
         depends->type = RECOMMEND;
         depends++;
     }
-    free(pkg->recommends_str);
+    xfree(pkg->recommends_str);
 
     for (i = 0; i < pkg->suggests_count; i++) {
         parseDepends(depends, pkg->suggests_str[i]);
-        free(pkg->suggests_str[i]);
+        xfree(pkg->suggests_str[i]);
         depends->type = SUGGEST;
         depends++;
     }
-    free(pkg->suggests_str);
+    xfree(pkg->suggests_str);
 }
 
 const char *constraint_to_str(version_constraint_t c)
@@ -453,7 +455,7 @@ void strip_pkg_name_and_version(const char *pkg_name, char **name, char **versio
 
 /*
  * Returns a printable string for pkg's dependency at the specified idx. The
- * resultant string must be passed to free() by the caller.
+ * resultant string must be passed to xfree() by the caller.
  */
 char *pkg_depend_str(pkg_t * pkg, int idx)
 {
@@ -600,7 +602,7 @@ static int parseDepends(compound_depend_t * compound_depend,
         /* hook up the dependency to its abstract pkg */
         possibilities[i]->pkg = ensure_abstract_pkg_by_name(pkg_name);
 
-        free(pkg_name);
+        xfree(pkg_name);
 
         /* now get past the ) and any possible | chars */
         while (*src && (isspace(*src) || (*src == ')') || (*src == '|')))
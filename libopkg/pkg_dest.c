@@ -56,7 +56,7 @@ int pkg_dest_init(pkg_dest_t * dest, const char *name, const char *root_dir)
      */
     status_file_dir = xdirname(dest->status_file_name);
     file_mkdir_hier(status_file_dir, 0755);
-    free(status_file_dir);
+    xfree(status_file_dir);
 
     if (opkg_config->image_status_file) {
         sprintf_alloc(&dest->image_status_file_name, "%s%s", dest->root_dir,
@@ -70,18 +70,18 @@ int pkg_dest_init(pkg_dest_t * dest, const char *name, const char *root_dir)
 
 void pkg_dest_deinit(pkg_dest_t * dest)
 {
-    free(dest->name);
+    xfree(dest->name);
     dest->name = NULL;
 
-    free(dest->root_dir);
+    xfree(dest->root_dir);
     dest->root_dir = NULL;
 
-    free(dest->info_dir);
+    xfree(dest->info_dir);
     dest->info_dir = NULL;
 
-    free(dest->status_file_name);
+    xfree(dest->status_file_name);
     dest->status_file_name = NULL;
 
-    free(dest->image_status_file_name);
+    xfree(dest->image_status_file_name);
     dest->image_status_file_name = NULL;
 }
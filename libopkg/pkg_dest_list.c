@@ -53,7 +53,7 @@ void pkg_dest_list_deinit(pkg_dest_list_t * list)
         pkg_dest_deinit(pkg_dest);
 
         /* malloced in pkg_dest_list_append */
-        free(pkg_dest);
+        xfree(pkg_dest);
         iter->data = NULL;
     }
     void_list_deinit((void_list_t *) list);
@@ -20,20 +20,40 @@
 
 #include "config.h"
 
+#include <dirent.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "file_util.h"
 #include "opkg_message.h"
 #include "opkg_archive.h"
 #include "pkg_extract.h"
 #include "sprintf_alloc.h"
+#include "xfuncs.h"
+
+/* The member index of the package file, kept on pkg until the file changes,
+ * so that each access opens its member directly. NULL for packages which
+ * are not in ar format. */
+static struct ar_index *pkg_ar_index(pkg_t * pkg)
+{
+    if (pkg->ar_index && !ar_index_stale(pkg->ar_index, pkg->local_filename))
+        return pkg->ar_index;
+
+    ar_index_free(pkg->ar_index);
+    pkg->ar_index = ar_index_open(pkg->local_filename);
+    return pkg->ar_index;
+}
 
 int pkg_extract_control_file_to_stream(pkg_t * pkg, FILE * stream)
 {
     int r;
     struct opkg_ar *ar;
 
-    ar = ar_open_pkg_control_archive(pkg->local_filename);
+    ar = ar_open_pkg_control_archive(pkg->local_filename,
+                                     pkg_ar_index(pkg));
     if (!ar) {
         opkg_msg(ERROR, "Failed to extract control.tar.* from package '%s'.\n",
                  pkg->local_filename);
@@ -49,16 +69,103 @@ int pkg_extract_control_file_to_stream(pkg_t * pkg, FILE * stream)
     return r;
 }
 
+struct ar_mem_files *pkg_extract_control_files_to_memory(pkg_t * pkg)
+{
+    struct ar_mem_files *files;
+    struct opkg_ar *ar;
+
+    ar = ar_open_pkg_control_archive(pkg->local_filename,
+                                     pkg_ar_index(pkg));
+    if (!ar) {
+        opkg_msg(ERROR, "Failed to extract control.tar.* from package '%s'.\n",
+                 pkg->local_filename);
+        return NULL;
+    }
+
+    files = ar_extract_all_to_memory(ar);
+    if (!files)
+        opkg_msg(ERROR, "Failed to read control files from package '%s'.\n",
+                 pkg->local_filename);
+
+    ar_close(ar);
+    return files;
+}
+
+/* Write control files read into memory by
+ * pkg_extract_control_files_to_memory(). */
+static int write_control_files(const struct ar_mem_files *files,
+                               const char *dir_with_prefix)
+{
+    size_t i;
+    char *path;
+    int fd, r = 0;
+
+    for (i = 0; r == 0 && i < files->count; i++) {
+        const struct ar_mem_file *m = &files->files[i];
+
+        sprintf_alloc(&path, "%s%s", dir_with_prefix, m->name);
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0
+            || write(fd, m->data, m->len) != (ssize_t)m->len
+            || fchmod(fd, m->mode) != 0) {
+            opkg_perror(ERROR, "Failed to write '%s'", path);
+            r = -1;
+        }
+        if (fd >= 0)
+            close(fd);
+        xfree(path);
+    }
+    return r;
+}
+
+/* A streamed package has no file to extract from; its control files were
+ * extracted to tmp_unpack_dir as it was read. */
+static int copy_unpacked_control_files(pkg_t * pkg, const char *dir_with_prefix)
+{
+    DIR *d;
+    struct dirent *dent;
+    struct stat st;
+    char *src, *dest;
+    int r = 0;
+
+    d = opendir(pkg->tmp_unpack_dir);
+    if (!d) {
+        opkg_perror(ERROR, "Failed to open dir %s", pkg->tmp_unpack_dir);
+        return -1;
+    }
+    while (r == 0 && (dent = readdir(d)) != NULL) {
+        sprintf_alloc(&src, "%s/%s", pkg->tmp_unpack_dir, dent->d_name);
+        if (stat(src, &st) == 0 && S_ISREG(st.st_mode)) {
+            sprintf_alloc(&dest, "%s%s", dir_with_prefix, dent->d_name);
+            r = file_copy(src, dest);
+            xfree(dest);
+        }
+        xfree(src);
+    }
+    closedir(d);
+    return r;
+}
+
 int pkg_extract_control_files_to_dir_with_prefix(pkg_t * pkg, const char *dir,
                                                  const char *prefix)
 {
     int r = -1;
     char *dir_with_prefix;
-    struct opkg_ar *ar;
+    struct opkg_ar *ar = NULL;
 
     sprintf_alloc(&dir_with_prefix, "%s/%s", dir, prefix);
 
-    ar = ar_open_pkg_control_archive(pkg->local_filename);
+    if (pkg->stage && pkg->tmp_unpack_dir) {
+        r = copy_unpacked_control_files(pkg, dir_with_prefix);
+        goto cleanup;
+    }
+    if (pkg->control_files) {
+        r = write_control_files(pkg->control_files, dir_with_prefix);
+        goto cleanup;
+    }
+
+    ar = ar_open_pkg_control_archive(pkg->local_filename,
+                                     pkg_ar_index(pkg));
     if (!ar) {
         opkg_msg(ERROR, "Failed to extract control.tar.* from package '%s'.\n",
                  pkg->local_filename);
@@ -72,7 +179,7 @@ int pkg_extract_control_files_to_dir_with_prefix(pkg_t * pkg, const char *dir,
                  pkg->local_filename);
 
  cleanup:
-    free(dir_with_prefix);
+    xfree(dir_with_prefix);
     if (ar)
         ar_close(ar);
     return r;
@@ -88,7 +195,15 @@ int pkg_extract_data_files_to_dir(pkg_t * pkg, const char *dir)
     int r;
     struct opkg_ar *ar;
 
-    ar = ar_open_pkg_data_archive(pkg->local_filename);
+    /* A streamed package was staged under dir as it was read. */
+    if (pkg->stage) {
+        r = ar_stage_commit(pkg->stage, &pkg->installed_size);
+        ar_stage_free(pkg->stage);
+        pkg->stage = NULL;
+        return r;
+    }
+
+    ar = ar_open_pkg_data_archive(pkg->local_filename, pkg_ar_index(pkg));
     if (!ar) {
         opkg_msg(ERROR, "Failed to extract data.tar.* from package '%s'.\n",
                  pkg->local_filename);
@@ -109,7 +224,10 @@ int pkg_extract_data_file_names_to_stream(pkg_t * pkg, FILE * stream)
     int r;
     struct opkg_ar *ar;
 
-    ar = ar_open_pkg_data_archive(pkg->local_filename);
+    if (pkg->stage)
+        return ar_stage_paths_to_stream(pkg->stage, stream);
+
+    ar = ar_open_pkg_data_archive(pkg->local_filename, pkg_ar_index(pkg));
     if (!ar) {
         opkg_msg(ERROR, "Failed to extract data.tar.* from package '%s'.\n",
                  pkg->local_filename);
@@ -27,7 +27,11 @@
 extern "C" {
 #endif
 
+struct ar_mem_files;
+
 int pkg_extract_control_file_to_stream(pkg_t * pkg, FILE * stream);
+/* Read all control files into memory, for pkg->control_files. */
+struct ar_mem_files *pkg_extract_control_files_to_memory(pkg_t * pkg);
 int pkg_extract_control_files_to_dir(pkg_t * pkg, const char *dir);
 int pkg_extract_control_files_to_dir_with_prefix(pkg_t * pkg,
                                                  const char *dir,
@@ -22,9 +22,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fnmatch.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
 
 #include "hash_table.h"
+#include "list_index.h"
 #include "release.h"
 #include "pkg.h"
 #include "opkg_message.h"
@@ -36,6 +41,8 @@
 #include "opkg_utils.h"
 #include "sprintf_alloc.h"
 #include "file_util.h"
+#include "opkg_profile.h"
+#include "opkg_stats.h"
 #include "xfuncs.h"
 
 static void free_pkgs(const char *key, void *entry, void *data)
@@ -52,7 +59,7 @@ static void free_pkgs(const char *key, void *entry, void *data)
     if (ab_pkg->pkgs) {
         for (i = 0; i < ab_pkg->pkgs->len; i++) {
             pkg_deinit(ab_pkg->pkgs->pkgs[i]);
-            free(ab_pkg->pkgs->pkgs[i]);
+            xfree(ab_pkg->pkgs->pkgs[i]);
         }
     }
 
@@ -60,50 +67,171 @@ static void free_pkgs(const char *key, void *entry, void *data)
     abstract_pkg_vec_free(ab_pkg->provided_by);
     abstract_pkg_vec_free(ab_pkg->replaced_by);
     pkg_vec_free(ab_pkg->pkgs);
-    free(ab_pkg->name);
-    free(ab_pkg);
+    xfree(ab_pkg->name);
+    xfree(ab_pkg);
 }
 
-static int pkg_hash_add_from_file(const char *file_name, pkg_src_t * src,
-                           pkg_dest_t * dest, int is_status_file, pkg_source_t source)
+/*
+ * Stamps of the list and status files, taken by pkg_hash_stamp_files() so
+ * that pkg_hash_refresh() can re-read just the feeds which changed.
+ */
+struct loaded_file {
+    file_stamp_t stamp;
+    pkg_src_t *src;             /* NULL for a status file */
+};
+static struct loaded_file *loaded_files;
+static unsigned int n_loaded_files;
+
+/* Set once a feed package has replaced the same package from another feed.
+ * Re-reading one of the two feeds could not bring the other one back. */
+static int feeds_overlap;
+
+/* The feeds last loaded, for pkg_hash_reload(): none, all of them, or the
+ * packages with the given names. */
+static enum { FEEDS_NONE, FEEDS_ALL, FEEDS_NAMES } feeds_loaded;
+static const char *const *feed_names;
+static int n_feed_names;
+
+/* The feed being re-read by pkg_hash_refresh(), if any, and whether it
+ * found something which only a full load can handle. */
+static pkg_src_t *refresh_src;
+static int refresh_incomplete;
+/* Installed packages which the refresh took out of their feed, marked with
+ * SF_MARKED until the feed lists them again. */
+static pkg_vec_t *refresh_detached;
+
+static void pkg_hash_unstamp_files(void)
 {
-    pkg_t *pkg;
-    FILE *fp = NULL;
-    char *buf = NULL, *bp = NULL;
-    const size_t len = 4096;
-    int ret = 0;
+    unsigned int i;
 
-    if (opkg_config->compress_list_files  && !is_status_file) {
-        struct opkg_ar *ar;
-        size_t size;
+    for (i = 0; i < n_loaded_files; i++)
+        file_stamp_deinit(&loaded_files[i].stamp);
+    xfree(loaded_files);
+    loaded_files = NULL;
+    n_loaded_files = 0;
+}
 
-        ar = ar_open_compressed_file(file_name);
-        if (!ar)
-            return -1;
+static int src_rank(pkg_src_t *src)
+{
+    pkg_src_list_elt_t *iter;
+    int rank = 0;
 
-        FILE *mfp = open_memstream(&bp, &size);
+    for (iter = void_list_first(&opkg_config->pkg_src_list); iter;
+            iter = void_list_next(&opkg_config->pkg_src_list, iter), rank++) {
+        if ((pkg_src_t *) iter->data == src)
+            return rank;
+    }
+    return -1;
+}
 
-        if (ar_copy_to_stream(ar, mfp) < 0) {
-            opkg_perror(ERROR, "Failed to open %s", file_name);
-            ret = -1;
-            goto cleanup;
-        }
-        fclose(mfp);
+static int str_equal(const char *a, const char *b)
+{
+    return a == b || (a && b && strcmp(a, b) == 0);
+}
 
-        fp = fmemopen(bp, size, "r");
-        if (fp == NULL) {
-            opkg_perror(ERROR, "Failed to open memory buffer: %s\n", strerror(errno));
-            ret = -1;
-            goto cleanup;
-        }
-    } else {
-        fp = fopen(file_name, "r");
-        if (fp == NULL) {
-            opkg_perror(ERROR, "Failed to open %s", file_name);
-            ret = -1;
-            goto cleanup;
+/* Whether feed entry pkg is the one which was merged into installed. */
+static int same_feed_entry(pkg_t *installed, pkg_t *pkg)
+{
+    return str_equal(installed->filename, pkg->filename)
+            && str_equal(installed->md5sum, pkg->md5sum)
+            && str_equal(installed->sha256sum, pkg->sha256sum)
+            && installed->size == pkg->size;
+}
+
+/*
+ * Whether a package parsed while re-reading refresh_src should go into the
+ * hash. The refresh must end up where a full load would, which takes every
+ * package, so anything that load would have merged with what is already
+ * there leaves the refresh incomplete: the same package in two feeds, or an
+ * installed package whose feed entry is not the one merged into it before.
+ */
+static int feed_pkg_wanted(pkg_t *pkg)
+{
+    abstract_pkg_t *ab_pkg = abstract_pkg_fetch_by_name(pkg->name);
+    pkg_t *dup = NULL;
+    unsigned int i;
+
+    if (!ab_pkg || !ab_pkg->pkgs)
+        return 1;
+
+    for (i = 0; i < ab_pkg->pkgs->len; i++) {
+        pkg_t *old = ab_pkg->pkgs->pkgs[i];
+
+        if (pkg_compare_versions(pkg, old) == 0
+                && strcmp(pkg->architecture, old->architecture) == 0) {
+            dup = old;
+            break;
         }
     }
+    if (!dup)
+        return 1;
+
+    /* Listed twice in this feed: the last entry wins. */
+    if (!dup->dest && dup->src == pkg->src)
+        return 1;
+
+    if (!dup->dest || !(dup->state_flag & SF_MARKED)
+            || !same_feed_entry(dup, pkg)) {
+        refresh_incomplete = 1;
+        return 0;
+    }
+
+    /* The installed package stays, and takes the place of this feed's
+     * entry as it would in a full load. */
+    dup->state_flag &= ~SF_MARKED;
+    dup->src = pkg->src;
+    memmove(&ab_pkg->pkgs->pkgs[i], &ab_pkg->pkgs->pkgs[i + 1],
+            (ab_pkg->pkgs->len - i - 1) * sizeof(pkg_t *));
+    ab_pkg->pkgs->pkgs[ab_pkg->pkgs->len - 1] = dup;
+    return 0;
+}
+
+/* The feed rank of pkg, with the packages only in a status file last. */
+static int pkg_rank(pkg_t *pkg)
+{
+    return pkg->src ? src_rank(pkg->src) : INT_MAX;
+}
+
+/*
+ * A refresh appends the packages of the feed it re-reads. Put them back in
+ * the order a full load would have, which is that of the feeds; the sort
+ * is stable, so each feed keeps the order of its list.
+ */
+static void sort_by_feed(const char *key, void *entry, void *data)
+{
+    abstract_pkg_t *ab_pkg = (abstract_pkg_t *) entry;
+    pkg_t **pkgs;
+    unsigned int i, j;
+
+    if (!ab_pkg->pkgs || ab_pkg->pkgs->len < 2)
+        return;
+
+    pkgs = ab_pkg->pkgs->pkgs;
+    for (i = 1; i < ab_pkg->pkgs->len; i++) {
+        pkg_t *pkg = pkgs[i];
+        int rank = pkg_rank(pkg);
+
+        for (j = i; j > 0 && pkg_rank(pkgs[j - 1]) > rank; j--)
+            pkgs[j] = pkgs[j - 1];
+        pkgs[j] = pkg;
+    }
+}
+
+/*
+ * Parse the package stanzas read from fp into the package hash. file_name
+ * only labels the profile span.
+ */
+static int pkg_hash_add_from_stream(FILE * fp, const char *file_name,
+                                    pkg_src_t * src, pkg_dest_t * dest,
+                                    int is_status_file, pkg_source_t source)
+{
+    pkg_t *pkg;
+    char *buf = NULL;
+    const size_t len = 4096;
+    int ret = 0;
+    int span = opkg_profile_begin(is_status_file ? "status parse" : "feed parse",
+                                  file_name);
+    opkg_mem_tag_t mem = opkg_mem_enter(OPKG_MEM_FEED), mem_inner;
 
     /* Remove UTF-8 BOM if present */
     if (!(getc(fp) == 0xEF && getc(fp) == 0xBB && getc(fp) == 0xBF))
@@ -112,19 +240,21 @@ static int pkg_hash_add_from_file(const char *file_name, pkg_src_t * src,
     buf = xmalloc(len);
 
     do {
+        mem_inner = opkg_mem_enter(OPKG_MEM_PKG);
         pkg = pkg_new();
         pkg->src = src;
         pkg->dest = dest;
         pkg->install_source = source;
 
         ret = parse_from_stream_nomalloc(pkg_parse_line, pkg, fp, 0, &buf, len);
+        opkg_mem_leave(mem_inner);
         if (pkg->name == NULL) {
             /* probably just a blank line */
             ret = 1;
         }
         if (ret) {
             pkg_deinit(pkg);
-            free(pkg);
+            xfree(pkg);
             if (ret == -1)
                 break;
             if (ret == 1)
@@ -132,15 +262,16 @@ static int pkg_hash_add_from_file(const char *file_name, pkg_src_t * src,
                 ret = 0;
             continue;
         }
+        opkg_stats.packages_parsed++;
 
         if (!pkg->architecture) {
             char *version_str = pkg_version_str_alloc(pkg);
             opkg_msg(NOTICE,
                      "Package %s version %s has no "
                      "valid architecture, ignoring.\n", pkg->name, version_str);
-            free(version_str);
+            xfree(version_str);
             pkg_deinit(pkg);
-            free(pkg);
+            xfree(pkg);
             continue;
         }
         if (!pkg->arch_priority) {
@@ -149,22 +280,79 @@ static int pkg_hash_add_from_file(const char *file_name, pkg_src_t * src,
                      "Package %s version %s is built for architecture %s "
                      "which cannot be installed here, ignoring.\n", pkg->name,
                      version_str, pkg->architecture);
-            free(version_str);
+            xfree(version_str);
+            pkg_deinit(pkg);
+            xfree(pkg);
+            continue;
+        }
+        if (refresh_src && !feed_pkg_wanted(pkg)) {
             pkg_deinit(pkg);
-            free(pkg);
+            xfree(pkg);
             continue;
         }
 
-        hash_insert_pkg(pkg, is_status_file);
+        mem_inner = opkg_mem_enter(OPKG_MEM_DEPENDS);
+        if (hash_insert_pkg(pkg, is_status_file) && !is_status_file)
+            feeds_overlap = 1;
+        opkg_mem_leave(mem_inner);
 
     } while (!feof(fp));
 
+    xfree(buf);
+
+    opkg_mem_leave(mem);
+    opkg_profile_end(span);
+    return ret;
+}
+
+static int pkg_hash_add_from_file(const char *file_name, pkg_src_t * src,
+                           pkg_dest_t * dest, int is_status_file, pkg_source_t source)
+{
+    FILE *fp = NULL;
+    char *bp = NULL;
+    int ret = 0;
+
+    if (opkg_config->compress_list_files  && !is_status_file) {
+        struct opkg_ar *ar;
+        size_t size;
+
+        ar = ar_open_compressed_file(file_name);
+        if (!ar) {
+            ret = -1;
+            goto cleanup;
+        }
+
+        FILE *mfp = open_memstream(&bp, &size);
+
+        if (ar_copy_to_stream(ar, mfp) < 0) {
+            opkg_perror(ERROR, "Failed to open %s", file_name);
+            ret = -1;
+            goto cleanup;
+        }
+        fclose(mfp);
+
+        fp = fmemopen(bp, size, "r");
+        if (fp == NULL) {
+            opkg_perror(ERROR, "Failed to open memory buffer: %s\n", strerror(errno));
+            ret = -1;
+            goto cleanup;
+        }
+    } else {
+        fp = fopen(file_name, "r");
+        if (fp == NULL) {
+            opkg_perror(ERROR, "Failed to open %s", file_name);
+            ret = -1;
+            goto cleanup;
+        }
+    }
+
+    ret = pkg_hash_add_from_stream(fp, file_name, src, dest, is_status_file,
+                                   source);
+
 cleanup:
-    free(buf);
     if (fp)
         fclose(fp);
-    free(bp);
-
+    xfree(bp);
     return ret;
 }
 
@@ -182,7 +370,7 @@ static int dist_hash_add_from_file(pkg_src_t * dist)
         if (file_exists(list_file)) {
             r = pkg_hash_add_from_file(list_file, dist, NULL, 0, PKG_SOURCE_UNKNOWN);
             if (r != 0) {
-                free(list_file);
+                xfree(list_file);
                 return -1;
             }
             char *subpath, *distribution, *component;
@@ -193,49 +381,117 @@ static int dist_hash_add_from_file(pkg_src_t * dist)
                                 dist->value, NULL, subpath, 0);
         }
 
-        free(list_file);
+        xfree(list_file);
     }
 
     return 0;
 }
 
+/*
+ * Abstract packages in name order, for sorted iteration. Built on first use
+ * and dropped whenever a name is added to the hash.
+ */
+static abstract_pkg_t **name_index;
+static unsigned int name_index_len;
+
+static void name_index_free(void)
+{
+    xfree(name_index);
+    name_index = NULL;
+    name_index_len = 0;
+}
+
 void pkg_hash_init(void)
 {
+    opkg_mem_tag_t mem = opkg_mem_enter(OPKG_MEM_DEPENDS);
+
     hash_table_init("pkg-hash", &opkg_config->pkg_hash,
                     OPKG_CONF_DEFAULT_HASH_LEN);
+    opkg_mem_leave(mem);
 }
 
 void pkg_hash_deinit(void)
 {
     hash_table_foreach(&opkg_config->pkg_hash, free_pkgs, NULL);
     hash_table_deinit(&opkg_config->pkg_hash);
+    name_index_free();
+    pkg_hash_unstamp_files();
+}
+
+/*
+ * Turn on the lookup counters of the package and file owner tables when the
+ * hash_diagnostics option is set. They cost a branch per lookup otherwise.
+ */
+void pkg_hash_enable_diagnostics(void)
+{
+    if (!opkg_config->hash_diagnostics)
+        return;
+
+    hash_table_enable_diagnostics(&opkg_config->pkg_hash);
+    hash_table_enable_diagnostics(&opkg_config->file_hash);
+    hash_table_enable_diagnostics(&opkg_config->dir_hash);
+    hash_table_enable_diagnostics(&opkg_config->obs_file_hash);
+}
+
+/*
+ * Throw away all package state and load the same feeds and the status files
+ * again. The file owner tables point into the package hash, so they go too.
+ */
+int pkg_hash_reload(void)
+{
+    opkg_mem_tag_t mem;
+
+    pkg_hash_deinit();
+    hash_table_deinit(&opkg_config->file_hash);
+    hash_table_deinit(&opkg_config->dir_hash);
+    hash_table_deinit(&opkg_config->obs_file_hash);
+    opkg_config->file_hash_loaded = 0;
+
+    pkg_hash_init();
+    mem = opkg_mem_enter(OPKG_MEM_FILE_HASH);
+    hash_table_init("file-hash", &opkg_config->file_hash,
+                    OPKG_CONF_DEFAULT_HASH_LEN);
+    opkg_mem_leave(mem);
+    mem = opkg_mem_enter(OPKG_MEM_DIR_HASH);
+    hash_table_init("dir-hash", &opkg_config->dir_hash,
+                    OPKG_CONF_DEFAULT_HASH_LEN);
+    opkg_mem_leave(mem);
+    hash_table_init("obs-file-hash", &opkg_config->obs_file_hash,
+                    OPKG_CONF_DEFAULT_HASH_LEN / 16);
+    pkg_hash_enable_diagnostics();
+
+    if (feeds_loaded == FEEDS_ALL && pkg_hash_load_feeds())
+        return -1;
+    if (feeds_loaded == FEEDS_NAMES
+            && pkg_hash_load_feed_names(feed_names, n_feed_names))
+        return -1;
+
+    return pkg_hash_load_status_files();
 }
 
 /*
  * Load in feed files from the cached "src" and/or "src/gz" locations.
  */
-int pkg_hash_load_feeds(void)
+static int pkg_hash_load_dists(void)
 {
     pkg_src_list_elt_t *iter;
     pkg_src_t *src, *subdist;
     char *list_file;
     int r;
 
-    opkg_msg(INFO, "\n");
-
     for (iter = void_list_first(&opkg_config->dist_src_list); iter;
             iter = void_list_next(&opkg_config->dist_src_list, iter)) {
 
         src = (pkg_src_t *) iter->data;
 
         sprintf_alloc(&list_file, "%s/%s%s", opkg_config->lists_dir, src->name,
-                      opkg_config->compress_list_files ? ".gz" : "");
+                      opkg_conf_list_suffix());
         if (file_exists(list_file)) {
             unsigned int i;
             release_t *release = release_new();
             r = release_init_from_file(release, list_file);
             if (r != 0) {
-                free(list_file);
+                xfree(list_file);
                 return -1;
             }
 
@@ -249,73 +505,587 @@ int pkg_hash_load_feeds(void)
                 sprintf_alloc(&subdist->name, "%s-%s", src->name, comps[i]);
                 r = dist_hash_add_from_file(subdist);
                 if (r != 0) {
-                    free(subdist->name);
-                    free(subdist);
-                    free(list_file);
+                    xfree(subdist->name);
+                    xfree(subdist);
+                    xfree(list_file);
                     return -1;
                 }
             }
-            free(subdist->name);
-            free(subdist);
+            xfree(subdist->name);
+            xfree(subdist);
         }
-        free(list_file);
+        xfree(list_file);
     }
 
+    return 0;
+}
+
+int pkg_hash_load_feeds(void)
+{
+    pkg_src_list_elt_t *iter;
+    pkg_src_t *src;
+    char *list_file;
+    int r;
+
+    opkg_msg(INFO, "\n");
+    feeds_loaded = FEEDS_ALL;
+
+    if (pkg_hash_load_dists() != 0)
+        return -1;
+
     for (iter = void_list_first(&opkg_config->pkg_src_list); iter;
             iter = void_list_next(&opkg_config->pkg_src_list, iter)) {
 
         src = (pkg_src_t *) iter->data;
 
         sprintf_alloc(&list_file, "%s/%s%s", opkg_config->lists_dir, src->name,
-                      opkg_config->compress_list_files ? ".gz" : "" );
+                      opkg_conf_list_suffix());
 
         if (file_exists(list_file)) {
             r = pkg_hash_add_from_file(list_file, src, NULL, 0, PKG_SOURCE_UNKNOWN);
             if (r != 0) {
-                free(list_file);
+                xfree(list_file);
+                return -1;
+            }
+        }
+        xfree(list_file);
+    }
+
+    opkg_mem_report("feeds loaded");
+    return 0;
+}
+
+/* Decompress the frames of list_file holding the given stanzas, which are
+ * sorted by position, and copy just those stanzas into stream. */
+static int copy_indexed_stanzas(const char *list_file,
+                                const struct list_index_entry *e, size_t n,
+                                FILE *stream)
+{
+    char *frame = NULL, *data = NULL;
+    size_t data_len = 0, i;
+    off_t loaded = -1;
+    int fd, r = 0;
+
+    fd = open(list_file, O_RDONLY);
+    if (fd < 0) {
+        opkg_perror(ERROR, "Failed to open %s", list_file);
+        return -1;
+    }
+
+    for (i = 0; i < n && !r; i++) {
+        if (e[i].frame_offset != loaded) {
+            struct opkg_ar *ar;
+            FILE *mfp;
+
+            xfree(data);
+            data = NULL;
+            frame = xrealloc(frame, e[i].frame_len ? e[i].frame_len : 1);
+            if (pread(fd, frame, e[i].frame_len, e[i].frame_offset)
+                != (ssize_t)e[i].frame_len) {
+                opkg_perror(ERROR, "Failed to read %s", list_file);
+                r = -1;
+                break;
+            }
+            ar = ar_open_compressed_buffer(frame, e[i].frame_len);
+            if (!ar) {
+                r = -1;
+                break;
+            }
+            mfp = open_memstream(&data, &data_len);
+            if (ar_copy_to_stream(ar, mfp) < 0) {
+                opkg_msg(ERROR, "Failed to decompress %s.\n", list_file);
+                r = -1;
+            }
+            fclose(mfp);
+            ar_close(ar);
+            loaded = e[i].frame_offset;
+            opkg_stats.list_frames_read++;
+        }
+        if (!r && e[i].offset + e[i].len > data_len) {
+            opkg_msg(ERROR, "Index of %s does not match it.\n", list_file);
+            r = -1;
+        }
+        if (!r) {
+            fwrite(data + e[i].offset, 1, e[i].len, stream);
+            fputc('\n', stream);
+        }
+    }
+
+    xfree(data);
+    xfree(frame);
+    close(fd);
+    return r;
+}
+
+/* Load only the named packages from a compressed, indexed list file. Returns
+ * 1 if the list has no usable index, so that the caller loads all of it. */
+static int pkg_hash_add_names_from_file(const char *list_file, pkg_src_t *src,
+                                        const char *const *names, int n)
+{
+    struct list_index_entry *e;
+    size_t n_entries;
+    char *bp = NULL;
+    size_t size;
+    FILE *mfp, *fp;
+    int r;
+
+    if (list_index_lookup(list_file, names, n, &e, &n_entries) != 0)
+        return 1;
+    if (n_entries == 0)
+        return 0;
+
+    mfp = open_memstream(&bp, &size);
+    r = copy_indexed_stanzas(list_file, e, n_entries, mfp);
+    fclose(mfp);
+    xfree(e);
+    if (r == 0) {
+        fp = fmemopen(bp, size, "r");
+        if (fp == NULL) {
+            opkg_perror(ERROR, "Failed to open memory buffer");
+            r = -1;
+        } else {
+            r = pkg_hash_add_from_stream(fp, list_file, src, NULL, 0,
+                                         PKG_SOURCE_UNKNOWN);
+            fclose(fp);
+        }
+    }
+    xfree(bp);
+    return r;
+}
+
+/*
+ * Load the named packages from the feeds, for commands which look up a few
+ * packages by name. Compressed lists with an index are read a frame at a time
+ * and only the stanzas of those packages are parsed; any other list is loaded
+ * in full, as by pkg_hash_load_feeds().
+ */
+int pkg_hash_load_feed_names(const char *const *names, int n)
+{
+    pkg_src_list_elt_t *iter;
+    pkg_src_t *src;
+    char *list_file;
+    int r;
+
+    opkg_msg(INFO, "\n");
+    feeds_loaded = FEEDS_NAMES;
+    feed_names = names;
+    n_feed_names = n;
+
+    if (pkg_hash_load_dists() != 0)
+        return -1;
+
+    for (iter = void_list_first(&opkg_config->pkg_src_list); iter;
+            iter = void_list_next(&opkg_config->pkg_src_list, iter)) {
+
+        src = (pkg_src_t *) iter->data;
+
+        sprintf_alloc(&list_file, "%s/%s%s", opkg_config->lists_dir, src->name,
+                      opkg_conf_list_suffix());
+
+        if (file_exists(list_file)) {
+            r = 1;
+            if (opkg_config->compress_list_files)
+                r = pkg_hash_add_names_from_file(list_file, src, names, n);
+            if (r == 1)
+                r = pkg_hash_add_from_file(list_file, src, NULL, 0,
+                                           PKG_SOURCE_UNKNOWN);
+            if (r != 0) {
+                xfree(list_file);
                 return -1;
             }
         }
-        free(list_file);
+        xfree(list_file);
     }
 
+    opkg_mem_report("feeds loaded");
     return 0;
 }
 
 /*
  * Load in status files from the configured "dest"s.
  */
+static FILE *open_status_file(const char *file_name, int *err)
+{
+    FILE *fp;
+
+    if (!file_exists(file_name))
+        return NULL;
+
+    fp = fopen(file_name, "r");
+    if (fp == NULL) {
+        opkg_perror(ERROR, "Failed to open %s", file_name);
+        *err = -1;
+    }
+    return fp;
+}
+
 int pkg_hash_load_status_files(void)
 {
     pkg_dest_list_elt_t *iter;
     pkg_dest_t *dest;
+    FILE **fps;
+    unsigned int i, n = 0;
+    int ret = 0;
 
     opkg_msg(INFO, "\n");
 
+    for (iter = void_list_first(&opkg_config->pkg_dest_list); iter;
+            iter = void_list_next(&opkg_config->pkg_dest_list, iter))
+        n++;
+    fps = xcalloc(2 * n + 1, sizeof(FILE *));
+
+    /* Open every status file of the same publish, then parse them without
+     * holding up writers. */
+    opkg_state_read_lock();
+    i = 0;
     for (iter = void_list_first(&opkg_config->pkg_dest_list); iter;
             iter = void_list_next(&opkg_config->pkg_dest_list, iter)) {
+        dest = (pkg_dest_t *) iter->data;
+        if (dest->image_status_file_name)
+            fps[i] = open_status_file(dest->image_status_file_name, &ret);
+        fps[i + 1] = open_status_file(dest->status_file_name, &ret);
+        i += 2;
+    }
+    opkg_state_read_unlock();
 
+    i = 0;
+    for (iter = void_list_first(&opkg_config->pkg_dest_list); iter;
+            iter = void_list_next(&opkg_config->pkg_dest_list, iter)) {
         dest = (pkg_dest_t *) iter->data;
 
-        if (dest->image_status_file_name &&
-                file_exists(dest->image_status_file_name)) {
-            int r = pkg_hash_add_from_file(dest->image_status_file_name, NULL,
+        if (ret == 0 && fps[i])
+            ret = pkg_hash_add_from_stream(fps[i],
+                                           dest->image_status_file_name, NULL,
                                            dest, 1, PKG_SOURCE_IMAGE);
-            if (r != 0)
-                return -1;
-        }
+        if (ret == 0 && fps[i + 1])
+            ret = pkg_hash_add_from_stream(fps[i + 1], dest->status_file_name,
+                                           NULL, dest, 1, PKG_SOURCE_WRITABLE);
+        i += 2;
+    }
 
-        if (file_exists(dest->status_file_name)) {
-            int r = pkg_hash_add_from_file(dest->status_file_name, NULL, dest,
-                                           1, PKG_SOURCE_WRITABLE);
-            if (r != 0)
-                return -1;
+    for (i = 0; i < 2 * n; i++) {
+        if (fps[i])
+            fclose(fps[i]);
+    }
+    xfree(fps);
+    if (ret != 0)
+        return -1;
+
+    opkg_mem_report("status loaded");
+    return 0;
+}
+
+static char *feed_list_file(pkg_src_t *src)
+{
+    char *list_file;
+
+    sprintf_alloc(&list_file, "%s/%s%s", opkg_config->lists_dir, src->name,
+                  opkg_conf_list_suffix());
+    return list_file;
+}
+
+static void stamp_file(const char *path, pkg_src_t *src)
+{
+    struct loaded_file *lf;
+
+    loaded_files = xrealloc(loaded_files,
+                            (n_loaded_files + 1) * sizeof(*loaded_files));
+    lf = &loaded_files[n_loaded_files++];
+    file_stamp_init(&lf->stamp, path);
+    lf->src = src;
+}
+
+/*
+ * Record what the list and status files look like before they are loaded,
+ * for pkg_hash_refresh(). This reads every one of them once more, so only
+ * long-lived libopkg users call it.
+ */
+void pkg_hash_stamp_files(void)
+{
+    pkg_src_list_elt_t *src_iter;
+    pkg_dest_list_elt_t *dest_iter;
+    char *list_file;
+
+    pkg_hash_unstamp_files();
+    feeds_overlap = 0;
+
+    for (src_iter = void_list_first(&opkg_config->pkg_src_list); src_iter;
+            src_iter = void_list_next(&opkg_config->pkg_src_list, src_iter)) {
+        pkg_src_t *src = (pkg_src_t *) src_iter->data;
+
+        list_file = feed_list_file(src);
+        stamp_file(list_file, src);
+        xfree(list_file);
+    }
+
+    for (dest_iter = void_list_first(&opkg_config->pkg_dest_list); dest_iter;
+            dest_iter = void_list_next(&opkg_config->pkg_dest_list, dest_iter)) {
+        pkg_dest_t *dest = (pkg_dest_t *) dest_iter->data;
+
+        if (dest->image_status_file_name)
+            stamp_file(dest->image_status_file_name, NULL);
+        stamp_file(dest->status_file_name, NULL);
+    }
+}
+
+/* Whether any package of ab_pkg has a dependency of the kind which
+ * buildDependedUponBy() records on target. */
+static int abstract_pkg_depends_on(abstract_pkg_t *ab_pkg,
+                                   abstract_pkg_t *target)
+{
+    unsigned int i;
+    int j, k, count;
+
+    for (i = 0; i < ab_pkg->pkgs->len; i++) {
+        pkg_t *pkg = ab_pkg->pkgs->pkgs[i];
+
+        count = pkg->pre_depends_count + pkg->depends_count
+                + pkg->recommends_count + pkg->suggests_count;
+        for (j = 0; j < count; j++) {
+            compound_depend_t *depends = &pkg->depends[j];
+
+            if (depends->type != PREDEPEND && depends->type != DEPEND
+                    && depends->type != RECOMMEND)
+                continue;
+            for (k = 0; k < depends->possibility_count; k++) {
+                if (depends->possibilities[k]->pkg == target)
+                    return 1;
+            }
         }
     }
+    return 0;
+}
+
+/* Whether any package of ab_pkg both replaces and conflicts with target,
+ * which is what buildReplaces() records. */
+static int abstract_pkg_replaces(abstract_pkg_t *ab_pkg, abstract_pkg_t *target)
+{
+    unsigned int i, j;
 
+    for (i = 0; i < ab_pkg->pkgs->len; i++) {
+        pkg_t *pkg = ab_pkg->pkgs->pkgs[i];
+
+        for (j = 0; j < pkg->replaces_count; j++) {
+            if (pkg->replaces[j].possibilities[0]->pkg == target
+                    && pkg_conflicts_abstract(pkg, target))
+                return 1;
+        }
+    }
     return 0;
 }
 
+/*
+ * Undo the edges which hash_insert_pkg() added to other abstract packages
+ * for pkg, once it has been taken out of ab_pkg->pkgs. Edges which another
+ * package of ab_pkg also accounts for stay.
+ */
+static void unlink_pkg(abstract_pkg_t *ab_pkg, pkg_t *pkg)
+{
+    unsigned int i;
+    int j, k, count;
+
+    /* buildProvides() adds one entry per package for each Provides, but
+     * ab_pkg provides itself only once. */
+    for (i = 1; i < pkg->provides_count; i++)
+        abstract_pkg_vec_remove(pkg->provides[i]->provided_by, ab_pkg);
+    if (!ab_pkg->pkgs->len)
+        abstract_pkg_vec_remove(ab_pkg->provided_by, ab_pkg);
+
+    count = pkg->pre_depends_count + pkg->depends_count + pkg->recommends_count
+            + pkg->suggests_count;
+    for (j = 0; j < count; j++) {
+        compound_depend_t *depends = &pkg->depends[j];
+
+        if (depends->type != PREDEPEND && depends->type != DEPEND
+                && depends->type != RECOMMEND)
+            continue;
+        for (k = 0; k < depends->possibility_count; k++) {
+            abstract_pkg_t *target = depends->possibilities[k]->pkg;
+
+            if (!abstract_pkg_depends_on(ab_pkg, target))
+                abstract_pkg_vec_remove(target->depended_upon_by, ab_pkg);
+        }
+    }
+
+    for (i = 0; i < pkg->replaces_count; i++) {
+        abstract_pkg_t *target = pkg->replaces[i].possibilities[0]->pkg;
+
+        if (!abstract_pkg_replaces(ab_pkg, target))
+            abstract_pkg_vec_remove(target->replaced_by, ab_pkg);
+    }
+}
+
+/* Drop the packages of one feed which are not installed, and detach the
+ * installed ones from it. */
+static void remove_feed_pkgs(const char *key, void *entry, void *data)
+{
+    abstract_pkg_t *ab_pkg = (abstract_pkg_t *) entry;
+    pkg_src_t *src = (pkg_src_t *) data;
+    pkg_vec_t *removed;
+    unsigned int i, j;
+
+    if (!ab_pkg->pkgs)
+        return;
+
+    removed = pkg_vec_alloc();
+    for (i = j = 0; i < ab_pkg->pkgs->len; i++) {
+        pkg_t *pkg = ab_pkg->pkgs->pkgs[i];
+
+        if (pkg->src == src && !pkg->dest) {
+            pkg_vec_insert(removed, pkg);
+            continue;
+        }
+        if (pkg->src == src) {
+            pkg->src = NULL;
+            pkg->state_flag |= SF_MARKED;
+            pkg_vec_insert(refresh_detached, pkg);
+        }
+        ab_pkg->pkgs->pkgs[j++] = pkg;
+    }
+    ab_pkg->pkgs->len = j;
+
+    for (i = 0; i < removed->len; i++) {
+        unlink_pkg(ab_pkg, removed->pkgs[i]);
+        pkg_deinit(removed->pkgs[i]);
+        xfree(removed->pkgs[i]);
+    }
+    pkg_vec_free(removed);
+}
+
+static void mark_compound_depends(compound_depend_t *depends, int count)
+{
+    int j, k;
+
+    for (j = 0; j < count; j++) {
+        for (k = 0; k < depends[j].possibility_count; k++)
+            depends[j].possibilities[k]->pkg->state_flag |= SF_MARKED;
+    }
+}
+
+/* Mark every abstract package which a package of ab_pkg refers to. */
+static void mark_referenced(const char *key, void *entry, void *data)
+{
+    abstract_pkg_t *ab_pkg = (abstract_pkg_t *) entry;
+    unsigned int i, j;
+
+    if (!ab_pkg->pkgs)
+        return;
+
+    for (i = 0; i < ab_pkg->pkgs->len; i++) {
+        pkg_t *pkg = ab_pkg->pkgs->pkgs[i];
+
+        for (j = 0; j < pkg->provides_count; j++)
+            pkg->provides[j]->state_flag |= SF_MARKED;
+        mark_compound_depends(pkg->depends, pkg->pre_depends_count
+                              + pkg->depends_count + pkg->recommends_count
+                              + pkg->suggests_count);
+        mark_compound_depends(pkg->conflicts, pkg->conflicts_count);
+        mark_compound_depends(pkg->replaces, pkg->replaces_count);
+    }
+}
+
+/* Collect the abstract packages left without packages or references. */
+static void collect_unused(const char *key, void *entry, void *data)
+{
+    abstract_pkg_t *ab_pkg = (abstract_pkg_t *) entry;
+    abstract_pkg_vec_t *unused = (abstract_pkg_vec_t *) data;
+
+    if (ab_pkg->state_flag & SF_MARKED)
+        ab_pkg->state_flag &= ~SF_MARKED;
+    else if (!ab_pkg->pkgs || !ab_pkg->pkgs->len)
+        abstract_pkg_vec_insert(unused, ab_pkg);
+}
+
+/*
+ * Drop the abstract packages which only the packages of a dropped feed had
+ * brought in, so that the hash matches what a full load would build.
+ */
+static void remove_unused_abstract_pkgs(void)
+{
+    abstract_pkg_vec_t *unused = abstract_pkg_vec_alloc();
+    unsigned int i;
+
+    hash_table_foreach(&opkg_config->pkg_hash, mark_referenced, NULL);
+    hash_table_foreach(&opkg_config->pkg_hash, collect_unused, unused);
+
+    for (i = 0; i < unused->len; i++) {
+        hash_table_remove(&opkg_config->pkg_hash, unused->pkgs[i]->name);
+        free_pkgs(NULL, unused->pkgs[i], NULL);
+    }
+    if (unused->len) {
+        opkg_msg(DEBUG, "Dropped %u unused abstract packages.\n",
+                 unused->len);
+        name_index_free();
+    }
+    abstract_pkg_vec_free(unused);
+}
+
+/*
+ * Bring the package hash up to date with the list files after some of them
+ * have changed on disk, re-reading only those feeds. Returns 0 on success
+ * and non-zero if the caller has to throw the hash away and load it again:
+ * when nothing was stamped, a status file changed, or the feeds are such
+ * that re-reading one of them alone would give a different result.
+ */
+int pkg_hash_refresh(void)
+{
+    unsigned int i, n_changed = 0;
+    int r = 0;
+
+    if (!loaded_files || feeds_overlap
+            || !void_list_empty(&opkg_config->dist_src_list))
+        return 1;
+
+    for (i = 0; i < n_loaded_files; i++) {
+        if (!loaded_files[i].src && file_stamp_changed(&loaded_files[i].stamp)) {
+            opkg_msg(INFO, "%s has changed.\n", loaded_files[i].stamp.path);
+            return 1;
+        }
+    }
+
+    refresh_detached = pkg_vec_alloc();
+    for (i = 0; i < n_loaded_files && r == 0; i++) {
+        struct loaded_file *lf = &loaded_files[i];
+
+        if (!lf->src || !file_stamp_changed(&lf->stamp))
+            continue;
+
+        opkg_msg(INFO, "Re-reading feed %s.\n", lf->src->name);
+        n_changed++;
+        hash_table_foreach(&opkg_config->pkg_hash, remove_feed_pkgs, lf->src);
+        if (lf->stamp.exists) {
+            refresh_src = lf->src;
+            r = pkg_hash_add_from_file(lf->stamp.path, lf->src, NULL, 0,
+                                       PKG_SOURCE_UNKNOWN);
+            refresh_src = NULL;
+        }
+        if (refresh_incomplete || feeds_overlap)
+            r = 1;
+    }
+    refresh_incomplete = 0;
+
+    /* An installed package no feed lists any more still has the fields of
+     * its old feed entry, which a full load would not give it. */
+    for (i = 0; i < refresh_detached->len; i++) {
+        if (refresh_detached->pkgs[i]->state_flag & SF_MARKED) {
+            refresh_detached->pkgs[i]->state_flag &= ~SF_MARKED;
+            r = 1;
+        }
+    }
+    pkg_vec_free(refresh_detached);
+    refresh_detached = NULL;
+
+    if (r == 0) {
+        if (n_changed) {
+            hash_table_foreach(&opkg_config->pkg_hash, sort_by_feed, NULL);
+            remove_unused_abstract_pkgs();
+        }
+        opkg_msg(DEBUG, "%u of %u list files changed.\n", n_changed,
+                 n_loaded_files);
+    }
+    return r;
+}
+
 abstract_pkg_t *abstract_pkg_fetch_by_name(const char *pkg_name)
 {
     return (abstract_pkg_t *) hash_table_get(&opkg_config->pkg_hash, pkg_name);
@@ -669,10 +1439,10 @@ pkg_t *pkg_hash_fetch_by_name_version_arch(const char *pkg_name,
         int is_match = (strcmp(version_str, version) == 0)
                 && (strcmp(vec->pkgs[i]->architecture, arch) == 0);
         if (is_match) {
-            free(version_str);
+            xfree(version_str);
             break;
         }
-        free(version_str);
+        xfree(version_str);
     }
 
     // TODO: see above
@@ -749,6 +1519,176 @@ void pkg_hash_fetch_available(pkg_vec_t * all)
                        all);
 }
 
+static int name_index_compare(const void *a, const void *b)
+{
+    const abstract_pkg_t *pa = *(const abstract_pkg_t **)a;
+    const abstract_pkg_t *pb = *(const abstract_pkg_t **)b;
+
+    return strcmp(pa->name, pb->name);
+}
+
+static void name_index_build(void)
+{
+    hash_table_t *hash = &opkg_config->pkg_hash;
+    unsigned int i;
+
+    if (name_index)
+        return;
+
+    name_index = xcalloc(hash->n_elements + 1, sizeof(*name_index));
+    for (i = 0; i < hash->n_buckets; i++) {
+        hash_entry_t *hash_entry = hash->entries + i;
+
+        do {
+            if (hash_entry->key)
+                name_index[name_index_len++] = hash_entry->data;
+        } while ((hash_entry = hash_entry->next));
+    }
+    qsort(name_index, name_index_len, sizeof(*name_index), name_index_compare);
+}
+
+/* The first slot of the name index whose name is not below prefix. */
+static unsigned int name_index_lower_bound(const char *prefix)
+{
+    unsigned int lo = 0, hi = name_index_len;
+
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+
+        if (strcmp(name_index[mid]->name, prefix) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+void pkg_hash_iter_init(pkg_hash_iter_t *it, unsigned int flags,
+                        const char *name_prefix, const char *architecture)
+{
+    memset(it, 0, sizeof(*it));
+    it->flags = flags;
+    it->name_prefix = name_prefix && *name_prefix ? name_prefix : NULL;
+    it->architecture = architecture;
+    if (it->name_prefix)
+        it->prefix_len = strlen(it->name_prefix);
+
+    if (flags & (PKG_ITER_SORTED | PKG_ITER_SORTED_VERSION)) {
+        name_index_build();
+        if (it->name_prefix)
+            it->index = name_index_lower_bound(it->name_prefix);
+    }
+}
+
+static abstract_pkg_t *iter_next_abstract(pkg_hash_iter_t *it)
+{
+    hash_table_t *hash = &opkg_config->pkg_hash;
+
+    if (it->flags & (PKG_ITER_SORTED | PKG_ITER_SORTED_VERSION)) {
+        abstract_pkg_t *ab_pkg;
+
+        if (it->index >= name_index_len)
+            return NULL;
+        ab_pkg = name_index[it->index++];
+        if (it->name_prefix
+                && strncmp(ab_pkg->name, it->name_prefix, it->prefix_len)) {
+            /* Past the last name with this prefix. */
+            it->index = name_index_len;
+            return NULL;
+        }
+        return ab_pkg;
+    }
+
+    while (it->bucket < hash->n_buckets) {
+        hash_entry_t *hash_entry = it->entry ? it->entry
+                                             : hash->entries + it->bucket;
+
+        it->entry = hash_entry->next;
+        if (!it->entry)
+            it->bucket++;
+        if (hash_entry->key && (!it->name_prefix
+                || !strncmp(hash_entry->key, it->name_prefix, it->prefix_len)))
+            return hash_entry->data;
+    }
+    return NULL;
+}
+
+/*
+ * The package of it->ab_pkg after it->last in (version, position) order, or
+ * NULL. Abstract packages hold few versions, so a scan beats sorting a copy.
+ */
+static pkg_t *iter_next_version(pkg_hash_iter_t *it)
+{
+    pkg_vec_t *vec = it->ab_pkg->pkgs;
+    pkg_t *best = NULL;
+    unsigned int i, best_pos = 0;
+
+    for (i = 0; i < vec->len; i++) {
+        pkg_t *pkg = vec->pkgs[i];
+        int r;
+
+        if (it->last) {
+            r = pkg_compare_versions(pkg, it->last);
+            if (r < 0 || (r == 0 && i <= it->pos))
+                continue;
+        }
+        if (!best || pkg_compare_versions(pkg, best) < 0) {
+            best = pkg;
+            best_pos = i;
+        }
+    }
+
+    it->last = best;
+    it->pos = best_pos;
+    return best;
+}
+
+static int iter_match(pkg_hash_iter_t *it, pkg_t *pkg)
+{
+    pkg_state_status_t st = pkg->state_status;
+
+    if (it->flags & (PKG_ITER_INSTALLED | PKG_ITER_HALF_INSTALLED)) {
+        if (st != SS_INSTALLED && st != SS_UNPACKED
+                && !((it->flags & PKG_ITER_HALF_INSTALLED)
+                     && st == SS_HALF_INSTALLED))
+            return 0;
+    }
+    if (it->architecture && (!pkg->architecture
+                || strcmp(pkg->architecture, it->architecture)))
+        return 0;
+    return 1;
+}
+
+/*
+ * The next matching package, or NULL once the iterator is exhausted.
+ */
+pkg_t *pkg_hash_iter_next(pkg_hash_iter_t *it)
+{
+    pkg_t *pkg;
+
+    while (1) {
+        if (it->ab_pkg && it->ab_pkg->pkgs) {
+            if (it->flags & PKG_ITER_SORTED_VERSION) {
+                pkg = iter_next_version(it);
+            } else {
+                pkg = it->pos < it->ab_pkg->pkgs->len
+                      ? it->ab_pkg->pkgs->pkgs[it->pos++] : NULL;
+            }
+            if (pkg) {
+                if (iter_match(it, pkg))
+                    return pkg;
+                continue;
+            }
+        }
+
+        it->ab_pkg = iter_next_abstract(it);
+        if (!it->ab_pkg)
+            return NULL;
+        it->pos = 0;
+        it->last = NULL;
+    }
+}
+
 static void pkg_hash_fetch_all_installed_helper(const char *pkg_name,
                                                 void *entry, void *data)
 {
@@ -841,6 +1781,7 @@ static abstract_pkg_t *add_new_abstract_pkg_by_name(const char *pkg_name)
 
     ab_pkg->name = xstrdup(pkg_name);
     hash_table_insert(&opkg_config->pkg_hash, pkg_name, ab_pkg);
+    name_index_free();
 
     return ab_pkg;
 }
@@ -856,9 +1797,10 @@ abstract_pkg_t *ensure_abstract_pkg_by_name(const char *pkg_name)
     return ab_pkg;
 }
 
-void hash_insert_pkg(pkg_t * pkg, int set_status)
+int hash_insert_pkg(pkg_t * pkg, int set_status)
 {
     abstract_pkg_t *ab_pkg;
+    int replaced;
 
     ab_pkg = ensure_abstract_pkg_by_name(pkg->name);
     if (!ab_pkg->pkgs)
@@ -883,8 +1825,9 @@ void hash_insert_pkg(pkg_t * pkg, int set_status)
 
     buildDependedUponBy(pkg, ab_pkg);
 
-    pkg_vec_insert_merge(ab_pkg->pkgs, pkg, set_status);
+    replaced = pkg_vec_insert_merge(ab_pkg->pkgs, pkg, set_status);
     pkg->parent = ab_pkg;
+    return replaced;
 }
 
 static const char *strip_offline_root(const char *file_name)
@@ -915,12 +1858,15 @@ pkg_t *file_hash_get_file_owner(const char *file_name)
 void file_hash_set_file_owner(const char *file_name, pkg_t * owning_pkg)
 {
     pkg_t *old_owning_pkg;
+    opkg_mem_tag_t mem;
 
     const char* long_file_name = file_name;
     file_name = strip_offline_root(file_name);
 
     old_owning_pkg = hash_table_get(&opkg_config->file_hash, file_name);
+    mem = opkg_mem_enter(OPKG_MEM_FILE_HASH);
     hash_table_insert(&opkg_config->file_hash, file_name, owning_pkg);
+    opkg_mem_leave(mem);
 
     /*
      * Multiple packages can claim ownership of a directory or a
@@ -950,6 +1896,7 @@ int dir_hash_get_ref_count(const char* file_name)
 void dir_hash_add_ref_count(const char* file_name)
 {
     int* current_count = hash_table_get(&opkg_config->dir_hash, file_name);
+    opkg_mem_tag_t mem = opkg_mem_enter(OPKG_MEM_DIR_HASH);
     if(!current_count)
     {
         current_count = xmalloc(sizeof(int*));
@@ -957,6 +1904,7 @@ void dir_hash_add_ref_count(const char* file_name)
     }
     *current_count = *current_count + 1;
     hash_table_insert(&opkg_config->dir_hash, file_name, current_count);
+    opkg_mem_leave(mem);
 }
 
 void dir_hash_remove(const char* file_name)
@@ -964,6 +1912,6 @@ void dir_hash_remove(const char* file_name)
     int* current_count = hash_table_get(&opkg_config->dir_hash, file_name);
     if (current_count) {
         hash_table_remove(&opkg_config->dir_hash, file_name);
-        free(current_count);
+        xfree(current_count);
     }
 }
@@ -37,15 +37,53 @@ enum fetch_type {
 };
 typedef enum fetch_type fetch_type_t;
 
+/* Flags for pkg_hash_iter_init(). */
+#define PKG_ITER_INSTALLED        0x01  /* installed or unpacked packages only */
+#define PKG_ITER_HALF_INSTALLED   0x02  /* as above, plus half installed */
+#define PKG_ITER_SORTED           0x04  /* in name order */
+#define PKG_ITER_SORTED_VERSION   0x08  /* in name order, then version order */
+
+/*
+ * A cursor over the packages in the hash which match the filters: a name
+ * prefix and an architecture, either of which may be NULL. Sorted order is
+ * served from an index of names kept between calls, so no package vector is
+ * built. The hash must not be changed while an iterator is in use.
+ */
+typedef struct {
+    unsigned int flags;
+    const char *name_prefix;
+    const char *architecture;
+
+    /* private */
+    size_t prefix_len;
+    unsigned int bucket;
+    hash_entry_t *entry;
+    unsigned int index;
+    abstract_pkg_t *ab_pkg;
+    unsigned int pos;
+    pkg_t *last;
+} pkg_hash_iter_t;
+
 void pkg_hash_init(void);
 void pkg_hash_deinit(void);
+int pkg_hash_reload(void);
+void pkg_hash_enable_diagnostics(void);
+void pkg_hash_stamp_files(void);
+int pkg_hash_refresh(void);
 
 void pkg_hash_fetch_available(pkg_vec_t * available);
 
+void pkg_hash_iter_init(pkg_hash_iter_t *it, unsigned int flags,
+                        const char *name_prefix, const char *architecture);
+pkg_t *pkg_hash_iter_next(pkg_hash_iter_t *it);
+
 int pkg_hash_load_feeds(void);
+/* names must stay valid for as long as pkg_hash_reload() may be called. */
+int pkg_hash_load_feed_names(const char *const *names, int n);
 int pkg_hash_load_status_files(void);
 
-void hash_insert_pkg(pkg_t * pkg, int set_status);
+/* Returns 1 if pkg replaced the same package from another source. */
+int hash_insert_pkg(pkg_t * pkg, int set_status);
 
 abstract_pkg_t *ensure_abstract_pkg_by_name(const char *pkg_name);
 void pkg_hash_fetch_all_installed(pkg_vec_t * installed, fetch_type_t constain);
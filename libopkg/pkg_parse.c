@@ -86,7 +86,7 @@ static unsigned long parse_ulong(pkg_t *pkg, const char *field,
     if (errno || (*endptr != '\0') || (*tmp == '-'))
         opkg_msg(ERROR, "Failed to parse %s line for %s\n", field, pkg->name);
 
-    free(tmp);
+    xfree(tmp);
     return value;
 }
 
@@ -105,14 +105,11 @@ static void parse_userfields(pkg_t *pkg, const char *cstr)
     nv_pair_list_append(&pkg->userfields, name, value);
 }
 
-int parse_version(pkg_t * pkg, const char *vstr)
+int pkg_version_parse(pkg_version_t * v, const char *vstr)
 {
     size_t offset;
     const char *numbers = "0123456789";
 
-    if (strncmp(vstr, "Version:", 8) == 0)
-        vstr += 8;
-
     while (*vstr && isspace(*vstr))
         vstr++;
 
@@ -122,20 +119,35 @@ int parse_version(pkg_t * pkg, const char *vstr)
     offset = strspn(vstr, numbers);
     if (vstr[offset] == ':') {
         errno = 0;
-        pkg->epoch = strtoul(vstr, NULL, 10);
+        v->epoch = strtoul(vstr, NULL, 10);
         if (errno) {
-            opkg_perror(ERROR, "%s: invalid epoch", pkg->name);
+            opkg_perror(ERROR, "%s: invalid epoch", vstr);
         }
         vstr += offset + 1;
     } else {
-        pkg->epoch = 0;
+        v->epoch = 0;
     }
 
-    pkg->version = trim_xstrdup(vstr);
-    pkg->revision = strrchr(pkg->version, '-');
+    v->version = trim_xstrdup(vstr);
+    v->revision = strrchr(v->version, '-');
+
+    if (v->revision)
+        *v->revision++ = '\0';
+
+    return 0;
+}
+
+int parse_version(pkg_t * pkg, const char *vstr)
+{
+    pkg_version_t v;
+
+    if (strncmp(vstr, "Version:", 8) == 0)
+        vstr += 8;
 
-    if (pkg->revision)
-        *pkg->revision++ = '\0';
+    pkg_version_parse(&v, vstr);
+    pkg->epoch = v.epoch;
+    pkg->version = v.version;
+    pkg->revision = v.revision;
 
     return 0;
 }
@@ -179,7 +191,7 @@ int pkg_parse_line(void *ptr, const char *line, uint mask)
             char *tmp = parse_simple("Auto-Installed", line);
             if (strcmp(tmp, "yes") == 0)
                 pkg->auto_installed = 1;
-            free(tmp);
+            xfree(tmp);
         } else if (opkg_config->verbose_status_file)
             userfield = 1;
         break;
@@ -213,7 +225,7 @@ int pkg_parse_line(void *ptr, const char *line, uint mask)
             char *tmp = parse_simple("Essential", line);
             if (strcmp(tmp, "yes") == 0)
                 pkg->essential = 1;
-            free(tmp);
+            xfree(tmp);
         } else if (opkg_config->verbose_status_file)
             userfield = 1;
         break;
@@ -353,7 +365,7 @@ int pkg_parse_from_stream(pkg_t * pkg, FILE * fp, uint mask)
         /* probably just a blank line */
         ret = 1;
     }
-    free(buf);
+    xfree(buf);
 
     return ret;
 }
@@ -28,6 +28,7 @@ extern "C" {
 #endif
 
 int parse_version(pkg_t * pkg, const char *raw);
+int pkg_version_parse(pkg_version_t * v, const char *raw);
 int pkg_parse_from_stream(pkg_t * pkg, FILE * fp, uint mask);
 int pkg_parse_line(void *ptr, const char *line, uint mask);
 
@@ -23,14 +23,17 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "file_util.h"
+#include "list_index.h"
 #include "opkg_conf.h"
 #include "opkg_download.h"
 #include "opkg_message.h"
 #include "opkg_verify.h"
 #include "pkg_src.h"
 #include "sprintf_alloc.h"
+#include "opkg_stats.h"
 #include "xfuncs.h"
 
 int pkg_src_init(pkg_src_t * src, const char *name, const char *base_url,
@@ -54,10 +57,10 @@ int pkg_src_init(pkg_src_t * src, const char *name, const char *base_url,
 
 void pkg_src_deinit(pkg_src_t * src)
 {
-    free(src->name);
-    free(src->value);
-    free(src->options);
-    free(src->extra_data);
+    xfree(src->name);
+    xfree(src->value);
+    xfree(src->options);
+    xfree(src->extra_data);
 }
 
 static int pkg_src_download(pkg_src_t * src)
@@ -85,16 +88,10 @@ static int pkg_src_download(pkg_src_t * src)
             goto cleanup;
         }
 
-        if (opkg_config->compress_list_files) {
-            strcat(feed, ".gz");
-            err = file_copy(cache_location, feed);
-        } else {
-            err = file_decompress(cache_location, feed);
-        }
-        free(cache_location);
+        err = file_decompress(cache_location, feed);
+        xfree(cache_location);
         if (err) {
-            opkg_msg(ERROR, "Couldn't %s feed for source %s.",
-                     (opkg_config->compress_list_files) ? "copy" : "decompress",
+            opkg_msg(ERROR, "Couldn't decompress feed for source %s.",
                      src->name);
             goto cleanup;
         }
@@ -102,15 +99,17 @@ static int pkg_src_download(pkg_src_t * src)
         err = opkg_download(url, feed, NULL, NULL);
         if (err)
             goto cleanup;
-        if (opkg_config->compress_list_files)
-            file_gz_compress(feed);
     }
 
+    /* Lists are stored compressed in indexed frames, see list_index.c. */
+    if (opkg_config->compress_list_files)
+        err = list_index_compress(feed, opkg_conf_list_suffix());
+
     opkg_msg(DEBUG, "Downloaded package list for %s.\n", src->name);
 
  cleanup:
-    free(feed);
-    free(url);
+    xfree(feed);
+    xfree(url);
     return err;
 }
 
@@ -147,8 +146,8 @@ static int pkg_src_download_signature(pkg_src_t * src)
     opkg_msg(DEBUG, "Downloaded signature for %s.\n", src->name);
 
  cleanup:
-    free(sigfile);
-    free(url);
+    xfree(sigfile);
+    xfree(url);
     return err;
 }
 
@@ -191,11 +190,11 @@ int pkg_src_verify(pkg_src_t * src)
  cleanup:
     if (err) {
         /* Remove incorrect files. */
-        unlink(feed);
-        unlink(sigfile);
+        opkg_unlink(feed);
+        opkg_unlink(sigfile);
     }
-    free(sigfile);
-    free(feed);
+    xfree(sigfile);
+    xfree(feed);
     return err;
 }
 
@@ -41,7 +41,7 @@ void pkg_src_list_deinit(pkg_src_list_t * list)
         pkg_src_deinit(pkg_src);
 
         /* malloced in pkg_src_list_append */
-        free(pkg_src);
+        xfree(pkg_src);
         iter->data = NULL;
     }
     void_list_deinit((void_list_t *) list);
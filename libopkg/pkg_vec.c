@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <fnmatch.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "pkg.h"
 #include "opkg_message.h"
@@ -43,9 +44,9 @@ void pkg_vec_free(pkg_vec_t * vec)
         return;
 
     if (vec->pkgs)
-        free(vec->pkgs);
+        xfree(vec->pkgs);
 
-    free(vec);
+    xfree(vec);
 }
 
 /*
@@ -54,10 +55,11 @@ void pkg_vec_free(pkg_vec_t * vec)
  *             so identical versions have identical version strings,
  *             implying identical packages; let's marry these
  */
-void pkg_vec_insert_merge(pkg_vec_t * vec, pkg_t * pkg, int set_status)
+int pkg_vec_insert_merge(pkg_vec_t * vec, pkg_t * pkg, int set_status)
 {
     unsigned int i;
     int found = 0;
+    int other_src;
 
     /* look for a duplicate pkg by name, version, and architecture */
     for (i = 0; i < vec->len; i++) {
@@ -85,7 +87,7 @@ void pkg_vec_insert_merge(pkg_vec_t * vec, pkg_t * pkg, int set_status)
         opkg_msg(DEBUG2, "Adding new pkg=%s version=%s arch=%s.\n", pkg->name,
                  pkg->version, pkg->architecture);
         pkg_vec_insert(vec, pkg);
-        return;
+        return 0;
     }
 
     /* update the one that we have */
@@ -98,9 +100,11 @@ void pkg_vec_insert_merge(pkg_vec_t * vec, pkg_t * pkg, int set_status)
     }
 
     /* overwrite the old one */
+    other_src = vec->pkgs[i]->src != pkg->src;
     pkg_deinit(vec->pkgs[i]);
-    free(vec->pkgs[i]);
+    xfree(vec->pkgs[i]);
     vec->pkgs[i] = pkg;
+    return other_src;
 }
 
 void pkg_vec_insert(pkg_vec_t * vec, const pkg_t * pkg)
@@ -165,8 +169,8 @@ void abstract_pkg_vec_free(abstract_pkg_vec_t * vec)
 {
     if (!vec)
         return;
-    free(vec->pkgs);
-    free(vec);
+    xfree(vec->pkgs);
+    xfree(vec);
 }
 
 /*
@@ -187,6 +191,26 @@ abstract_pkg_t *abstract_pkg_vec_get(abstract_pkg_vec_t * vec, int i)
         return NULL;
 }
 
+/*
+ * Remove the first occurrence of pkg, keeping the order of the rest.
+ */
+void abstract_pkg_vec_remove(abstract_pkg_vec_t * vec, abstract_pkg_t * pkg)
+{
+    unsigned int i;
+
+    if (!vec)
+        return;
+
+    for (i = 0; i < vec->len; i++) {
+        if (vec->pkgs[i] == pkg) {
+            memmove(vec->pkgs + i, vec->pkgs + i + 1,
+                    (vec->len - i - 1) * sizeof(abstract_pkg_t *));
+            vec->len--;
+            return;
+        }
+    }
+}
+
 int abstract_pkg_vec_contains(abstract_pkg_vec_t * vec, abstract_pkg_t * apkg)
 {
     unsigned int i;
@@ -45,7 +45,8 @@ struct abstract_pkg_vec {
 pkg_vec_t *pkg_vec_alloc(void);
 void pkg_vec_free(pkg_vec_t * vec);
 
-void pkg_vec_insert_merge(pkg_vec_t * vec, pkg_t * pkg, int set_status);
+/* Returns 1 if pkg took the place of a package from another source. */
+int pkg_vec_insert_merge(pkg_vec_t * vec, pkg_t * pkg, int set_status);
 void pkg_vec_insert(pkg_vec_t * vec, const pkg_t * pkg);
 int pkg_vec_contains(pkg_vec_t * vec, pkg_t * apkg);
 
@@ -60,6 +61,7 @@ void abstract_pkg_vec_free(abstract_pkg_vec_t * vec);
 void abstract_pkg_vec_insert(abstract_pkg_vec_t * vec,
                              abstract_pkg_t * pkg);
 abstract_pkg_t *abstract_pkg_vec_get(abstract_pkg_vec_t * vec, int i);
+void abstract_pkg_vec_remove(abstract_pkg_vec_t * vec, abstract_pkg_t * pkg);
 int abstract_pkg_vec_contains(abstract_pkg_vec_t * vec,
                               abstract_pkg_t * apkg);
 void abstract_pkg_vec_sort(abstract_pkg_vec_t * vec, compare_fcn_t compar);
@@ -26,6 +26,7 @@
 #include "opkg_message.h"
 #include "release.h"
 #include "opkg_utils.h"
+#include "opkg_stats.h"
 #include "xfuncs.h"
 #include "opkg_archive.h"
 
@@ -36,6 +37,7 @@
 
 #include "parse_util.h"
 #include "file_util.h"
+#include "list_index.h"
 
 static void release_init(release_t * release)
 {
@@ -139,7 +141,7 @@ int release_verify_file(release_t * release, const char *file_name,
     int ret = 0;
     int r;
 
-    r = stat(file_name, &f_info);
+    r = opkg_stat(file_name, &f_info);
     if ((r != 0) || (f_info.st_size != release_get_size(release, pathname))) {
         opkg_msg(ERROR, "Size verification failed for %s - %s.\n",
                  release->name, pathname);
@@ -165,9 +167,9 @@ int release_verify_file(release_t * release, const char *file_name,
 
     }
 
-    free(f_md5);
+    xfree(f_md5);
 #if WITH_SHA256
-    free(f_sha256);
+    xfree(f_sha256);
 #endif
 
     return ret;
@@ -187,23 +189,23 @@ void release_deinit(release_t * release)
 {
     unsigned int i;
 
-    free(release->name);
-    free(release->datestring);
+    xfree(release->name);
+    xfree(release->datestring);
 
     for (i = 0; i < release->architectures_count; i++) {
-        free(release->architectures[i]);
+        xfree(release->architectures[i]);
     }
-    free(release->architectures);
+    xfree(release->architectures);
 
     for (i = 0; i < release->components_count; i++) {
-        free(release->components[i]);
+        xfree(release->components[i]);
     }
-    free(release->components);
+    xfree(release->components);
 
     for (i = 0; i < release->complist_count; i++) {
-        free(release->complist[i]);
+        xfree(release->complist[i]);
     }
-    free(release->complist);
+    xfree(release->complist);
 
 }
 
@@ -254,7 +256,7 @@ int release_init_from_file(release_t * release, const char *filename)
 
 cleanup:
     fclose(release_file);
-    free(bp);
+    xfree(bp);
     return err;
 }
 
@@ -331,44 +333,41 @@ int release_download(release_t * release, pkg_src_t * dist, char *lists_dir,
                 if (cache_location) {
                     err = release_verify_file(release, cache_location, subpath);
                     if (err) {
-                        unlink(list_file_name);
+                        opkg_unlink(list_file_name);
                     } else {
-                        if (opkg_config->compress_list_files) {
-                            strcat(list_file_name, ".gz");
-                            err = file_copy(cache_location, list_file_name);
-                        } else {
-                            err = file_decompress(cache_location, list_file_name);
-                        }
-                        if (err) {
-                            opkg_msg(ERROR, "Couldn't %s %s",
-                                    (opkg_config->compress_list_files) ? "copy" : "decompress", url);
-                        }
+                        err = file_decompress(cache_location, list_file_name);
+                        if (err)
+                            opkg_msg(ERROR, "Couldn't decompress %s", url);
+                        else if (opkg_config->compress_list_files)
+                            err = list_index_compress(list_file_name,
+                                                      opkg_conf_list_suffix());
                     }
                 }
-                free(url);
-                free(cache_location);
+                xfree(url);
+                xfree(cache_location);
             }
 
             if (!dist->gzip || err) {
                 sprintf_alloc(&url, "%s-%s/Packages", prefix, nv->name);
                 err = opkg_download(url, list_file_name, NULL, NULL);
                 if (!err) {
-                    if (opkg_config->compress_list_files)
-                        err = file_gz_compress(list_file_name);
                     err = release_verify_file(release, list_file_name, subpath);
                     if (err)
-                        unlink(list_file_name);
+                        opkg_unlink(list_file_name);
+                    else if (opkg_config->compress_list_files)
+                        err = list_index_compress(list_file_name,
+                                                  opkg_conf_list_suffix());
                 }
-                free(url);
+                xfree(url);
             }
 
-            free(list_file_name);
+            xfree(list_file_name);
         }
 
         if (err)
             ret = 1;
 
-        free(prefix);
+        xfree(prefix);
     }
 
     return ret;
@@ -124,7 +124,7 @@ int release_parse_from_stream(release_t * release, FILE * fp)
     buf = xmalloc(len);
     ret = parse_from_stream_nomalloc(release_parse_line, release, fp, 0, &buf,
                                      len);
-    free(buf);
+    xfree(buf);
 
     return ret;
 }
@@ -29,6 +29,7 @@
 #include "opkg_upgrade_internal.h"
 #include "opkg_remove.h"
 #include "pkg.h"
+#include "xfuncs.h"
 
 static void print_dependents_warning(pkg_t *pkg, abstract_pkg_t **dependents)
 {
@@ -104,31 +105,30 @@ int opkg_solver_remove(int num_pkgs, char **pkg_names)
 
                     if (!opkg_config->force_removal_of_dependent_packages) {
                         print_dependents_warning(pkg, dependents);
-                        free(dependents);
+                        xfree(dependents);
                         err = -1;
                         continue;
                     }
 
                     /* get packages depending on this package - Karthik */
                     if (opkg_get_dependent_pkgs(pkg, dependents, pkgs_to_remove)) {
-                        free(dependents);
+                        xfree(dependents);
                         err = -1;
                         continue;
                     }
                 }
-                free(dependents);
+                xfree(dependents);
             }
             pkg_vec_insert(pkgs_to_remove, pkg);
-
-            /* get autoinstalled packages that are orphaned by the removal of
-             * this one */
-            if (opkg_config->autoremove) {
-                if (opkg_get_autoinstalled_pkgs(pkg, pkgs_to_remove))
-                    err = -1;
-            }
         }
     }
 
+    /* get autoinstalled packages that are orphaned by the removal of these */
+    if (opkg_config->autoremove) {
+        if (opkg_get_autoinstalled_pkgs(pkgs_to_remove))
+            err = -1;
+    }
+
     for (i = 0; i < pkgs_to_remove->len; i++) {
         if (opkg_remove_pkg(pkgs_to_remove->pkgs[i])) {
             err = -1;
@@ -261,8 +261,8 @@ int opkg_solver_list_upgradable(int num_pkgs, char **pkg_names) {
         old_v = pkg_version_str_alloc(_old_pkg);
         new_v = pkg_version_str_alloc(_new_pkg);
         printf("%s - %s - %s\n", _old_pkg->name, old_v, new_v);
-        free(old_v);
-        free(new_v);
+        xfree(old_v);
+        xfree(new_v);
     }
     return 0;
 }
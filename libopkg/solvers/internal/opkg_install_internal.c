@@ -16,11 +16,14 @@
      General Public License for more details.
 */
 
+#include "config.h"
+
 #include "opkg_install_internal.h"
 #include "opkg_solver_internal.h"
 #include "pkg_depends.h"
 #include "opkg_install.h"
 #include "opkg_remove.h"
+#include "opkg_space.h"
 #include "opkg_message.h"
 #include "opkg_utils.h"
 #include "pkg_hash.h"
@@ -62,6 +65,36 @@ static int pkg_remove_installed_replacees_unwind(pkg_vec_t *replacees)
     return err;
 }
 
+/* Check the space the packages to install need, net of what the versions
+ * they upgrade and the packages removed with them free, before any of them
+ * is touched. */
+static int check_install_space(pkg_vec_t *pkgs_to_install, pkg_vec_t *replacees,
+                               pkg_vec_t *orphans)
+{
+    opkg_space_plan_t *plan;
+    unsigned int i;
+    int r;
+
+    plan = opkg_space_plan_alloc();
+    for (i = 0; i < pkgs_to_install->len; i++) {
+        pkg_t *pkg = pkgs_to_install->pkgs[i];
+
+        if (pkg->state_status == SS_INSTALLED
+                || pkg->state_status == SS_UNPACKED)
+            continue;
+        opkg_space_plan_install(plan, pkg,
+                                pkg_hash_fetch_installed_by_name(pkg->name));
+    }
+    for (i = 0; i < replacees->len; i++)
+        opkg_space_plan_remove(plan, replacees->pkgs[i]);
+    for (i = 0; i < orphans->len; i++)
+        opkg_space_plan_remove(plan, orphans->pkgs[i]);
+
+    r = opkg_space_plan_check(plan);
+    opkg_space_plan_free(plan);
+    return r;
+}
+
 static int opkg_prepare_install_by_name(const char *pkg_name, pkg_t **pkg)
 {
     int cmp;
@@ -92,13 +125,13 @@ static int opkg_prepare_install_by_name(const char *pkg_name, pkg_t **pkg)
                 0,
                 1);
 
-        free(dependence_to_satisfy);
+        xfree(dependence_to_satisfy);
     } else {
         new = pkg_hash_fetch_best_installation_candidate_by_name(name);
     }
 
-    free(name);
-    free(version);
+    xfree(name);
+    xfree(version);
 
     if (new == NULL) {
         opkg_msg(NOTICE, "Unknown package '%s'.\n", pkg_name);
@@ -130,22 +163,22 @@ static int opkg_prepare_install_by_name(const char *pkg_name, pkg_t **pkg)
         if (cmp == 0) {
             opkg_msg(NOTICE, "Package %s (%s) installed in %s is up to date.\n",
                      old->name, old_version, old->dest->name);
-            free(old_version);
-            free(new_version);
+            xfree(old_version);
+            xfree(new_version);
             return 0;
         } else if (cmp > 0) {
             opkg_msg(NOTICE,
                      "Not downgrading package %s on %s from %s to %s.\n",
                      old->name, old->dest->name, old_version, new_version);
-            free(old_version);
-            free(new_version);
+            xfree(old_version);
+            xfree(new_version);
             return 0;
         } else if (cmp < 0) {
             new->dest = old->dest;
             old->state_want = SW_DEINSTALL;
         }
-        free(old_version);
-        free(new_version);
+        xfree(old_version);
+        xfree(new_version);
     }
 
     new->state_want = SW_INSTALL;
@@ -163,6 +196,11 @@ int opkg_execute_install(pkg_t *pkg, pkg_vec_t *pkgs_to_install, pkg_vec_t *repl
     /* Add top level package to pkgs_to_install vector */
     pkg_vec_insert(pkgs_to_install, pkg);
 
+    if (check_install_space(pkgs_to_install, replacees, orphans)) {
+        errors++;
+        goto out;
+    }
+
     /* Remove orphans */
     pkg_remove_installed(orphans);
 
@@ -198,6 +236,7 @@ int opkg_execute_install(pkg_t *pkg, pkg_vec_t *pkgs_to_install, pkg_vec_t *repl
             errors++;
     }
 
+out:
     if (errors) {
         if (from_upgrade) {
             /* The installation failed so we need to reset the appropriate
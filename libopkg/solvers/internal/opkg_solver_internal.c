@@ -15,13 +15,17 @@
      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
      General Public License for more details.
 */
+#include "config.h"
+
 #include <xfuncs.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "opkg_message.h"
 #include "pkg.h"
 #include "pkg_depends_internal.h"
 #include "opkg_solver_internal.h"
+#include "opkg_profile.h"
 
 /* adds the list of providers of the package being replaced */
 static void pkg_get_provider_replacees(pkg_t *pkg,
@@ -227,60 +231,105 @@ int opkg_get_dependent_pkgs(pkg_t *pkg, abstract_pkg_t **dependents, pkg_vec_t *
     return 0;
 }
 
-/*
-* Find  packages that were autoinstalled and will be orphaned by the removal of pkg.
-*/
-int opkg_get_autoinstalled_pkgs(pkg_t *pkg, pkg_vec_t *dependent_pkgs)
+/* Call fn on each installed package which satisfies a Pre-Depends, Depends
+ * or Recommends of pkg, directly or as a provider. These are the types which
+ * would normally be autoinstalled; SUGGEST is not, and neither CONFLICTS nor
+ * GREEDY_DEPEND keep a package installed.
+ */
+static void foreach_installed_dependency(pkg_t *pkg,
+                                         void (*fn)(pkg_t *, pkg_vec_t *),
+                                         pkg_vec_t *data)
 {
-    int i, j;
-    int err = 0;
-    int n_deps;
-    pkg_t *p;
-    struct compound_depend *cdep;
-
     int count = pkg->pre_depends_count + pkg->depends_count
         + pkg->recommends_count + pkg->suggests_count;
+    int i, j;
+    unsigned int k, l;
 
     for (i = 0; i < count; i++) {
-        cdep = &pkg->depends[i];
-        /* Only remove dependency types which would normally be autoinstalled,
-         * namely the types PREDEPEND, DEPEND and RECOMMEND. We don't consider
-         * SUGGEST which are not normally autoinstalled and we don't consider
-         * CONFLICTS or GREEDY_DEPEND either.
-         */
+        struct compound_depend *cdep = &pkg->depends[i];
         int uninteresting = cdep->type != PREDEPEND
                 && cdep->type != DEPEND
                 && cdep->type != RECOMMEND;
         if (uninteresting)
             continue;
         for (j = 0; j < cdep->possibility_count; j++) {
-            p = pkg_hash_fetch_installed_by_name(cdep->possibilities[j]->pkg->
-                                                 name);
+            abstract_pkg_vec_t *provided_by =
+                    cdep->possibilities[j]->pkg->provided_by;
 
-            /* If the package is not installed, this could have
-             * been a circular dependency and the package has
-             * already been removed.
-             */
-            if (!p)
-                return -1;
+            for (k = 0; k < provided_by->len; k++) {
+                pkg_vec_t *pkgs = provided_by->pkgs[k]->pkgs;
 
-            if (!p->auto_installed)
-                continue;
-
-            n_deps = pkg_has_installed_dependents(p, NULL);
-            if (n_deps == 1) {
-                opkg_msg(NOTICE,
-                         "%s was autoinstalled and is "
-                         "now orphaned, will remove.\n", p->name);
-                pkg_vec_insert(dependent_pkgs, p);
-            } else
-                opkg_msg(INFO,
-                         "%s was autoinstalled and is " "still required by %d "
-                         "installed packages.\n", p->name, n_deps);
+                if (!pkgs)
+                    continue;
+                for (l = 0; l < pkgs->len; l++) {
+                    pkg_t *p = pkgs->pkgs[l];
+                    int installed = (p->state_status == SS_INSTALLED)
+                            || (p->state_status == SS_UNPACKED);
+                    if (installed)
+                        fn(p, data);
+                }
+            }
         }
     }
+}
 
-    return err;
+/* Mark a package kept, queueing it so that its own dependencies are marked. */
+static void mark_kept(pkg_t *pkg, pkg_vec_t *queue)
+{
+    if (pkg->state_flag & SF_MARKED)
+        return;
+    pkg->state_flag |= SF_MARKED;
+    pkg_vec_insert(queue, pkg);
+}
+
+static void sweep_orphan(pkg_t *pkg, pkg_vec_t *pkgs_to_remove)
+{
+    if ((pkg->state_flag & SF_MARKED) || !pkg->auto_installed)
+        return;
+    opkg_msg(NOTICE, "%s was autoinstalled and is now orphaned, will remove.\n",
+             pkg->name);
+    pkg->state_flag |= SF_MARKED;
+    pkg_vec_insert(pkgs_to_remove, pkg);
+}
+
+/*
+ * Add to pkgs_to_remove the autoinstalled packages which are orphaned by its
+ * removal, in one pass over the dependency graph: everything reachable from
+ * the packages which were installed by hand and are staying is marked, and
+ * the unmarked autoinstalled packages that the removed ones depend on, up to
+ * their own dependencies, are swept.
+ */
+int opkg_get_autoinstalled_pkgs(pkg_vec_t *pkgs_to_remove)
+{
+    pkg_vec_t *installed = pkg_vec_alloc();
+    pkg_vec_t *queue = pkg_vec_alloc();
+    unsigned int i;
+
+    pkg_hash_fetch_all_installed(installed, INSTALLED);
+
+    /* The packages being removed are not followed by the marking. */
+    for (i = 0; i < pkgs_to_remove->len; i++)
+        pkgs_to_remove->pkgs[i]->state_flag |= SF_MARKED;
+
+    for (i = 0; i < installed->len; i++) {
+        pkg_t *pkg = installed->pkgs[i];
+        if (!pkg->auto_installed)
+            mark_kept(pkg, queue);
+    }
+    for (i = 0; i < queue->len; i++)
+        foreach_installed_dependency(queue->pkgs[i], mark_kept, queue);
+
+    /* pkgs_to_remove grows as orphans are found, which are then swept for
+     * their own dependencies. */
+    for (i = 0; i < pkgs_to_remove->len; i++)
+        foreach_installed_dependency(pkgs_to_remove->pkgs[i], sweep_orphan,
+                                     pkgs_to_remove);
+
+    pkg_vec_clear_marks(installed);
+    pkg_vec_clear_marks(pkgs_to_remove);
+    pkg_vec_free(queue);
+    pkg_vec_free(installed);
+    return 0;
 }
 
 static int check_conflicts_for(pkg_t *pkg)
@@ -384,8 +433,8 @@ static int opkg_install_check_downgrade(pkg_t *pkg, pkg_t *old_pkg,
                 }
             }
 
-            free(old_version);
-            free(new_version);
+            xfree(old_version);
+            xfree(new_version);
         }
 
         /* Do nothing if package already up-to-date. */
@@ -406,26 +455,35 @@ static int opkg_install_check_downgrade(pkg_t *pkg, pkg_t *old_pkg,
     return 0;
 }
 
+/* Only the packages of the abstract packages which provide pkg, or in the
+ * strict case its one virtual package, can provide it, so only those are
+ * looked at rather than every package in the hash. */
 static int is_provides_installed(pkg_t *pkg, int strict)
 {
-    int i, ret = 0;
-    pkg_vec_t *available_pkgs = pkg_vec_alloc();
-
-    pkg_hash_fetch_all_installed(available_pkgs, INSTALLED_TOBE_INSTALLED);
-
-    for (i = 0; i < available_pkgs->len; i++) {
-        pkg_t *installed_pkg = available_pkgs->pkgs[i];
-        /* Return true if the installed_pkg provides pkg, is not pkg, and is
-         * not set to be removed (issue 121) */
-        if (is_pkg_a_provides(pkg, installed_pkg, strict)
-                && (strcmp(pkg->name, installed_pkg->name))
-                && (installed_pkg->state_want == SW_INSTALL)) {
-            ret = 1;
-            break;
+    abstract_pkg_vec_t *providers[2];
+    int n = 0, i;
+    unsigned int j, k;
+
+    providers[n++] = pkg->parent->provided_by;
+    if (strict && pkg->provides_count == 2)
+        providers[n++] = pkg->provides[1]->provided_by;
+
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < providers[i]->len; j++) {
+            pkg_vec_t *vec = providers[i]->pkgs[j]->pkgs;
+
+            for (k = 0; vec && k < vec->len; k++) {
+                pkg_t *installed_pkg = vec->pkgs[k];
+                /* Return true if the installed_pkg provides pkg, is not pkg,
+                 * and is not set to be removed (issue 121) */
+                if (installed_pkg->state_want == SW_INSTALL
+                        && strcmp(pkg->name, installed_pkg->name)
+                        && is_pkg_a_provides(pkg, installed_pkg, strict))
+                    return 1;
+            }
         }
     }
-    pkg_vec_free(available_pkgs);
-    return ret;
+    return 0;
 }
 
 static int calculate_dependencies_for(pkg_t *pkg, pkg_vec_t *pkgs_to_install, pkg_vec_t *replacees, pkg_vec_t *orphans)
@@ -446,10 +504,10 @@ static int calculate_dependencies_for(pkg_t *pkg, pkg_vec_t *pkgs_to_install, pk
         tmp = unresolved;
         while (*unresolved) {
             opkg_message(ERROR, "\t%s", *unresolved);
-            free(*unresolved);
+            xfree(*unresolved);
             unresolved++;
         }
-        free(tmp);
+        xfree(tmp);
         opkg_message(ERROR, "\n");
         opkg_msg(INFO,
             "This could mean that your package list is out of date or that the packages\n"
@@ -561,7 +619,7 @@ cleanup:
     return err;
 }
 
-int internal_solver_solv(typeId  transactionType, pkg_t *pkg, pkg_vec_t *pkgs_to_install, pkg_vec_t *replacees, pkg_vec_t *orphans)
+static int solve_pkg(typeId transactionType, pkg_t *pkg, pkg_vec_t *pkgs_to_install, pkg_vec_t *replacees, pkg_vec_t *orphans)
 {
     int err = 0;
     int from_upgrade = (transactionType == SOLVER_TRANSACTION_UPGRADE);
@@ -622,6 +680,21 @@ int internal_solver_solv(typeId  transactionType, pkg_t *pkg, pkg_vec_t *pkgs_to
     return 0;
 }
 
+int internal_solver_solv(typeId  transactionType, pkg_t *pkg, pkg_vec_t *pkgs_to_install, pkg_vec_t *replacees, pkg_vec_t *orphans)
+{
+    int span = opkg_profile_begin("solver solve", pkg->name);
+    opkg_mem_tag_t mem = opkg_mem_enter(OPKG_MEM_SOLVER);
+    int err;
+
+    pkg_depends_solve_begin();
+    err = solve_pkg(transactionType, pkg, pkgs_to_install, replacees, orphans);
+    pkg_depends_solve_end();
+
+    opkg_mem_leave(mem);
+    opkg_profile_end(span);
+    return err;
+}
+
 char *opkg_solver_version_alloc(void)
 {
     return NULL;
@@ -34,7 +34,7 @@ typedef enum typeId typeId;
 
 int pkg_has_installed_dependents(pkg_t *pkg, abstract_pkg_t ***pdependents);
 int opkg_get_dependent_pkgs(pkg_t *pkg, abstract_pkg_t **dependents, pkg_vec_t *dependent_pkgs);
-int opkg_get_autoinstalled_pkgs(pkg_t *pkg, pkg_vec_t *dependent_pkgs);
+int opkg_get_autoinstalled_pkgs(pkg_vec_t *pkgs_to_remove);
 int internal_solver_solv(typeId  transactionType, pkg_t *pkg, pkg_vec_t *pkgs_to_install, pkg_vec_t *replacees, pkg_vec_t *orphans);
 
 #ifdef __cplusplus
@@ -19,6 +19,8 @@
    General Public License for more details.
 */
 
+#include "config.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -26,6 +28,8 @@
 #include "opkg_install_internal.h"
 #include "opkg_solver_internal.h"
 #include "opkg_message.h"
+#include "opkg_space.h"
+#include "pkg_hash.h"
 #include "xfuncs.h"
 
 static int opkg_prepare_upgrade_pkg(pkg_t * old, pkg_t ** pkg)
@@ -54,7 +58,7 @@ static int opkg_prepare_upgrade_pkg(pkg_t * old, pkg_t ** pkg)
         opkg_msg(NOTICE,
                  "Assuming locally installed package %s (%s) "
                  "is up to date.\n", old->name, old_version);
-        free(old_version);
+        xfree(old_version);
         return 0;
     }
 
@@ -69,22 +73,22 @@ static int opkg_prepare_upgrade_pkg(pkg_t * old, pkg_t ** pkg)
     if (cmp == 0) {
         opkg_msg(INFO, "Package %s (%s) installed in %s is up to date.\n",
                  old->name, old_version, old->dest->name);
-        free(old_version);
-        free(new_version);
+        xfree(old_version);
+        xfree(new_version);
         return 0;
     } else if (cmp > 0) {
         opkg_msg(NOTICE, "Not downgrading package %s on %s from %s to %s.\n",
                  old->name, old->dest->name, old_version, new_version);
-        free(old_version);
-        free(new_version);
+        xfree(old_version);
+        xfree(new_version);
         return 0;
     } else if (cmp < 0) {
         new->dest = old->dest;
         old->state_want = SW_DEINSTALL;
     }
 
-    free(old_version);
-    free(new_version);
+    xfree(old_version);
+    xfree(new_version);
 
     new->state_flag = old->state_flag;
     new->state_want = SW_INSTALL;
@@ -123,6 +127,35 @@ cleanup:
     return r;
 }
 
+static int check_upgrade_space(pkg_vec_t *upgrade_pkgs)
+{
+    opkg_space_plan_t *plan;
+    unsigned int i;
+    pkg_t *new, *old;
+    int r;
+
+    plan = opkg_space_plan_alloc();
+    for (i = 0; i < upgrade_pkgs->len; i++) {
+        new = upgrade_pkgs->pkgs[i];
+        opkg_space_plan_install(plan, new,
+                                pkg_hash_fetch_installed_by_name(new->name));
+    }
+    r = opkg_space_plan_check(plan);
+    opkg_space_plan_free(plan);
+    if (r == 0)
+        return 0;
+
+    /* Undo what opkg_prepare_upgrade_pkg() marked. */
+    for (i = 0; i < upgrade_pkgs->len; i++) {
+        new = upgrade_pkgs->pkgs[i];
+        old = pkg_hash_fetch_installed_by_name(new->name);
+        if (old)
+            old->state_want = SW_INSTALL;
+        new->state_want = SW_UNKNOWN;
+    }
+    return -1;
+}
+
 int opkg_upgrade_multiple_pkgs(pkg_vec_t * pkgs_to_upgrade)
 {
     int r;
@@ -146,6 +179,14 @@ int opkg_upgrade_multiple_pkgs(pkg_vec_t * pkgs_to_upgrade)
         pkg_vec_insert(upgrade_pkgs, new);
     }
 
+    /* Dependencies are only known as each package is solved, but the
+     * upgrades themselves are checked for space before any is done. */
+    r = check_upgrade_space(upgrade_pkgs);
+    if (r) {
+        pkg_vec_free(upgrade_pkgs);
+        return -1;
+    }
+
     for (i = 0; i < upgrade_pkgs->len; i++) {
         pkgs_to_install = pkg_vec_alloc();
         replacees = pkg_vec_alloc();
@@ -16,12 +16,16 @@
    General Public License for more details.
 */
 
+#include "config.h"
+
 #include "xfuncs.h"
 #include "pkg.h"
 #include "opkg_message.h"
 #include "pkg_depends.h"
 
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 static char **merge_unresolved(char **oldstuff, char **newstuff)
 {
@@ -75,10 +79,306 @@ static int pkg_installed_and_constraint_satisfied(pkg_t *pkg, void *cdata)
         && version_constraints_satisfied(depend, pkg));
 }
 
+/*
+ * State kept for one solve: the abstract packages whose dependencies have
+ * been checked, the best candidate found for each (abstract package,
+ * constraint) pair, and hashed sets mirroring the vectors of packages to
+ * install, for the membership tests. Candidates are only kept for one walk
+ * of the dependencies, as the packages marked for install between walks can
+ * change them (see pkg_breaks_reverse_dep()).
+ */
+
+struct memo_candidate {
+    const depend_t *depend;     /* NULL for an empty slot */
+    int installed;              /* installed satisfiers only */
+    pkg_t *pkg;
+};
+
+struct memo_pkg_set {
+    const pkg_vec_t *vec;
+    unsigned int synced;        /* entries of vec added so far */
+    pkg_t **slots;
+    unsigned int n_slots;
+    unsigned int count;
+    struct memo_pkg_set *next;
+};
+
+struct dep_memo {
+    unsigned int depth;
+
+    abstract_pkg_t **checked;
+    unsigned int n_checked_slots;
+    unsigned int n_checked;
+
+    struct memo_candidate *candidates;
+    unsigned int n_candidate_slots;
+    unsigned int n_candidates;
+    unsigned long lookups;
+    unsigned long hits;
+
+    struct memo_pkg_set *sets;
+};
+
+static struct dep_memo *memo;
+
+static unsigned int hash_ptr(const void *p)
+{
+    uintptr_t v = (uintptr_t)p;
+
+    v ^= v >> 17;
+    return (unsigned int)(v * 0x9e3779b1u);
+}
+
+static unsigned int hash_str(unsigned int h, const char *s)
+{
+    while (s && *s)
+        h = h * 33 + (unsigned char)*s++;
+    return h;
+}
+
+static unsigned int hash_depend(const depend_t *depend, int installed)
+{
+    unsigned int h = hash_ptr(depend->pkg);
+
+    h = h * 33 + depend->constraint;
+    h = h * 33 + installed;
+    return hash_str(h, depend->version);
+}
+
+static int same_depend(const depend_t *a, const depend_t *b)
+{
+    if (a->pkg != b->pkg || a->constraint != b->constraint)
+        return 0;
+    if (!a->version || !b->version)
+        return a->version == b->version;
+    return strcmp(a->version, b->version) == 0;
+}
+
+/* Packages are the same for is_pkg_in_pkg_vec() when their name, version
+ * and architecture are, so they are hashed by name and architecture. */
+static unsigned int hash_pkg(const pkg_t *pkg)
+{
+    return hash_str(hash_str(5381, pkg->name), pkg->architecture);
+}
+
+static int same_pkg(pkg_t *a, pkg_t *b)
+{
+    return strcmp(a->name, b->name) == 0
+        && pkg_compare_versions(a, b) == 0
+        && strcmp(a->architecture, b->architecture) == 0;
+}
+
+static void checked_grow(void)
+{
+    abstract_pkg_t **old = memo->checked;
+    unsigned int n = memo->n_checked_slots, i, j;
+
+    memo->n_checked_slots = n ? 2 * n : 256;
+    memo->checked = xcalloc(memo->n_checked_slots, sizeof(abstract_pkg_t *));
+    for (i = 0; i < n; i++) {
+        if (!old[i])
+            continue;
+        j = hash_ptr(old[i]) & (memo->n_checked_slots - 1);
+        while (memo->checked[j])
+            j = (j + 1) & (memo->n_checked_slots - 1);
+        memo->checked[j] = old[i];
+    }
+    xfree(old);
+}
+
+/* Mark the dependencies of ab_pkg checked, returning 1 if they already were. */
+static int memo_check(abstract_pkg_t *ab_pkg)
+{
+    unsigned int j;
+
+    if (2 * (memo->n_checked + 1) > memo->n_checked_slots)
+        checked_grow();
+    j = hash_ptr(ab_pkg) & (memo->n_checked_slots - 1);
+    while (memo->checked[j]) {
+        if (memo->checked[j] == ab_pkg)
+            return 1;
+        j = (j + 1) & (memo->n_checked_slots - 1);
+    }
+    memo->checked[j] = ab_pkg;
+    memo->n_checked++;
+    return 0;
+}
+
+static int memo_is_checked(abstract_pkg_t *ab_pkg)
+{
+    unsigned int j;
+
+    if (!memo->n_checked_slots)
+        return 0;
+    j = hash_ptr(ab_pkg) & (memo->n_checked_slots - 1);
+    while (memo->checked[j]) {
+        if (memo->checked[j] == ab_pkg)
+            return 1;
+        j = (j + 1) & (memo->n_checked_slots - 1);
+    }
+    return 0;
+}
+
+static void candidates_grow(void)
+{
+    struct memo_candidate *old = memo->candidates;
+    unsigned int n = memo->n_candidate_slots, i, j;
+
+    memo->n_candidate_slots = n ? 2 * n : 256;
+    memo->candidates = xcalloc(memo->n_candidate_slots,
+                               sizeof(struct memo_candidate));
+    for (i = 0; i < n; i++) {
+        if (!old[i].depend)
+            continue;
+        j = hash_depend(old[i].depend, old[i].installed)
+            & (memo->n_candidate_slots - 1);
+        while (memo->candidates[j].depend)
+            j = (j + 1) & (memo->n_candidate_slots - 1);
+        memo->candidates[j] = old[i];
+    }
+    xfree(old);
+}
+
+/* The best installation candidate satisfying depend, among the installed
+ * packages if installed is set, looked up once per solve. */
+static pkg_t *memo_candidate(depend_t *depend, int installed)
+{
+    struct memo_candidate *c;
+    unsigned int j;
+
+    memo->lookups++;
+    if (2 * (memo->n_candidates + 1) > memo->n_candidate_slots)
+        candidates_grow();
+    j = hash_depend(depend, installed) & (memo->n_candidate_slots - 1);
+    while ((c = &memo->candidates[j])->depend) {
+        if (c->installed == installed && same_depend(c->depend, depend)) {
+            memo->hits++;
+            return c->pkg;
+        }
+        j = (j + 1) & (memo->n_candidate_slots - 1);
+    }
+
+    c->depend = depend;
+    c->installed = installed;
+    c->pkg = pkg_hash_fetch_best_installation_candidate(depend->pkg,
+            installed ? pkg_installed_and_constraint_satisfied
+                      : pkg_constraint_satisfied,
+            depend, 0, 1);
+    memo->n_candidates++;
+    return c->pkg;
+}
+
+static void pkg_set_add(struct memo_pkg_set *set, pkg_t *pkg)
+{
+    unsigned int j;
+
+    if (2 * (set->count + 1) > set->n_slots) {
+        pkg_t **old = set->slots;
+        unsigned int n = set->n_slots, i;
+
+        set->n_slots = n ? 2 * n : 64;
+        set->slots = xcalloc(set->n_slots, sizeof(pkg_t *));
+        set->count = 0;
+        for (i = 0; i < n; i++)
+            if (old[i])
+                pkg_set_add(set, old[i]);
+        xfree(old);
+    }
+
+    j = hash_pkg(pkg) & (set->n_slots - 1);
+    while (set->slots[j]) {
+        if (same_pkg(set->slots[j], pkg))
+            return;
+        j = (j + 1) & (set->n_slots - 1);
+    }
+    set->slots[j] = pkg;
+    set->count++;
+}
+
+/* As is_pkg_in_pkg_vec(), through a set which follows the vector as it grows
+ * by pkg_vec_insert(). */
+static int memo_in_vec(pkg_vec_t *vec, pkg_t *pkg)
+{
+    struct memo_pkg_set *set;
+    unsigned int j;
+
+    for (set = memo->sets; set; set = set->next)
+        if (set->vec == vec)
+            break;
+    if (!set) {
+        set = xcalloc(1, sizeof(struct memo_pkg_set));
+        set->vec = vec;
+        set->next = memo->sets;
+        memo->sets = set;
+    }
+    for (; set->synced < vec->len; set->synced++)
+        pkg_set_add(set, vec->pkgs[set->synced]);
+
+    if (!set->count)
+        return 0;
+    j = hash_pkg(pkg) & (set->n_slots - 1);
+    while (set->slots[j]) {
+        if (same_pkg(set->slots[j], pkg))
+            return 1;
+        j = (j + 1) & (set->n_slots - 1);
+    }
+    return 0;
+}
+
+static void memo_clear_candidates(void)
+{
+    if (memo->n_candidates)
+        memset(memo->candidates, 0,
+               memo->n_candidate_slots * sizeof(struct memo_candidate));
+    memo->n_candidates = 0;
+}
+
+/* Drop the set of a vector which is about to be freed. */
+static void memo_forget_vec(pkg_vec_t *vec)
+{
+    struct memo_pkg_set **p, *set;
+
+    for (p = &memo->sets; (set = *p) != NULL; p = &set->next) {
+        if (set->vec == vec) {
+            *p = set->next;
+            xfree(set->slots);
+            xfree(set);
+            return;
+        }
+    }
+}
+
+void pkg_depends_solve_begin(void)
+{
+    if (!memo)
+        memo = xcalloc(1, sizeof(struct dep_memo));
+    memo->depth++;
+}
+
+void pkg_depends_solve_end(void)
+{
+    struct memo_pkg_set *set, *next;
+
+    if (!memo || --memo->depth)
+        return;
+
+    opkg_msg(DEBUG2, "Dependency memo: %u packages checked, %lu of %lu "
+             "candidate lookups memoized.\n", memo->n_checked, memo->hits,
+             memo->lookups);
+    for (set = memo->sets; set; set = next) {
+        next = set->next;
+        xfree(set->slots);
+        xfree(set);
+    }
+    xfree(memo->checked);
+    xfree(memo->candidates);
+    xfree(memo);
+    memo = NULL;
+}
+
 /* returns ndependencies or negative error value */
-int pkg_hash_fetch_unsatisfied_dependencies(pkg_t *pkg,
-                                            pkg_vec_t *unsatisfied,
-                                            char ***unresolved)
+static int fetch_unsatisfied_dependencies(pkg_t *pkg, pkg_vec_t *unsatisfied,
+                                          char ***unresolved)
 {
     pkg_t *satisfier_entry_pkg;
     int i, j;
@@ -97,15 +397,13 @@ int pkg_hash_fetch_unsatisfied_dependencies(pkg_t *pkg,
         *unresolved = NULL;
         return 0;
     }
-    if (ab_pkg->dependencies_checked) { /* avoid duplicate or cyclic checks */
+    if (memo_check(ab_pkg)) { /* avoid duplicate or cyclic checks */
         opkg_msg(DEBUG2, "Already checked dependencies for '%s'.\n",
                  ab_pkg->name);
         *unresolved = NULL;
         return 0;
-    } else {
-        opkg_msg(DEBUG2, "Checking dependencies for '%s'.\n", ab_pkg->name);
-        ab_pkg->dependencies_checked = 1;       /* mark it for subsequent visits */
     }
+    opkg_msg(DEBUG2, "Checking dependencies for '%s'.\n", ab_pkg->name);
     count = pkg->pre_depends_count + pkg->depends_count + pkg->recommends_count
         + pkg->suggests_count;
     if (!count) {
@@ -145,14 +443,14 @@ int pkg_hash_fetch_unsatisfied_dependencies(pkg_t *pkg,
                         pkg_t *pkg_scout = test_vec->pkgs[k];
                         /* not installed, and not already known about? */
                         int wanted = (pkg_scout->state_want != SW_INSTALL)
-                                && !pkg_scout->parent->dependencies_checked
-                                && !is_pkg_in_pkg_vec(unsatisfied, pkg_scout);
+                                && !memo_is_checked(pkg_scout->parent)
+                                && !memo_in_vec(unsatisfied, pkg_scout);
                         if (wanted) {
                             char **newstuff = NULL;
                             int rc;
                             pkg_vec_t *tmp_vec = pkg_vec_alloc();
                             /* check for not-already-installed dependencies */
-                            rc = pkg_hash_fetch_unsatisfied_dependencies(pkg_scout,
+                            rc = fetch_unsatisfied_dependencies(pkg_scout,
                                     tmp_vec, &newstuff);
                             if (newstuff == NULL) {
                                 int m;
@@ -168,7 +466,6 @@ int pkg_hash_fetch_unsatisfied_dependencies(pkg_t *pkg,
                                     ok = 0;
                                     break;
                                 }
-                                pkg_vec_free(tmp_vec);
                                 if (ok) {
                                     /* mark this one for installation */
                                     opkg_msg(NOTICE,
@@ -181,8 +478,10 @@ int pkg_hash_fetch_unsatisfied_dependencies(pkg_t *pkg,
                                 opkg_msg(DEBUG,
                                          "Not installing %s due to "
                                          "broken depends.\n", pkg_scout->name);
-                                free(newstuff);
+                                xfree(newstuff);
                             }
+                            memo_forget_vec(tmp_vec);
+                            pkg_vec_free(tmp_vec);
                         }
                     }
                 }
@@ -195,13 +494,7 @@ int pkg_hash_fetch_unsatisfied_dependencies(pkg_t *pkg,
         for (j = 0; j < compound_depend->possibility_count; j++) {
             /* foreach provided_by, which includes the abstract_pkg itself */
             depend_t *dependence_to_satisfy = possible_satisfiers[j];
-            abstract_pkg_t *satisfying_apkg = possible_satisfiers[j]->pkg;
-            pkg_t *satisfying_pkg = pkg_hash_fetch_best_installation_candidate(
-                    satisfying_apkg,
-                    pkg_installed_and_constraint_satisfied,
-                    dependence_to_satisfy,
-                    0,
-                    1);
+            pkg_t *satisfying_pkg = memo_candidate(dependence_to_satisfy, 1);
             opkg_msg(DEBUG, "satisfying_pkg=%p\n", satisfying_pkg);
             if (satisfying_pkg != NULL) {
                 found = 1;
@@ -214,13 +507,8 @@ int pkg_hash_fetch_unsatisfied_dependencies(pkg_t *pkg,
             for (j = 0; j < compound_depend->possibility_count; j++) {
                 /* foreach provided_by, which includes the abstract_pkg itself */
                 depend_t *dependence_to_satisfy = possible_satisfiers[j];
-                abstract_pkg_t *satisfying_apkg = possible_satisfiers[j]->pkg;
-                pkg_t *satisfying_pkg = pkg_hash_fetch_best_installation_candidate(
-                        satisfying_apkg,
-                        pkg_constraint_satisfied,
-                        dependence_to_satisfy,
-                        0,
-                        1);
+                pkg_t *satisfying_pkg = memo_candidate(dependence_to_satisfy,
+                                                       0);
                 opkg_msg(DEBUG, "satisfying_pkg=%p\n", satisfying_pkg);
                 if (!satisfying_pkg)
                     continue;
@@ -276,15 +564,14 @@ int pkg_hash_fetch_unsatisfied_dependencies(pkg_t *pkg,
                     char **newstuff = NULL;
 
                     int not_seen_before = satisfier_entry_pkg != pkg
-                            && !is_pkg_in_pkg_vec(unsatisfied,
-                                    satisfier_entry_pkg);
+                            && !memo_in_vec(unsatisfied, satisfier_entry_pkg);
                     if (not_seen_before) {
                         pkg_vec_insert(unsatisfied, satisfier_entry_pkg);
-                        pkg_hash_fetch_unsatisfied_dependencies(satisfier_entry_pkg,
+                        fetch_unsatisfied_dependencies(satisfier_entry_pkg,
                                 unsatisfied, &newstuff);
                         the_lost = merge_unresolved(the_lost, newstuff);
                         if (newstuff)
-                            free(newstuff);
+                            xfree(newstuff);
                     }
                 }
             }
@@ -295,6 +582,23 @@ int pkg_hash_fetch_unsatisfied_dependencies(pkg_t *pkg,
     return unsatisfied->len;
 }
 
+/* Outside of a solve, a call is a solve of its own. Within one, the caller
+ * goes on to change or free unsatisfied, so its set is dropped: a vector
+ * allocated later at the same address must not inherit it. */
+int pkg_hash_fetch_unsatisfied_dependencies(pkg_t *pkg,
+                                            pkg_vec_t *unsatisfied,
+                                            char ***unresolved)
+{
+    int r;
+
+    pkg_depends_solve_begin();
+    r = fetch_unsatisfied_dependencies(pkg, unsatisfied, unresolved);
+    memo_forget_vec(unsatisfied);
+    memo_clear_candidates();
+    pkg_depends_solve_end();
+    return r;
+}
+
 pkg_vec_t *pkg_hash_fetch_satisfied_dependencies(pkg_t *pkg)
 {
     pkg_vec_t *satisfiers;
@@ -25,6 +25,11 @@
 extern "C" {
 #endif
 
+/* Dependency lookups are memoized for the duration of a solve. Solves may
+ * nest; the memo is dropped when the outermost one ends. */
+void pkg_depends_solve_begin(void);
+void pkg_depends_solve_end(void);
+
 int pkg_hash_fetch_unsatisfied_dependencies(pkg_t *pkg,
                                             pkg_vec_t *depends,
                                             char ***unresolved);
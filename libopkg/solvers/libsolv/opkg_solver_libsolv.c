@@ -17,6 +17,8 @@
    General Public License for more details.
 */
 
+#include "config.h"
+
 #include <stdlib.h>
 
 #include <solv/pool.h>
@@ -29,10 +31,12 @@
 #include "opkg_install.h"
 #include "opkg_download.h"
 #include "opkg_remove.h"
+#include "opkg_space.h"
 #include "opkg_message.h"
 #include "opkg_utils.h"
 #include "pkg_vec.h"
 #include "pkg_hash.h"
+#include "opkg_profile.h"
 #include "xfuncs.h"
 #include "sprintf_alloc.h"
 
@@ -142,8 +146,8 @@ int opkg_solver_install(int num_pkgs, char **pkg_names)
         }
 
         dataiterator_free(&di);
-        free(name);
-        free(version);
+        xfree(name);
+        xfree(version);
     }
 
     err = libsolv_solver_solve(solver);
@@ -332,7 +336,7 @@ static void libsolv_solver_set_arch_policy(libsolv_solver_t *libsolv_solver)
     }
 
  SET_ARCH_POLICY_AND_EXIT:
-    free(archs);
+    xfree(archs);
     opkg_msg(DEBUG2, "libsolv arch policy: %s\n", arch_policy);
     pool_setarchpolicy(libsolv_solver->pool, arch_policy);
 }
@@ -416,7 +420,7 @@ static void pkg2solvable(pkg_t *pkg, Solvable *solvable_out, int installed)
 
     char *version = pkg_version_str_alloc(pkg);
     Id versionId = pool_str2id(pool, version, 1);
-    free(version);
+    xfree(version);
 
     /* set the solvable version */
     solvable_out->evr = versionId;
@@ -538,7 +542,7 @@ static void populate_installed_repo(libsolv_solver_t *libsolv_solver)
         opkg_message(DEBUG2, "Installed package: %s - %s\n",
                      pkg->name, version);
 
-        free(version);
+        xfree(version);
 
         /* add a new solvable to the installed packages repo */
         Id solvable_id = repo_add_solvable(libsolv_solver->repo_installed);
@@ -627,7 +631,7 @@ static void populate_available_repos(libsolv_solver_t *libsolv_solver)
                 solvable_id = pool_str2id(libsolv_solver->pool, pkg->name, 1);
                 queue_push2(&libsolv_solver->solver_jobs, SOLVER_SOLVABLE_PROVIDES
                             | SOLVER_INSTALL, solvable_id);
-                free(version);
+                xfree(version);
                 continue;
             } else {
                 solvable_id = repo_add_solvable(libsolv_solver->repo_to_install);
@@ -648,7 +652,7 @@ static void populate_available_repos(libsolv_solver_t *libsolv_solver)
             solvable_id = repo_add_solvable(libsolv_solver->repo_available);
         }
 
-        free(version);
+        xfree(version);
 
         /* set solvable attributes using the package */
         solvable = pool_id2solvable(libsolv_solver->pool, solvable_id);
@@ -688,6 +692,8 @@ static void printsolution_callback(struct s_Pool *pool, void *data, int type, co
 
 static int libsolv_solver_init(libsolv_solver_t *libsolv_solver)
 {
+    int span;
+
     /* initialize the solver job queue */
     queue_init(&libsolv_solver->solver_jobs);
 
@@ -721,6 +727,8 @@ static int libsolv_solver_init(libsolv_solver_t *libsolv_solver)
         return -1;
     }
 
+    span = opkg_profile_begin("solver populate", NULL);
+
     /* read in repo of installed packages */
     populate_installed_repo(libsolv_solver);
 
@@ -733,6 +741,8 @@ static int libsolv_solver_init(libsolv_solver_t *libsolv_solver)
     /* create index of what each package provides */
     pool_createwhatprovides(libsolv_solver->pool);
 
+    opkg_profile_end(span);
+
     /* create the solver with the solver pool */
     libsolv_solver->solver = solver_create(libsolv_solver->pool);
 
@@ -770,10 +780,12 @@ static int libsolv_solver_init(libsolv_solver_t *libsolv_solver)
 static libsolv_solver_t *libsolv_solver_new(void)
 {
     libsolv_solver_t *libsolv_solver;
+    opkg_mem_tag_t mem = opkg_mem_enter(OPKG_MEM_SOLVER);
     int err;
 
     libsolv_solver = xcalloc(1, sizeof(libsolv_solver_t));
     err = libsolv_solver_init(libsolv_solver);
+    opkg_mem_leave(mem);
     if (err) {
         opkg_message(ERROR, "Could not initialize libsolv solver\n");
         libsolv_solver_free(libsolv_solver);
@@ -862,9 +874,13 @@ static void libsolv_print_all_problem_rules(libsolv_solver_t *libsolv_solver, Id
 
 static int libsolv_solver_solve(libsolv_solver_t *libsolv_solver)
 {
+    int span = opkg_profile_begin("solver solve", NULL);
     int problem_count = solver_solve(libsolv_solver->solver,
                                      &libsolv_solver->solver_jobs);
 
+    opkg_profile_end(span);
+    opkg_mem_report("solve");
+
     /* print out all problems and recommended solutions */
     if (problem_count) {
         opkg_message(ERROR, "Solver encountered %d problem(s):\n", problem_count);
@@ -898,7 +914,7 @@ static void libsolv_solver_free(libsolv_solver_t *libsolv_solver)
         solver_free(libsolv_solver->solver);
     queue_free(&libsolv_solver->solver_jobs);
     pool_free(libsolv_solver->pool);
-    free(libsolv_solver);
+    xfree(libsolv_solver);
 }
 
 static int requires_download(Id typeId)
@@ -911,11 +927,13 @@ static int requires_download(Id typeId)
 static int libsolv_solver_transaction_preamble(libsolv_solver_t *libsolv_solver, pkg_vec_t *pkgs, Transaction *transaction, int no_action)
 {
     pkg_t *pkg;
-    int i;
+    opkg_space_plan_t *plan;
+    int i, r;
 
     /* order the transaction so dependencies are handled first */
     transaction_order(transaction, 0);
 
+    plan = opkg_space_plan_alloc();
     for (i = 0; i < transaction->steps.count; i++) {
         Id stepId = transaction->steps.elements[i];
         Solvable *solvable = pool_id2solvable(libsolv_solver->pool, stepId);
@@ -932,6 +950,28 @@ static int libsolv_solver_transaction_preamble(libsolv_solver_t *libsolv_solver,
         pkg = pkg_hash_fetch_by_name_version_arch(pkg_name, evr, arch);
         pkg_vec_insert(pkgs, pkg);
 
+        if (typeId == SOLVER_TRANSACTION_ERASE)
+            opkg_space_plan_remove(plan, pkg);
+        else if (requires_download(typeId))
+            opkg_space_plan_install(plan, pkg,
+                    pkg_hash_fetch_installed_by_name(pkg->name));
+    }
+
+    /* Check the space for the whole transaction before any of it is done */
+    r = opkg_space_plan_check(plan);
+    opkg_space_plan_free(plan);
+    if (r)
+        return -1;
+
+    for (i = 0; i < transaction->steps.count; i++) {
+        Id stepId = transaction->steps.elements[i];
+        Id typeId = transaction_type(transaction, stepId,
+                SOLVER_TRANSACTION_SHOW_ACTIVE |
+                SOLVER_TRANSACTION_CHANGE_IS_REINSTALL |
+                SOLVER_TRANSACTION_SHOW_OBSOLETES |
+                SOLVER_TRANSACTION_OBSOLETE_IS_UPGRADE);
+
+        pkg = pkgs->pkgs[i];
         if (!no_action && pkg->local_filename == NULL &&
             opkg_config->download_first && requires_download(typeId)) {
             if (opkg_download_pkg(pkg)) {
@@ -1047,7 +1087,7 @@ static int libsolv_solver_execute_transaction(libsolv_solver_t *libsolv_solver)
 
                         opkg_message(NOTICE, "Upgrading %s (%s) to %s (%s) on %s\n",
                                      old->name, old_version, pkg->name, pkg->version, pkg->dest->name);
-                        free(old_version);
+                        xfree(old_version);
                     }
                 } else {
                     if (pkg->dest == NULL)
@@ -1108,8 +1148,8 @@ static int libsolv_solver_print_transaction(libsolv_solver_t *libsolv_solver)
                 new_v = pkg_version_str_alloc(pkg);
                 old_v = pkg_version_str_alloc(old);
                 printf("%s - %s - %s\n", pkg->name, old_v, new_v);
-                free(new_v);
-                free(old_v);
+                xfree(new_v);
+                xfree(old_v);
                 break;
             default:
                 break;
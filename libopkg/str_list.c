@@ -35,7 +35,7 @@ void str_list_elt_init(str_list_elt_t * elt, char *data)
 void str_list_elt_deinit(str_list_elt_t * elt)
 {
     if (elt->data)
-        free(elt->data);
+        xfree(elt->data);
     void_list_elt_deinit((void_list_elt_t *) elt);
 }
 
@@ -59,9 +59,9 @@ void str_list_deinit(str_list_t * list)
         if (!elt)
             return;
         list_del_init(&elt->node);
-        free(elt->data);
+        xfree(elt->data);
         elt->data = NULL;
-        free(elt);
+        xfree(elt);
     }
 }
 
@@ -81,7 +81,7 @@ void str_list_remove(str_list_t * list, str_list_elt_t ** iter)
                                  (void_list_elt_t **) iter);
 
     if (str)
-        free(str);
+        xfree(str);
 }
 
 void str_list_remove_elt(str_list_t * list, const char *target_str)
@@ -90,7 +90,7 @@ void str_list_remove_elt(str_list_t * list, const char *target_str)
                                      (void *)target_str,
                                      (void_list_cmp_t) strcmp);
     if (str)
-        free(str);
+        xfree(str);
 }
 
 str_list_elt_t *str_list_first(str_list_t * list)
@@ -107,7 +107,7 @@ str_list_elt_t *str_list_next(str_list_t * list, str_list_elt_t * node)
 void str_list_purge(str_list_t * list)
 {
     str_list_deinit(list);
-    free(list);
+    xfree(list);
 }
 
 int str_list_contains(str_list_t * list, const char *s, int use_glob)
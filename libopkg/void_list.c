@@ -45,7 +45,7 @@ void void_list_elt_deinit(void_list_elt_t * elt)
 {
     list_del_init(&elt->node);
     void_list_elt_init(elt, NULL);
-    free(elt);
+    xfree(elt);
 }
 
 void void_list_init(void_list_t * list)
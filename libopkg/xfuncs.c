@@ -28,9 +28,192 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+#include "opkg_conf.h"
 #include "opkg_message.h"
 #include "xfuncs.h"
 
+#if USE_MEMORY_ACCOUNTING
+#include <pthread.h>
+#include <stdint.h>
+
+struct mem_stats {
+    size_t live;
+    size_t peak;
+    unsigned long allocs;
+};
+
+struct mem_block {
+    void *ptr;
+    size_t size;
+    opkg_mem_tag_t tag;
+};
+
+static const char *mem_tag_names[OPKG_MEM_NTAGS] = {
+    "other", "feed", "pkg", "depends", "file_hash", "dir_hash", "solver",
+    "archive"
+};
+
+static struct mem_stats mem_stats[OPKG_MEM_NTAGS];
+static size_t mem_live, mem_peak;
+/* The table below is shared by all threads, the subsystem entered is not. */
+static __thread opkg_mem_tag_t mem_tag;
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Open addressing table of the live blocks, keyed by address. */
+static struct mem_block *mem_blocks;
+static size_t mem_blocks_len;
+static size_t mem_blocks_used;
+
+static size_t mem_slot(const void *ptr)
+{
+    uintptr_t h = (uintptr_t)ptr >> 4;
+
+    h ^= h >> 17;
+    h *= 0x9e3779b1u;
+    return h & (mem_blocks_len - 1);
+}
+
+static void mem_charge(opkg_mem_tag_t tag, size_t size)
+{
+    struct mem_stats *st = &mem_stats[tag];
+
+    st->live += size;
+    st->allocs++;
+    if (st->live > st->peak)
+        st->peak = st->live;
+    mem_live += size;
+    if (mem_live > mem_peak)
+        mem_peak = mem_live;
+}
+
+static void mem_drop(void *ptr)
+{
+    size_t i, j, k;
+
+    if (ptr == NULL || mem_blocks_len == 0)
+        return;
+
+    for (i = mem_slot(ptr); mem_blocks[i].ptr != ptr; i = (i + 1) & (mem_blocks_len - 1))
+        if (mem_blocks[i].ptr == NULL)
+            return;
+
+    mem_stats[mem_blocks[i].tag].live -= mem_blocks[i].size;
+    mem_live -= mem_blocks[i].size;
+    mem_blocks_used--;
+
+    /* Shift later members of the probe sequence back into the hole. */
+    for (j = (i + 1) & (mem_blocks_len - 1); mem_blocks[j].ptr;
+            j = (j + 1) & (mem_blocks_len - 1)) {
+        k = mem_slot(mem_blocks[j].ptr);
+        if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+            mem_blocks[i] = mem_blocks[j];
+            i = j;
+        }
+    }
+    mem_blocks[i].ptr = NULL;
+}
+
+static void mem_insert(void *ptr, size_t size, opkg_mem_tag_t tag)
+{
+    size_t i;
+
+    for (i = mem_slot(ptr); mem_blocks[i].ptr; i = (i + 1) & (mem_blocks_len - 1))
+        ;
+    mem_blocks[i].ptr = ptr;
+    mem_blocks[i].size = size;
+    mem_blocks[i].tag = tag;
+    mem_blocks_used++;
+}
+
+static void mem_grow(void)
+{
+    struct mem_block *old = mem_blocks;
+    size_t i, old_len = mem_blocks_len;
+
+    mem_blocks_len = old_len ? old_len * 2 : 4096;
+    mem_blocks = calloc(mem_blocks_len, sizeof(*mem_blocks));
+    if (mem_blocks == NULL) {
+        opkg_perror(ERROR, "calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    mem_blocks_used = 0;
+    for (i = 0; i < old_len; i++)
+        if (old[i].ptr)
+            mem_insert(old[i].ptr, old[i].size, old[i].tag);
+    free(old);
+}
+
+static void mem_forget(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+
+    pthread_mutex_lock(&mem_lock);
+    mem_drop(ptr);
+    pthread_mutex_unlock(&mem_lock);
+}
+
+static void mem_track(void *ptr, size_t size, opkg_mem_tag_t tag)
+{
+    if (ptr == NULL)
+        return;
+
+    pthread_mutex_lock(&mem_lock);
+
+    /* An address freed behind our back may have been handed out again. */
+    mem_drop(ptr);
+
+    if ((mem_blocks_used + 1) * 4 > mem_blocks_len * 3)
+        mem_grow();
+
+    mem_insert(ptr, size, tag);
+    mem_charge(tag, size);
+
+    pthread_mutex_unlock(&mem_lock);
+}
+
+opkg_mem_tag_t opkg_mem_enter(opkg_mem_tag_t tag)
+{
+    opkg_mem_tag_t prev = mem_tag;
+
+    mem_tag = tag;
+    return prev;
+}
+
+void opkg_mem_leave(opkg_mem_tag_t prev)
+{
+    mem_tag = prev;
+}
+
+void xfree(void *ptr)
+{
+    mem_forget(ptr);
+    free(ptr);
+}
+
+void opkg_mem_report(const char *phase)
+{
+    int i;
+
+    if (opkg_config->verbosity < DEBUG)
+        return;
+
+    printf("memory: %s, %zu bytes live, %zu bytes peak\n", phase, mem_live,
+           mem_peak);
+    for (i = 0; i < OPKG_MEM_NTAGS; i++) {
+        if (mem_stats[i].allocs == 0)
+            continue;
+        printf("\t%-10s live=%zu, peak=%zu, n_allocs=%lu\n",
+               mem_tag_names[i], mem_stats[i].live, mem_stats[i].peak,
+               mem_stats[i].allocs);
+    }
+}
+#else
+#define mem_track(ptr, size, tag) ((void)0)
+#define mem_forget(ptr) ((void)0)
+#endif
+
 extern void *xmalloc(size_t size)
 {
     void *ptr = malloc(size);
@@ -38,16 +221,22 @@ extern void *xmalloc(size_t size)
         opkg_perror(ERROR, "malloc");
         exit(EXIT_FAILURE);
     }
+    mem_track(ptr, size, mem_tag);
     return ptr;
 }
 
 extern void *xrealloc(void *ptr, size_t size)
 {
+    /* The old block is forgotten first: once realloc() has released it,
+     * another thread may be handed the same address and track it. A failed
+     * realloc() exits, so the old block never has to be tracked again. */
+    mem_forget(ptr);
     ptr = realloc(ptr, size);
     if (ptr == NULL && size != 0) {
         opkg_perror(ERROR, "realloc");
         exit(EXIT_FAILURE);
     }
+    mem_track(ptr, size, mem_tag);
     return ptr;
 }
 
@@ -58,6 +247,7 @@ extern void *xcalloc(size_t nmemb, size_t size)
         opkg_perror(ERROR, "calloc");
         exit(EXIT_FAILURE);
     }
+    mem_track(ptr, nmemb * size, mem_tag);
     return ptr;
 }
 
@@ -75,6 +265,7 @@ extern char *xstrdup(const char *s)
         exit(EXIT_FAILURE);
     }
 
+    mem_track(t, strlen(t) + 1, mem_tag);
     return t;
 }
 
@@ -92,6 +283,7 @@ extern char *xstrndup(const char *s, int n)
         exit(EXIT_FAILURE);
     }
 
+    mem_track(t, strlen(t) + 1, mem_tag);
     return t;
 }
 
@@ -107,6 +299,6 @@ extern char *xdirname(const char *path)
     pathcopy = xstrdup(path);
     tmp = dirname(pathcopy);
     parent = xstrdup(tmp);
-    free(pathcopy);
+    xfree(pathcopy);
     return parent;
 }
@@ -23,6 +23,7 @@
 #define	XFUNCS_H
 
 #include <stddef.h>
+#include <stdlib.h>
 
 extern void *xmalloc(size_t size);
 extern void *xrealloc(void *old, size_t size);
@@ -31,4 +32,35 @@ extern char *xstrdup(const char *s);
 extern char *xstrndup(const char *s, int n);
 extern char *xdirname(const char *path);
 
+/* Subsystems that allocations made through the functions above are charged
+ * to when opkg is built with USE_MEMORY_ACCOUNTING. */
+typedef enum {
+    OPKG_MEM_OTHER,
+    OPKG_MEM_FEED,              /* list and status file parsing */
+    OPKG_MEM_PKG,               /* pkg_t and its fields */
+    OPKG_MEM_DEPENDS,           /* abstract packages and the dependency graph */
+    OPKG_MEM_FILE_HASH,
+    OPKG_MEM_DIR_HASH,
+    OPKG_MEM_SOLVER,
+    OPKG_MEM_ARCHIVE,           /* archive handles and buffers */
+    OPKG_MEM_NTAGS
+} opkg_mem_tag_t;
+
+#if USE_MEMORY_ACCOUNTING
+/*
+ * Allocations are charged to the innermost subsystem entered. Memory must be
+ * released with xfree() for it to stop counting as live; xfree() also takes
+ * memory which did not come from the functions above.
+ */
+extern opkg_mem_tag_t opkg_mem_enter(opkg_mem_tag_t tag);
+extern void opkg_mem_leave(opkg_mem_tag_t prev);
+extern void opkg_mem_report(const char *phase);
+extern void xfree(void *ptr);
+#else
+#define opkg_mem_enter(tag) OPKG_MEM_OTHER
+#define opkg_mem_leave(prev) ((void)(prev))
+#define opkg_mem_report(phase) ((void)0)
+#define xfree(ptr) free(ptr)
+#endif
+
 #endif                          /* XFUNCS_H */
@@ -50,5 +50,5 @@ static void print_regcomp_err(const regex_t * preg, int err)
 
     opkg_msg(ERROR, "Internal error compiling regex: %s.", error);
 
-    free(error);
+    xfree(error);
 }
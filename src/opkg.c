@@ -34,7 +34,12 @@
 #include "file_util.h"
 #include "opkg_message.h"
 #include "opkg_download.h"
+#include "opkg_profile.h"
+#include "opkg_stats.h"
 #include "xfuncs.h"
+#if USE_OPKGD
+#include "opkg_daemon.h"
+#endif
 
 enum {
     ARGS_OPT_FORCE_MAINTAINER = 129,
@@ -70,6 +75,10 @@ enum {
     ARGS_OPT_WRITABLE_ONLY,
     ARGS_OPT_IMAGE_ONLY,
     ARGS_OPT_SHOW_SOURCE,
+    ARGS_OPT_NO_DAEMON,
+    ARGS_OPT_STDIN,
+    ARGS_OPT_PROFILE,
+    ARGS_OPT_STATS_FILE,
 };
 
 static struct option long_options[] = {
@@ -132,6 +141,12 @@ static struct option long_options[] = {
     {"writable-only", 0, 0, ARGS_OPT_WRITABLE_ONLY},
     {"image-only", 0, 0, ARGS_OPT_IMAGE_ONLY},
     {"show-source", 0, 0, ARGS_OPT_SHOW_SOURCE},
+    {"stdin", 0, 0, ARGS_OPT_STDIN},
+    {"profile", 2, 0, ARGS_OPT_PROFILE},
+    {"stats-file", 1, 0, ARGS_OPT_STATS_FILE},
+#if USE_OPKGD
+    {"no-daemon", 0, 0, ARGS_OPT_NO_DAEMON},
+#endif
     {"verbosity", 2, 0, 'V'},
     {"version", 0, 0, 'v'},
     {0, 0, 0, 0}
@@ -139,9 +154,36 @@ static struct option long_options[] = {
 
 const char *short_options = "Ad:f:no:p:l:t:vV::";
 
+#if USE_OPKGD
+/* Cleared by options which change what gets loaded, as opkgd can only answer
+ * queries against its own view of the configuration. -o is fine as the
+ * daemon_socket lives under the offline root, but another configuration
+ * file may well name the socket of a daemon loaded without it. */
+static int use_daemon = 1;
+
+static int option_is_per_query(int c)
+{
+    switch (c) {
+    case 'A':
+    case 'o':
+    case 'v':
+    case 'V':
+    case ARGS_OPT_SIZE:
+    case ARGS_OPT_SHORT_DESCRIPTION:
+    case ARGS_OPT_FIELDS_FILTER:
+    case ARGS_OPT_WRITABLE_ONLY:
+    case ARGS_OPT_IMAGE_ONLY:
+    case ARGS_OPT_SHOW_SOURCE:
+        return 1;
+    default:
+        return 0;
+    }
+}
+#endif
+
 static void store_str_arg(char **dest, const char *arg)
 {
-    free(*dest);
+    xfree(*dest);
     *dest = xstrdup(arg);
 }
 
@@ -178,7 +220,7 @@ static int args_parse_stage1(int argc, char *argv[])
             solver_version = opkg_solver_version_alloc();
             if (solver_version) {
                 printf("opkg version " VERSION " (%s)\n", solver_version);
-                free(solver_version);
+                xfree(solver_version);
             } else {
                 printf("opkg version " VERSION "\n");
             }
@@ -188,6 +230,9 @@ static int args_parse_stage1(int argc, char *argv[])
             if (optarg != NULL)
                 opkg_config->verbosity = atoi(optarg);
             break;
+        case ARGS_OPT_PROFILE:
+            opkg_profile_enable(optarg);
+            break;
         case '?':
             parse_err = -1;
             break;
@@ -225,6 +270,11 @@ static int args_parse_stage2(int argc, char *argv[])
         if (c == -1)
             break;
 
+#if USE_OPKGD
+        if (!option_is_per_query(c))
+            use_daemon = 0;
+#endif
+
         switch (c) {
         case 'A':
             opkg_config->query_all = 1;
@@ -236,6 +286,7 @@ static int args_parse_stage2(int argc, char *argv[])
         case 'f':
         case 'v':
         case 'V':
+        case ARGS_OPT_PROFILE:
             // Already handled in stage 1 command line parsing
             break;
         case 't':
@@ -299,7 +350,7 @@ static int args_parse_stage2(int argc, char *argv[])
                                         tuple, targ);
                 }
             }
-            free(tuple);
+            xfree(tuple);
             break;
         case ARGS_OPT_ADD_EXCLUDE:
             str_list_append(&opkg_config->exclude_list, optarg);
@@ -319,6 +370,9 @@ static int args_parse_stage2(int argc, char *argv[])
         case ARGS_OPT_CACHE_DIR:
             store_str_arg(&opkg_config->cache_dir, optarg);
             break;
+        case ARGS_OPT_STATS_FILE:
+            store_str_arg(&opkg_config->stats_file, optarg);
+            break;
         case ARGS_OPT_HOST_CACHE_DIR:
             opkg_config->host_cache_dir = 1;
             break;
@@ -349,6 +403,12 @@ static int args_parse_stage2(int argc, char *argv[])
         case ARGS_OPT_SHOW_SOURCE:
             opkg_config->show_source = 1;
             break;
+        case ARGS_OPT_STDIN:
+            opkg_config->use_stdin = 1;
+            break;
+        case ARGS_OPT_NO_DAEMON:
+            // Already cleared use_daemon above
+            break;
         default:
             fprintf(stderr, "Encountered unhandled option %d during command line parsing\n", c);
         }
@@ -375,6 +435,8 @@ static void usage()
     printf("\tclean                           Clean internal cache\n");
     printf("\tflag <flag> <pkgs>              Flag package(s)\n");
     printf("\t <flag>=hold|noprune|user|ok|installed|unpacked (one per invocation)\n");
+    printf("\tbatch [file]                    Run sub-commands read from [file] or stdin,\n");
+    printf("\t                                one per line, in a single process\n");
 
     printf("\nInformational Commands:\n");
     printf("\tlist                            List available packages\n");
@@ -389,7 +451,11 @@ static void usage()
     printf("\tdownload <pkg>                  Download <pkg> to current directory\n");
     printf("\tcompare-versions <v1> <op> <v2>\n");
     printf("\t                                compare versions using <= < > >= = << >>\n");
+    printf("\tcompare-versions --stdin        compare \"<v1> <op> <v2>\" lines read from stdin,\n");
+    printf("\t                                printing one result per line\n");
     printf("\tprint-architecture              List installable package architectures\n");
+    printf("\tdebug-stats                     Print hash table diagnostics after loading\n");
+    printf("\t                                the package lists and installed files\n");
     printf("\tdepends [-A] [pkgname|glob]+\n");
     printf("\twhatdepends [-A] [pkgname|glob]+\n");
     printf("\twhatdependsrec [-A] [pkgname|glob]+\n");
@@ -437,6 +503,12 @@ static void usage()
     printf("\t                                plus the package name. Valid for info and status.\n");
     printf("\t--short-description             Display only the first line of the description.\n");
     printf("\t--size                          Print package size when listing available packages\n");
+    printf("\t--profile[=<file>]              Print the time spent in each phase of the run to\n");
+    printf("\t                                stderr, and write a Chrome trace to <file>\n");
+    printf("\t--stats-file <file>|fd:<n>      Write run statistics as JSON on exit\n");
+#if USE_OPKGD
+    printf("\t--no-daemon                     Don't hand read-only queries to a running opkgd\n");
+#endif
 
     printf("\nForce Options:\n");
     printf("\t--force-depends                 Install/remove despite failed dependencies\n");
@@ -471,6 +543,21 @@ static void usage()
     exit(1);
 }
 
+/* Whether the command only needs the named packages from the feeds, which
+ * can then be looked up through the list file indexes. */
+static int names_only(const char *cmd_name, int argc, char **argv)
+{
+    int i;
+
+    if (strcmp(cmd_name, "info") != 0 || argc == 0
+        || !opkg_config->compress_list_files)
+        return 0;
+    for (i = 0; i < argc; i++)
+        if (strpbrk(argv[i], "*?[\\"))
+            return 0;
+    return 1;
+}
+
 int main(int argc, char *argv[])
 {
     int opts, err = -1;
@@ -479,6 +566,9 @@ int main(int argc, char *argv[])
     int nocheckfordirorfile;
     int noreadfeedsfile;
     int noloadconf;
+    int span;
+
+    opkg_stats_start();
 
     if (opkg_conf_init())
         goto err0;
@@ -535,14 +625,32 @@ int main(int argc, char *argv[])
         usage();
     }
 
+    /* Lookups are only counted when something is going to report them. */
+    if (opkg_config->stats_file || !strcmp(cmd_name, "debug-stats"))
+        opkg_config->hash_diagnostics = 1;
+
     if (!noloadconf) {
         if (opkg_conf_finalize())
             goto err0;
     }
 
+#if USE_OPKGD
+    if (use_daemon && opkg_daemon_cmd_view(cmd_name) != -1
+            && !(cmd->requires_args && opts == argc)) {
+        if (opkg_daemon_exec(opkg_config->daemon_socket, cmd_name,
+                             argc - opts, (const char **)(argv + opts),
+                             &err) == 0)
+            goto err1;
+    }
+#endif
+
     if (!nocheckfordirorfile) {
         if (!noreadfeedsfile) {
-            if (pkg_hash_load_feeds())
+            if (names_only(cmd_name, argc - opts, argv + opts)) {
+                if (pkg_hash_load_feed_names((const char *const *)(argv + opts),
+                                             argc - opts))
+                    goto err1;
+            } else if (pkg_hash_load_feeds())
                 goto err1;
         }
 
@@ -556,10 +664,15 @@ int main(int argc, char *argv[])
         usage();
     }
 
+    span = opkg_profile_begin("command", cmd_name);
     err = opkg_cmd_exec(cmd, argc - opts, (const char **)(argv + opts));
+    opkg_profile_end(span);
 
     opkg_download_cleanup();
  err1:
+    opkg_profile_report(stderr);
+    if (opkg_config->stats_file)
+        opkg_stats_write(opkg_config->stats_file, cmd_name, err);
     opkg_conf_deinit();
 
  err0:
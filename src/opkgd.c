@@ -0,0 +1,433 @@
+/* vi: set expandtab sw=4 sts=4: */
+/* opkgd.c - the opkg package management system
+
+   SPDX-License-Identifier: GPL-2.0-or-later
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2, or (at
+   your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   opkgd keeps the package database loaded and answers read-only queries
+   from the opkg command line tool over a Unix socket.
+*/
+
+#include "config.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <locale.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "opkg_conf.h"
+#include "opkg_daemon.h"
+#include "opkg_message.h"
+#include "pkg.h"
+#include "pkg_hash.h"
+#include "sprintf_alloc.h"
+#include "xfuncs.h"
+
+static struct option long_options[] = {
+    {"conf-file", 1, 0, 'f'},
+    {"conf", 1, 0, 'f'},
+    {"offline-root", 1, 0, 'o'},
+    {"socket", 1, 0, 's'},
+    {"verbosity", 2, 0, 'V'},
+    {"help", 0, 0, 'h'},
+    {0, 0, 0, 0}
+};
+
+static const char *short_options = "f:o:s:V::h";
+
+/* Command line settings, re-applied on every reload. */
+static char **conf_files;
+static int conf_file_count;
+static char *offline_root;
+static char *socket_path;
+static int verbosity = NOTICE;
+
+static volatile sig_atomic_t quit;
+static volatile sig_atomic_t reload;
+
+/* The view this process serves. The first process serves the feeds view and
+ * forks a second one for the installed view, as the two databases are
+ * loaded differently. */
+static int view = OPKG_DAEMON_VIEW_FEEDS;
+static pid_t installed_pid;
+
+/* Whether a database is loaded. After a failed reload, queries are refused
+ * so that opkg answers them itself, until the files change again. */
+static int loaded;
+
+/* The files the database was last loaded from, watched for changes. */
+static char *watched_lists_dir;
+static char **watched_status_files;
+static int n_watched_status_files;
+
+static void usage(void)
+{
+    printf("usage: opkgd [options...]\n");
+    printf("\nOptions:\n");
+    printf("\t-f <conf_file>                  Use <conf_file> as the opkg configuration file\n");
+    printf("\t--conf <conf_file>              Can be given multiple times\n");
+    printf("\t-o <dir>                        Use <dir> as the root directory for\n");
+    printf("\t--offline-root <dir>            offline installation of packages.\n");
+    printf("\t-s <path>                       Listen on <path> instead of the daemon_socket\n");
+    printf("\t--socket <path>                 configuration option.\n");
+    printf("\t-V[<level>]                     Set verbosity level to <level>.\n");
+    printf("\t--verbosity[=<level>]\n");
+    printf("\n");
+    printf(" opkgd reloads its state whenever the status files, the package lists or\n");
+    printf(" the configuration change, or when it receives SIGHUP. Commands which only\n");
+    printf(" look at installed packages are served by a second process on the socket\n");
+    printf(" path followed by \".installed\".\n");
+
+    exit(1);
+}
+
+static void signal_handler(int sig)
+{
+    if (installed_pid > 0)
+        kill(installed_pid, sig);
+
+    if (sig == SIGHUP)
+        reload = 1;
+    else
+        quit = 1;
+}
+
+static void signature_add(unsigned long *sig, const char *path)
+{
+    struct stat st;
+
+    if (stat(path, &st) != 0) {
+        *sig = *sig * 33 + 1;
+        return;
+    }
+
+    *sig = *sig * 33 + (unsigned long)st.st_ino;
+    *sig = *sig * 33 + (unsigned long)st.st_size;
+    *sig = *sig * 33 + (unsigned long)st.st_mtim.tv_sec;
+    *sig = *sig * 33 + (unsigned long)st.st_mtim.tv_nsec;
+}
+
+static void signature_add_dir(unsigned long *sig, const char *path)
+{
+    DIR *dir;
+    struct dirent *ent;
+    char *entry;
+
+    signature_add(sig, path);
+
+    dir = opendir(path);
+    if (dir == NULL)
+        return;
+
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.')
+            continue;
+        sprintf_alloc(&entry, "%s/%s", path, ent->d_name);
+        signature_add(sig, entry);
+        xfree(entry);
+    }
+    closedir(dir);
+}
+
+/*
+ * Summarise everything the loaded state was built from. Any install, remove
+ * or update run by the command line tool changes at least one of these.
+ */
+static unsigned long state_signature(void)
+{
+    unsigned long sig = 5381;
+    int i;
+
+    if (conf_file_count > 0) {
+        for (i = 0; i < conf_file_count; i++)
+            signature_add(&sig, conf_files[i]);
+    } else {
+        const char *conf_file_dir = getenv("OPKG_CONF_DIR");
+        char *path;
+
+        if (conf_file_dir == NULL)
+            conf_file_dir = OPKG_CONF_DEFAULT_CONF_FILE_DIR;
+        sprintf_alloc(&path, "%s/%s", offline_root ? offline_root : "",
+                      conf_file_dir);
+        signature_add_dir(&sig, path);
+        xfree(path);
+    }
+
+    if (watched_lists_dir)
+        signature_add_dir(&sig, watched_lists_dir);
+    for (i = 0; i < n_watched_status_files; i++)
+        signature_add(&sig, watched_status_files[i]);
+
+    return sig;
+}
+
+static void unwatch_state(void)
+{
+    int i;
+
+    xfree(watched_lists_dir);
+    watched_lists_dir = NULL;
+    for (i = 0; i < n_watched_status_files; i++)
+        xfree(watched_status_files[i]);
+    xfree(watched_status_files);
+    watched_status_files = NULL;
+    n_watched_status_files = 0;
+}
+
+static void watch_status_file(const char *path)
+{
+    watched_status_files = xrealloc(watched_status_files,
+            (n_watched_status_files + 1) * sizeof(char *));
+    watched_status_files[n_watched_status_files++] = xstrdup(path);
+}
+
+static void watch_state(void)
+{
+    pkg_dest_list_elt_t *iter;
+    pkg_dest_t *dest;
+
+    unwatch_state();
+
+    if (view == OPKG_DAEMON_VIEW_FEEDS)
+        watched_lists_dir = xstrdup(opkg_config->lists_dir);
+
+    for (iter = void_list_first(&opkg_config->pkg_dest_list); iter;
+            iter = void_list_next(&opkg_config->pkg_dest_list, iter)) {
+        dest = (pkg_dest_t *) iter->data;
+        watch_status_file(dest->status_file_name);
+        if (dest->image_status_file_name)
+            watch_status_file(dest->image_status_file_name);
+    }
+}
+
+/* Keep the file list of every installed package in memory, so that files
+ * and search do not read the .list files for each query. */
+static void hold_file_lists(void)
+{
+    pkg_vec_t *installed = pkg_vec_alloc();
+    unsigned int i;
+
+    pkg_hash_fetch_all_installed(installed, INSTALLED);
+    for (i = 0; i < installed->len; i++)
+        pkg_get_installed_files(installed->pkgs[i]);
+    pkg_vec_free(installed);
+}
+
+static int state_load(void)
+{
+    int i;
+
+    if (opkg_conf_init())
+        goto err;
+
+    opkg_config->verbosity = verbosity;
+    for (i = 0; i < conf_file_count; i++) {
+        opkg_config->conf_files = xrealloc(opkg_config->conf_files,
+                ++opkg_config->conf_file_count * sizeof(char *));
+        opkg_config->conf_files[i] = xstrdup(conf_files[i]);
+    }
+    if (offline_root)
+        opkg_config->offline_root = xstrdup(offline_root);
+
+    if (opkg_conf_load())
+        goto err;
+
+    /* opkg_conf_deinit() clears the verbosity along with the other options
+     * and the config files may have changed it. */
+    opkg_config->verbosity = verbosity;
+
+    opkg_conf_stamp_files();
+    if (view == OPKG_DAEMON_VIEW_FEEDS) {
+        pkg_hash_stamp_files();
+        if (pkg_hash_load_feeds())
+            goto err;
+    }
+    if (pkg_hash_load_status_files())
+        goto err;
+
+    /* File ownership stays resident for the commands which look it up. */
+    pkg_info_preinstall_check();
+    if (view == OPKG_DAEMON_VIEW_INSTALLED)
+        hold_file_lists();
+
+    watch_state();
+    loaded = 1;
+    return 0;
+
+ err:
+    opkg_conf_deinit();
+    loaded = 0;
+    return -1;
+}
+
+/*
+ * Bring the database up to date with the files it was loaded from. When
+ * only package lists changed, just those feeds are re-read; a changed
+ * status file means a full reload, as an install or remove can touch any
+ * package. A failed reload leaves nothing loaded.
+ */
+static void state_reload(void)
+{
+    int full = reload || !loaded;
+
+    reload = 0;
+    if (!full && view == OPKG_DAEMON_VIEW_FEEDS
+            && !opkg_conf_files_changed() && pkg_hash_refresh() == 0)
+        return;
+
+    opkg_msg(INFO, "Reloading package database.\n");
+    if (loaded)
+        opkg_conf_deinit();
+    if (state_load() != 0)
+        opkg_msg(ERROR, "Failed to reload package database, leaving "
+                 "queries to opkg until it changes.\n");
+}
+
+static int serve(int listen_fd)
+{
+    unsigned long sig = state_signature();
+
+    while (!quit) {
+        unsigned long cur;
+        pid_t pid;
+        int client_fd;
+
+        client_fd = accept(listen_fd, NULL, NULL);
+        if (client_fd == -1) {
+            if (errno != EINTR)
+                opkg_perror(ERROR, "Failed to accept connection");
+            continue;
+        }
+
+        cur = state_signature();
+        if (reload || cur != sig) {
+            state_reload();
+            sig = state_signature();
+        }
+
+        /* The child inherits stdio buffers; don't let it repeat them. */
+        fflush(stdout);
+        fflush(stderr);
+
+        pid = fork();
+        if (pid == -1) {
+            opkg_perror(ERROR, "Failed to fork");
+        } else if (pid == 0) {
+            close(listen_fd);
+            if (loaded)
+                _exit(opkg_daemon_handle_client(client_fd, view)
+                      ? EXIT_FAILURE : 0);
+            _exit(opkg_daemon_refuse_client(client_fd) ? EXIT_FAILURE : 0);
+        }
+        close(client_fd);
+    }
+
+    return 0;
+}
+
+/* Stop the installed view server along with this one. */
+static void stop_installed_server(void)
+{
+    if (installed_pid <= 0)
+        return;
+    kill(installed_pid, SIGTERM);
+    waitpid(installed_pid, NULL, 0);
+    installed_pid = 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct sigaction sa;
+    char *path = NULL;
+    int c, listen_fd, err = -1;
+
+    setlocale(LC_ALL, "");
+
+    while ((c = getopt_long(argc, argv, short_options, long_options,
+                            NULL)) != -1) {
+        switch (c) {
+        case 'f':
+            conf_files = xrealloc(conf_files,
+                                  ++conf_file_count * sizeof(char *));
+            conf_files[conf_file_count - 1] = optarg;
+            break;
+        case 'o':
+            offline_root = optarg;
+            break;
+        case 's':
+            socket_path = optarg;
+            break;
+        case 'V':
+            verbosity = INFO;
+            if (optarg != NULL)
+                verbosity = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (optind != argc)
+        usage();
+
+    installed_pid = fork();
+    if (installed_pid == -1) {
+        opkg_perror(ERROR, "Failed to fork");
+        return err;
+    }
+    if (installed_pid == 0)
+        view = OPKG_DAEMON_VIEW_INSTALLED;
+
+    if (state_load() != 0)
+        goto out;
+
+    path = opkg_daemon_socket_path(socket_path ? socket_path
+                                   : opkg_config->daemon_socket, view);
+    listen_fd = opkg_daemon_listen(path);
+    if (listen_fd < 0)
+        goto out;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = signal_handler;
+    sigemptyset(&sa.sa_mask);
+    /* No SA_RESTART: accept() must return so the flags are acted on. */
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    sa.sa_handler = SIG_IGN;
+    sa.sa_flags = SA_NOCLDWAIT;
+    sigaction(SIGCHLD, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    opkg_msg(INFO, "Listening on %s.\n", path);
+    err = serve(listen_fd);
+
+    close(listen_fd);
+    unlink(path);
+
+ out:
+    stop_installed_server();
+    if (loaded)
+        opkg_conf_deinit();
+    unwatch_state();
+    xfree(path);
+    xfree(conf_files);
+    return err;
+}
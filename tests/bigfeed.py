@@ -0,0 +1,279 @@
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# Generator for large synthetic feeds and installed databases, used by the
+# scale tests. Package i only depends on packages with a smaller index, so
+# the first n_installed packages form a dependency-closed installed set.
+#
+# Only the packages which a test actually downloads (those outside the
+# installed set which install targets depend on, and the newer versions
+# offered for upgrade) are written as real .opk files; every other entry of
+# the index points at a file which does not exist.
+
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+import cfg
+import opk
+
+SCALE_ARCH = 'scalearch'
+
+
+def env_int(name, default):
+    return int(os.environ.get(name, default))
+
+
+class BigFeed:
+    def __init__(self, n_packages=None, n_installed=None, files_per_pkg=None,
+                 n_upgrades=20, n_targets=5, payload_size=0, seed=1):
+        self.n_packages = n_packages or env_int('OPKG_SCALE_PACKAGES', 10000)
+        self.n_installed = n_installed or self.n_packages // 10
+        self.files_per_pkg = files_per_pkg or max(1, 100000 // self.n_installed + 1)
+        self.n_upgrades = min(n_upgrades, self.n_installed)
+        self.n_targets = n_targets
+        self.payload_size = payload_size
+        self.rng = random.Random(seed)
+
+        self.names = ['pkg{:06d}'.format(i) for i in range(self.n_packages)]
+        self.versions = [self._version() for i in range(self.n_packages)]
+        self.depends = [self._depends(i) for i in range(self.n_packages)]
+        self.provides = {}
+        for i in range(0, self.n_packages, 10):
+            # Two providers for each virtual package.
+            self.provides[i] = 'virtual{}'.format(i // 10)
+            if i + 5 < self.n_packages:
+                self.provides[i + 5] = 'virtual{}'.format(i // 10)
+        self.depends_fields = [self._depends_field(i)
+                               for i in range(self.n_packages)]
+
+        self.upgrades = list(range(self.n_installed - self.n_upgrades,
+                                   self.n_installed))
+        self.targets = list(range(self.n_installed,
+                                  min(self.n_packages,
+                                      self.n_installed + self.n_targets)))
+        self.real = set()
+        for t in self.targets:
+            self.real |= self.closure(t)
+        self.real -= set(range(self.n_installed))
+
+    def _version(self):
+        r = self.rng
+        kind = r.randrange(4)
+        if kind == 0:
+            return '{}.{}.{}-r{}'.format(r.randrange(10), r.randrange(30),
+                                         r.randrange(100), r.randrange(5))
+        if kind == 1:
+            return '{}:{}.{}'.format(r.randrange(1, 4), r.randrange(10),
+                                     r.randrange(30))
+        if kind == 2:
+            return '{}.{}~rc{}'.format(r.randrange(10), r.randrange(30),
+                                       r.randrange(5))
+        return '{}.{}+git{:08x}'.format(r.randrange(10), r.randrange(30),
+                                        r.getrandbits(32))
+
+    def _depends(self, i):
+        # Core libraries (small indices) are depended upon by most packages.
+        deps = set()
+        for _ in range(self.rng.randrange(6) if i else 0):
+            deps.add(int(i * self.rng.random() ** 3))
+        return sorted(deps)
+
+    def _depends_field(self, i):
+        fields = []
+        for d in self.depends[i]:
+            if d in self.provides and self.rng.randrange(4) == 0:
+                fields.append(self.provides[d])
+            elif self.rng.randrange(3) == 0:
+                fields.append('{} (>= {})'.format(self.names[d],
+                                                  self.versions[d]))
+            else:
+                fields.append(self.names[d])
+        return ', '.join(fields)
+
+    def closure(self, i):
+        todo, seen = [i], set()
+        while todo:
+            p = todo.pop()
+            if p not in seen:
+                seen.add(p)
+                todo.extend(self.depends[p])
+        return seen
+
+    def installed_leaves(self):
+        """Installed packages which no other installed package needs."""
+        needed = set(self.provides)
+        for i in range(self.n_installed):
+            needed.update(self.depends[i])
+        return [i for i in range(self.n_installed) if i not in needed]
+
+    def upgrade_version(self, i):
+        return self.versions[i] + '.1'
+
+    def files(self, i):
+        return ['/usr/lib/{}/file{:04d}'.format(self.names[i], f)
+                for f in range(self.files_per_pkg)]
+
+    def _stanza(self, i, version, arch, depends):
+        s = 'Package: {}\nVersion: {}\n'.format(self.names[i], version)
+        if depends:
+            s += 'Depends: {}\n'.format(depends)
+        if i in self.provides:
+            s += 'Provides: {}\n'.format(self.provides[i])
+        s += 'Section: {}\nArchitecture: {}\n'.format(
+            'libs' if i % 2 else 'utils', arch)
+        return s
+
+    def _write_opk(self, i, version, depends):
+        control = {'Package': self.names[i], 'Version': version}
+        if depends:
+            control['Depends'] = depends
+        if i in self.provides:
+            control['Provides'] = self.provides[i]
+        data_files = None
+        if self.payload_size:
+            # Random bytes, so that compression does not shrink them.
+            payload = 'usr/share/{}/payload.bin'.format(self.names[i])
+            os.makedirs(os.path.dirname(payload), exist_ok=True)
+            with open(payload, 'wb') as f:
+                f.write(self.rng.randbytes(self.payload_size))
+            data_files = [payload]
+        fname = opk.Opk(**control).write(data_files=data_files)
+        if data_files:
+            shutil.rmtree('usr')
+        return fname, os.stat(fname).st_size, opk.md5sum_file(fname)
+
+    def write_feed(self):
+        """Writes Packages to cfg.opkdir, which must be the cwd."""
+        with open('Packages', 'w') as f:
+            for i in range(self.n_packages):
+                depends = self.depends_fields[i]
+                stanza = self._stanza(i, self.versions[i], 'all', depends)
+                if i in self.real:
+                    fname, size, md5 = self._write_opk(i, self.versions[i],
+                                                       depends)
+                else:
+                    fname = '{}_{}_all.opk'.format(self.names[i], i)
+                    size, md5 = 1000 + i, '{:032x}'.format(i)
+                f.write(stanza)
+                f.write('Filename: {}\nSize: {}\nMD5Sum: {}\n'.format(
+                    fname, size, md5))
+                f.write('Description: Synthetic package {}\n'
+                        ' generated for the opkg scale tests.\n\n'.format(i))
+
+                if i in self.upgrades:
+                    version = self.upgrade_version(i)
+                    fname, size, md5 = self._write_opk(i, version, depends)
+                    f.write(self._stanza(i, version, 'all', depends))
+                    f.write('Filename: {}\nSize: {}\nMD5Sum: {}\n\n'.format(
+                        fname, size, md5))
+                if i % 5 == 1:
+                    # An older version which is never the best candidate.
+                    f.write(self._stanza(i, '0~{}'.format(i), 'all',
+                                         depends))
+                    f.write('Filename: old/{}_{}.opk\nSize: 1\n\n'.format(
+                        self.names[i], i))
+                if i % 7 == 3:
+                    # The same version for a second, lower-priority arch.
+                    f.write(self._stanza(i, self.versions[i], SCALE_ARCH,
+                                         depends))
+                    f.write('Filename: {}/{}_{}.opk\nSize: 1\n\n'.format(
+                        SCALE_ARCH, self.names[i], i))
+
+    def write_installed(self):
+        """Writes the status database of the installed set."""
+        info_dir = '{}{}/lib/opkg/info'.format(cfg.offline_root,
+                                                os.environ['VARDIR'])
+        os.makedirs(info_dir, exist_ok=True)
+        status = '{}{}/lib/opkg/status'.format(cfg.offline_root,
+                                                os.environ['VARDIR'])
+        with open(status, 'w') as f:
+            for i in range(self.n_installed):
+                stanza = self._stanza(i, self.versions[i], 'all',
+                                      self.depends_fields[i])
+                f.write(stanza)
+                f.write('Status: install {} installed\n'.format(
+                    'user' if i % 3 == 0 else 'ok'))
+                if i % 3:
+                    f.write('Auto-Installed: yes\n')
+                f.write('Installed-Time: {}\n\n'.format(1700000000 + i))
+                with open('{}/{}.control'.format(info_dir, self.names[i]),
+                          'w') as cf:
+                    cf.write(stanza)
+                with open('{}/{}.list'.format(info_dir, self.names[i]),
+                          'w') as lf:
+                    lf.write(''.join(p + '\n' for p in self.files(i)))
+
+    def setup(self):
+        """Starts a new test with this feed and installed database."""
+        opk.regress_init()
+        conf = '{}{}/opkg/opkg.conf'.format(cfg.offline_root,
+                                            os.environ['SYSCONFDIR'])
+        with open(conf, 'w') as f:
+            f.write('arch {} 1\narch all 10\n'.format(SCALE_ARCH))
+            f.write('src test file:{}\n'.format(cfg.opkdir))
+        os.system('rm -rf {}/*'.format(cfg.opkdir))
+        self.write_feed()
+        self.write_installed()
+
+
+def run(args):
+    """
+    Runs opkg and returns (status, stdout, stderr, seconds, max RSS in MiB).
+    """
+    cmd = [cfg.opkgcl, '-o', cfg.offline_root] + args.split()
+    with tempfile.TemporaryFile() as err:
+        start = time.monotonic()
+        p = subprocess.Popen(cmd, stdout=subprocess.PIPE, stderr=err)
+        output = p.stdout.read()
+        _, status, usage = os.wait4(p.pid, 0)
+        elapsed = time.monotonic() - start
+        p.returncode = os.waitstatus_to_exitcode(status)
+        p.stdout.close()
+        err.seek(0)
+        errors = err.read()
+    # ru_maxrss is in KiB on Linux.
+    return (p.returncode, output.decode('utf-8', 'replace'),
+            errors.decode('utf-8', 'replace'), elapsed,
+            usage.ru_maxrss / 1024.0)
+
+
+def check_budget(feed, what, args, seconds, mib):
+    """
+    Runs opkg with 'args' and fails the test if it exits with an error.
+    Returns the standard output. Budgets are given per 10k packages and
+    scaled with the feed size and OPKG_SCALE_BUDGET, to allow for slow
+    machines. Exceeding them only fails the test when OPKG_SCALE_ENFORCE is
+    set, as "make scale" does; otherwise it is reported.
+    """
+    factor = float(os.environ.get('OPKG_SCALE_BUDGET', '1'))
+    enforce = os.environ.get('OPKG_SCALE_ENFORCE', '') not in ('', '0')
+    scale = max(1.0, feed.n_packages / 10000.0)
+    status, output, errors, elapsed, rss = run(args)
+    print('{}: {} packages, {:.2f} s, {:.1f} MiB'.format(
+        what, feed.n_packages, elapsed, rss))
+    if status != 0:
+        print(errors[-2000:])
+        opk.fail('"{}" failed with status {}.'.format(args, status))
+
+    over = []
+    if elapsed > seconds * scale * factor:
+        over.append('{} took {:.2f} s, budget {:.2f} s.'.format(
+            what, elapsed, seconds * scale * factor))
+    if rss > mib * scale * factor:
+        over.append('{} used {:.1f} MiB, budget {:.1f} MiB.'.format(
+            what, rss, mib * scale * factor))
+    for msg in over:
+        if enforce:
+            opk.fail(msg)
+        print('Over budget: ' + msg)
+    return output
+
+
+if __name__ == '__main__':
+    # Stand-alone use: python3 bigfeed.py [n_packages] writes the feed to
+    # cfg.opkdir and the installed database to cfg.offline_root.
+    BigFeed(int(sys.argv[1]) if len(sys.argv) > 1 else None).setup()
@@ -0,0 +1,60 @@
+#! /usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# Run several sub-commands through a single "opkg batch" and check that each
+# one is framed with its exit status, that state changes made by earlier
+# commands are seen by later ones and that the status file ends up correct.
+
+import re
+import opk, cfg, opkgcl
+
+opk.regress_init()
+
+o = opk.OpkGroup()
+o.add(Package='a', Version='1.0')
+o.add(Package='b', Version='1.0', Depends='a')
+o.write_opk()
+o.write_list()
+
+(status, output) = opkgcl.batch([
+    '# comment lines and blank lines are skipped',
+    '',
+    'update',
+    'install b',
+    'flag hold a',
+    'compare-versions 1.0 "<<" 1.1',
+    'compare-versions 1.1 "<<" 1.0',
+    'no-such-command',
+    'remove a',
+])
+
+if status == 0:
+    opk.fail('Batch with failing commands exited successfully.')
+
+ends = re.findall(r'^@@ end (\d+) (-?\d+)$', output, re.MULTILINE)
+if [int(n) for n, _ in ends] != list(range(1, 8)):
+    opk.fail('Unexpected command framing:\n{}'.format(output))
+
+# "remove a" must fail because b depends on it.
+results = [int(r) for _, r in ends]
+if results[:6] != [0, 0, 0, 0, 1, -1] or results[6] == 0:
+    opk.fail('Unexpected command results {}.'.format(results))
+
+if not re.search(r'^@@ begin 2 install b$', output, re.MULTILINE):
+    opk.fail('Command line missing from framing:\n{}'.format(output))
+
+if not opkgcl.is_installed('a') or not opkgcl.is_installed('b'):
+    opk.fail('Packages installed in batch are not installed.')
+
+# The hold flag set earlier in the batch must have been written out.
+status_file = '{}{}/lib/opkg/status'.format(cfg.offline_root, opkgcl.vardir)
+with open(status_file) as f:
+    if 'hold' not in f.read():
+        opk.fail('Flag set in batch was not written to the status file.')
+
+# NUL separated input
+(status, output) = opkgcl.batch(['compare-versions 2 ">=" 1', 'info a'],
+                                sep='\0')
+if status != 0 or re.findall(r'^@@ end \d+ (-?\d+)$', output,
+                             re.MULTILINE) != ['0', '0']:
+    opk.fail('NUL separated batch failed:\n{}'.format(output))
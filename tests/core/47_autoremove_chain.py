@@ -0,0 +1,44 @@
+#! /usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# Create package 'a' which depends on 'b', which depends on 'c' and 'v', a
+# virtual package provided by 'p'. Create package 'd' which depends on 'c'.
+# Install 'a' and 'd', then remove 'a' with --autoremove and check that 'b'
+# and 'p', only needed through 'a', are autoremoved along the chain, while
+# 'c', still needed by 'd', is not.
+#
+
+import os
+import opk, cfg, opkgcl
+
+opk.regress_init()
+
+o = opk.OpkGroup()
+o.add(Package="a", Depends="b")
+o.add(Package="b", Depends="c, v")
+o.add(Package="c")
+o.add(Package="p", Provides="v")
+o.add(Package="d", Depends="c")
+
+o.write_opk()
+o.write_list()
+
+opkgcl.update()
+
+opkgcl.install("a")
+opkgcl.install("d")
+for name in ("a", "b", "c", "p", "d"):
+    if not opkgcl.is_installed(name):
+        opk.fail("Package '{}' not installed.".format(name))
+
+opkgcl.remove("a", "--autoremove")
+if opkgcl.is_installed("a"):
+    opk.fail("Package 'a' removed but reports as installed.")
+if opkgcl.is_installed("b"):
+    opk.fail("Package 'b' only needed by 'a' but was not autoremoved.")
+if opkgcl.is_installed("p"):
+    opk.fail("Package 'p' only needed by 'b' but was not autoremoved.")
+if not opkgcl.is_installed("c"):
+    opk.fail("Package 'c' still needed by 'd' but was autoremoved.")
+if not opkgcl.is_installed("d"):
+    opk.fail("Package 'd' explicitly installed but was removed.")
@@ -0,0 +1,51 @@
+#! /usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# The internal solver remembers, for one solve, which packages it already
+# found to install. The dependencies of each package pulled in are fetched
+# into a vector of their own, and those vectors come and go within the
+# solve; what is remembered of one must not be taken for another.
+#
+# Upgrades of installed packages x and z are pulled in one after the other.
+# Their dependencies overlap, and w and v depend on each other. The solves
+# for t1 and t2 must between them install everything, each dependency once.
+
+import opk, cfg, opkgcl
+
+opk.regress_init()
+
+o = opk.OpkGroup()
+o.add(Package='x', Version='1.0')
+o.add(Package='z', Version='1.0')
+o.write_opk()
+o.write_list()
+opkgcl.update()
+opkgcl.install('x z')
+
+o = opk.OpkGroup()
+o.add(Package='x', Version='2.0', Depends='w, y')
+o.add(Package='z', Version='2.0', Depends='w, v, u')
+o.add(Package='w', Depends='v')
+o.add(Package='v', Depends='w')
+o.add(Package='y')
+o.add(Package='u')
+o.add(Package='t1', Depends='x (>= 2.0), z (>= 2.0)')
+o.add(Package='t2', Depends='w, y')
+o.write_opk()
+o.write_list()
+opkgcl.update()
+
+status, output = opkgcl.opkgcl('install t1 t2')
+if status != 0:
+    opk.fail('Install of t1 and t2 failed:\n{}'.format(output))
+for name, version in (('x', '2.0'), ('z', '2.0'), ('t1', None),
+                      ('t2', None), ('w', None), ('v', None), ('y', None),
+                      ('u', None)):
+    if not opkgcl.is_installed(name, version):
+        opk.fail('Package {} was not installed.'.format(name))
+for name in ('w', 'v', 'y', 'u'):
+    if output.count('Installing {} '.format(name)) != 1:
+        opk.fail('Dependency {} not installed once:\n{}'.format(name, output))
+    if not opkgcl.is_autoinstalled(name):
+        opk.fail('Dependency {} not marked auto-installed.'.format(name))
+
@@ -0,0 +1,260 @@
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# A local HTTP server for feeds, which can add per-request latency, cap the
+# bandwidth and drop connections at random, for testing and benchmarking
+# opkg's download code without a real mirror. It answers GET and HEAD with
+# ETag and Last-Modified, honours If-None-Match and If-Modified-Since, and
+# serves single byte ranges.
+
+import argparse
+import email.utils
+import os
+import random
+import socket
+import sys
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import unquote, urlsplit
+
+
+class FeedServer:
+    def __init__(self, directory, latency=0.0, bandwidth=None, drop_rate=0.0,
+                 port=0, seed=1):
+        """
+        latency is in seconds per request, bandwidth in bytes per second per
+        connection (None for unlimited), and drop_rate the probability of
+        closing a connection half way through a response body.
+        """
+        self.directory = os.path.realpath(directory)
+        self.latency = latency
+        self.bandwidth = bandwidth
+        self.drop_rate = drop_rate
+        self.rng = random.Random(seed)
+        self.lock = threading.Lock()
+        self.reset_stats()
+
+        handler = type('Handler', (FeedRequestHandler,), {'feed': self})
+        self.httpd = ThreadingHTTPServer(('127.0.0.1', port), handler)
+        self.httpd.daemon_threads = True
+        self.thread = None
+
+    @property
+    def url(self):
+        return 'http://127.0.0.1:{}'.format(self.httpd.server_address[1])
+
+    def reset_stats(self):
+        with self.lock:
+            self.stats = {'requests': 0, 'head': 0, 'bytes': 0,
+                          'not_modified': 0, 'partial': 0, 'dropped': 0}
+
+    def count(self, key, n=1):
+        with self.lock:
+            self.stats[key] += n
+
+    def should_drop(self):
+        with self.lock:
+            return self.drop_rate > 0 and self.rng.random() < self.drop_rate
+
+    def start(self):
+        self.thread = threading.Thread(target=self.httpd.serve_forever,
+                                       daemon=True)
+        self.thread.start()
+        return self
+
+    def stop(self):
+        self.httpd.shutdown()
+        self.httpd.server_close()
+        self.thread.join()
+
+    def __enter__(self):
+        return self.start()
+
+    def __exit__(self, *exc):
+        self.stop()
+
+
+class FeedRequestHandler(BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+    feed = None
+
+    def log_message(self, format, *args):
+        pass
+
+    def do_HEAD(self):
+        self.feed.count('head')
+        self.respond(send_body=False)
+
+    def do_GET(self):
+        self.respond(send_body=True)
+
+    def translate_path(self):
+        path = unquote(urlsplit(self.path).path)
+        full = os.path.realpath(os.path.join(self.feed.directory,
+                                             path.lstrip('/')))
+        if full != self.feed.directory and \
+                not full.startswith(self.feed.directory + os.sep):
+            return None
+        return full
+
+    def send_empty(self, code):
+        self.send_response(code)
+        self.send_header('Content-Length', '0')
+        self.end_headers()
+
+    def respond(self, send_body):
+        self.feed.count('requests')
+        if self.feed.latency:
+            time.sleep(self.feed.latency)
+
+        path = self.translate_path()
+        if path is None or not os.path.isfile(path):
+            self.send_empty(404)
+            return
+
+        st = os.stat(path)
+        size = st.st_size
+        etag = '"{:x}-{:x}"'.format(st.st_mtime_ns, size)
+        mtime = int(st.st_mtime)
+
+        if self.not_modified(etag, mtime):
+            self.feed.count('not_modified')
+            self.send_response(304)
+            self.send_header('ETag', etag)
+            self.end_headers()
+            return
+
+        start, end = 0, size - 1
+        code = 200
+        rng = self.headers.get('Range')
+        if rng:
+            r = self.parse_range(rng, size)
+            if r is None:
+                self.send_response(416)
+                self.send_header('Content-Range', 'bytes */{}'.format(size))
+                self.send_header('Content-Length', '0')
+                self.end_headers()
+                return
+            start, end = r
+            code = 206
+            self.feed.count('partial')
+
+        self.send_response(code)
+        self.send_header('Content-Type', 'application/octet-stream')
+        self.send_header('Content-Length', str(end - start + 1))
+        self.send_header('ETag', etag)
+        self.send_header('Last-Modified',
+                         email.utils.formatdate(mtime, usegmt=True))
+        self.send_header('Accept-Ranges', 'bytes')
+        if code == 206:
+            self.send_header('Content-Range',
+                             'bytes {}-{}/{}'.format(start, end, size))
+        self.end_headers()
+
+        if send_body:
+            self.send_body(path, start, end - start + 1)
+
+    def not_modified(self, etag, mtime):
+        inm = self.headers.get('If-None-Match')
+        if inm is not None:
+            return etag in [t.strip() for t in inm.split(',')] or inm == '*'
+        ims = self.headers.get('If-Modified-Since')
+        if ims is not None:
+            try:
+                since = email.utils.parsedate_to_datetime(ims).timestamp()
+            except (TypeError, ValueError):
+                return False
+            return mtime <= since
+        return False
+
+    @staticmethod
+    def parse_range(value, size):
+        """Parses a single 'bytes=' range, returning (start, end) or None."""
+        if not value.startswith('bytes=') or ',' in value:
+            return None
+        first, _, last = value[6:].strip().partition('-')
+        try:
+            if first == '':
+                n = int(last)
+                if n <= 0:
+                    return None
+                return max(0, size - n), size - 1
+            start = int(first)
+            end = int(last) if last else size - 1
+        except ValueError:
+            return None
+        if start >= size or end < start:
+            return None
+        return start, min(end, size - 1)
+
+    def send_body(self, path, offset, length):
+        bandwidth = self.feed.bandwidth
+        chunk = 64 * 1024
+        if bandwidth:
+            # Small enough chunks to keep the rate smooth.
+            chunk = max(1024, min(chunk, bandwidth // 20))
+        drop_at = length // 2 if self.feed.should_drop() else None
+
+        sent = 0
+        began = time.monotonic()
+        with open(path, 'rb') as f:
+            f.seek(offset)
+            while sent < length:
+                n = min(chunk, length - sent)
+                if drop_at is not None and sent + n > drop_at:
+                    n = drop_at - sent
+                data = f.read(n)
+                if not data:
+                    break
+                try:
+                    self.wfile.write(data)
+                except (BrokenPipeError, ConnectionResetError):
+                    return
+                sent += len(data)
+                self.feed.count('bytes', len(data))
+
+                if drop_at is not None and sent >= drop_at:
+                    self.feed.count('dropped')
+                    self.drop()
+                    return
+                if bandwidth:
+                    ahead = sent / bandwidth - (time.monotonic() - began)
+                    if ahead > 0:
+                        time.sleep(ahead)
+
+    def drop(self):
+        self.close_connection = True
+        try:
+            self.wfile.flush()
+            self.connection.shutdown(socket.SHUT_RDWR)
+        except OSError:
+            pass
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Serve a feed directory over HTTP on localhost.')
+    parser.add_argument('directory')
+    parser.add_argument('--port', type=int, default=8080)
+    parser.add_argument('--latency', type=float, default=0,
+                        help='delay before each response, in milliseconds')
+    parser.add_argument('--bandwidth', type=int, default=0,
+                        help='per-connection cap in KiB/s, 0 for none')
+    parser.add_argument('--drop-rate', type=float, default=0,
+                        help='probability of dropping a connection mid-body')
+    args = parser.parse_args()
+
+    server = FeedServer(args.directory, latency=args.latency / 1000.0,
+                        bandwidth=args.bandwidth * 1024 or None,
+                        drop_rate=args.drop_rate, port=args.port)
+    print('Serving {} at {}'.format(server.directory, server.url))
+    sys.stdout.flush()
+    try:
+        server.httpd.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    print(server.stats)
+
+
+if __name__ == '__main__':
+    main()
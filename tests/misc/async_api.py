@@ -0,0 +1,173 @@
+#! /usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# The asynchronous libopkg API must report progress and completion as
+# events, refuse a second operation while one runs, and stop a cancelled
+# upgrade between packages. Maintainer scripts hold the worker thread until
+# the test lets it go, so that each step happens at a known point.
+
+import ctypes
+import errno
+import os
+import select
+import opk, cfg, opkgcl
+
+lib_path = os.path.join(os.path.dirname(os.path.dirname(cfg.opkgcl)),
+                        'libopkg', 'libopkg.so.1')
+try:
+    lib = ctypes.CDLL(lib_path, use_errno=True)
+    lib.opkg_async_fd
+except (OSError, AttributeError):
+    print('async_api.py: libopkg API not built, skipping')
+    exit(0)
+
+OPKG_EVENT_PROGRESS, OPKG_EVENT_DONE = 0, 1
+OPKG_INSTALL = 0
+
+
+class Event(ctypes.Structure):
+    _fields_ = [('type', ctypes.c_int),
+                ('action', ctypes.c_int),
+                ('percentage', ctypes.c_int),
+                ('pkg_name', ctypes.c_char_p),
+                ('result', ctypes.c_int),
+                ('cancelled', ctypes.c_int)]
+
+
+for name in ('opkg_async_install_package', 'opkg_async_remove_package',
+             'opkg_async_upgrade_all'):
+    getattr(lib, name).restype = ctypes.c_void_p
+    getattr(lib, name).argtypes = [ctypes.c_char_p] \
+        if name != 'opkg_async_upgrade_all' else []
+for name in ('opkg_async_fd', 'opkg_async_wait', 'opkg_async_cancel',
+             'opkg_async_free'):
+    getattr(lib, name).argtypes = [ctypes.c_void_p]
+lib.opkg_async_next_event.argtypes = [ctypes.c_void_p, ctypes.POINTER(Event)]
+
+
+def next_event(op):
+    """Waits for and returns the next event of 'op' as a tuple."""
+    event = Event()
+    while not lib.opkg_async_next_event(op, ctypes.byref(event)):
+        if not select.select([lib.opkg_async_fd(op)], [], [], 30)[0]:
+            opk.fail('No event within 30 s.')
+    name = event.pkg_name.decode() if event.pkg_name else None
+    return (event.type, event.action, event.percentage, name, event.result,
+            event.cancelled)
+
+
+def wait_for(op, pred):
+    """Reads events until 'pred' matches one, which is returned."""
+    while True:
+        event = next_event(op)
+        if pred(event):
+            return event
+        if event[0] == OPKG_EVENT_DONE:
+            opk.fail('Operation finished early: {}.'.format(event))
+
+
+def start():
+    """Sets libopkg up for the offline root, where scripts only run when
+    forced."""
+    if lib.opkg_new() != 0:
+        opk.fail('opkg_new() failed.')
+    lib.opkg_set_option(b'force_postinstall', b'1')
+
+
+def blocking_preinst(gate):
+    return '#!/bin/sh\nwhile [ ! -e {} ]; do sleep 0.05; done\n'.format(gate)
+
+
+opk.regress_init()
+os.environ['OFFLINE_ROOT'] = cfg.offline_root
+install_gate = os.path.join(cfg.opkdir, 'install.go')
+upgrade_gate = os.path.join(cfg.opkdir, 'upgrade.go')
+for gate in (install_gate, upgrade_gate):
+    if os.path.exists(gate):
+        os.unlink(gate)
+
+o = opk.OpkGroup()
+slow = opk.Opk(Package='slow')
+slow.preinst = blocking_preinst(install_gate)
+o.addOpk(slow)
+o.add(Package='u1', Version='1.0')
+o.add(Package='u2', Version='1.0')
+o.write_opk()
+o.write_list()
+opkgcl.update()
+opkgcl.install('u1 u2')
+
+start()
+
+# A second operation is refused while the install is held in its preinst.
+op = lib.opkg_async_install_package(b'slow')
+if not op:
+    opk.fail('Could not start the install.')
+progress = [wait_for(op, lambda e: e[0] == OPKG_EVENT_PROGRESS
+                     and e[2] >= 75)]
+if lib.opkg_async_remove_package(b'u1'):
+    opk.fail('A second operation started while the first was running.')
+if ctypes.get_errno() != errno.EBUSY:
+    opk.fail('Second operation failed with errno {}, not EBUSY.'.format(
+        ctypes.get_errno()))
+
+open(install_gate, 'w').close()
+while True:
+    event = next_event(op)
+    if event[0] == OPKG_EVENT_DONE:
+        break
+    progress.append(event)
+if event[4] != 0 or event[5]:
+    opk.fail('Install finished with {}.'.format(event))
+if any(e[1] != OPKG_INSTALL for e in progress):
+    opk.fail('Unexpected actions in the install progress: {}.'.format(
+        progress))
+percentages = [e[2] for e in progress]
+if percentages != sorted(percentages) or percentages[-1] != 100:
+    opk.fail('Install progress is out of order: {}.'.format(percentages))
+lib.opkg_async_free(op)
+
+# Once the DONE event has been read the next operation may start.
+op = lib.opkg_async_remove_package(b'slow')
+if not op:
+    opk.fail('Could not start a remove after the install finished.')
+event = wait_for(op, lambda e: e[0] == OPKG_EVENT_DONE)
+if event[4] != 0:
+    opk.fail('Remove finished with {}.'.format(event))
+lib.opkg_async_free(op)
+lib.opkg_free()
+# Removing its temporary directory leaves libopkg in another directory.
+os.chdir(cfg.opkdir)
+
+# A cancelled upgrade stops after the package being upgraded.
+o = opk.OpkGroup()
+for name in ('u1', 'u2'):
+    pkg = opk.Opk(Package=name, Version='2.0')
+    pkg.preinst = blocking_preinst(upgrade_gate)
+    o.addOpk(pkg)
+o.write_opk()
+o.write_list()
+opkgcl.update()
+
+start()
+op = lib.opkg_async_upgrade_all()
+if not op:
+    opk.fail('Could not start the upgrade.')
+first = wait_for(op, lambda e: e[0] == OPKG_EVENT_PROGRESS and e[3])[3]
+lib.opkg_async_cancel(op)
+open(upgrade_gate, 'w').close()
+event = wait_for(op, lambda e: e[0] == OPKG_EVENT_DONE)
+if not event[5] or event[4] == 0:
+    opk.fail('Cancelled upgrade finished with {}.'.format(event))
+lib.opkg_async_free(op)
+lib.opkg_free()
+
+second = 'u2' if first == 'u1' else 'u1'
+if not opkgcl.is_installed(first, '2.0'):
+    opk.fail('{} was not upgraded before the cancel took effect.'.format(
+        first))
+if not opkgcl.is_installed(second, '1.0'):
+    opk.fail('{} was upgraded after the upgrade was cancelled.'.format(
+        second))
+if opkgcl.is_installed('slow'):
+    opk.fail('Package slow was not removed.')
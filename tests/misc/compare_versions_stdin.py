@@ -0,0 +1,40 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# "compare-versions --stdin" must give, line by line, the same answers as
+# running "compare-versions" once per triple.
+
+import subprocess
+import opk, cfg, opkgcl
+
+opk.regress_init()
+
+triples = [
+    ('1.12A', '<<', '1.12B'),
+    ('1.2', '>>', '1.12'),
+    ('001.1535A', '<=', '001.CIBUILDX20160919_153521'),
+    ('1:1.12B', '<<', '2:1.12A'),
+    ('2.0', '>=', '1:1.0'),
+    ('1.0-r1', '=', '1.0-r1'),
+    ('1.0-r1', '=', '1.0-r2'),
+    ('1.0~rc1', '<<', '1.0'),
+    ('1.0', '?!', '1.0'),
+]
+
+expected = []
+for v1, op, v2 in triples:
+    status = opkgcl.opkgcl("compare-versions '{}' '{}' '{}'".format(v1, op, v2))[0]
+    expected.append(-1 if status == 255 else status)
+
+stdin = ''.join('{} {} {}\n'.format(*t) for t in triples)
+stdin += '\n1.0 <<\n'
+p = subprocess.run([cfg.opkgcl, 'compare-versions', '--stdin'],
+                   input=stdin.encode(), stdout=subprocess.PIPE,
+                   stderr=subprocess.DEVNULL)
+results = [int(l) for l in p.stdout.decode().split()]
+
+if results != expected + [-1]:
+    opk.fail('--stdin gave {}, expected {}'.format(results, expected + [-1]))
+
+if p.returncode == 0:
+    opk.fail('Malformed input did not make compare-versions --stdin fail.')
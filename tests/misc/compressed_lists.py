@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# With compress_list_files, a feed index, plain or gzip, is stored gzip
+# compressed in several members (compressed in parallel) next to a package
+# index, and list_compression zstd stores it in zstd frames. The packages
+# load the same from all of them.
+
+import gzip
+import os
+
+import opk, cfg, opkgcl
+
+opk.regress_init()
+
+with open("Packages", "w") as f:
+    for i in range(12000):
+        f.write("Package: pkg{0:05d}\nVersion: 1.0\nArchitecture: all\n"
+                "Filename: pkg{0:05d}.opk\nSize: 1\nMD5Sum: {1:032x}\n"
+                "Description: Package number {0} of a feed index large "
+                "enough to be compressed in more than one block\n\n"
+                .format(i, i * 7919))
+with open("Packages", "rb") as f:
+    index = f.read()
+with gzip.open("Packages.gz", "wb") as f:
+    f.write(index)
+if len(index) < 2 * 1024 * 1024:
+    opk.fail("Test feed index too small ({} bytes).".format(len(index)))
+
+conf = "{}{}/opkg/opkg.conf".format(cfg.offline_root,
+                                    os.environ["SYSCONFDIR"])
+lists = "{}/var/lib/opkg/lists".format(cfg.offline_root)
+
+def configure(src, *options):
+    with open(conf, "w") as f:
+        f.write("arch all 1\n")
+        f.write("{} test file:{}\n".format(src, cfg.opkdir))
+        f.write("option compress_list_files 1\n")
+        for o in options:
+            f.write("option {}\n".format(o))
+    for name in os.listdir(lists) if os.path.isdir(lists) else []:
+        os.unlink(os.path.join(lists, name))
+
+def check_loaded(what):
+    status, output = opkgcl.opkgcl("list 'pkg0599*'")
+    if status != 0 or len(output.splitlines()) != 10:
+        opk.fail("{}: packages not loaded from the list file.".format(what))
+
+def gzip_members(data):
+    """Counts the members of a gzip file by their headers."""
+    n = 0
+    while data:
+        n += 1
+        d = gzip.zlib.decompressobj(16 + gzip.zlib.MAX_WBITS)
+        d.decompress(data)
+        data = d.unused_data
+    return n
+
+configure("src", "compress_threads 4")
+if opkgcl.update() != 0:
+    opk.fail("Update failed.")
+with open(os.path.join(lists, "test.gz"), "rb") as f:
+    data = f.read()
+if gzip.decompress(data) != index:
+    opk.fail("Compressed list file differs from the feed index.")
+if gzip_members(data) < 2:
+    opk.fail("Large list file not compressed in blocks.")
+check_loaded("gzip, from a plain index")
+
+configure("src/gz")
+if opkgcl.update() != 0:
+    opk.fail("Update from a gzip index failed.")
+with open(os.path.join(lists, "test.gz"), "rb") as f:
+    data = f.read()
+if gzip.decompress(data) != index or gzip_members(data) < 2:
+    opk.fail("Gzip index not stored in blocks.")
+if not os.path.exists(os.path.join(lists, "test.gz.idx")):
+    opk.fail("No package index written for the list file.")
+check_loaded("gzip, from a gzip index")
+
+configure("src", "list_compression zstd")
+status, output = opkgcl.opkgcl("update")
+if "Unsupported list_compression" in output:
+    print("compressed_lists.py: zstd not built, skipping")
+    exit(0)
+if status != 0 or not os.path.exists(os.path.join(lists, "test.zst")):
+    opk.fail("Update with zstd list compression failed.")
+check_loaded("zstd, from a plain index")
+
+configure("src/gz", "list_compression zstd")
+if opkgcl.update() != 0 or not os.path.exists(os.path.join(lists, "test.zst")):
+    opk.fail("Update from a gzip index with zstd list compression failed.")
+check_loaded("zstd, from a gzip index")
@@ -0,0 +1,105 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# Packages must be cached under the checksum from their index entry: the same
+# package from a second feed is a cache hit, found without any request. With
+# "cache_max_kb", the least recently used packages must be evicted, but not
+# the installed versions or those being installed.
+
+import json
+import os
+import cfg, opk, opkgcl
+from feedserver import FeedServer
+
+opk.regress_init()
+
+# Packages of a few KiB each, which do not compress.
+os.makedirs("usr/share", exist_ok=True)
+o = opk.OpkGroup()
+for name in ("a", "b", "c"):
+    path = "usr/share/{}".format(name)
+    with open(path, "wb") as f:
+        f.write(os.urandom(8192))
+    o.add(Package=name)
+    o.opk_list[-1].write(data_files=[path])
+o.write_list()
+os.system("rm -rf usr")
+
+md5 = {}
+with open("Packages") as f:
+    for stanza in f.read().split("\n\n"):
+        fields = dict(line.split(": ", 1) for line in stanza.splitlines()
+                      if ": " in line)
+        if "Package" in fields:
+            md5[fields["Package"]] = fields["MD5Sum"]
+
+conf = "{}{}/opkg/opkg.conf".format(cfg.offline_root,
+                                    os.environ["SYSCONFDIR"])
+cache_dir = "{}{}/cache/opkg".format(cfg.offline_root, os.environ["VARDIR"])
+stats_file = "{}/stats.json".format(cfg.offline_root)
+
+
+def cached(name):
+    return os.path.exists("{}/md5/{}".format(cache_dir, md5[name]))
+
+
+def write_conf(url, extra=""):
+    with open(conf, "w") as f:
+        f.write("arch all 1\n")
+        f.write(extra)
+        f.write("src test {}\n".format(url))
+
+
+def run(args):
+    status, _ = opkgcl.opkgcl("--stats-file {} {}".format(stats_file, args))
+    if status != 0:
+        opk.fail("'opkg {}' failed.".format(args))
+    with open(stats_file) as f:
+        return json.load(f)["downloads"]
+
+
+with FeedServer(cfg.opkdir) as first, FeedServer(cfg.opkdir) as second:
+    write_conf(first.url)
+    opkgcl.update()
+    run("install a")
+    if not cached("a"):
+        opk.fail("Package 'a' not cached under its checksum.")
+
+    opkgcl.remove("a")
+    write_conf(second.url)
+    opkgcl.update()
+    second.reset_stats()
+    downloads = run("install a")
+    if not opkgcl.is_installed("a"):
+        opk.fail("Package 'a' not reinstalled from the cache.")
+    if downloads["cache_hits"] != 1 or second.stats["requests"] != 0:
+        opk.fail("Package 'a' from a second feed was not a cache hit.")
+
+    # Room for about two packages: installing "b" and "c" in turn leaves "b"
+    # the least recently used, while the installed "a" has to stay.
+    write_conf(second.url, "option cache_max_kb 20\n")
+    run("install b")
+    opkgcl.remove("b")
+    # File times may be coarser than the runs are apart.
+    b_path = "{}/md5/{}".format(cache_dir, md5["b"])
+    t = os.stat(b_path).st_mtime - 60
+    os.utime(b_path, (t, t))
+    downloads = run("install c")
+    if downloads["cache_evictions"] != 1:
+        opk.fail("Expected one eviction, got {}."
+                 .format(downloads["cache_evictions"]))
+    if cached("b"):
+        opk.fail("Least recently used package 'b' was not evicted.")
+    if not cached("a") or not cached("c"):
+        opk.fail("Installed package evicted from the cache.")
+    if second.stats["head"] != 0:
+        opk.fail("Package downloads made HEAD requests.")
+
+# A package copied from a file:// feed has the time of its source, and must
+# still not be evicted before it is installed, even from a cache too small
+# to hold it.
+write_conf("file://{}".format(cfg.opkdir), "option cache_max_kb 4\n")
+opkgcl.update()
+run("install b")
+if not opkgcl.is_installed("b"):
+    opk.fail("Package 'b' from a file:// feed was not installed.")
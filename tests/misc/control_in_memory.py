@@ -0,0 +1,43 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# Control files of local packages must be read into memory: only maintainer
+# scripts may be written to a temporary directory, to be run before the
+# package is installed, and all control files must still end up in the
+# info directory.
+
+import os
+import cfg, opk, opkgcl
+
+opk.regress_init()
+
+listing = os.path.join(cfg.offline_root, "preinst_dir")
+
+o = opk.OpkGroup()
+a = opk.Opk(Package="a")
+a.preinst = '#!/bin/sh\nls "$(dirname "$0")" > {}\n'.format(listing)
+a.postinst = '#!/bin/sh\ntrue\n'
+o.addOpk(a)
+o.add(Package="b", Depends="a")
+o.write_opk()
+
+status = opkgcl.install("a_1.0_all.opk b_1.0_all.opk")
+if status != 0:
+    opk.fail("Local packages failed to install.")
+for name in ("a", "b"):
+    if not opkgcl.is_installed(name):
+        opk.fail("Package '{}' not installed.".format(name))
+
+if not os.path.exists(listing):
+    opk.fail("Preinst of 'a' was not run.")
+with open(listing) as f:
+    unpacked = sorted(f.read().split())
+if unpacked != ["postinst", "preinst"]:
+    opk.fail("Files besides the scripts were unpacked: {}.".format(unpacked))
+
+info_dir = "{}{}/lib/opkg/info".format(cfg.offline_root, os.environ["VARDIR"])
+for name in ("a.control", "a.preinst", "a.postinst", "b.control"):
+    if not os.path.exists(os.path.join(info_dir, name)):
+        opk.fail("Control file '{}' not installed.".format(name))
+if not os.access(os.path.join(info_dir, "a.postinst"), os.X_OK):
+    opk.fail("Script 'a.postinst' lost its mode.")
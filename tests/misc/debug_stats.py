@@ -0,0 +1,66 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# "debug-stats" must report the shape of the package and file owner hash
+# tables, including the lookup counters which are off in normal runs.
+
+import json
+import os
+import opk, cfg, opkgcl
+
+opk.regress_init()
+
+os.makedirs("usr/share/a", exist_ok=True)
+files = []
+for i in range(20):
+    name = "usr/share/a/file{}".format(i)
+    with open(name, "w") as f:
+        f.write("{}\n".format(i))
+    files.append(name)
+
+o = opk.OpkGroup()
+o.add(Package="a", Depends="b")
+o.add(Package="b")
+o.add(Package="c")
+o.opk_list[0].write(data_files=files)
+o.opk_list[1].write()
+o.opk_list[2].write()
+o.write_list()
+os.system("rm -rf usr")
+
+opkgcl.update()
+opkgcl.install("a")
+if not opkgcl.is_installed("a"):
+    opk.fail("Package 'a' not installed.")
+
+status, output = opkgcl.opkgcl("debug-stats")
+if status != 0:
+    opk.fail("debug-stats failed.")
+
+for table in ("pkg-hash", "file-hash", "dir-hash", "obs-file-hash"):
+    if "\n{}: ".format(table) not in "\n" + output:
+        opk.fail("Table {} not reported:\n{}".format(table, output))
+for line in ("chain lengths:", "deepest keys:", "lookups:",
+             "keys compared per lookup:", "load factor over time:"):
+    if line not in output:
+        opk.fail("No '{}' in debug-stats output:\n{}".format(line, output))
+
+# The installed files are loaded into the file hash.
+head = output[output.index("file-hash: "):].split("\n")[0]
+if int(head.split()[1]) < len(files):
+    opk.fail("Installed files missing from the file hash: {}".format(head))
+
+stats_file = "{}/stats.json".format(cfg.opkdir)
+status, output = opkgcl.opkgcl("--stats-file {} list".format(stats_file))
+with open(stats_file) as f:
+    stats = json.load(f)
+os.unlink(stats_file)
+
+pkg_hash = [t for t in stats["hash_tables"] if t["name"] == "pkg-hash"][0]
+if sum(pkg_hash["chain_lengths"]) != pkg_hash["buckets"]:
+    opk.fail("Chain length histogram does not cover every bucket.")
+if pkg_hash["hits"] + pkg_hash["misses"] != sum(pkg_hash["probes"]) or \
+        pkg_hash["hits"] == 0:
+    opk.fail("Lookups not counted: {}.".format(pkg_hash))
+if not pkg_hash["load"] or pkg_hash["load"][0]["elements"] != 1:
+    opk.fail("Load factor not sampled: {}.".format(pkg_hash["load"]))
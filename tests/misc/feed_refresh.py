@@ -0,0 +1,122 @@
+#! /usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# When only feed lists change, opkgd re-reads just those feeds into the
+# package database it already holds. What it answers afterwards must match a
+# fresh load, including when a feed changes what it provides, conflicts
+# with or depends on, and when a feed is emptied.
+
+import os
+import subprocess
+import time
+import opk, cfg, opkgcl
+
+opkgd = os.path.join(os.path.dirname(cfg.opkgcl), 'opkgd')
+if not os.access(opkgd, os.X_OK):
+    print('feed_refresh.py: opkgd not built, skipping')
+    exit(0)
+
+opk.regress_init()
+conf_dir = '{}{}/opkg'.format(cfg.offline_root, os.environ['SYSCONFDIR'])
+with open(os.path.join(conf_dir, 'opkg.conf'), 'a') as f:
+    f.write('src other file:{}/other\n'.format(cfg.opkdir))
+os.makedirs('other', exist_ok=True)
+
+
+def write_feed(name, packages):
+    """Writes the list of one feed. Package files are only built once, so
+    that an unchanged package keeps its entry."""
+    o = opk.OpkGroup()
+    for control in packages:
+        pkg = o.add(**control)
+        filename = '{Package}_{Version}_{Architecture}.opk'.format(
+            **pkg.control)
+        if filename in built:
+            pkg.control['Filename'] = filename
+        else:
+            pkg.write()
+            built.add(filename)
+    o.write_list(name)
+
+
+built = set()
+write_feed('Packages', [dict(Package='a', Version='1.0', Depends='lib1'),
+                        dict(Package='lib1'),
+                        dict(Package='v', Provides='virt'),
+                        dict(Package='x', Conflicts='y')])
+write_feed('other/Packages', [dict(Package='b', Depends='bdep'),
+                              dict(Package='bdep'),
+                              dict(Package='w', Provides='virt')])
+opkgcl.update()
+opkgcl.install('a')
+
+log_name = os.path.join(cfg.opkdir, 'opkgd.log')
+log = open(log_name, 'w')
+daemon = subprocess.Popen([opkgd, '-V3', '-o', cfg.offline_root],
+                          stderr=log, stdout=log)
+sock = '{}{}/run/opkgd.sock'.format(cfg.offline_root, opkgcl.vardir)
+try:
+    for i in range(50):
+        if os.path.exists(sock):
+            break
+        time.sleep(0.1)
+    else:
+        opk.fail('opkgd did not create {}'.format(sock))
+
+    def check_all():
+        for args in ('list', 'list-upgradable', 'info', 'find "*"',
+                     'whatprovides virt', 'whatdepends lib1',
+                     'whatconflicts y', '-A whatdepends bdep',
+                     'depends -A a', 'info y', 'info newdep',
+                     'whatrecommends newdep'):
+            served = opkgcl.opkgcl(args)
+            local = opkgcl.opkgcl('--no-daemon {}'.format(args))
+            if served != local:
+                opk.fail('"{}" differs after a refresh:\n{}\nvs\n{}'.format(
+                    args, served[1], local[1]))
+
+    def daemon_log():
+        log.flush()
+        with open(log_name) as f:
+            return f.read()
+
+    check_all()
+
+    def update(how):
+        """Runs opkg update and checks how opkgd took in the change."""
+        start = len(daemon_log())
+        opkgcl.update()
+        check_all()
+        output = daemon_log()[start:]
+        refreshed = 'Re-reading feed' in output and \
+            'Reloading package database' not in output
+        if refreshed != (how == 'refresh'):
+            opk.fail('opkgd did not {} after the update:\n{}'.format(
+                how, output))
+        return output
+
+    # New versions, and packages which drop their Provides and Conflicts.
+    # The installed packages are listed as before.
+    write_feed('Packages', [dict(Package='a', Version='1.0', Depends='lib1'),
+                            dict(Package='a', Version='2.0', Depends='lib2'),
+                            dict(Package='lib1'),
+                            dict(Package='lib2'),
+                            dict(Package='v'),
+                            dict(Package='z', Recommends='newdep')])
+    update('refresh')
+
+    # Packages which only the emptied feed referred to are gone.
+    write_feed('other/Packages', [])
+    if 'unused abstract packages' not in update('refresh'):
+        opk.fail('Packages only the emptied feed referred to were kept.')
+
+    # The installed version of a is no longer in its feed, which leaves it
+    # with fields only a full load can take away.
+    write_feed('Packages', [dict(Package='a', Version='2.0', Depends='lib2'),
+                            dict(Package='lib1'),
+                            dict(Package='lib2')])
+    update('reload')
+finally:
+    daemon.terminate()
+    daemon.wait()
+    log.close()
@@ -0,0 +1,69 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# Feeds served over HTTP must work, and with the curl backend a feed index
+# download which was cut off must be resumed with a range request from the
+# partial file in the cache.
+
+import os
+import cfg, opk, opkgcl
+from feedserver import FeedServer
+
+opk.regress_init()
+
+o = opk.OpkGroup()
+o.add(Package="a", Depends="b")
+o.add(Package="b")
+o.write_opk()
+o.write_list()
+
+# Pad the index, so that the cut falls well inside the body.
+with open("Packages", "a") as f:
+    for i in range(2000):
+        f.write("Package: filler{}\nVersion: 1.0\nArchitecture: all\n"
+                "Filename: filler{}.opk\nSize: 1\n\n".format(i, i))
+
+conf = "{}{}/opkg/opkg.conf".format(cfg.offline_root,
+                                    os.environ["SYSCONFDIR"])
+
+with FeedServer(cfg.opkdir, latency=0.01) as server:
+    with open(conf, "w") as f:
+        f.write("arch all 1\n")
+        f.write("src test {}\n".format(server.url))
+
+    opkgcl.update()
+    if server.stats["requests"] == 0:
+        opk.fail("Feed index not fetched over HTTP.")
+
+    opkgcl.install("a")
+    if not opkgcl.is_installed("a") or not opkgcl.is_installed("b"):
+        opk.fail("Packages not installed over HTTP.")
+
+    if server.stats["head"] == 0:
+        # The wget backend does not keep partial downloads.
+        print("misc/http_feed.py: Skipping resume check without curl.")
+        exit(0)
+
+    # Make the index newer, so that the cached copy is stale.
+    with open("Packages", "a") as f:
+        f.write("Package: late\nVersion: 1.0\nArchitecture: all\n"
+                "Filename: late.opk\nSize: 1\n\n")
+    index_size = os.stat("Packages").st_size
+
+    server.drop_rate = 1.0
+    server.reset_stats()
+    if opkgcl.opkgcl("update")[0] == 0:
+        opk.fail("Update succeeded although the download was cut off.")
+    if server.stats["dropped"] == 0:
+        opk.fail("Download was not cut off.")
+
+    server.drop_rate = 0.0
+    server.reset_stats()
+    if opkgcl.opkgcl("update")[0] != 0:
+        opk.fail("Update failed after the connection came back.")
+    if server.stats["partial"] != 1:
+        opk.fail("Partial download was not resumed with a range request.")
+    if server.stats["bytes"] >= index_size:
+        opk.fail("Resumed download fetched the whole index again.")
+    if "late" not in opkgcl.opkgcl("list late")[1]:
+        opk.fail("Resumed index is incomplete.")
@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# With compress_list_files, "opkg info <name>" reads the package from the
+# list file through its index: only the frames holding that name are
+# decompressed and only its stanzas parsed. An index which no longer
+# matches its list file is ignored and the whole list is loaded.
+
+import json
+import os
+
+import opk, cfg, opkgcl
+
+opk.regress_init()
+
+N = 3000
+
+def stanza(name, version):
+    return ("Package: {0}\nVersion: {1}\nArchitecture: all\n"
+            "Filename: {0}_{1}.opk\nSize: 1\nMD5Sum: {2:032x}\n"
+            "Description: {0} version {1}\n\n"
+            .format(name, version, 0))
+
+with open("Packages", "w") as f:
+    for i in range(N):
+        f.write(stanza("pkg{:05d}".format(i), "1.0"))
+        # A second version of one package, many frames further on.
+        if i == 2500:
+            f.write(stanza("pkg00010", "2.0"))
+
+conf = "{}{}/opkg/opkg.conf".format(cfg.offline_root,
+                                    os.environ["SYSCONFDIR"])
+lists = "{}/var/lib/opkg/lists".format(cfg.offline_root)
+stats_file = "{}/stats.json".format(cfg.opkdir)
+
+with open(conf, "w") as f:
+    f.write("arch all 1\n")
+    f.write("src test file:{}\n".format(cfg.opkdir))
+    f.write("option compress_list_files 1\n")
+
+if opkgcl.update() != 0:
+    opk.fail("Update failed.")
+if not os.path.exists(os.path.join(lists, "test.gz.idx")):
+    opk.fail("No package index written for the list file.")
+
+def info(name):
+    status, output = opkgcl.opkgcl("--stats-file {} info {}"
+                                   .format(stats_file, name))
+    if status != 0:
+        opk.fail("info {} failed.".format(name))
+    with open(stats_file) as f:
+        stats = json.load(f)
+    os.unlink(stats_file)
+    return output, stats
+
+output, stats = info("pkg00010")
+if "Version: 1.0" not in output or "Version: 2.0" not in output:
+    opk.fail("Both versions of pkg00010 not found through the index.")
+if stats["packages_parsed"] != 2 or stats["list_frames_read"] != 2:
+    opk.fail("Indexed lookup read more than it needed: {} parsed, {} frames."
+             .format(stats["packages_parsed"], stats["list_frames_read"]))
+
+output, stats = info("pkg02999")
+if "Package: pkg02999" not in output or stats["packages_parsed"] != 1:
+    opk.fail("Last package not found through the index.")
+
+output, stats = info("nosuchpkg")
+if "Package:" in output or stats["packages_parsed"] != 0:
+    opk.fail("Lookup of a missing package parsed packages.")
+
+# Globs need every package.
+output, stats = info("'pkg0001*'")
+if stats["packages_parsed"] < N:
+    opk.fail("Glob lookup did not load the whole list.")
+
+# A list file rewritten behind the index's back.
+list_file = os.path.join(lists, "test.gz")
+with open(list_file, "rb") as f:
+    data = f.read()
+os.unlink(list_file)
+with open(list_file, "wb") as f:
+    f.write(data + data[:0])
+os.utime(list_file, ns=(0, 12345))
+output, stats = info("pkg00010")
+if "Version: 2.0" not in output or stats["packages_parsed"] < N:
+    opk.fail("Stale index was used.")
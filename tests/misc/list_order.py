@@ -0,0 +1,49 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# The list commands walk the package hash in name order, and a pattern with
+# a literal start only visits the names which begin with it.
+
+import opk, cfg, opkgcl
+
+opk.regress_init()
+
+names = ["zeta", "alpha", "ab", "abc", "b", "a", "abd-dev", "mid"]
+o = opk.OpkGroup()
+for n in names:
+    o.add(Package=n)
+o.add(Package="abc", Version="2.0")
+o.write_opk()
+o.write_list()
+
+opkgcl.update()
+
+def listed(args):
+    status, output = opkgcl.opkgcl(args)
+    if status != 0:
+        opk.fail("'{}' failed.".format(args))
+    return [line.split(" - ")[0] for line in output.splitlines()]
+
+got = listed("list")
+want = ["a", "ab", "abc", "abc", "abd-dev", "alpha", "b", "mid", "zeta"]
+if got != want:
+    opk.fail("'list' not in name order: {}".format(got))
+
+got = listed("list 'ab*'")
+if got != ["ab", "abc", "abc", "abd-dev"]:
+    opk.fail("'list ab*' gave {}".format(got))
+
+got = listed("list 'ab?'")
+if got != ["abc", "abc"]:
+    opk.fail("'list ab?' gave {}".format(got))
+
+if listed("list 'abz*'") != [] or listed("list 'zz'") != []:
+    opk.fail("A pattern with no match listed packages.")
+
+opkgcl.install("abd-dev")
+opkgcl.install("b")
+got = listed("list-installed")
+if got != ["abd-dev", "b"]:
+    opk.fail("'list-installed' gave {}".format(got))
+if listed("list-installed 'a*'") != ["abd-dev"]:
+    opk.fail("'list-installed a*' did not filter by prefix.")
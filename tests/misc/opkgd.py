@@ -0,0 +1,97 @@
+#! /usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# Read-only queries answered by opkgd must match what opkg prints on its own,
+# and the daemon must pick up changes made by opkg behind its back. A
+# configuration it cannot read must leave queries to opkg without stopping
+# the daemon.
+
+import os
+import subprocess
+import time
+import opk, cfg, opkgcl
+
+opkgd = os.path.join(os.path.dirname(cfg.opkgcl), 'opkgd')
+if not os.access(opkgd, os.X_OK):
+    print('opkgd.py: opkgd not built, skipping')
+    exit(0)
+
+opk.regress_init()
+
+o = opk.OpkGroup()
+o.add(Package='a', Version='1.0', Description='first package')
+o.add(Package='b', Version='1.0', Depends='a', Description='second package')
+o.addOpk(opk.Opk(Package='c', Version='1.0'))
+o.write_opk()
+o.write_list()
+opkgcl.update()
+
+sock = '{}{}/run/opkgd.sock'.format(cfg.offline_root, opkgcl.vardir)
+socks = [sock, sock + '.installed']
+conf = '{}{}/opkg/broken.conf'.format(cfg.offline_root,
+                                     os.environ['SYSCONFDIR'])
+daemon = subprocess.Popen([opkgd, '-o', cfg.offline_root])
+try:
+    for i in range(50):
+        if all(os.path.exists(s) for s in socks):
+            break
+        time.sleep(0.1)
+    else:
+        opk.fail('opkgd did not create {}'.format(socks))
+
+    def check(args):
+        served = opkgcl.opkgcl(args)
+        local = opkgcl.opkgcl('--no-daemon {}'.format(args))
+        if served != local:
+            opk.fail('"{}" differs through opkgd:\n{}\nvs\n{}'.format(
+                args, served[1], local[1]))
+
+    def served(args):
+        return 'Served by the daemon' in opkgcl.opkgcl('-V3 ' + args)[1]
+
+    for args in ('list', 'status', '-f /dev/null list'):
+        if served(args) != (args[0] != '-'):
+            opk.fail('opkg {} use opkgd for "{}"'.format(
+                'did not' if args[0] != '-' else 'should not', args))
+
+    check('list')
+    check('info b')
+    check('find "*package*"')
+    check('whatdepends a')
+
+    opkgcl.install('b')
+    if not opkgcl.is_installed('b'):
+        opk.fail('Package "b" not installed.')
+
+    check('info b')
+    check('list-upgradable')
+    check('-A whatdepends a')
+    check('status')
+    check('status a')
+    check('list-installed')
+    opkgcl.install('c_1.0_all.opk')
+    check('files c')
+    check('search "*c*"')
+    check('search /nonexistent')
+
+    o.add(Package='d', Version='1.0')
+    o.write_opk()
+    o.write_list()
+    opkgcl.update()
+    check('list')
+    check('info d')
+
+    os.symlink('/nonexistent', conf)
+    if served('list') or served('status'):
+        opk.fail('opkgd served queries without a database')
+    os.unlink(conf)
+    if not served('list') or not served('status'):
+        opk.fail('opkgd did not reload after its configuration was fixed')
+    check('info d')
+finally:
+    daemon.terminate()
+    daemon.wait()
+
+for s in socks:
+    if os.path.exists(s):
+        opk.fail('opkgd did not remove {} on exit'.format(s))
@@ -0,0 +1,50 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# Local package files given to install are read in parallel, but must be
+# added in argument order alongside package names from the feeds, and a
+# package file which cannot be read must fail the install. Four threads are
+# used whatever the number of cores.
+
+import os
+import cfg, opk, opkgcl
+
+opk.regress_init()
+conf = "{}{}/opkg/opkg.conf".format(cfg.offline_root,
+                                    os.environ["SYSCONFDIR"])
+with open(conf, "a") as f:
+    f.write("option read_threads 4\n")
+
+count = 24
+o = opk.OpkGroup()
+o.add(Package="feed")
+for i in range(count):
+    if i:
+        o.add(Package="p{}".format(i), Depends="p{}".format(i - 1))
+    else:
+        o.add(Package="p0", Depends="feed")
+o.write_opk()
+o.write_list()
+opkgcl.update()
+
+files = ["p{}_1.0_all.opk".format(i) for i in reversed(range(count))]
+with open("broken_1.0_all.opk", "w") as f:
+    f.write("not a package\n")
+
+status = opkgcl.install(" ".join(files + ["broken_1.0_all.opk"]))
+if status == 0:
+    opk.fail("Install of an unreadable package file succeeded.")
+for i in range(count):
+    if opkgcl.is_installed("p{}".format(i)):
+        opk.fail("Package 'p{}' installed despite the error.".format(i))
+os.unlink("broken_1.0_all.opk")
+
+status, output = opkgcl.opkgcl("-V3 install " + " ".join(
+    files[:count // 2] + ["feed"] + files[count // 2:]))
+if status != 0:
+    opk.fail("Local packages failed to install.")
+if "Reading {} package files on 4 threads".format(count) not in output:
+    opk.fail("Package files were not read on 4 threads.")
+for name in ["feed"] + ["p{}".format(i) for i in range(count)]:
+    if not opkgcl.is_installed(name):
+        opk.fail("Package '{}' not installed.".format(name))
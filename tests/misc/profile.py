@@ -0,0 +1,48 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# "--profile" must print a per-phase timing summary and, when given a file,
+# write the same spans there as Chrome trace events.
+
+import json
+import os
+import opk, cfg, opkgcl
+
+opk.regress_init()
+
+o = opk.OpkGroup()
+o.add(Package="a", Depends="b")
+o.add(Package="b")
+o.write_opk()
+o.write_list()
+
+opkgcl.update()
+
+trace = "{}/profile.json".format(cfg.opkdir)
+status, output = opkgcl.opkgcl("--profile={} install a".format(trace))
+if status != 0:
+    opk.fail("Install with --profile failed.")
+
+if not opkgcl.is_installed("a") or not opkgcl.is_installed("b"):
+    opk.fail("Packages not installed with --profile.")
+
+for phase in ("config", "feed parse", "download", "verify", "install",
+              "extract", "status write", "command", "wall"):
+    if not any(line.split("  ")[0] == phase for line in output.splitlines()):
+        opk.fail("Phase '{}' missing from the profile summary.".format(phase))
+
+with open(trace) as f:
+    events = json.load(f)["traceEvents"]
+
+installs = sorted(e["args"]["detail"] for e in events if e["name"] == "install")
+if installs != ["a", "b"]:
+    opk.fail("Expected one install span per package, got {}.".format(installs))
+
+if any(e["ph"] != "X" or e["dur"] < 0 for e in events):
+    opk.fail("Malformed trace events.")
+
+os.unlink(trace)
+
+status, output = opkgcl.opkgcl("list-installed")
+if "phase" in output:
+    opk.fail("Profile summary printed without --profile.")
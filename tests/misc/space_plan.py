@@ -0,0 +1,47 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# The disk space of a transaction must be checked once, before any of it is
+# done: a package depending on two packages which fit one at a time but not
+# together must leave neither installed. An upgrade must be credited with
+# the space of the version it replaces.
+
+import os
+import cfg, opk, opkgcl
+
+opk.regress_init()
+
+st = os.statvfs(cfg.offline_root)
+available = st.f_bavail * st.f_frsize
+part = available * 6 // 10
+
+o = opk.OpkGroup()
+o.add(**{"Package": "big1", "Installed-Size": part})
+o.add(**{"Package": "big2", "Installed-Size": part})
+o.add(Package="a", Depends="big1, big2")
+o.write_opk()
+o.write_list()
+opkgcl.update()
+
+status, output = opkgcl.opkgcl("-V2 install a")
+if status == 0:
+    opk.fail("Install needing more space than available succeeded.")
+if "the transaction needs" not in output:
+    opk.fail("Transaction was not checked for space as a whole.")
+for name in ("a", "big1", "big2"):
+    if opkgcl.is_installed(name):
+        opk.fail("Package '{}' installed by a transaction which "
+                 "does not fit.".format(name))
+
+if opkgcl.install("big1") != 0 or not opkgcl.is_installed("big1"):
+    opk.fail("Package 'big1' not installed, though it fits.")
+
+# The new version alone does not fit, but it frees the space of the old one.
+o = opk.OpkGroup()
+o.add(**{"Package": "big1", "Version": "2.0", "Installed-Size": part * 2})
+o.write_opk()
+o.write_list()
+opkgcl.update()
+
+if opkgcl.upgrade("big1") != 0 or not opkgcl.is_installed("big1", "2.0"):
+    opk.fail("Upgrade not credited with the space of the old version.")
@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# Installs and removes must publish new status and .list files by renaming
+# them into place under the generation file's lock, so that read-only
+# queries running at the same time never see a partly written database.
+
+import fcntl
+import os
+import subprocess
+import time
+import opk, cfg, opkgcl
+
+opk.regress_init()
+
+o = opk.OpkGroup()
+base = ["p{:03d}".format(i) for i in range(100)]
+for name in base:
+    o.add(Package=name, Description="A package which stays installed")
+o.add(Package="q")
+seen = os.path.join(cfg.opkdir, "r.seen")
+r = opk.Opk(Package="r")
+r.postinst = ('#!/bin/sh\n'
+              'cd "$(dirname "$0")" && ls r.list r.list.new > {}\n'
+              'true\n').format(seen)
+o.addOpk(r)
+o.write_opk()
+o.write_list()
+
+opkgcl.update()
+status, output = opkgcl.opkgcl("install " + " ".join(base))
+if status != 0:
+    opk.fail("Installing the base packages failed.")
+
+var = "{}{}".format(cfg.offline_root, os.environ["VARDIR"])
+gen_file = "{}/run/opkg.lock.gen".format(var)
+info_dir = "{}/lib/opkg/info".format(var)
+
+with open(gen_file) as f:
+    gen = int(f.read())
+if gen < 1:
+    opk.fail("Generation not bumped by install: {}.".format(gen))
+for d in (info_dir, "{}/lib/opkg".format(var)):
+    leftovers = [n for n in os.listdir(d) if n.endswith(".new")]
+    if leftovers:
+        opk.fail("Temp files left behind: {}.".format(leftovers))
+
+opkgcl.install("q")
+with open(gen_file) as f:
+    if int(f.read()) <= gen:
+        opk.fail("Generation not bumped by a second install.")
+
+# The .list of a new package is only published with the status file, after
+# its postinst has run.
+opkgcl.opkgcl("--force-postinstall install r")
+with open(seen) as f:
+    listing = f.read().split()
+if listing != ["r.list.new"]:
+    opk.fail("r.list was published before the status: {}.".format(listing))
+if not os.path.exists(os.path.join(info_dir, "r.list")) \
+        or not opkgcl.is_installed("r"):
+    opk.fail("r was not installed.")
+
+# Readers wait while a publish is in progress...
+with open(gen_file) as f:
+    fcntl.flock(f, fcntl.LOCK_EX)
+    reader = subprocess.Popen([cfg.opkgcl, "-o", cfg.offline_root,
+                               "list-installed"], stdout=subprocess.PIPE,
+                              stderr=subprocess.DEVNULL)
+    time.sleep(0.5)
+    if reader.poll() is not None:
+        opk.fail("list-installed did not wait for the publish lock.")
+output = reader.communicate()[0].decode()
+if reader.returncode != 0 or "p099 - " not in output:
+    opk.fail("list-installed failed after the publish.")
+
+# ...so a reader running alongside installs and removes always sees every
+# package which stays installed, and the file lists of the packages it saw.
+writer = subprocess.Popen(
+    "for i in 1 2 3 4 5 6 7 8; do {0} -o {1} remove q && "
+    "{0} -o {1} install q; done".format(cfg.opkgcl, cfg.offline_root),
+    shell=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+reads = 0
+while writer.poll() is None or reads == 0:
+    status, output = opkgcl.opkgcl("list-installed")
+    names = set(line.split(" - ")[0] for line in output.splitlines())
+    if status != 0 or not set(base) <= names:
+        writer.wait()
+        opk.fail("Reader saw a partial status: {} packages.".format(
+            len(set(base) & names)))
+    status, output = opkgcl.opkgcl("whatprovides p050")
+    if status != 0 or "Failed to open" in output \
+            or "    p050" not in output:
+        writer.wait()
+        opk.fail("Reader saw file lists of another status:\n{}".format(
+            output))
+    reads += 1
+if writer.returncode != 0:
+    opk.fail("Concurrent installs and removes failed.")
@@ -0,0 +1,66 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# "--stats-file" must write a JSON record of the run on exit, to a file or
+# to an inherited file descriptor.
+
+import json
+import os
+import subprocess
+import opk, cfg, opkgcl
+
+opk.regress_init()
+
+o = opk.OpkGroup()
+a = o.add(Package="a", Depends="b")
+a.postinst = "#!/bin/sh\nexit 0\n"
+o.add(Package="b")
+o.write_opk()
+o.write_list()
+
+opkgcl.update()
+
+stats_file = "{}/stats.json".format(cfg.opkdir)
+status, output = opkgcl.opkgcl("--force-postinstall --stats-file {} install a"
+                               .format(stats_file))
+if status != 0:
+    opk.fail("Install with --stats-file failed.")
+
+with open(stats_file) as f:
+    stats = json.load(f)
+os.unlink(stats_file)
+
+if stats["command"] != "install" or stats["exit_status"] != 0:
+    opk.fail("Wrong command or exit status in {}.".format(stats))
+if stats["packages_parsed"] < 2:
+    opk.fail("Parsed packages not counted.")
+if stats["downloads"]["count"] != 2 or stats["downloads"]["bytes"] <= 0:
+    opk.fail("Downloads not counted: {}.".format(stats["downloads"]))
+if stats["syscalls"]["stat"] == 0 or stats["syscalls"]["unlink"] == 0:
+    opk.fail("File system calls not counted: {}.".format(stats["syscalls"]))
+if stats["peak_rss_kib"] <= 0:
+    opk.fail("No peak RSS.")
+
+tables = {t["name"]: t for t in stats["hash_tables"]}
+if tables["pkg-hash"]["elements"] < 2 or \
+        tables["pkg-hash"]["max_chain_length"] < 1:
+    opk.fail("Package hash table not reported: {}.".format(tables))
+
+scripts = [(s["package"], s["script"]) for s in stats["scripts"]]
+if ("a", "postinst") not in scripts:
+    opk.fail("postinst run not recorded: {}.".format(scripts))
+
+# The packages are now in the cache.
+opkgcl.remove("a")
+r, w = os.pipe()
+cmd = "{} -o {} --stats-file fd:{} install a".format(
+    cfg.opkgcl, cfg.offline_root, w)
+p = subprocess.Popen(cmd, shell=True, pass_fds=(w,),
+                     stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+os.close(w)
+with os.fdopen(r) as f:
+    stats = json.load(f)
+p.wait()
+
+if stats["downloads"]["cache_hits"] < 1 or stats["downloads"]["count"] != 0:
+    opk.fail("Cache hits not counted: {}.".format(stats["downloads"]))
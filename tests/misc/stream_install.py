@@ -0,0 +1,130 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# With "stream_install", a package fetched over HTTP must be installed as it
+# is downloaded, without a copy in the cache, and a package which fails its
+# checksum must leave nothing behind: neither files nor staged copies. A
+# package with only a SHA256 checksum is streamed if this build can check it,
+# or with --force-checksum, which also lets a checksum mismatch by.
+
+import hashlib
+import os
+import cfg, opk, opkgcl
+from feedserver import FeedServer
+
+opk.regress_init()
+
+os.makedirs("usr/share/a", exist_ok=True)
+os.makedirs("usr/share/bad", exist_ok=True)
+os.makedirs("usr/share/s", exist_ok=True)
+for name in ("usr/share/a/file1", "usr/share/a/file2", "usr/share/bad/file",
+             "usr/share/s/file"):
+    with open(name, "w") as f:
+        f.write("{}\n".format(name))
+
+o = opk.OpkGroup()
+o.add(Package="a")
+o.add(Package="bad")
+o.add(Package="s")
+o.opk_list[0].write(data_files=["usr/share/a/file1", "usr/share/a/file2"])
+o.opk_list[1].write(data_files=["usr/share/bad/file"])
+o.opk_list[2].write(data_files=["usr/share/s/file"])
+o.write_list()
+os.system("rm -rf usr")
+with open(o.opk_list[2].control["Filename"], "rb") as f:
+    s_sha256 = hashlib.sha256(f.read()).hexdigest()
+
+# Break the checksum of "bad" in the index, and give "s" only a SHA256 one.
+with open("Packages") as f:
+    stanzas = f.read().split("\n\n")
+for i, stanza in enumerate(stanzas):
+    if stanza.startswith("Package: bad\n"):
+        sum_line = "MD5Sum: " + "0" * 32
+    elif stanza.startswith("Package: s\n"):
+        sum_line = "SHA256sum: " + s_sha256
+    else:
+        continue
+    stanzas[i] = "\n".join(
+        sum_line if line.startswith("MD5Sum:") else line
+        for line in stanza.split("\n"))
+with open("Packages", "w") as f:
+    f.write("\n\n".join(stanzas))
+
+conf = "{}{}/opkg/opkg.conf".format(cfg.offline_root,
+                                    os.environ["SYSCONFDIR"])
+
+
+def root_files():
+    for dirpath, _, filenames in os.walk(cfg.offline_root):
+        for name in filenames:
+            yield os.path.join(dirpath, name)
+
+
+with FeedServer(cfg.opkdir) as server:
+    with open(conf, "w") as f:
+        f.write("arch all 1\n")
+        f.write("option stream_install 1\n")
+        f.write("src test {}\n".format(server.url))
+
+    opkgcl.update()
+    if server.stats["head"] == 0:
+        # Streaming needs the curl backend.
+        print("misc/stream_install.py: Skipping without curl.")
+        exit(0)
+
+    status, output = opkgcl.opkgcl("-V2 install a")
+    if "Staging a as it is downloaded" not in output:
+        opk.fail("Package 'a' was not streamed.")
+    if not opkgcl.is_installed("a"):
+        opk.fail("Package 'a' not installed from a stream.")
+    for name in ("file1", "file2"):
+        path = "{}/usr/share/a/{}".format(cfg.offline_root, name)
+        if not os.path.exists(path):
+            opk.fail("File '{}' not installed.".format(path))
+    if "/usr/share/a/file1" not in opkgcl.opkgcl("files a")[1]:
+        opk.fail("File list of 'a' is incomplete.")
+    if any(f.endswith(".opk") for f in root_files()):
+        opk.fail("Streamed package was kept in the cache.")
+
+    if opkgcl.opkgcl("install bad")[0] == 0:
+        opk.fail("Package with a bad checksum was installed.")
+    if opkgcl.is_installed("bad"):
+        opk.fail("Package with a bad checksum is marked installed.")
+    if os.path.exists("{}/usr/share/bad".format(cfg.offline_root)):
+        opk.fail("Package with a bad checksum left its files behind.")
+    if any(".opkg-stage-" in f for f in root_files()):
+        opk.fail("Staged files were left behind.")
+
+    # Without SHA256 support there is nothing to check "s" against, which
+    # only --force-checksum lets by, as for a downloaded package.
+    status, output = opkgcl.opkgcl("-V2 install s")
+    streamed = "Staging s as it is downloaded" in output
+    if streamed != opkgcl.is_installed("s"):
+        opk.fail("Package 's' was {}streamed but {}installed.".format(
+            "" if streamed else "not ", "" if streamed else "not "))
+    if not streamed:
+        if "Checksum is either missing or unsupported" not in output:
+            opk.fail("Package 's' failed for another reason:\n" + output)
+        # The failed install left its download in the cache.
+        os.unlink("{}{}/cache/opkg/sha256/{}".format(
+            cfg.offline_root, os.environ["VARDIR"], s_sha256))
+        output = opkgcl.opkgcl("-V2 --force-checksum install s")[1]
+        if "Staging s as it is downloaded" not in output:
+            opk.fail("Package 's' was not streamed with --force-checksum.")
+        if not opkgcl.is_installed("s"):
+            opk.fail("Package 's' not installed with --force-checksum.")
+    if not os.path.exists("{}/usr/share/s/file".format(cfg.offline_root)):
+        opk.fail("File of package 's' not installed.")
+    if any(".opkg-stage-" in f for f in root_files()):
+        opk.fail("Staged files were left behind.")
+
+    # --force-checksum lets a mismatch by, as it does for a downloaded
+    # package.
+    output = opkgcl.opkgcl("-V2 --force-checksum install bad")[1]
+    if "Staging bad as it is downloaded" not in output:
+        opk.fail("Package 'bad' was not streamed with --force-checksum.")
+    if "Ignored" not in output or not opkgcl.is_installed("bad"):
+        opk.fail("Package 'bad' not installed with --force-checksum:\n"
+                 + output)
+    if not os.path.exists("{}/usr/share/bad/file".format(cfg.offline_root)):
+        opk.fail("File of package 'bad' not installed.")
@@ -0,0 +1,70 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# An xz data archive installs the same whether it is decoded by libarchive or
+# by the multi-threaded decoder, including one made of several xz streams.
+
+import hashlib
+import lzma
+import os
+import random
+import subprocess
+
+import opk, cfg, opkgcl
+
+opk.regress_init()
+
+rng = random.Random(1)
+with open("payload.bin", "wb") as f:
+    # Some structure, so that xz has something to do.
+    words = [bytes(rng.randrange(256) for _ in range(16)) for _ in range(64)]
+    f.write(b"".join(rng.choice(words) for _ in range(64 * 1024)))
+with open("payload.bin", "rb") as f:
+    payload_md5 = hashlib.md5(f.read()).hexdigest()
+
+o = opk.OpkGroup()
+single = opk.Opk(Package="single")
+single.write(data_files=["payload.bin"], compression="xz")
+o.addOpk(single)
+
+# Rewrite the data archive of "multi" as a run of separate xz streams.
+multi = opk.Opk(Package="multi")
+filename = multi.write(data_files=["payload.bin"], compression="xz")
+subprocess.check_call(["ar", "x", filename, "data.tar.xz"])
+with open("data.tar.xz", "rb") as f:
+    tar = lzma.decompress(f.read())
+with open("data.tar.xz", "wb") as f:
+    for i in range(0, len(tar), 256 * 1024):
+        f.write(lzma.compress(tar[i:i + 256 * 1024]))
+subprocess.check_call(["ar", "r", filename, "data.tar.xz"])
+os.unlink("data.tar.xz")
+o.addOpk(multi)
+os.unlink("payload.bin")
+o.write_list()
+
+conf = "{}{}/opkg/opkg.conf".format(cfg.offline_root,
+                                    os.environ["SYSCONFDIR"])
+
+def installed_md5():
+    path = "{}/payload.bin".format(cfg.offline_root)
+    if not os.path.exists(path):
+        return None
+    with open(path, "rb") as f:
+        return hashlib.md5(f.read()).hexdigest()
+
+for threads in (1, 4):
+    with open(conf, "w") as f:
+        f.write("arch all 1\n")
+        f.write("src test file:{}\n".format(cfg.opkdir))
+        f.write("option decompress_threads {}\n".format(threads))
+    opkgcl.update()
+    for pkg in ("single", "multi"):
+        opkgcl.install(pkg)
+        if not opkgcl.is_installed(pkg):
+            opk.fail("'{}' not installed with {} threads.".format(pkg, threads))
+        if installed_md5() != payload_md5:
+            opk.fail("'{}' payload differs with {} threads.".format(
+                pkg, threads))
+        opkgcl.remove(pkg)
+        if installed_md5() is not None:
+            opk.fail("'{}' payload left behind.".format(pkg))
@@ -24,6 +24,7 @@ class Opk:
         'Essential',
         'Filename',
         'Homepage',
+        'Installed-Size',
         'InstalledSize',
         'MD5Sum',
         'Maintainer',
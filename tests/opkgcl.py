@@ -23,6 +23,12 @@ def opkgcl(opkg_args):
     return (status, stdout_data.decode('utf-8'))
 
 
+def batch(commands, flags='', sep='\n'):
+    with open('batch.txt', 'w') as f:
+        f.write(sep.join(commands) + sep)
+    return opkgcl('{} --force-postinstall batch batch.txt'.format(flags))
+
+
 def distupgrade(params=None, flags=''):
     if params:
         return opkgcl('{} --force-postinstall dist-upgrade {}'.format(flags, params))[0]
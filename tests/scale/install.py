@@ -0,0 +1,20 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# Installing packages whose dependencies are spread over a large feed, next
+# to a large installed database, must stay within budget.
+
+import bigfeed, opk, opkgcl
+
+feed = bigfeed.BigFeed()
+feed.setup()
+bigfeed.check_budget(feed, 'update', 'update', seconds=2, mib=64)
+
+targets = [feed.names[i] for i in feed.targets]
+bigfeed.check_budget(feed, 'install',
+                     '--force-postinstall install ' + ' '.join(targets),
+                     seconds=5, mib=128)
+
+for i in feed.real:
+    if not opkgcl.is_installed(feed.names[i]):
+        opk.fail('{} not installed.'.format(feed.names[i]))
@@ -0,0 +1,32 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# Listing a large feed and a large installed database must stay within
+# budget and show every package.
+
+import bigfeed, opk
+
+feed = bigfeed.BigFeed()
+feed.setup()
+bigfeed.check_budget(feed, 'update', 'update', seconds=2, mib=64)
+
+output = bigfeed.check_budget(feed, 'list', 'list', seconds=3, mib=96)
+listed = set(line.split(' - ')[0] for line in output.splitlines())
+if len(listed & set(feed.names)) != feed.n_packages:
+    opk.fail('list shows {} of {} packages.'.format(
+        len(listed & set(feed.names)), feed.n_packages))
+
+output = bigfeed.check_budget(feed, 'list-installed', 'list-installed',
+                              seconds=2, mib=64)
+if len(output.splitlines()) != feed.n_installed:
+    opk.fail('list-installed shows {} of {} packages.'.format(
+        len(output.splitlines()), feed.n_installed))
+
+output = bigfeed.check_budget(feed, 'list-upgradable', 'list-upgradable',
+                              seconds=4, mib=128)
+# The internal solver also prints notices about candidates it rejects.
+upgradable = set(line.split(' - ')[0] for line in output.splitlines()
+                 if ' - ' in line)
+if upgradable != set(feed.names[i] for i in feed.upgrades):
+    opk.fail('list-upgradable shows {} packages, expected {}.'.format(
+        len(upgradable), len(feed.upgrades)))
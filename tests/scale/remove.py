@@ -0,0 +1,20 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# Removing packages from a large installed database, which owns over 100k
+# files, must stay within budget.
+
+import bigfeed, opk, opkgcl
+
+feed = bigfeed.BigFeed()
+feed.setup()
+
+victims = [feed.names[i] for i in feed.installed_leaves()[-5:]]
+bigfeed.check_budget(feed, 'remove', 'remove ' + ' '.join(victims),
+                     seconds=3, mib=96)
+
+for name in victims:
+    if opkgcl.is_installed(name):
+        opk.fail('{} not removed.'.format(name))
+if not opkgcl.is_installed(feed.names[0]):
+    opk.fail('{} removed.'.format(feed.names[0]))
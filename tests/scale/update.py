@@ -0,0 +1,11 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# "update" on a large feed must stay within its time and memory budget.
+
+import bigfeed
+
+feed = bigfeed.BigFeed()
+feed.setup()
+
+bigfeed.check_budget(feed, 'update', 'update', seconds=2, mib=64)
@@ -0,0 +1,20 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# Upgrading a large installed database, of which only a few packages have
+# newer versions, must stay within budget.
+
+import bigfeed, opk, opkgcl
+
+feed = bigfeed.BigFeed()
+feed.setup()
+bigfeed.check_budget(feed, 'update', 'update', seconds=2, mib=64)
+
+bigfeed.check_budget(feed, 'upgrade', '--force-postinstall upgrade',
+                     seconds=5, mib=128)
+
+for i in feed.upgrades:
+    if not opkgcl.is_installed(feed.names[i], feed.upgrade_version(i)):
+        opk.fail('{} not upgraded.'.format(feed.names[i]))
+if not opkgcl.is_installed(feed.names[0], feed.versions[0]):
+    opk.fail('{} changed by upgrade.'.format(feed.names[0]))